@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
@@ -34,19 +35,142 @@
 #include "assuan-defs.h"
 
 
+/* Start the deadline set by ASSUAN_TRANSACT_TIMEOUT for a
+   transaction or connection handshake on CTX.  */
+void
+_assuan_deadline_begin (assuan_context_t ctx)
+{
+  if (ctx->deadline.timeout)
+    {
+      ctx->deadline.transact = _assuan_get_msec () + ctx->deadline.timeout;
+      ctx->deadline.transact_set = 1;
+    }
+  else
+    ctx->deadline.transact_set = 0;
+}
+
+
+/* Stop the deadline started by _assuan_deadline_begin.  */
+void
+_assuan_deadline_end (assuan_context_t ctx)
+{
+  ctx->deadline.transact_set = 0;
+}
+
+
+/* Return the number of milliseconds left until the next deadline of
+   CTX, 0 if it has passed or -1 if no deadline is set.  */
+long
+_assuan_deadline_left (assuan_context_t ctx)
+{
+  unsigned long now;
+  long left, n;
+
+  if (ctx->deadline.expired)
+    return 0;
+  if (!ctx->deadline.user_set && !ctx->deadline.transact_set)
+    return -1;
+
+  now = _assuan_get_msec ();
+  left = INT_MAX;
+  if (ctx->deadline.user_set)
+    {
+      n = (long)(ctx->deadline.user - now);
+      if (n < left)
+        left = n;
+    }
+  if (ctx->deadline.transact_set)
+    {
+      n = (long)(ctx->deadline.transact - now);
+      if (n < left)
+        left = n;
+    }
+  return left > 0? left : 0;
+}
+
+
+/* Mark the deadline of CTX as passed while waiting for reading or,
+   if FOR_WRITE is set, for writing.  As the state of the peer is
+   unknown after an interrupted read or write, all further I/O on CTX
+   fails from now on.  Sets ERRNO to ETIMEDOUT.  */
+void
+_assuan_deadline_expire (assuan_context_t ctx, int for_write)
+{
+  if (!ctx->deadline.expired)
+    {
+      _assuan_log_control_channel (ctx, for_write, "deadline expired",
+                                   NULL, 0, NULL, 0);
+      ctx->deadline.expired = 1;
+      ctx->inbound.eof = 1;
+    }
+  gpg_err_set_errno (ETIMEDOUT);
+}
+
+
+/* Wait until FD of CTX is ready for reading or, if FOR_WRITE is set,
+   for writing.  Returns 0 if the I/O may proceed or -1 with ERRNO
+   set to ETIMEDOUT if a deadline has passed.  A connection using
+   shared memory waits in its engine functions instead.  */
+static int
+wait_for_io (assuan_context_t ctx, assuan_fd_t fd, int for_write)
+{
+  long left;
+  int res;
+
+  for (;;)
+    {
+      left = _assuan_deadline_left (ctx);
+      if (left < 0)
+        return 0;
+      if (!left)
+        break;
+      if (_assuan_shm_wait_fd (ctx) != ASSUAN_INVALID_FD)
+        return 0;
+
+      res = _assuan_poll (ctx, fd, for_write, (int)left);
+      if (res > 0)
+        return 0;
+      if (res < 0 && errno != EINTR)
+        return 0;  /* Let the actual I/O report the error.  */
+    }
+
+  _assuan_deadline_expire (ctx, for_write);
+  return -1;
+}
+
+
+/* Return the error code for a failed writen or readline.  */
+static gpg_err_code_t
+io_error_code (assuan_context_t ctx)
+{
+  if (ctx->deadline.expired)
+    return GPG_ERR_TIMEOUT;
+  return gpg_err_code_from_syserror ();
+}
+
+
 /* Extended version of write(2) to guarantee that all bytes are
    written.  Returns 0 on success or -1 and ERRNO on failure.  NOTE:
    This function does not return the number of bytes written, so any
    error must be treated as fatal for this connection as the state of
    the receiver is unknown.  This works best if blocking is allowed
    (so EAGAIN cannot occur).  */
+static int
+writen_nonblock (assuan_context_t ctx, const char *buffer, size_t length);
+
 static int
 writen (assuan_context_t ctx, const char *buffer, size_t length)
 {
+  if (ctx->transact.nonblock || ctx->flags.in_server_loop)
+    return writen_nonblock (ctx, buffer, length);
+
   while (length)
     {
-      ssize_t nwritten = ctx->engine.writefnc (ctx, buffer, length);
+      ssize_t nwritten;
 
+      if (wait_for_io (ctx, ctx->outbound.fd, 1))
+        return -1; /* deadline expired */
+      nwritten = ctx->engine.writefnc (ctx, buffer, length);
       if (nwritten < 0)
         {
           if (errno == EINTR)
@@ -59,6 +183,111 @@ writen (assuan_context_t ctx, const char *buffer, size_t length)
   return 0;  /* okay */
 }
 
+/* Variant of writen used while a transaction is driven by
+   assuan_transact_step and for the connections of a server loop.  As
+   much as possible is written right away; the rest is appended to the
+   pending output and written later by _assuan_flush_pending.  Returns
+   0 on success or -1 and ERRNO on failure.  */
+static int
+writen_nonblock (assuan_context_t ctx, const char *buffer, size_t length)
+{
+  while (length && !ctx->outbound.pending.length)
+    {
+      ssize_t nwritten = ctx->engine.writefnc (ctx, buffer, length);
+
+      if (nwritten < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+          return -1; /* write error */
+        }
+      length -= nwritten;
+      buffer += nwritten;
+    }
+
+  if (!length)
+    return 0;
+
+  if (ctx->outbound.pending.length + length > ctx->outbound.pending.size)
+    {
+      size_t newsize = ctx->outbound.pending.length + length + LINELENGTH;
+      char *newbuf;
+
+      /* Do not use realloc so that the old buffer can be wiped.  */
+      newbuf = _assuan_malloc (ctx, newsize);
+      if (!newbuf)
+        return -1;
+      if (ctx->outbound.pending.buffer)
+        {
+          memcpy (newbuf, ctx->outbound.pending.buffer,
+                  ctx->outbound.pending.length);
+          wipememory (ctx->outbound.pending.buffer,
+                      ctx->outbound.pending.size);
+          _assuan_free (ctx, ctx->outbound.pending.buffer);
+        }
+      ctx->outbound.pending.buffer = newbuf;
+      ctx->outbound.pending.size = newsize;
+    }
+  memcpy (ctx->outbound.pending.buffer + ctx->outbound.pending.length,
+          buffer, length);
+  ctx->outbound.pending.length += length;
+  return 0;
+}
+
+
+/* Write the complete lines in BUFFER of LENGTH to CTX.  Unlike
+   _assuan_write_line the lines are not checked nor logged; this is
+   used for the pre-rendered greeting of assuan_accept.  */
+gpg_error_t
+_assuan_write_lines (assuan_context_t ctx, const char *buffer, size_t length)
+{
+  if (writen (ctx, buffer, length))
+    return _assuan_error (ctx, io_error_code (ctx));
+  return 0;
+}
+
+
+/* Write out the output queued by writen_nonblock.  Returns 0 if
+   nothing is pending anymore, an error with the code GPG_ERR_EAGAIN
+   if the peer does not accept more data right now, or another
+   error.  */
+gpg_error_t
+_assuan_flush_pending (assuan_context_t ctx)
+{
+  char *buffer = ctx->outbound.pending.buffer;
+  size_t length = ctx->outbound.pending.length;
+  size_t off = 0;
+
+  while (off < length)
+    {
+      ssize_t nwritten = ctx->engine.writefnc (ctx, buffer + off,
+                                               length - off);
+
+      if (nwritten < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EWOULDBLOCK)
+            gpg_err_set_errno (EAGAIN);
+          break;
+        }
+      off += nwritten;
+    }
+
+  if (off)
+    {
+      memmove (buffer, buffer + off, length - off);
+      wipememory (buffer + length - off, off);
+      ctx->outbound.pending.length = length - off;
+    }
+  if (off < length)
+    return _assuan_error (ctx, gpg_err_code_from_syserror ());
+  return 0;
+}
+
+
 /* Read an entire line. Returns 0 on success or -1 and ERRNO on
    failure.  EOF is indictated by setting the integer at address
    R_EOF.  Note: BUF, R_NREAD and R_EOF contain a valid result even if
@@ -74,8 +303,12 @@ readline (assuan_context_t ctx, char *buf, size_t buflen,
   *r_nread = 0;
   while (nleft > 0)
     {
-      ssize_t n = ctx->engine.readfnc (ctx, buf, nleft);
+      ssize_t n;
 
+      if (!ctx->transact.nonblock && !ctx->flags.in_server_loop
+          && wait_for_io (ctx, ctx->inbound.fd, 0))
+        return -1; /* deadline expired */
+      n = ctx->engine.readfnc (ctx, buf, nleft);
       if (n < 0)
         {
           if (errno == EINTR)
@@ -120,6 +353,8 @@ _assuan_read_line (assuan_context_t ctx)
   int nread, atticlen;
   char *endp = 0;
 
+  if (ctx->deadline.expired)
+    return _assuan_error (ctx, GPG_ERR_TIMEOUT);
   if (ctx->inbound.eof)
     return _assuan_error (ctx, GPG_ERR_EOF);
 
@@ -153,8 +388,11 @@ _assuan_read_line (assuan_context_t ctx)
       int saved_errno = errno;
       char buf[100];
 
-      snprintf (buf, sizeof buf, "error: %s", strerror (errno));
-      _assuan_log_control_channel (ctx, 0, buf, NULL, 0, NULL, 0);
+      if (saved_errno != EAGAIN)
+        {
+          snprintf (buf, sizeof buf, "error: %s", strerror (errno));
+          _assuan_log_control_channel (ctx, 0, buf, NULL, 0, NULL, 0);
+        }
 
       if (saved_errno == EAGAIN)
         {
@@ -167,7 +405,7 @@ _assuan_read_line (assuan_context_t ctx)
         }
 
       gpg_err_set_errno (saved_errno);
-      return _assuan_error (ctx, gpg_err_code_from_syserror ());
+      return _assuan_error (ctx, io_error_code (ctx));
     }
   if (!nread)
     {
@@ -304,18 +542,18 @@ _assuan_write_line (assuan_context_t ctx, const char *prefix,
     {
       rc = writen (ctx, prefix, prefixlen);
       if (rc)
-	rc = _assuan_error (ctx, gpg_err_code_from_syserror ());
+	rc = _assuan_error (ctx, io_error_code (ctx));
     }
   if (!rc && !(monitor_result & ASSUAN_IO_MONITOR_IGNORE))
     {
       rc = writen (ctx, line, len);
       if (rc)
-	rc = _assuan_error (ctx, gpg_err_code_from_syserror ());
+	rc = _assuan_error (ctx, io_error_code (ctx));
       if (!rc)
         {
           rc = writen (ctx, "\n", 1);
           if (rc)
-	    rc = _assuan_error (ctx, gpg_err_code_from_syserror ());
+	    rc = _assuan_error (ctx, io_error_code (ctx));
         }
     }
   return rc;
@@ -410,7 +648,7 @@ _assuan_cookie_write_data (void *cookie, const char *buffer, size_t orig_size)
           if ( !(monitor_result & ASSUAN_IO_MONITOR_IGNORE)
                && writen (ctx, ctx->outbound.data.line, linelen))
             {
-              ctx->outbound.data.error = gpg_err_code_from_syserror ();
+              ctx->outbound.data.error = io_error_code (ctx);
               return 0;
             }
           line = ctx->outbound.data.line;
@@ -456,7 +694,7 @@ _assuan_cookie_write_flush (void *cookie)
       if (! (monitor_result & ASSUAN_IO_MONITOR_IGNORE)
            && writen (ctx, ctx->outbound.data.line, linelen))
         {
-          ctx->outbound.data.error = gpg_err_code_from_syserror ();
+          ctx->outbound.data.error = io_error_code (ctx);
           return 0;
         }
       ctx->outbound.data.linelen = 0;
@@ -483,6 +721,10 @@ _assuan_cookie_write_flush (void *cookie)
  * If BUFFER is NULL and LENGTH is 1 and we are a client, a "CAN" is
  * send instead of an "END".
  *
+ * If ASSUAN_DATA_MEMFD has been set and LENGTH is at least that
+ * value, the data is passed in a sealed memory file on connections
+ * with descriptor passing whose peer has agreed to that.
+ *
  * Return value: 0 on success or an error code
  **/
 
@@ -506,6 +748,19 @@ assuan_send_data (assuan_context_t ctx, const void *buffer, size_t length)
     }
   else
     {
+      if (ctx->uds.data_memfd && length >= (size_t)ctx->uds.data_memfd
+          && !ctx->flags.confidential)
+        {
+          gpg_error_t err;
+
+          /* Data lines buffered so far go first.  */
+          _assuan_cookie_write_flush (ctx);
+          if (ctx->outbound.data.error)
+            return ctx->outbound.data.error;
+          err = _assuan_uds_send_data (ctx, buffer, length);
+          if (gpg_err_code (err) != GPG_ERR_NOT_SUPPORTED)
+            return err;
+        }
       _assuan_cookie_write_data (ctx, buffer, length);
       if (ctx->outbound.data.error)
         return ctx->outbound.data.error;
@@ -548,3 +803,52 @@ assuan_receivefd (assuan_context_t ctx, assuan_fd_t *fd)
 		      "of file descriptors");
   return ctx->engine.receivefd (ctx, fd);
 }
+
+
+/* Send the NFDS descriptors FDS to the peer.  Where supported they
+   are passed in a single message instead of one message each.  */
+gpg_error_t
+assuan_sendfds (assuan_context_t ctx, const assuan_fd_t *fds, int nfds)
+{
+  gpg_error_t err = 0;
+  int i;
+
+  if (!ctx || (!fds && nfds) || nfds < 0)
+    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
+
+  if (! ctx->engine.sendfd)
+    return set_error (ctx, GPG_ERR_NOT_IMPLEMENTED,
+		      "server does not support sending and receiving "
+		      "of file descriptors");
+  if (!nfds)
+    return 0;
+  if (ctx->engine.sendfds)
+    return ctx->engine.sendfds (ctx, fds, nfds);
+  for (i = 0; !err && i < nfds; i++)
+    err = ctx->engine.sendfd (ctx, fds[i]);
+  return err;
+}
+
+
+/* Receive NFDS pending descriptors into FDS.  If fewer are pending,
+   an error is returned and none is taken.  */
+gpg_error_t
+assuan_receivefds (assuan_context_t ctx, assuan_fd_t *fds, int nfds)
+{
+  gpg_error_t err = 0;
+  int i;
+
+  if (!ctx || (!fds && nfds) || nfds < 0)
+    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
+
+  if (! ctx->engine.receivefd)
+    return set_error (ctx, GPG_ERR_NOT_IMPLEMENTED,
+		      "server does not support sending and receiving "
+		      "of file descriptors");
+  if (ctx->uds.pendingfdscount < nfds)
+    return set_error (ctx, GPG_ERR_ASS_GENERAL,
+                      "not enough file descriptors pending");
+  for (i = 0; !err && i < nfds; i++)
+    err = ctx->engine.receivefd (ctx, fds + i);
+  return err;
+}
@@ -61,6 +61,29 @@ struct cmdtbl_s
   const char *name;
   assuan_handler_t handler;
   const char *helpstr;
+  int priority;     /* An ASSUAN_PRIORITY_ value.  */
+};
+
+
+/* A response line as classified by the client.  */
+struct parsed_response_s
+{
+  int type;     /* An ASSUAN_RESPONSE_ value.  */
+  int off;      /* Offset of the text after the response keyword.  */
+  int kwoff;    /* Status and inquire lines: offset and length of */
+  int kwlen;    /*   the keyword.  */
+  int argoff;   /*   Offset of the arguments after the keyword.  */
+  gpg_error_t err; /* Error lines: the error code.  */
+};
+
+
+/* An entry of the client's table of status handlers.  */
+struct status_handler_s
+{
+  char *keyword;         /* NULL for an unused slot.  */
+  unsigned int hash;     /* Hash value of KEYWORD.  */
+  assuan_status_handler_t handler; /* NULL if unregistered.  */
+  void *opaque;
 };
 
 
@@ -96,6 +119,8 @@ struct assuan_context_s
     unsigned int convey_comments : 1;
     unsigned int no_logging : 1;
     unsigned int force_close : 1;
+    unsigned int allow_shm : 1;
+    unsigned int async_inquire : 1;
     /* From here, we have internal flags, not defined by assuan_flag_t.  */
     unsigned int is_socket : 1;
     unsigned int is_server : 1; /* Set if this is context belongs to a server */
@@ -105,6 +130,8 @@ struct assuan_context_s
     unsigned int in_command : 1;
     unsigned int in_inq_cb : 1; /* Client: inquire callback is active */
     unsigned int confidential_inquiry : 1; /* Client: inquiry is confidential */
+    unsigned int in_server_loop : 1; /* Server: driven by a server loop.  */
+    unsigned int in_next_read : 1; /* Server: reading without waiting.  */
   } flags;
 
   /* If set, this is called right before logging an I/O line.  */
@@ -115,6 +142,7 @@ struct assuan_context_s
   struct assuan_system_hooks system;
 
   int peercred_valid;   /* Whether this structure has valid information. */
+  int peercred_pending; /* Socket server: PEERCRED is yet to be fetched.  */
   struct _assuan_peercred peercred;
 
   /* Now come the members specific to subsystems or engines.  FIXME:
@@ -129,6 +157,8 @@ struct assuan_context_s
     ssize_t (*writefnc) (assuan_context_t, const void *, size_t);
     /* Send a file descriptor.  */
     gpg_error_t (*sendfd) (assuan_context_t, assuan_fd_t);
+    /* Send several file descriptors at once; may be NULL.  */
+    gpg_error_t (*sendfds) (assuan_context_t, const assuan_fd_t *, int);
     /* Receive a file descriptor.  */
     gpg_error_t (*receivefd) (assuan_context_t, assuan_fd_t *);
   } engine;
@@ -143,6 +173,103 @@ struct assuan_context_s
   gpg_error_t err_no;
   const char *err_str;
 
+  /* The callbacks of the client transaction in progress.  They are
+     kept here so that a transaction suspended by an inquire callback
+     can be resumed with assuan_transact_resume.  */
+  struct {
+    gpg_error_t (*data_cb) (void *, const void *, size_t);
+    void *data_cb_arg;
+    gpg_error_t (*inquire_cb) (void *, const char *);
+    void *inquire_cb_arg;
+    gpg_error_t (*status_cb) (void *, const char *);
+    void *status_cb_arg;
+    unsigned int inquire_pending : 1; /* Waiting for the inquired data.  */
+    unsigned int nonblock : 1;      /* Driven by assuan_transact_step.  */
+    unsigned int no_response : 1;   /* Only a comment line was sent.  */
+    unsigned int skip_response : 1; /* Discard lines up to OK or ERR.  */
+    gpg_error_t saved_rc;           /* Result to return after skipping.  */
+    unsigned int chunksize;         /* Value of ASSUAN_DATA_CHUNKSIZE.  */
+    /* Data collected for DATA_CB.  */
+    struct {
+      char *buffer;
+      size_t size;    /* Allocated size of BUFFER.  */
+      size_t length;  /* Used length of BUFFER.  */
+      size_t limit;   /* Chunk size for the current transaction.  */
+    } chunk;
+  } transact;
+
+  /* The handlers for status lines registered by the client.  This is
+     a hash table with open addressing; SIZE is a power of two.  */
+  struct {
+    struct status_handler_s *table;
+    size_t size;
+    size_t used;
+  } status_handlers;
+
+  /* Used by assuan-pool.c for contexts created by assuan_pool_get.  */
+  struct {
+    char *name;            /* The socket name used for the connection.  */
+    unsigned int flags;    /* The flags used for the connection.  */
+    assuan_context_t next; /* Next idle context in the pool.  */
+  } pool;
+
+  /* Used by assuan-server-loop.c for the connections of a server
+     loop.  */
+  struct {
+    assuan_server_t server;  /* The server loop running this context.  */
+    struct assuan_server_worker_s *worker; /* The worker owning it.  */
+    assuan_context_t next;   /* Next connection of the worker.  */
+    assuan_context_t prev;   /* Previous connection of the worker.  */
+    assuan_context_t qnext;  /* Next connection in the run queue.  */
+    unsigned int queued : 1; /* The connection is in the run queue.  */
+    unsigned int prio : 2;   /* The run queue it is in.  */
+    unsigned long qtime;     /* The time it was queued in msec.  */
+    unsigned int active : 1; /* Holds a slot for a running command.  */
+    unsigned int waiting : 1;/* Waits for a command slot.  */
+    unsigned int uid_counted : 1; /* Counted for the quota of UID.  */
+    assuan_context_t wnext;  /* Next connection waiting for a slot.  */
+    unsigned long uid;       /* User ID of the client.  */
+    /* The timeout of the connection.  Uses the lock of the worker.  */
+    assuan_context_t tnext;  /* Next timer in the slot of the wheel.  */
+    assuan_context_t tprev;  /* Previous timer in the slot.  */
+    assuan_context_t *thead; /* The slot or NULL if not scheduled.  */
+    unsigned long ttick;     /* Tick at which the timer is due.  */
+    unsigned long twhen;     /* The time of the timer in msec.  */
+    unsigned long since;     /* Last activity or start of the command.  */
+    unsigned int serving : 2;/* Number of workers serving it.  */
+    unsigned int in_cmd : 1; /* SINCE is the start of a command.  */
+    unsigned int expired : 1;/* Timed out; to be closed.  */
+    /* Used if the worker has an io_uring.  */
+    unsigned int rslot;      /* Slot of the connection in the ring.  */
+    int rhead;               /* The received buffers not yet read, */
+    int rtail;               /* linked through the ring, or -1.  */
+    unsigned int rbufs;      /* Number of those buffers.  */
+    int rerr;                /* Error of the receive or 0.  */
+    unsigned int receiving : 1; /* A multishot receive is armed.  */
+    unsigned int cancelling : 1;/* That receive is being cancelled.  */
+    unsigned int starved : 1;/* Waits for free receive buffers.  */
+    unsigned int polling : 1;/* Waits until the socket is writable.  */
+    unsigned int eof : 1;    /* The client has closed its end.  */
+    assuan_context_t snext;  /* Next connection waiting for buffers.  */
+  } loop;
+
+  /* Deadlines for I/O on this context in the units of
+     _assuan_get_msec.  */
+  struct {
+    unsigned int timeout;        /* Value of ASSUAN_TRANSACT_TIMEOUT.  */
+    unsigned long user;          /* Set by assuan_set_deadline.  */
+    unsigned long transact;      /* End of the current transaction.  */
+    unsigned int user_set : 1;
+    unsigned int transact_set : 1;
+    unsigned int expired : 1;    /* A deadline passed; I/O is disabled.  */
+  } deadline;
+
+  /* The budget of one call of assuan_process_next.  */
+  struct {
+    unsigned int lines;          /* Value of ASSUAN_PROCESS_LINES.  */
+    unsigned int usec;           /* Value of ASSUAN_PROCESS_USEC.  */
+  } budget;
+
   /* The following members are used by assuan_inquire_ext.  */
   gpg_error_t (*inquire_cb) (void *cb_data, gpg_error_t rc,
 			     unsigned char *buf, size_t len);
@@ -152,6 +279,14 @@ struct assuan_context_s
   char *hello_line;
   char *okay_line;    /* See assuan_set_okay_line() */
 
+  /* The greeting rendered from HELLO_LINE by assuan_accept, ready to
+     be written.  PID is the process id it was rendered for.  */
+  struct {
+    char *buffer;
+    size_t length;
+    pid_t pid;
+  } hello;
+
 
   struct {
     assuan_fd_t fd;
@@ -160,6 +295,7 @@ struct assuan_context_s
     int linelen;  /* w/o CR, LF - might not be the same as
                      strlen(line) due to embedded nuls. However a nul
                      is always written at this pos. */
+    struct parsed_response_s parsed; /* Client: the classified line.  */
     struct {
       char line[LINELENGTH];
       int linelen ;
@@ -175,6 +311,12 @@ struct assuan_context_s
       int linelen;
       int error;
     } data;
+    /* Output not yet written in non-blocking mode.  */
+    struct {
+      char *buffer;
+      size_t length;
+      size_t size;
+    } pending;
   } outbound;
 
   int max_accepts;  /* If we can not handle more than one connection,
@@ -232,10 +374,20 @@ struct assuan_context_s
 
   /* Structure used for unix domain sockets.  */
   struct {
-    assuan_fd_t pendingfds[5]; /* Array to save received descriptors.  */
+    assuan_fd_t *pendingfds;  /* Ring buffer of received descriptors.  */
+    unsigned int pendingsize; /* Its number of slots, a power of two.  */
+    unsigned int pendinghead; /* The slot of the oldest descriptor.  */
     int pendingfdscount;  /* Number of received descriptors. */
+    int maxpending;       /* Value of ASSUAN_MAX_PENDING_FDS.  */
+    int data_memfd;       /* Value of ASSUAN_DATA_MEMFD.  */
+    unsigned int memfd_offered : 1; /* OPTION data-memfd has been sent.  */
+    unsigned int peer_memfd : 1;    /* The peer takes DFD lines.  */
   } uds;
 
+  /* The shared memory rings of the connection or NULL; see
+     assuan-shm.c.  */
+  struct assuan_shm_s *shm;
+
   gpg_error_t (*accept_handler)(assuan_context_t);
   void (*finish_handler)(assuan_context_t);
 
@@ -248,6 +400,9 @@ struct assuan_context_s
      handler.  */
   const char *current_cmd_name;
 
+  /* The priority of the command last dispatched.  */
+  int current_cmd_priority;
+
   assuan_handler_t bye_notify_fnc;
   assuan_handler_t reset_notify_fnc;
   assuan_handler_t cancel_notify_fnc;
@@ -317,6 +472,10 @@ assuan_fd_t _assuan_socket (assuan_context_t ctx, int namespace,
                             int style, int protocol);
 int _assuan_connect (assuan_context_t ctx, assuan_fd_t sock,
                      struct sockaddr *addr, socklen_t length);
+int _assuan_poll (assuan_context_t ctx, assuan_fd_t fd, int for_write,
+                  int timeout);
+unsigned long _assuan_get_msec (void);
+unsigned long _assuan_get_usec (void);
 
 extern struct assuan_system_hooks _assuan_system_hooks;
 
@@ -331,14 +490,43 @@ _assuan_system_hooks_copy (assuan_system_hooks_t dst,
 /*-- assuan-pipe-server.c --*/
 void _assuan_release_context (assuan_context_t ctx);
 
+/*-- assuan-socket-server.c --*/
+int _assuan_fd_peercred (assuan_fd_t fd, struct _assuan_peercred *cred);
+void _assuan_socket_peercred (assuan_context_t ctx,
+                              const struct _assuan_peercred *cred);
+
 /*-- assuan-uds.c --*/
+gpg_error_t _assuan_uds_push_fd (assuan_context_t ctx, assuan_fd_t fd);
+int _assuan_uds_pop_fd (assuan_context_t ctx, assuan_fd_t *r_fd);
+void _assuan_uds_take_fds (assuan_context_t ctx, assuan_msghdr_t msg);
 void _assuan_uds_close_fds (assuan_context_t ctx);
+gpg_error_t _assuan_uds_send_data (assuan_context_t ctx, const void *buffer,
+                                   size_t length);
+gpg_error_t _assuan_uds_map_data (assuan_context_t ctx, const char *args,
+                                  void **r_data, size_t *r_length);
+void _assuan_uds_unmap_data (assuan_context_t ctx, void *data, size_t length);
+void _assuan_uds_offer_memfd (assuan_context_t ctx);
+gpg_error_t _assuan_uds_memfd_option (assuan_context_t ctx);
 void _assuan_uds_deinit (assuan_context_t ctx);
 void _assuan_init_uds_io (assuan_context_t ctx);
 
+/*-- assuan-shm.c --*/
+gpg_error_t _assuan_shm_handler (assuan_context_t ctx, char *line);
+void _assuan_shm_commit (assuan_context_t ctx, gpg_error_t rc);
+void _assuan_shm_sent_fds (assuan_context_t ctx, size_t nbytes);
+void _assuan_shm_idle (assuan_context_t ctx);
+assuan_fd_t _assuan_shm_wait_fd (assuan_context_t ctx);
+void _assuan_shm_release (assuan_context_t ctx);
+
 
 /*-- assuan-handler.c --*/
 gpg_error_t _assuan_register_std_commands (assuan_context_t ctx);
+gpg_error_t _assuan_update_shm_command (assuan_context_t ctx);
+gpg_error_t _assuan_process_line (assuan_context_t ctx);
+int _assuan_budget_spent (assuan_context_t ctx, unsigned int nlines,
+                          unsigned long start);
+int _assuan_command_priority (assuan_context_t ctx, const char *line,
+                              size_t len);
 
 /*-- assuan-buffer.c --*/
 gpg_error_t _assuan_read_line (assuan_context_t ctx);
@@ -346,11 +534,24 @@ int _assuan_cookie_write_data (void *cookie, const char *buffer, size_t size);
 int _assuan_cookie_write_flush (void *cookie);
 gpg_error_t _assuan_write_line (assuan_context_t ctx, const char *prefix,
                                    const char *line, size_t len);
+gpg_error_t _assuan_write_lines (assuan_context_t ctx, const char *buffer,
+                                 size_t length);
+gpg_error_t _assuan_flush_pending (assuan_context_t ctx);
+void _assuan_deadline_begin (assuan_context_t ctx);
+void _assuan_deadline_end (assuan_context_t ctx);
+long _assuan_deadline_left (assuan_context_t ctx);
+void _assuan_deadline_expire (assuan_context_t ctx, int for_write);
 
 /*-- client.c --*/
 gpg_error_t _assuan_read_from_server (assuan_context_t ctx,
 				      assuan_response_t *okay, int *off,
                                       int convey_comments);
+void _assuan_release_status_handlers (assuan_context_t ctx);
+gpg_error_t _assuan_transact_responses
+     (assuan_context_t ctx,
+      gpg_error_t (*data_cb)(void *, const void *, size_t), void *data_cb_arg,
+      gpg_error_t (*inquire_cb)(void*, const char *), void *inquire_cb_arg,
+      gpg_error_t (*status_cb)(void*, const char *), void *status_cb_arg);
 
 /*-- assuan-error.c --*/
 
@@ -375,6 +576,7 @@ gpg_error_t w32_fdpass_recv (assuan_context_t ctx, assuan_fd_t *fd);
 
 /*-- assuan-logging.c --*/
 void _assuan_init_log_envvars (void);
+int _assuan_log_control_p (assuan_context_t ctx);
 void _assuan_log_control_channel (assuan_context_t ctx, int outbound,
                                   const char *string,
                                   const void *buffer1, size_t length1,
@@ -392,6 +594,7 @@ assuan_fd_t _assuan_sock_new (assuan_context_t ctx, int domain, int type,
 			      int proto);
 int _assuan_sock_connect (assuan_context_t ctx, assuan_fd_t sockfd,
                           struct sockaddr *addr, int addrlen);
+int _assuan_sock_uses_socks (struct sockaddr *addr);
 int _assuan_sock_bind (assuan_context_t ctx, assuan_fd_t sockfd,
 		       struct sockaddr *addr, int addrlen);
 int _assuan_sock_set_sockaddr_un (const char *fname, struct sockaddr *addr,
@@ -462,8 +665,10 @@ int putc_unlocked (int c, FILE *stream);
 
 void _assuan_client_finish (assuan_context_t ctx);
 void _assuan_client_release (assuan_context_t ctx);
+void _assuan_client_reset (assuan_context_t ctx);
 
 void _assuan_server_finish (assuan_context_t ctx);
+void _assuan_server_reset (assuan_context_t ctx);
 void _assuan_server_release (assuan_context_t ctx);
 
 
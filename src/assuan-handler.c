@@ -129,6 +129,8 @@ std_handler_option (assuan_context_t ctx, char *line)
 			 set_error (ctx, GPG_ERR_ASS_SYNTAX,
 				    "option should not begin with one dash"));
 
+  if (!strcmp (key, "data-memfd"))
+    return PROCESS_DONE (ctx, _assuan_uds_memfd_option (ctx));
   if (ctx->option_handler_fnc)
     return PROCESS_DONE (ctx, ctx->option_handler_fnc (ctx, key, value));
   return PROCESS_DONE (ctx, 0);
@@ -247,6 +249,18 @@ std_handler_help (assuan_context_t ctx, char *line)
   return PROCESS_DONE (ctx, 0);
 }
 
+static const char std_help_shm[] =
+  "SHM <RINGSIZE>\n"
+  "\n"
+  "Used by a client to exchange the following lines through shared\n"
+  "memory.  The server inquires SHM_FDS and takes the memory file and\n"
+  "two eventfds sent by the client along with the END.";
+static gpg_error_t
+std_handler_shm (assuan_context_t ctx, char *line)
+{
+  return PROCESS_DONE (ctx, _assuan_shm_handler (ctx, line));
+}
+
 static const char std_help_end[] =
   "END\n"
   "\n"
@@ -386,7 +400,9 @@ w32_handler_sendfd (assuan_context_t ctx, char *line)
       return PROCESS_DONE (ctx, err);
     }
 
-  ctx->uds.pendingfds[ctx->uds.pendingfdscount++] = (assuan_fd_t)file_handle;
+  err = _assuan_uds_push_fd (ctx, (assuan_fd_t)file_handle);
+  if (err)
+    CloseHandle ((HANDLE)file_handle);
   return PROCESS_DONE (ctx, err);
 }
 #endif
@@ -399,20 +415,24 @@ static struct {
   gpg_error_t (*handler)(assuan_context_t, char *line);
   const char *help;
   int always; /* always initialize this command */
+  int priority; /* the cheap control commands come first */
 } std_cmd_table[] = {
-  { "NOP",    std_handler_nop, std_help_nop, 1 },
-  { "CANCEL", std_handler_cancel, std_help_cancel, 1 },
-  { "OPTION", std_handler_option, std_help_option, 1 },
-  { "BYE",    std_handler_bye, std_help_bye, 1 },
-  { "AUTH",   std_handler_auth, std_help_auth, 1 },
-  { "RESET",  std_handler_reset, std_help_reset, 1 },
-  { "END",    std_handler_end, std_help_end, 1 },
-  { "HELP",   std_handler_help, std_help_help, 1 },
-
-  { "INPUT",  std_handler_input, std_help_input, 0 },
-  { "OUTPUT", std_handler_output, std_help_output, 0 },
+  { "NOP",    std_handler_nop, std_help_nop, 1, ASSUAN_PRIORITY_HIGH },
+  { "CANCEL", std_handler_cancel, std_help_cancel, 1, ASSUAN_PRIORITY_HIGH },
+  { "OPTION", std_handler_option, std_help_option, 1, ASSUAN_PRIORITY_HIGH },
+  { "BYE",    std_handler_bye, std_help_bye, 1, ASSUAN_PRIORITY_HIGH },
+  { "AUTH",   std_handler_auth, std_help_auth, 1, ASSUAN_PRIORITY_NORMAL },
+  { "RESET",  std_handler_reset, std_help_reset, 1, ASSUAN_PRIORITY_HIGH },
+  { "END",    std_handler_end, std_help_end, 1, ASSUAN_PRIORITY_NORMAL },
+  { "SHM",    std_handler_shm, std_help_shm, 0, ASSUAN_PRIORITY_NORMAL },
+  { "HELP",   std_handler_help, std_help_help, 1, ASSUAN_PRIORITY_HIGH },
+
+  { "INPUT",  std_handler_input, std_help_input, 0, ASSUAN_PRIORITY_NORMAL },
+  { "OUTPUT", std_handler_output, std_help_output, 0,
+    ASSUAN_PRIORITY_NORMAL },
 #if HAVE_W32_SYSTEM
-  { "SENDFD",  w32_handler_sendfd, w32_help_sendfd, 1 },
+  { "SENDFD",  w32_handler_sendfd, w32_help_sendfd, 1,
+    ASSUAN_PRIORITY_NORMAL },
 #endif
   { } };
 
@@ -489,7 +509,10 @@ assuan_register_command (assuan_context_t ctx, const char *cmd_name,
     }
 
   if (cmd_index == -1)
-    cmd_index = ctx->cmdtbl_used++;
+    {
+      cmd_index = ctx->cmdtbl_used++;
+      ctx->cmdtbl[cmd_index].priority = ASSUAN_PRIORITY_NORMAL;
+    }
 
   ctx->cmdtbl[cmd_index].name = cmd_name;
   ctx->cmdtbl[cmd_index].handler = handler;
@@ -497,6 +520,57 @@ assuan_register_command (assuan_context_t ctx, const char *cmd_name,
   return 0;
 }
 
+/* Set the PRIORITY of the registered command CMD_NAME.  The server
+   loop serves connections whose next command has a higher priority
+   first if assuan_server_set_priorities has been used.  */
+gpg_error_t
+assuan_set_command_priority (assuan_context_t ctx, const char *cmd_name,
+                             int priority)
+{
+  int i;
+
+  if (!ctx || !cmd_name
+      || priority < ASSUAN_PRIORITY_LOW || priority > ASSUAN_PRIORITY_HIGH)
+    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
+
+  for (i = 0; i < ctx->cmdtbl_used; i++)
+    if (!my_strcasecmp (cmd_name, ctx->cmdtbl[i].name))
+      {
+        ctx->cmdtbl[i].priority = priority;
+        return 0;
+      }
+  return _assuan_error (ctx, GPG_ERR_ASS_UNKNOWN_CMD);
+}
+
+
+/* Return the priority of the command at the start of LINE, which has
+   LEN bytes and need not be a complete line.  Unknown commands have
+   the normal priority.  */
+int
+_assuan_command_priority (assuan_context_t ctx, const char *line, size_t len)
+{
+  char name[32];
+  size_t n;
+  int i;
+
+  for (n = 0; n < len && line[n] != ' ' && line[n] != '\t'
+         && line[n] != '\n' && line[n] != '\r'; n++)
+    ;
+  if (!n || n >= sizeof name)
+    return ASSUAN_PRIORITY_NORMAL;
+  memcpy (name, line, n);
+  name[n] = 0;
+
+  for (i = 0; i < ctx->cmdtbl_used; i++)
+    if (!strcmp (name, ctx->cmdtbl[i].name))
+      return ctx->cmdtbl[i].priority;
+  for (i = 0; i < ctx->cmdtbl_used; i++)
+    if (!my_strcasecmp (name, ctx->cmdtbl[i].name))
+      return ctx->cmdtbl[i].priority;
+  return ASSUAN_PRIORITY_NORMAL;
+}
+
+
 /* Return the name of the command currently processed by a handler.
    The string returned is valid until the next call to an assuan
    function on the same context.  Returns NULL if no handler is
@@ -597,14 +671,53 @@ _assuan_register_std_commands (assuan_context_t ctx)
       if (std_cmd_table[i].always)
         {
           rc = assuan_register_command (ctx, std_cmd_table[i].name, NULL, NULL);
+          if (!rc)
+            rc = assuan_set_command_priority (ctx, std_cmd_table[i].name,
+                                              std_cmd_table[i].priority);
           if (rc)
             return rc;
         }
     }
+  if (ctx->flags.allow_shm)
+    return _assuan_update_shm_command (ctx);
   return 0;
 }
 
 
+/* Register the SHM command if the server has set ASSUAN_ALLOW_SHM
+   and it is not yet known; remove our SHM command if the flag has
+   been cleared.  */
+gpg_error_t
+_assuan_update_shm_command (assuan_context_t ctx)
+{
+  gpg_error_t rc;
+  int i;
+
+  for (i=0; i < ctx->cmdtbl_used; i++)
+    if (!my_strcasecmp (ctx->cmdtbl[i].name, "SHM"))
+      break;
+
+  if (!ctx->flags.allow_shm)
+    {
+      if (i < ctx->cmdtbl_used && ctx->cmdtbl[i].handler == std_handler_shm)
+        {
+          ctx->cmdtbl_used--;
+          memmove (ctx->cmdtbl + i, ctx->cmdtbl + i + 1,
+                   (ctx->cmdtbl_used - i) * sizeof *ctx->cmdtbl);
+          memset (ctx->cmdtbl + ctx->cmdtbl_used, 0, sizeof *ctx->cmdtbl);
+        }
+      return 0;
+    }
+  if (i < ctx->cmdtbl_used)
+    return 0;
+
+  rc = assuan_register_command (ctx, "SHM", NULL, NULL);
+  if (!rc)
+    rc = assuan_set_command_priority (ctx, "SHM", ASSUAN_PRIORITY_NORMAL);
+  return rc;
+}
+
+
 
 /* Process the special data lines.  The "D " has already been removed
    from the line.  As all handlers this function may modify the line.  */
@@ -691,6 +804,7 @@ dispatch_command (assuan_context_t ctx, char *line, int linelen)
 
 /*    fprintf (stderr, "DBG-assuan: processing %s `%s'\n", s, line); */
   ctx->current_cmd_name = ctx->cmdtbl[i].name;
+  ctx->current_cmd_priority = ctx->cmdtbl[i].priority;
   err = ctx->cmdtbl[i].handler (ctx, line);
   ctx->current_cmd_name = NULL;
   return err;
@@ -759,6 +873,10 @@ assuan_process_done (assuan_context_t ctx, gpg_error_t rc)
         ctx->finish_handler (ctx);
     }
 
+  /* The SHM command switches to shared memory after its OK.  */
+  if (ctx->shm)
+    _assuan_shm_commit (ctx, rc);
+
   if (ctx->post_cmd_notify_fnc)
     ctx->post_cmd_notify_fnc (ctx, rc);
 
@@ -782,16 +900,16 @@ process_next (assuan_context_t ctx)
      However, we will always first read the next line.  The client is
      required to write full lines without blocking long after starting
      a partial line.  */
+  ctx->flags.in_next_read = 1;
   rc = _assuan_read_line (ctx);
-  if (_assuan_error_is_eagain (ctx, rc))
-    return 0;
+  ctx->flags.in_next_read = 0;
   if (gpg_err_code (rc) == GPG_ERR_EOF)
     {
       ctx->flags.process_complete = 1;
       return 0;
     }
   if (rc)
-    return rc;
+    return rc;  /* Including GPG_ERR_EAGAIN.  */
   if (*ctx->inbound.line == '#' || !ctx->inbound.linelen)
      /* Comment lines are ignored.  */
     return 0;
@@ -837,20 +955,34 @@ process_next (assuan_context_t ctx)
    (this should be done by the command handler), assuan_process_next
    should be invoked the next time the connected FD is readable.
    Eventually, the caller will finish by invoking assuan_process_done.
-   DONE is set to 1 if the connection has ended.  */
+   DONE is set to 1 if the connection has ended.  Buffered lines are
+   processed as well, up to the budget set with ASSUAN_PROCESS_LINES
+   and ASSUAN_PROCESS_USEC; if lines are left, assuan_pending_line
+   returns true and this function is to be called again without
+   waiting for the FD.  */
 gpg_error_t
 assuan_process_next (assuan_context_t ctx, int *done)
 {
   gpg_error_t rc;
+  unsigned int nlines = 0;
+  unsigned long start = 0;
 
   if (done)
     *done = 0;
   ctx->flags.process_complete = 0;
+  if (ctx->budget.usec)
+    start = _assuan_get_usec ();
   do
     {
       rc = process_next (ctx);
+      nlines++;
     }
-  while (!rc && !ctx->flags.process_complete && assuan_pending_line (ctx));
+  while (!rc && !ctx->flags.process_complete && assuan_pending_line (ctx)
+         && !_assuan_budget_spent (ctx, nlines, start));
+  if (_assuan_error_is_eagain (ctx, rc))
+    rc = 0;
+  if (!ctx->flags.process_complete)
+    _assuan_shm_idle (ctx);
 
   if (done)
     *done = !!ctx->flags.process_complete;
@@ -859,6 +991,31 @@ assuan_process_next (assuan_context_t ctx, int *done)
 }
 
 
+/* Return true if CTX has used up its budget for one call of
+   assuan_process_next after NLINES lines processed since START as
+   returned by _assuan_get_usec.  */
+int
+_assuan_budget_spent (assuan_context_t ctx, unsigned int nlines,
+                      unsigned long start)
+{
+  if (ctx->budget.lines && nlines >= ctx->budget.lines)
+    return 1;
+  if (ctx->budget.usec && _assuan_get_usec () - start >= ctx->budget.usec)
+    return 1;
+  return 0;
+}
+
+
+/* Process the next line from the client of CTX.  This is used by
+   the server loop; unlike assuan_process_next it returns
+   GPG_ERR_EAGAIN without delay if no complete line is available.  */
+gpg_error_t
+_assuan_process_line (assuan_context_t ctx)
+{
+  return process_next (ctx);
+}
+
+
 
 static gpg_error_t
 process_request (assuan_context_t ctx)
@@ -943,7 +1100,15 @@ assuan_get_active_fds (assuan_context_t ctx, int what,
   if (!ctx || fdarraysize < 2 || what < 0 || what > 1)
     return -1;
 
-  if (!what)
+  /* With shared memory the peer signals an eventfd while the socket
+     still carries descriptors and the end of the connection; both are
+     to be polled for reading.  */
+  if (_assuan_shm_wait_fd (ctx) != ASSUAN_INVALID_FD)
+    {
+      fdarray[n++] = ctx->inbound.fd;
+      fdarray[n++] = _assuan_shm_wait_fd (ctx);
+    }
+  else if (!what)
     {
       if (ctx->inbound.fd != ASSUAN_INVALID_FD)
         fdarray[n++] = ctx->inbound.fd;
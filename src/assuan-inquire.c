@@ -98,6 +98,28 @@ put_membuf (assuan_context_t ctx,
   mb->len += len;
 }
 
+/* Append the data announced by the "DFD" line with the arguments ARGS
+   to MB.  The descriptor is taken even if MB is already too large.  */
+static gpg_error_t
+put_membuf_from_fd (assuan_context_t ctx, struct membuf *mb, const char *args)
+{
+  gpg_error_t rc;
+  void *data;
+  size_t len;
+
+  rc = _assuan_uds_map_data (ctx, args, &data, &len);
+  if (rc)
+    return rc;
+  put_membuf (ctx, mb, data, len);
+  _assuan_uds_unmap_data (ctx, data, len);
+  return 0;
+}
+
+/* Return true if LINE announces data passed in a descriptor.  */
+#define IS_DATA_FD_LINE(line) \
+  ((line)[0] == 'D' && (line)[1] == 'F' && (line)[2] == 'D' \
+   && (line)[3] == ' ')
+
 static void *
 get_membuf (assuan_context_t ctx, struct membuf *mb, size_t *len)
 {
@@ -207,6 +229,13 @@ assuan_inquire (assuan_context_t ctx, const char *keyword,
           rc = _assuan_error (ctx, GPG_ERR_ASS_CANCELED);
           goto out;
         }
+      if (IS_DATA_FD_LINE (line) && !nodataexpected)
+        {
+          rc = put_membuf_from_fd (ctx, &mb, (char *)line + 4);
+          if (rc)
+            goto out;
+          continue;
+        }
       if ((line[0] != 'D' && line[0] != 'd')
           || line[1] != ' ' || nodataexpected)
         {
@@ -310,6 +339,16 @@ _assuan_inquire_ext_cb (assuan_context_t ctx)
       goto out;
     }
 
+  if (IS_DATA_FD_LINE (line) && mb)
+    {
+      rc = put_membuf_from_fd (ctx, mb, (char *)line + 4);
+      if (!rc && mb->too_large)
+        rc = _assuan_error (ctx, GPG_ERR_ASS_TOO_MUCH_DATA);
+      if (rc)
+        goto out;
+      return 0;
+    }
+
   if ((line[0] != 'D' && line[0] != 'd') || line[1] != ' ' || mb == NULL)
     {
       rc = _assuan_error (ctx, GPG_ERR_ASS_UNEXPECTED_CMD);
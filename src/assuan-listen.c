@@ -57,55 +57,30 @@ assuan_set_hello_line (assuan_context_t ctx, const char *line)
       _assuan_free (ctx, ctx->hello_line);
       ctx->hello_line = buf;
     }
+  _assuan_free (ctx, ctx->hello.buffer);
+  ctx->hello.buffer = NULL;
   return 0;
 }
 
 
-/**
- * assuan_accept:
- * @ctx: context
- *
- * Cancel any existing connection and wait for a connection from a
- * client.  The initial handshake is performed which may include an
- * initial authentication or encryption negotiation.
- *
- * Return value: 0 on success or an error if the connection could for
- * some reason not be established.
- **/
-gpg_error_t
-assuan_accept (assuan_context_t ctx)
+/* Pass the lines of the greeting of CTX for process APID to FNC.  */
+static gpg_error_t
+walk_hello (assuan_context_t ctx, pid_t apid,
+            gpg_error_t (*fnc) (assuan_context_t ctx, const char *prefix,
+                                const char *line, size_t len, void *opaque),
+            void *opaque)
 {
-  gpg_error_t rc = 0;
+  gpg_error_t rc;
   const char *p, *pend;
-  pid_t apid = getpid ();
   char tmpbuf[50];
 
-  if (!ctx)
-    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
-
-  if (ctx->max_accepts != -1)
-    {
-      if (ctx->max_accepts-- == 0)
-	return -1; /* second invocation for pipemode -> terminate */
-    }
-  if (ctx->accept_handler)
-    {
-      /* FIXME: This should be superfluous, if everything else is
-	 correct.  */
-      ctx->finish_handler (ctx);
-      rc = ctx->accept_handler (ctx);
-      if (rc)
-	return rc;
-    }
-
-  /* Send the hello. */
   p = ctx->hello_line;
   if (p && (pend = strchr (p, '\n')))
     { /* This is a multi line hello.  Send all but the last line as
          comments. */
       do
         {
-          rc = _assuan_write_line (ctx, "# ", p, pend - p);
+          rc = fnc (ctx, "# ", p, pend - p, opaque);
           if (rc)
             return rc;
           p = pend + 1;
@@ -116,11 +91,11 @@ assuan_accept (assuan_context_t ctx)
       if (apid != ASSUAN_INVALID_PID)
         {
           snprintf (tmpbuf, sizeof tmpbuf, "%s, process %i", p, (int)apid);
-          rc = _assuan_write_line (ctx, "OK ", tmpbuf, strlen (tmpbuf));
+          rc = fnc (ctx, "OK ", tmpbuf, strlen (tmpbuf), opaque);
         }
       else
 #endif
-        rc = _assuan_write_line (ctx, "OK ", p, strlen (p));
+        rc = fnc (ctx, "OK ", p, strlen (p), opaque);
 
     }
   else if (p)
@@ -129,11 +104,11 @@ assuan_accept (assuan_context_t ctx)
       if (apid != ASSUAN_INVALID_PID)
         {
           snprintf (tmpbuf, sizeof tmpbuf, "%s, process %i", p, (int)apid);
-          rc = assuan_write_line (ctx, tmpbuf);
+          rc = fnc (ctx, NULL, tmpbuf, strlen (tmpbuf), opaque);
         }
       else
 #endif
-        rc = assuan_write_line (ctx, p);
+        rc = fnc (ctx, NULL, p, strlen (p), opaque);
     }
   else
     {
@@ -141,18 +116,134 @@ assuan_accept (assuan_context_t ctx)
       if (apid != ASSUAN_INVALID_PID)
         {
           snprintf (tmpbuf, sizeof tmpbuf, "%s, process %i", okstr, (int)apid);
-          rc = assuan_write_line (ctx, tmpbuf);
+          rc = fnc (ctx, NULL, tmpbuf, strlen (tmpbuf), opaque);
         }
       else
-        rc = assuan_write_line (ctx, okstr);
+        rc = fnc (ctx, NULL, okstr, strlen (okstr), opaque);
+    }
+  return rc;
+}
+
+
+/* Line function for walk_hello to send the line.  */
+static gpg_error_t
+write_hello_line (assuan_context_t ctx, const char *prefix,
+                  const char *line, size_t len, void *opaque)
+{
+  (void)opaque;
+  return _assuan_write_line (ctx, prefix, line, len);
+}
+
+
+/* The greeting rendered by render_hello_line.  If BUFFER is NULL only
+   the LENGTH is computed.  */
+struct hello_render_s
+{
+  char *buffer;
+  size_t length;
+};
+
+
+/* Line function for walk_hello to append the line to the
+   hello_render_s at OPAQUE.  */
+static gpg_error_t
+render_hello_line (assuan_context_t ctx, const char *prefix,
+                   const char *line, size_t len, void *opaque)
+{
+  struct hello_render_s *r = opaque;
+  size_t prefixlen = prefix? strlen (prefix) : 0;
+
+  /* Leave the truncation of long lines to _assuan_write_line.  */
+  if (len + prefixlen + 2 > ASSUAN_LINELENGTH)
+    return _assuan_error (ctx, GPG_ERR_TOO_LARGE);
+
+  if (r->buffer)
+    {
+      if (prefixlen)
+        memcpy (r->buffer + r->length, prefix, prefixlen);
+      memcpy (r->buffer + r->length + prefixlen, line, len);
+      r->buffer[r->length + prefixlen + len] = '\n';
     }
+  r->length += prefixlen + len + 1;
+  return 0;
+}
+
+
+/* Render the greeting of CTX for process APID so that it can be sent
+   with one write.  */
+static gpg_error_t
+render_hello (assuan_context_t ctx, pid_t apid)
+{
+  struct hello_render_s r;
+  gpg_error_t rc;
+
+  r.buffer = NULL;
+  r.length = 0;
+  rc = walk_hello (ctx, apid, render_hello_line, &r);
   if (rc)
     return rc;
 
+  r.buffer = _assuan_malloc (ctx, r.length);
+  if (!r.buffer)
+    return _assuan_error (ctx, gpg_err_code_from_syserror ());
+  r.length = 0;
+  walk_hello (ctx, apid, render_hello_line, &r);
+
+  _assuan_free (ctx, ctx->hello.buffer);
+  ctx->hello.buffer = r.buffer;
+  ctx->hello.length = r.length;
+  ctx->hello.pid = apid;
   return 0;
 }
 
 
+/**
+ * assuan_accept:
+ * @ctx: context
+ *
+ * Cancel any existing connection and wait for a connection from a
+ * client.  The initial handshake is performed which may include an
+ * initial authentication or encryption negotiation.
+ *
+ * Return value: 0 on success or an error if the connection could for
+ * some reason not be established.
+ **/
+gpg_error_t
+assuan_accept (assuan_context_t ctx)
+{
+  gpg_error_t rc = 0;
+  pid_t apid = getpid ();
+
+  if (!ctx)
+    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
+
+  if (ctx->max_accepts != -1)
+    {
+      if (ctx->max_accepts-- == 0)
+	return -1; /* second invocation for pipemode -> terminate */
+    }
+  if (ctx->accept_handler)
+    {
+      /* FIXME: This should be superfluous, if everything else is
+	 correct.  */
+      ctx->finish_handler (ctx);
+      rc = ctx->accept_handler (ctx);
+      if (rc)
+	return rc;
+      ctx->deadline.expired = 0;
+    }
+
+  /* Send the hello.  Unless the lines are to be monitored or logged,
+     the greeting is rendered once and then sent with one write.  */
+  if (!ctx->io_monitor && !_assuan_log_control_p (ctx)
+      && ((ctx->hello.buffer && ctx->hello.pid == apid)
+          || !render_hello (ctx, apid)))
+    return _assuan_write_lines (ctx, ctx->hello.buffer, ctx->hello.length);
+
+  return walk_hello (ctx, apid, write_hello_line, NULL);
+}
+
+
 
 assuan_fd_t
 assuan_get_input_fd (assuan_context_t ctx)
@@ -158,6 +158,19 @@ _assuan_log_handler (assuan_context_t ctx, void *hook, unsigned int cat,
 
 
 
+/* Return true if control channel messages of CTX are logged.  This
+   checks whether logging is enabled and does a quick check to see
+   whether the callback supports our category.  */
+int
+_assuan_log_control_p (assuan_context_t ctx)
+{
+  return (ctx
+          && ctx->log_cb
+          && !ctx->flags.no_logging
+          && (*ctx->log_cb) (ctx, ctx->log_cb_data, ASSUAN_LOG_CONTROL, NULL));
+}
+
+
 /* Log a control channel message.  This is either a STRING with a
    diagnostic or actual data in (BUFFER1,LENGTH1) and
    (BUFFER2,LENGTH2).  If OUTBOUND is true the data is intended for
@@ -172,12 +185,7 @@ _assuan_log_control_channel (assuan_context_t ctx, int outbound,
   char *outbuf;
   int saved_errno;
 
-  /* Check whether logging is enabled and do a quick check to see
-     whether the callback supports our category.  */
-  if (!ctx
-      || !ctx->log_cb
-      || ctx->flags.no_logging
-      || !(*ctx->log_cb) (ctx, ctx->log_cb_data, ASSUAN_LOG_CONTROL, NULL))
+  if (!_assuan_log_control_p (ctx))
     return;
 
   saved_errno = errno;
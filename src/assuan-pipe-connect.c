@@ -100,7 +100,9 @@ initial_handshake (assuan_context_t ctx)
   int off;
   gpg_error_t err;
 
+  _assuan_deadline_begin (ctx);
   err = _assuan_read_from_server (ctx, &response, &off, 0);
+  _assuan_deadline_end (ctx);
   if (err)
     TRACE1 (ctx, ASSUAN_LOG_SYSIO, "initial_handshake", ctx,
 	    "can't connect server: %s", gpg_strerror (err));
@@ -238,6 +240,7 @@ pipe_connect (assuan_context_t ctx,
 #else
   ctx->engine.sendfd = NULL;
 #endif
+  ctx->engine.sendfds = NULL;
   ctx->engine.receivefd = NULL;
   ctx->finish_handler = _assuan_client_finish;
   ctx->max_accepts = 1;
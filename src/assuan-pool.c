@@ -0,0 +1,252 @@
+/* assuan-pool.c - Pool of client connections
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of Assuan.
+ *
+ * Assuan is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Assuan is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef HAVE_W32_SYSTEM
+# include <poll.h>
+#endif
+
+#include "assuan-defs.h"
+
+
+/* A pool of idle client connections.  The idle contexts are kept in
+   a list linked through their POOL.NEXT member with the most recently
+   returned context first.  */
+struct assuan_pool_s
+{
+  gpgrt_lock_t lock;
+  struct assuan_malloc_hooks malloc_hooks;
+  gpg_err_source_t err_source;
+  assuan_log_cb_t log_cb;
+  void *log_cb_data;
+
+  unsigned int max_idle;  /* Maximum number of idle contexts.  */
+  unsigned int nidle;     /* Current number of idle contexts.  */
+  assuan_context_t idle;  /* List of idle contexts.  */
+};
+
+
+/* Create a new connection pool which keeps at most MAX_IDLE idle
+   connections.  The pool uses the default error source, malloc hooks
+   and log handler in effect at the time of this call.  */
+gpg_error_t
+assuan_pool_new (assuan_pool_t *r_pool, unsigned int max_idle)
+{
+  assuan_malloc_hooks_t malloc_hooks = assuan_get_malloc_hooks ();
+  gpg_err_source_t err_source = assuan_get_gpg_err_source ();
+  assuan_pool_t pool;
+  gpg_err_code_t ec;
+
+  if (!r_pool)
+    return gpg_err_make (err_source, GPG_ERR_ASS_INV_VALUE);
+  *r_pool = NULL;
+
+  pool = malloc_hooks->malloc (sizeof *pool);
+  if (!pool)
+    return gpg_err_make (err_source, gpg_err_code_from_syserror ());
+  memset (pool, 0, sizeof *pool);
+  ec = gpgrt_lock_init (&pool->lock);
+  if (ec)
+    {
+      malloc_hooks->free (pool);
+      return gpg_err_make (err_source, ec);
+    }
+  pool->malloc_hooks = *malloc_hooks;
+  pool->err_source = err_source;
+  assuan_get_log_cb (&pool->log_cb, &pool->log_cb_data);
+  pool->max_idle = max_idle;
+
+  *r_pool = pool;
+  return 0;
+}
+
+
+/* Release POOL and all idle connections.  Contexts still checked out
+   from the pool must be released with assuan_release and may not be
+   returned to the pool anymore.  */
+void
+assuan_pool_release (assuan_pool_t pool)
+{
+  assuan_context_t ctx;
+
+  if (!pool)
+    return;
+
+  while ((ctx = pool->idle))
+    {
+      pool->idle = ctx->pool.next;
+      ctx->pool.next = NULL;
+      assuan_release (ctx);
+    }
+  gpgrt_lock_destroy (&pool->lock);
+  pool->malloc_hooks.free (pool);
+}
+
+
+/* Return true if the idle connection CTX still looks usable.  An idle
+   connection has nothing to read; a readable socket means that the
+   server closed the connection or sent garbage.  */
+static int
+connection_alive (assuan_context_t ctx)
+{
+  if (ctx->inbound.eof || ctx->inbound.attic.linelen
+      || ctx->inbound.fd == ASSUAN_INVALID_FD)
+    return 0;
+
+#ifndef HAVE_W32_SYSTEM
+  {
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = ctx->inbound.fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    do
+      n = poll (&pfd, 1, 0);
+    while (n < 0 && errno == EINTR);
+    if (n < 0 || (n > 0 && pfd.revents))
+      return 0;
+  }
+#endif /*!HAVE_W32_SYSTEM*/
+
+  return 1;
+}
+
+
+/* Return a context connected to the socket NAME in R_CTX.  An idle
+   connection from POOL made with the same NAME and FLAGS is re-used
+   if available; otherwise a new connection is made using
+   assuan_socket_connect.  The context is to be returned to the pool
+   with assuan_pool_put.  */
+gpg_error_t
+assuan_pool_get (assuan_pool_t pool, assuan_context_t *r_ctx,
+                 const char *name, unsigned int flags)
+{
+  gpg_error_t err;
+  assuan_context_t ctx, *ctxp;
+
+  if (!pool || !r_ctx || !name)
+    return gpg_err_make (pool? pool->err_source : GPG_ERR_SOURCE_ASSUAN,
+                         GPG_ERR_ASS_INV_VALUE);
+  *r_ctx = NULL;
+
+  for (;;)
+    {
+      gpgrt_lock_lock (&pool->lock);
+      for (ctxp = &pool->idle; (ctx = *ctxp); ctxp = &ctx->pool.next)
+        if (ctx->pool.flags == flags && !strcmp (ctx->pool.name, name))
+          {
+            *ctxp = ctx->pool.next;
+            ctx->pool.next = NULL;
+            pool->nidle--;
+            break;
+          }
+      gpgrt_lock_unlock (&pool->lock);
+
+      if (!ctx)
+        break;
+      if (connection_alive (ctx))
+        {
+          *r_ctx = ctx;
+          return 0;
+        }
+      assuan_release (ctx);
+    }
+
+  err = assuan_new_ext (&ctx, pool->err_source, &pool->malloc_hooks,
+                        pool->log_cb, pool->log_cb_data);
+  if (err)
+    return err;
+
+  ctx->pool.name = _assuan_malloc (ctx, strlen (name) + 1);
+  if (!ctx->pool.name)
+    {
+      err = _assuan_error (ctx, gpg_err_code_from_syserror ());
+      assuan_release (ctx);
+      return err;
+    }
+  strcpy (ctx->pool.name, name);
+  ctx->pool.flags = flags;
+
+  err = assuan_socket_connect (ctx, name, ASSUAN_INVALID_PID, flags);
+  if (err)
+    {
+      assuan_release (ctx);
+      return err;
+    }
+
+  *r_ctx = ctx;
+  return 0;
+}
+
+
+/* Return the context CTX obtained by assuan_pool_get to POOL.  The
+   flags, deadlines, status handlers and I/O monitor set by the user
+   are reset and descriptors not yet received are closed.  Then the
+   server is sent a RESET so that the next user starts with a clean
+   state; if that fails, or if the pool is full, the connection is
+   closed.  */
+void
+assuan_pool_put (assuan_pool_t pool, assuan_context_t ctx)
+{
+  assuan_context_t victim = NULL;
+  assuan_context_t *ctxp;
+
+  if (!ctx)
+    return;
+  if (!pool || !ctx->pool.name || !pool->max_idle
+      || ctx->transact.inquire_pending || ctx->transact.nonblock
+      || ctx->flags.in_inq_cb)
+    {
+      assuan_release (ctx);
+      return;
+    }
+  _assuan_client_reset (ctx);
+  if (assuan_transact (ctx, "RESET", NULL, NULL, NULL, NULL, NULL, NULL)
+      || !connection_alive (ctx))
+    {
+      assuan_release (ctx);
+      return;
+    }
+
+  gpgrt_lock_lock (&pool->lock);
+  if (pool->nidle >= pool->max_idle)
+    {
+      /* Evict the least recently used connection.  */
+      for (ctxp = &pool->idle; (*ctxp)->pool.next; ctxp = &(*ctxp)->pool.next)
+        ;
+      victim = *ctxp;
+      *ctxp = NULL;
+      pool->nidle--;
+    }
+  ctx->pool.next = pool->idle;
+  pool->idle = ctx;
+  pool->nidle++;
+  gpgrt_lock_unlock (&pool->lock);
+
+  if (victim)
+    assuan_release (victim);
+}
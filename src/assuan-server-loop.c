@@ -0,0 +1,3106 @@
+/* assuan-server-loop.c - Event loop serving many socket connections
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of Assuan.
+ *
+ * Assuan is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Assuan is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+# include <fcntl.h>
+# include <sched.h>
+# include <sys/socket.h>
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+#endif
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_LINUX_IO_URING_H) \
+    && defined(HAVE_SYS_MMAN_H) && defined(__GNUC__)
+# include <poll.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+# if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#  define USE_IO_URING 1
+# endif
+#endif
+
+#include "assuan-defs.h"
+#include "debug.h"
+
+
+/* The maximum number of events fetched by one epoll_wait.  This is
+   also the number of connections a worker serves before it checks
+   for new events again.  */
+#define MAX_EVENTS 64
+
+/* The maximum number of workers of a server.  */
+#define MAX_WORKERS 1024
+
+/* The size of the hash table for the connections per user.  */
+#define UID_BUCKETS 64
+
+#define xtoi_1(p)   (*(p) <= '9'? (*(p)- '0'): \
+                     *(p) <= 'F'? (*(p)-'A'+10):(*(p)-'a'+10))
+#define xtoi_2(p)   ((xtoi_1(p) * 16) + xtoi_1((p)+1))
+
+/* The timer wheel for the timeouts.  A tick is TICK_MSEC
+   milliseconds.  Each of the WHEEL_LEVELS levels has WHEEL_SIZE
+   slots, each slot of a level covering the whole previous level, so
+   that timers up to WHEEL_SPAN ticks (about 46 hours) ahead can be
+   scheduled.  Longer timeouts are re-scheduled when due.  */
+#define TICK_MSEC    10
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN   (1UL << (WHEEL_BITS * WHEEL_LEVELS))
+
+/* The number of command priorities and thus of run queues.  */
+#define NUM_PRIORITIES (ASSUAN_PRIORITY_HIGH + 1)
+
+
+/* A worker of a server loop.  Each worker has its own epoll instance
+   with the connections it has accepted; they are kept in a list
+   linked through the LOOP.NEXT and LOOP.PREV members of their
+   contexts.  Connections with pending events are queued through
+   LOOP.QNEXT until they are served by this or, if this worker is
+   busy, by another worker.  */
+struct assuan_server_worker_s
+{
+  assuan_server_t server;
+  int epfd;                   /* The epoll instance.  */
+  int wakefd;                 /* Eventfd to wake up the worker.  */
+  struct server_ring_s *ring; /* The io_uring used instead of EPFD.  */
+  int cpu;                    /* The CPU to run on or -1.  */
+  unsigned int idle : 1;      /* Waiting for events.  Uses SERVER->LOCK.  */
+
+  gpgrt_lock_t lock;          /* Protects the following members.  */
+  assuan_context_t conns;     /* The connections of this worker.  */
+  unsigned int nconns;        /* Number of connections.  */
+  assuan_context_t qhead[NUM_PRIORITIES]; /* Connections ready to be */
+  assuan_context_t qtail[NUM_PRIORITIES]; /* served by the priority of
+                                             their next command.  */
+  assuan_context_t yhead;     /* Connections which used up their */
+  assuan_context_t ytail;     /* budget; queued after the next poll.  */
+  unsigned long tick;         /* The next tick of the wheel.  */
+  unsigned long clock;        /* The time in msec when TICK is due.  */
+  unsigned long wake_tick;    /* Tick until which the worker sleeps.  */
+  unsigned int napping : 1;   /* Sleeping until WAKE_TICK.  */
+  unsigned int ntimers;       /* Number of timers in the wheel.  */
+  assuan_context_t wheel[WHEEL_LEVELS][WHEEL_SIZE]; /* The timers of
+                                 the connections, linked through
+                                 LOOP.TNEXT.  */
+};
+typedef struct assuan_server_worker_s *server_worker_t;
+typedef struct server_ring_s *server_ring_t;
+
+
+/* The number of connections of a user.  */
+struct uid_count_s
+{
+  struct uid_count_s *next;
+  unsigned long uid;
+  unsigned int count;
+};
+
+
+/* A server loop.  */
+struct assuan_server_s
+{
+  struct assuan_malloc_hooks malloc_hooks;
+  gpg_err_source_t err_source;
+  assuan_log_cb_t log_cb;
+  void *log_cb_data;
+
+  assuan_fd_t listen_fd;
+  unsigned int flags;
+  assuan_server_connect_t connect_cb;
+  assuan_server_disconnect_t disconnect_cb;
+  void *opaque;
+
+  unsigned int nworkers;        /* Number of workers.  */
+  server_worker_t workers;      /* Array with the workers.  */
+  volatile int stop;            /* Set by assuan_server_stop.  */
+  unsigned int idle_timeout;    /* Set by assuan_server_set_timeouts */
+  unsigned int command_timeout; /* while no worker is running.  */
+  unsigned int aging;           /* Set by assuan_server_set_priorities.  */
+  int io_uring;                 /* The workers use io_uring.  */
+
+  gpgrt_lock_t lock;            /* Protects the following members.  */
+  unsigned int nrunning;        /* Number of running workers.  */
+  unsigned int nidle;           /* Number of idle workers.  */
+  unsigned int accept_blocked:1;/* Accepting is suspended until a
+                                   connection ends.  */
+  unsigned int handed_off:1;    /* The listening socket has been
+                                   passed to another process.  */
+  unsigned int max_spare;       /* Maximum number of spare contexts.  */
+  unsigned int nspare;          /* Number of spare contexts.  */
+  assuan_context_t spare;       /* Contexts of ended connections kept
+                                   for re-use, linked through
+                                   LOOP.NEXT.  */
+  unsigned int max_conns;       /* The limits set by */
+  unsigned int max_active;      /* assuan_server_set_limits  */
+  unsigned int max_per_uid;     /* or 0 for no limit.  */
+  unsigned int limit_flags;
+  unsigned int nconns;          /* Number of connections.  */
+  unsigned int nactive;         /* Number of running commands.  */
+  assuan_context_t whead;       /* Connections waiting for a command */
+  assuan_context_t wtail;       /* slot, linked through LOOP.WNEXT.  */
+  struct uid_count_s *uids[UID_BUCKETS]; /* Connections per user.  */
+  char busy_line[128];          /* Sent to rejected clients.  */
+};
+
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static void wake_worker (server_worker_t w);
+static void enqueue_connection (assuan_context_t ctx);
+#ifdef USE_IO_URING
+static int ring_add_connection (assuan_context_t ctx);
+static void ring_remove_connection (assuan_context_t ctx);
+static int ring_poll_output (assuan_context_t ctx);
+#endif
+
+/* Return true if SERVER has timeouts.  */
+#define TIMED(server) ((server)->idle_timeout || (server)->command_timeout)
+
+/* Return true if SERVER serves the connections by priority.  */
+#define PRIORITIZED(server) ((server)->aging)
+
+/* Return true if the connections of SERVER may be served by other
+   workers than the one which accepted them.  */
+#define SHARED(server) ((server)->nworkers > 1 && !(server)->io_uring)
+
+#ifdef USE_IO_URING
+
+/* The number of submission queue entries of a ring.  The completion
+   queue is larger as each multishot request may complete many
+   times.  */
+#define SQ_ENTRIES 256
+#define CQ_ENTRIES 4096
+
+/* The receive buffers provided to a ring.  RING_BUFS buffers of
+   RING_BUFSIZE bytes are shared by the connections of a worker.  A
+   connection holding CONN_BUFS of them stops receiving until it has
+   read them, which leaves further input in the socket as with
+   epoll.  */
+#define RING_BUFS    128
+#define RING_BUFSIZE 4096
+#define RING_BGID    0
+#define CONN_BUFS    8
+
+/* The room for the ancillary data of a message received with
+   descriptor passing; assuan_sendfds sends up to 64 descriptors in
+   one message.  */
+#define RING_CONTROL_SIZE CMSG_SPACE (64 * sizeof (int))
+
+/* The user data of the requests.  The low two bits tell the kind of
+   request; those of the connections carry the slot of the connection
+   and its generation, so that completions of ended connections are
+   recognized.  */
+#define UD_LISTEN  0
+#define UD_WAKE    4
+#define UD_IGNORE  8
+#define UD_RECV    1
+#define UD_POLLOUT 2
+#define UD_KIND(ud)  ((unsigned int)(ud) & 3)
+#define UD_SLOT(ud)  ((unsigned int)(ud) >> 2)
+#define UD_GEN(ud)   ((unsigned int)((ud) >> 32))
+
+
+/* A slot of the connections of a ring.  */
+struct ring_slot_s
+{
+  assuan_context_t ctx;         /* The connection or NULL.  */
+  unsigned int gen;             /* Incremented when it is released.  */
+  unsigned int next;            /* The next free slot.  */
+};
+
+
+/* The io_uring of a worker, used instead of its epoll instance.  It
+   is only used by the thread running the worker.  The connections
+   keep a multishot receive armed, which fills the buffers provided
+   to the ring; reading from a connection takes the data from these
+   buffers.  */
+struct server_ring_s
+{
+  int fd;
+  unsigned char *sqmap;         /* The mapped rings.  */
+  size_t sqmapsize;
+  unsigned char *cqmap;
+  size_t cqmapsize;
+  struct io_uring_sqe *sqes;
+  size_t sqessize;
+  unsigned int *sqhead;
+  unsigned int *sqtailp;
+  unsigned int *sqflags;
+  unsigned int sqmask;
+  unsigned int sqentries;
+  unsigned int sqtail;          /* Published when entering the ring.  */
+  unsigned int *cqhead;
+  unsigned int *cqtail;
+  unsigned int cqmask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *br; /* The provided buffers.  */
+  size_t brsize;
+  unsigned char *bufs;
+  unsigned short brtail;
+  unsigned int nfree;           /* Number of buffers in BR.  */
+  int bnext[RING_BUFS];         /* Next buffer of the connection.  */
+  unsigned int boff[RING_BUFS]; /* Start of the unread data.  */
+  unsigned int bend[RING_BUFS]; /* End of the data.  */
+  struct msghdr msg;            /* The template of the receives.  */
+  unsigned int hdrlen;          /* Offset of the data in a buffer.  */
+
+  struct ring_slot_s *slots;    /* The connections; slot 0 is unused.  */
+  unsigned int nslots;
+  unsigned int freeslot;        /* First free slot or 0.  */
+  assuan_context_t shead;       /* Connections waiting for free */
+  assuan_context_t stail;       /* buffers, linked through LOOP.SNEXT.  */
+  unsigned int listening : 1;   /* The listening socket is polled.  */
+  unsigned int waking : 1;      /* The wake up descriptor is polled.  */
+};
+
+
+/* Return the user data for the request KIND of the connection CTX
+   on the ring R.  */
+static uint64_t
+ring_user_data (server_ring_t r, assuan_context_t ctx, unsigned int kind)
+{
+  unsigned int slot = ctx->loop.rslot;
+
+  return (((uint64_t)r->slots[slot].gen << 32)
+          | ((uint64_t)slot << 2) | kind);
+}
+
+
+/* Submit the queued requests of R and, if WAIT is true, wait up to
+   TIMEOUT milliseconds or, if TIMEOUT is -1, without limit for a
+   completion.  Returns -1 with ERRNO set on error.  */
+static int
+ring_enter (server_ring_t r, int wait, int timeout)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned int nsubmit, flags = 0;
+  int res;
+
+  nsubmit = r->sqtail - __atomic_load_n (r->sqhead, __ATOMIC_ACQUIRE);
+  if (!nsubmit && !wait)
+    return 0;
+  __atomic_store_n (r->sqtailp, r->sqtail, __ATOMIC_RELEASE);
+
+  memset (&arg, 0, sizeof arg);
+  if (wait)
+    {
+      flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+      if (timeout >= 0)
+        {
+          ts.tv_sec = timeout / 1000;
+          ts.tv_nsec = (timeout % 1000) * 1000000L;
+          arg.ts = (uintptr_t)&ts;
+        }
+    }
+  do
+    res = syscall (__NR_io_uring_enter, r->fd, nsubmit, wait? 1 : 0, flags,
+                   wait? &arg : NULL, wait? sizeof arg : 0);
+  while (res < 0 && errno == EINTR && !wait);
+  if (res < 0 && (errno == ETIME || errno == EAGAIN || errno == EBUSY))
+    res = 0;  /* Timed out or to be tried again.  */
+  return res < 0? -1 : 0;
+}
+
+
+/* Return true if completions of R are waiting in the kernel because
+   the completion queue was full.  */
+static int
+ring_overflown (server_ring_t r)
+{
+  return !!(__atomic_load_n (r->sqflags, __ATOMIC_RELAXED)
+            & IORING_SQ_CQ_OVERFLOW);
+}
+
+
+/* Return a cleared submission queue entry of R.  Returns NULL with
+   ERRNO set if the queue is full and can't be submitted.  */
+static struct io_uring_sqe *
+ring_get_sqe (server_ring_t r)
+{
+  struct io_uring_sqe *sqe;
+
+  if (r->sqtail - __atomic_load_n (r->sqhead, __ATOMIC_ACQUIRE)
+      >= r->sqentries)
+    {
+      if (ring_enter (r, 0, 0))
+        return NULL;
+      if (r->sqtail - __atomic_load_n (r->sqhead, __ATOMIC_ACQUIRE)
+          >= r->sqentries)
+        {
+          gpg_err_set_errno (EBUSY);
+          return NULL;
+        }
+    }
+  sqe = r->sqes + (r->sqtail & r->sqmask);
+  memset (sqe, 0, sizeof *sqe);
+  r->sqtail++;
+  return sqe;
+}
+
+
+/* Return the next completion of R or NULL.  */
+static struct io_uring_cqe *
+ring_peek (server_ring_t r)
+{
+  unsigned int head = *r->cqhead;
+
+  if (head == __atomic_load_n (r->cqtail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return r->cqes + (head & r->cqmask);
+}
+
+
+/* Release the completion returned by ring_peek.  */
+static void
+ring_advance (server_ring_t r)
+{
+  __atomic_store_n (r->cqhead, *r->cqhead + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Return the buffer BID to the buffers provided by R.  */
+static void
+ring_put_buffer (server_ring_t r, int bid)
+{
+  struct io_uring_buf *buf;
+
+  buf = r->br->bufs + (r->brtail & (RING_BUFS - 1));
+  buf->addr = (uintptr_t)(r->bufs + bid * RING_BUFSIZE);
+  buf->len = RING_BUFSIZE;
+  buf->bid = bid;
+  r->brtail++;
+  __atomic_store_n (&r->br->tail, r->brtail, __ATOMIC_RELEASE);
+  r->nfree++;
+}
+
+
+/* Queue a multishot receive on FD with the user data UD.  */
+static int
+ring_recv (server_ring_t r, int fd, uint64_t ud)
+{
+  struct io_uring_sqe *sqe = ring_get_sqe (r);
+
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)&r->msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RING_BGID;
+  sqe->user_data = ud;
+  return 0;
+}
+
+
+/* Queue a poll for EVENTS on FD with the user data UD, which is
+   repeated if MULTISHOT is true.  */
+static int
+ring_poll (server_ring_t r, int fd, unsigned int events, int multishot,
+           uint64_t ud)
+{
+  struct io_uring_sqe *sqe = ring_get_sqe (r);
+
+  if (!sqe)
+    return -1;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  events = (events << 16) | (events >> 16);  /* Stored word-reversed.  */
+#endif
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->len = multishot? IORING_POLL_ADD_MULTI : 0;
+  sqe->user_data = ud;
+  return 0;
+}
+
+
+/* Queue the cancellation of the request with the user data UD.  */
+static int
+ring_cancel (server_ring_t r, uint64_t ud)
+{
+  struct io_uring_sqe *sqe = ring_get_sqe (r);
+
+  if (!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = ud;
+  sqe->user_data = UD_IGNORE;
+  return 0;
+}
+
+
+/* Wait up to a second for a completion of R.  */
+static struct io_uring_cqe *
+ring_wait_cqe (server_ring_t r)
+{
+  struct io_uring_cqe *cqe = ring_peek (r);
+
+  if (!cqe && !ring_enter (r, 1, 1000))
+    cqe = ring_peek (r);
+  return cqe;
+}
+
+
+/* Return true if the kernel supports multishot receives into
+   provided buffers, which is tried on a socket pair.  */
+static int
+ring_probe (server_ring_t r)
+{
+  struct io_uring_cqe *cqe;
+  int sv[2];
+  int ok = 0;
+  int more = 0;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+    return 0;
+  if (!ring_recv (r, sv[0], UD_IGNORE) && write (sv[1], "", 1) == 1
+      && (cqe = ring_wait_cqe (r)))
+    {
+      ok = (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)
+            && (cqe->flags & IORING_CQE_F_MORE));
+      more = !!(cqe->flags & IORING_CQE_F_MORE);
+      if ((cqe->flags & IORING_CQE_F_BUFFER))
+        {
+          r->nfree--;
+          ring_put_buffer (r, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+      ring_advance (r);
+    }
+  /* The end of the stream finishes the receive.  */
+  close (sv[1]);
+  while (more && (cqe = ring_wait_cqe (r)))
+    {
+      more = !!(cqe->flags & IORING_CQE_F_MORE);
+      if ((cqe->flags & IORING_CQE_F_BUFFER))
+        {
+          r->nfree--;
+          ring_put_buffer (r, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+      ring_advance (r);
+    }
+  close (sv[0]);
+  return ok && !more;
+}
+
+
+/* Release the ring of the worker W.  */
+static void
+ring_destroy (server_worker_t w)
+{
+  server_ring_t r = w->ring;
+
+  if (!r)
+    return;
+  /* Closing the ring also cancels its requests.  */
+  if (r->fd != -1)
+    close (r->fd);
+  if (r->sqes)
+    munmap (r->sqes, r->sqessize);
+  if (r->cqmap && r->cqmap != r->sqmap)
+    munmap (r->cqmap, r->cqmapsize);
+  if (r->sqmap)
+    munmap (r->sqmap, r->sqmapsize);
+  if (r->bufs)
+    munmap (r->bufs, RING_BUFS * RING_BUFSIZE);
+  if (r->br)
+    munmap (r->br, r->brsize);
+  if (r->slots)
+    w->server->malloc_hooks.free (r->slots);
+  w->server->malloc_hooks.free (r);
+  w->ring = NULL;
+}
+
+
+/* Map the area at OFFSET of the ring FD or, if FD is -1, anonymous
+   memory of SIZE bytes.  Returns NULL on error.  */
+static void *
+ring_map (int fd, size_t size, off_t offset)
+{
+  void *p;
+
+  if (fd == -1)
+    p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  else
+    p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, fd, offset);
+  return p == MAP_FAILED? NULL : p;
+}
+
+
+/* Set up the ring of the worker W.  */
+static gpg_err_code_t
+ring_create (server_worker_t w)
+{
+  assuan_server_t server = w->server;
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  server_ring_t r;
+  unsigned int i;
+  gpg_err_code_t ec;
+
+  r = server->malloc_hooks.malloc (sizeof *r);
+  if (!r)
+    return gpg_err_code_from_syserror ();
+  memset (r, 0, sizeof *r);
+  r->fd = -1;
+  w->ring = r;
+
+  memset (&p, 0, sizeof p);
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+  p.cq_entries = CQ_ENTRIES;
+  r->fd = syscall (__NR_io_uring_setup, SQ_ENTRIES, &p);
+  if (r->fd == -1)
+    goto leave;
+  /* Waiting with a timeout needs IORING_ENTER_EXT_ARG.  */
+  if (!(p.features & IORING_FEAT_EXT_ARG)
+      || !(p.features & IORING_FEAT_NODROP))
+    {
+      gpg_err_set_errno (EOPNOTSUPP);
+      goto leave;
+    }
+
+  r->sqmapsize = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+  r->cqmapsize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cqmapsize > r->sqmapsize)
+    r->sqmapsize = r->cqmapsize;
+  r->sqmap = ring_map (r->fd, r->sqmapsize, IORING_OFF_SQ_RING);
+  if (!r->sqmap)
+    goto leave;
+  if ((p.features & IORING_FEAT_SINGLE_MMAP))
+    r->cqmap = r->sqmap;
+  else
+    {
+      r->cqmap = ring_map (r->fd, r->cqmapsize, IORING_OFF_CQ_RING);
+      if (!r->cqmap)
+        goto leave;
+    }
+  r->sqessize = p.sq_entries * sizeof (struct io_uring_sqe);
+  r->sqes = ring_map (r->fd, r->sqessize, IORING_OFF_SQES);
+  if (!r->sqes)
+    goto leave;
+
+  r->sqhead = (unsigned int *)(r->sqmap + p.sq_off.head);
+  r->sqtailp = (unsigned int *)(r->sqmap + p.sq_off.tail);
+  r->sqflags = (unsigned int *)(r->sqmap + p.sq_off.flags);
+  r->sqmask = *(unsigned int *)(r->sqmap + p.sq_off.ring_mask);
+  r->sqentries = p.sq_entries;
+  r->sqtail = *r->sqtailp;
+  for (i = 0; i < p.sq_entries; i++)
+    ((unsigned int *)(r->sqmap + p.sq_off.array))[i] = i;
+  r->cqhead = (unsigned int *)(r->cqmap + p.cq_off.head);
+  r->cqtail = (unsigned int *)(r->cqmap + p.cq_off.tail);
+  r->cqmask = *(unsigned int *)(r->cqmap + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(r->cqmap + p.cq_off.cqes);
+
+  r->brsize = RING_BUFS * sizeof (struct io_uring_buf);
+  r->br = ring_map (-1, r->brsize, 0);
+  r->bufs = ring_map (-1, RING_BUFS * RING_BUFSIZE, 0);
+  if (!r->br || !r->bufs)
+    goto leave;
+  memset (&reg, 0, sizeof reg);
+  reg.ring_addr = (uintptr_t)r->br;
+  reg.ring_entries = RING_BUFS;
+  reg.bgid = RING_BGID;
+  if (syscall (__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+               &reg, 1))
+    goto leave;
+  for (i = 0; i < RING_BUFS; i++)
+    ring_put_buffer (r, i);
+
+  /* The data follows the header and the room for the descriptors.  */
+  if ((server->flags & ASSUAN_SOCKET_SERVER_FDPASSING))
+    r->msg.msg_controllen = RING_CONTROL_SIZE;
+  r->hdrlen = sizeof (struct io_uring_recvmsg_out) + r->msg.msg_controllen;
+
+  if (!ring_probe (r))
+    {
+      gpg_err_set_errno (EOPNOTSUPP);
+      goto leave;
+    }
+  return 0;
+
+ leave:
+  ec = gpg_err_code_from_syserror ();
+  ring_destroy (w);
+  return ec;
+}
+
+
+/* Set up the rings of all workers of SERVER.  On error SERVER is left
+   without rings.  */
+static gpg_err_code_t
+create_rings (assuan_server_t server)
+{
+  gpg_err_code_t ec = 0;
+  unsigned int i;
+
+  for (i = 0; !ec && i < server->nworkers; i++)
+    ec = ring_create (server->workers + i);
+  if (ec)
+    {
+      for (i = 0; i < server->nworkers; i++)
+        ring_destroy (server->workers + i);
+      return ec == GPG_ERR_ENOMEM? ec : GPG_ERR_NOT_SUPPORTED;
+    }
+  server->io_uring = 1;
+  return 0;
+}
+
+#endif /*USE_IO_URING*/
+
+
+
+/* Release the workers of SERVER.  */
+static void
+destroy_workers (assuan_server_t server)
+{
+  unsigned int i;
+
+  for (i = 0; i < server->nworkers; i++)
+    {
+      server_worker_t w = server->workers + i;
+
+#ifdef USE_IO_URING
+      ring_destroy (w);
+#endif
+      if (w->wakefd != -1)
+        close (w->wakefd);
+      if (w->epfd != -1)
+        close (w->epfd);
+      gpgrt_lock_destroy (&w->lock);
+    }
+  if (server->workers)
+    server->malloc_hooks.free (server->workers);
+  server->workers = NULL;
+  server->nworkers = 0;
+}
+
+
+/* Create NWORKERS workers for SERVER.  CPUS is NULL or has the CPU
+   for each worker.  */
+static gpg_err_code_t
+create_workers (assuan_server_t server, unsigned int nworkers,
+                const int *cpus)
+{
+  struct epoll_event ev;
+  server_worker_t w;
+  gpg_err_code_t ec;
+
+  server->workers = server->malloc_hooks.malloc (nworkers
+                                                 * sizeof *server->workers);
+  if (!server->workers)
+    return gpg_err_code_from_syserror ();
+  memset (server->workers, 0, nworkers * sizeof *server->workers);
+
+  for (; server->nworkers < nworkers; server->nworkers++)
+    {
+      w = server->workers + server->nworkers;
+      w->server = server;
+      w->cpu = cpus? cpus[server->nworkers] : -1;
+      w->wakefd = -1;
+      w->clock = _assuan_get_msec ();
+      gpgrt_lock_init (&w->lock);
+
+      w->epfd = epoll_create1 (EPOLL_CLOEXEC);
+      if (w->epfd == -1)
+        goto leave;
+      w->wakefd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (w->wakefd == -1)
+        goto leave;
+
+      memset (&ev, 0, sizeof ev);
+      ev.events = EPOLLIN | EPOLLET;
+      ev.data.ptr = &w->wakefd;
+      if (epoll_ctl (w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev))
+        goto leave;
+
+      /* All workers accept connections.  With several workers only
+         one of them shall be woken up for a new connection.  */
+      ev.data.ptr = &server->listen_fd;
+#ifdef EPOLLEXCLUSIVE
+      if (nworkers > 1)
+        ev.events |= EPOLLEXCLUSIVE;
+#endif
+      if (epoll_ctl (w->epfd, EPOLL_CTL_ADD, server->listen_fd, &ev))
+        goto leave;
+    }
+#ifdef USE_IO_URING
+  /* Fall back to epoll if the rings can't be set up.  */
+  if (server->io_uring && create_rings (server))
+    server->io_uring = 0;
+#endif
+  return 0;
+
+ leave:
+  ec = gpg_err_code_from_syserror ();
+  server->nworkers++;  /* Also clean up the failed worker.  */
+  destroy_workers (server);
+  return ec;
+}
+
+#endif /*HAVE_SYS_EPOLL_H*/
+
+
+/* Create a server loop for the listening socket LISTEN_FD and store
+   it at R_SERVER.  The server takes ownership of LISTEN_FD.  For each
+   new connection CONNECT_CB is called with the new context so that
+   the commands can be registered; before a connection is released,
+   DISCONNECT_CB is called.  Both get OPAQUE as their first argument.
+   The only supported flag is ASSUAN_SOCKET_SERVER_FDPASSING.  The
+   contexts use the default error source, malloc hooks and log handler
+   in effect at the time of this call.  The server has one worker
+   which is run by assuan_server_loop.  */
+gpg_error_t
+assuan_server_new (assuan_server_t *r_server, assuan_fd_t listen_fd,
+                   unsigned int flags,
+                   assuan_server_connect_t connect_cb,
+                   assuan_server_disconnect_t disconnect_cb, void *opaque)
+{
+  assuan_malloc_hooks_t malloc_hooks = assuan_get_malloc_hooks ();
+  gpg_err_source_t err_source = assuan_get_gpg_err_source ();
+#ifdef HAVE_SYS_EPOLL_H
+  assuan_server_t server;
+  gpg_err_code_t ec;
+  int fl;
+
+  if (!r_server || listen_fd == ASSUAN_INVALID_FD
+      || (flags & ~ASSUAN_SOCKET_SERVER_FDPASSING))
+    return gpg_err_make (err_source, GPG_ERR_ASS_INV_VALUE);
+  *r_server = NULL;
+
+  /* Accepting is done until EAGAIN, thus the listening socket must
+     not block.  */
+  fl = fcntl (listen_fd, F_GETFL);
+  if (fl == -1 || fcntl (listen_fd, F_SETFL, fl | O_NONBLOCK) == -1)
+    return gpg_err_make (err_source, gpg_err_code_from_syserror ());
+
+  server = malloc_hooks->malloc (sizeof *server);
+  if (!server)
+    return gpg_err_make (err_source, gpg_err_code_from_syserror ());
+  memset (server, 0, sizeof *server);
+  server->malloc_hooks = *malloc_hooks;
+  server->err_source = err_source;
+  assuan_get_log_cb (&server->log_cb, &server->log_cb_data);
+  server->listen_fd = listen_fd;
+  server->flags = flags;
+  server->connect_cb = connect_cb;
+  server->disconnect_cb = disconnect_cb;
+  server->opaque = opaque;
+
+  ec = create_workers (server, 1, NULL);
+  if (ec)
+    {
+      malloc_hooks->free (server);
+      return gpg_err_make (err_source, ec);
+    }
+  gpgrt_lock_init (&server->lock);
+
+  *r_server = server;
+  return 0;
+#else /*!HAVE_SYS_EPOLL_H*/
+  (void)listen_fd;
+  (void)flags;
+  (void)connect_cb;
+  (void)disconnect_cb;
+  (void)opaque;
+
+  if (r_server)
+    *r_server = NULL;
+  (void)malloc_hooks;
+  return gpg_err_make (err_source, GPG_ERR_NOT_SUPPORTED);
+#endif /*!HAVE_SYS_EPOLL_H*/
+}
+
+
+/* Use NWORKERS workers for SERVER.  Each worker is to be run on its
+   own thread with assuan_server_run_worker.  If CPUS is not NULL, it
+   has NWORKERS entries with the CPU to bind each worker to or -1 to
+   leave that worker unbound.  This may only be called while no
+   worker is running and SERVER has no connections.  On error SERVER
+   is left with one worker or, if even that fails, without workers
+   until this is called again.  */
+gpg_error_t
+assuan_server_set_workers (assuan_server_t server, unsigned int nworkers,
+                           const int *cpus)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  gpg_err_code_t ec;
+  unsigned int i;
+
+  if (!server || !nworkers || nworkers > MAX_WORKERS)
+    return _assuan_error (NULL, GPG_ERR_ASS_INV_VALUE);
+  if (server->nrunning)
+    return gpg_err_make (server->err_source, GPG_ERR_INV_STATE);
+  for (i = 0; i < server->nworkers; i++)
+    if (server->workers[i].nconns)
+      return gpg_err_make (server->err_source, GPG_ERR_INV_STATE);
+
+  destroy_workers (server);
+  ec = create_workers (server, nworkers, cpus);
+  if (ec)
+    {
+      /* Try to keep the server usable.  If that fails as well, the
+         server is left without workers and assuan_server_run_worker
+         returns GPG_ERR_INV_STATE until workers have been set up.  */
+      if (create_workers (server, 1, NULL))
+        destroy_workers (server);
+      return gpg_err_make (server->err_source, ec);
+    }
+  return 0;
+#else /*!HAVE_SYS_EPOLL_H*/
+  (void)nworkers;
+  (void)cpus;
+  return _assuan_error (NULL, server? GPG_ERR_NOT_SUPPORTED
+                        /**/     : GPG_ERR_ASS_INV_VALUE);
+#endif /*!HAVE_SYS_EPOLL_H*/
+}
+
+
+/* Keep up to MAX_SPARE contexts of ended connections of SERVER for
+   re-use by new connections.  A re-used context keeps the commands
+   and handlers registered by the connect callback as well as the
+   hello line and the user pointer.  Setting MAX_SPARE to 0 disables
+   the re-use.  */
+gpg_error_t
+assuan_server_set_recycle (assuan_server_t server, unsigned int max_spare)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  assuan_context_t ctx, list = NULL;
+
+  if (!server)
+    return _assuan_error (NULL, GPG_ERR_ASS_INV_VALUE);
+
+  gpgrt_lock_lock (&server->lock);
+  server->max_spare = max_spare;
+  while (server->nspare > max_spare)
+    {
+      ctx = server->spare;
+      server->spare = ctx->loop.next;
+      server->nspare--;
+      ctx->loop.next = list;
+      list = ctx;
+    }
+  gpgrt_lock_unlock (&server->lock);
+
+  while ((ctx = list))
+    {
+      list = ctx->loop.next;
+      assuan_release (ctx);
+    }
+  return 0;
+#else /*!HAVE_SYS_EPOLL_H*/
+  (void)max_spare;
+  return _assuan_error (NULL, server? GPG_ERR_NOT_SUPPORTED
+                        /**/     : GPG_ERR_ASS_INV_VALUE);
+#endif /*!HAVE_SYS_EPOLL_H*/
+}
+
+
+/* Limit the load SERVER takes on.  MAX_CONNS is the maximum number
+   of connections; further clients are left in the backlog of the
+   listening socket until a connection ends or, with the flag
+   ASSUAN_SERVER_LIMIT_REJECT, are told that the server is busy.
+   MAX_ACTIVE is the maximum number of commands running at the same
+   time; the commands of other connections are not read until a
+   command has finished.  MAX_PER_UID is the maximum number of
+   connections of a user; further clients of that user are always
+   rejected.  A limit of 0 means no limit.  The limits may be changed
+   while the server is running.  */
+gpg_error_t
+assuan_server_set_limits (assuan_server_t server, unsigned int max_conns,
+                          unsigned int max_active, unsigned int max_per_uid,
+                          unsigned int flags)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  gpg_error_t busy;
+  char ebuf[50];
+  unsigned int i;
+
+  if (!server || (flags & ~ASSUAN_SERVER_LIMIT_REJECT))
+    return _assuan_error (NULL, GPG_ERR_ASS_INV_VALUE);
+
+  /* Rejected clients get this error in response to connecting.  */
+  busy = gpg_err_make (server->err_source, GPG_ERR_LIMIT_REACHED);
+  gpg_strerror_r (busy, ebuf, sizeof ebuf);
+
+  gpgrt_lock_lock (&server->lock);
+  server->max_conns = max_conns;
+  server->max_active = max_active;
+  server->max_per_uid = max_per_uid;
+  server->limit_flags = flags;
+  snprintf (server->busy_line, sizeof server->busy_line,
+            "ERR %d %.50s <%.30s> - server busy\n",
+            busy, ebuf, gpg_strsource (busy));
+  gpgrt_lock_unlock (&server->lock);
+
+  /* Let the workers resume accepting and admit waiting commands in
+   * case the limits have been raised.  */
+  for (i = 0; i < server->nworkers; i++)
+    wake_worker (server->workers + i);
+  return 0;
+#else /*!HAVE_SYS_EPOLL_H*/
+  (void)max_conns;
+  (void)max_active;
+  (void)max_per_uid;
+  (void)flags;
+  return _assuan_error (NULL, server? GPG_ERR_NOT_SUPPORTED
+                        /**/     : GPG_ERR_ASS_INV_VALUE);
+#endif /*!HAVE_SYS_EPOLL_H*/
+}
+
+
+/* Close connections of SERVER whose client has not sent anything for
+   IDLE_TIMEOUT milliseconds while no command was running, or whose
+   command has not finished within COMMAND_TIMEOUT milliseconds.  The
+   client is sent an ERR line with GPG_ERR_TIMEOUT before.  A timeout
+   of 0 disables it.  This may only be called while no worker is
+   running.  */
+gpg_error_t
+assuan_server_set_timeouts (assuan_server_t server, unsigned int idle_timeout,
+                            unsigned int command_timeout)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  if (!server)
+    return _assuan_error (NULL, GPG_ERR_ASS_INV_VALUE);
+  if (server->nrunning)
+    return gpg_err_make (server->err_source, GPG_ERR_INV_STATE);
+
+  server->idle_timeout = idle_timeout;
+  server->command_timeout = command_timeout;
+  return 0;
+#else /*!HAVE_SYS_EPOLL_H*/
+  (void)idle_timeout;
+  (void)command_timeout;
+  return _assuan_error (NULL, server? GPG_ERR_NOT_SUPPORTED
+                        /**/     : GPG_ERR_ASS_INV_VALUE);
+#endif /*!HAVE_SYS_EPOLL_H*/
+}
+
+
+/* Serve the connections of SERVER by the priority of their next
+   command as set with assuan_set_command_priority.  A connection
+   which has waited for AGING milliseconds to be served is ranked one
+   priority higher so that connections with low priority commands are
+   not starved.  An AGING of 0 serves them in the order they became
+   ready, which is the default.  This may only be called while no
+   worker is running.  */
+gpg_error_t
+assuan_server_set_priorities (assuan_server_t server, unsigned int aging)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  if (!server)
+    return _assuan_error (NULL, GPG_ERR_ASS_INV_VALUE);
+  if (server->nrunning)
+    return gpg_err_make (server->err_source, GPG_ERR_INV_STATE);
+
+  server->aging = aging;
+  return 0;
+#else /*!HAVE_SYS_EPOLL_H*/
+  (void)aging;
+  return _assuan_error (NULL, server? GPG_ERR_NOT_SUPPORTED
+                        /**/     : GPG_ERR_ASS_INV_VALUE);
+#endif /*!HAVE_SYS_EPOLL_H*/
+}
+
+
+/* Let the workers of SERVER use an io_uring instead of epoll if
+   ENABLE is true.  Each connection then keeps a multishot receive
+   armed, which fills buffers shared by the connections of its worker;
+   the worker takes the completions from the ring and enters the
+   kernel only to submit requests or when it has nothing else to do.
+   A connection is only served by the worker which accepted it.
+   Returns GPG_ERR_NOT_SUPPORTED if the system lacks the needed
+   io_uring features, in which case SERVER keeps using epoll.  This
+   may only be called while no worker is running and SERVER has no
+   connections; spare contexts are released.  */
+gpg_error_t
+assuan_server_set_io_uring (assuan_server_t server, int enable)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  gpg_err_code_t ec = 0;
+  unsigned int i, max_spare;
+
+  if (!server)
+    return _assuan_error (NULL, GPG_ERR_ASS_INV_VALUE);
+  if (server->nrunning)
+    return gpg_err_make (server->err_source, GPG_ERR_INV_STATE);
+  for (i = 0; i < server->nworkers; i++)
+    if (server->workers[i].nconns)
+      return gpg_err_make (server->err_source, GPG_ERR_INV_STATE);
+  if (!enable == !server->io_uring)
+    return 0;
+
+#ifdef USE_IO_URING
+  /* The spare contexts read the way they were set up for.  */
+  max_spare = server->max_spare;
+  assuan_server_set_recycle (server, 0);
+  server->max_spare = max_spare;
+
+  for (i = 0; i < server->nworkers; i++)
+    ring_destroy (server->workers + i);
+  server->io_uring = 0;
+  if (enable)
+    ec = create_rings (server);
+#else
+  (void)max_spare;
+  ec = GPG_ERR_NOT_SUPPORTED;
+#endif
+  return ec? gpg_err_make (server->err_source, ec) : 0;
+#else /*!HAVE_SYS_EPOLL_H*/
+  (void)enable;
+  return _assuan_error (NULL, server? GPG_ERR_NOT_SUPPORTED
+                        /**/     : GPG_ERR_ASS_INV_VALUE);
+#endif /*!HAVE_SYS_EPOLL_H*/
+}
+
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Add the connection CTX to the epoll instance or the ring of its
+   worker or, if OP is EPOLL_CTL_MOD, re-arm its registration.  */
+static int
+arm_connection (assuan_context_t ctx, int op)
+{
+  server_worker_t w = ctx->loop.worker;
+  struct epoll_event ev;
+
+#ifdef USE_IO_URING
+  if (w->ring)
+    return ring_add_connection (ctx);
+#endif
+  memset (&ev, 0, sizeof ev);
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  /* With several workers a connection may be served by another worker
+     than its owner.  A one-shot registration makes sure that it is
+     not reported again while it is being served.  Re-arming reports
+     a writable socket right away, thus ask for that only if there is
+     output to flush.  */
+  if (w->server->nworkers > 1)
+    {
+      ev.events |= EPOLLONESHOT;
+      if (!ctx->outbound.pending.length)
+        ev.events &= ~EPOLLOUT;
+    }
+  ev.data.ptr = ctx;
+  return epoll_ctl (w->epfd, op, ctx->inbound.fd, &ev);
+}
+
+
+/* Return the priority of the next command of the connection CTX,
+   which must not be served at the same time.  This looks at the
+   buffered input or peeks at the socket or the received buffers.  */
+static int
+connection_priority (assuan_context_t ctx)
+{
+  char buffer[32];
+  ssize_t n;
+
+  if (ctx->loop.expired)
+    return ASSUAN_PRIORITY_HIGH;  /* Only to be closed.  */
+  if (ctx->flags.in_command)
+    return ctx->current_cmd_priority;  /* Input for that command.  */
+  if (ctx->inbound.attic.linelen)
+    return _assuan_command_priority (ctx, ctx->inbound.attic.line,
+                                     ctx->inbound.attic.linelen);
+#ifdef USE_IO_URING
+  if (ctx->loop.worker->ring)
+    {
+      server_ring_t r = ctx->loop.worker->ring;
+      int bid = ctx->loop.rhead;
+
+      if (bid < 0)
+        return ASSUAN_PRIORITY_HIGH;
+      return _assuan_command_priority (ctx, ((char *)r->bufs
+                                             + bid * RING_BUFSIZE
+                                             + r->boff[bid]),
+                                       r->bend[bid] - r->boff[bid]);
+    }
+#endif
+  n = recv (ctx->inbound.fd, buffer, sizeof buffer, MSG_PEEK | MSG_DONTWAIT);
+  if (n <= 0)
+    return ASSUAN_PRIORITY_HIGH;  /* Output to flush or the end.  */
+  return _assuan_command_priority (ctx, buffer, n);
+}
+
+
+/* Append CTX to the run queue of W for its priority LOOP.PRIO.  Must
+   be called with the lock of W held.  */
+static void
+link_connection (server_worker_t w, assuan_context_t ctx)
+{
+  int prio = ctx->loop.prio;
+
+  ctx->loop.qnext = NULL;
+  if (w->qtail[prio])
+    w->qtail[prio]->loop.qnext = ctx;
+  else
+    w->qhead[prio] = ctx;
+  w->qtail[prio] = ctx;
+}
+
+
+/* Append CTX to the run queue of its worker unless it is already
+   queued.  */
+static void
+enqueue_connection (assuan_context_t ctx)
+{
+  server_worker_t w = ctx->loop.worker;
+  int prio = ASSUAN_PRIORITY_NORMAL;
+  unsigned long now = 0;
+
+  if (PRIORITIZED (w->server))
+    {
+      prio = connection_priority (ctx);
+      now = _assuan_get_msec ();
+    }
+
+  gpgrt_lock_lock (&w->lock);
+  if (!ctx->loop.queued)
+    {
+      ctx->loop.queued = 1;
+      ctx->loop.prio = prio;
+      ctx->loop.qtime = now;
+      link_connection (w, ctx);
+    }
+  gpgrt_lock_unlock (&w->lock);
+}
+
+
+/* Return the priority of the run queue of W to serve next or -1 if
+   all are empty.  A connection which has waited for the aging time
+   of the server counts as much as one with the next higher priority.
+   Must be called with the lock of W held.  */
+static int
+next_queue (server_worker_t w)
+{
+  unsigned long aging = w->server->aging;
+  unsigned long now = 0;
+  unsigned long score, best_score = 0;
+  int prio, best = -1;
+
+  for (prio = NUM_PRIORITIES - 1; prio >= 0; prio--)
+    {
+      if (!w->qhead[prio])
+        continue;
+      if (best < 0)
+        {
+          if (!aging)
+            return prio;
+          now = _assuan_get_msec ();
+        }
+      score = prio * aging + (now - w->qhead[prio]->loop.qtime);
+      if (best < 0 || score > best_score)
+        {
+          best = prio;
+          best_score = score;
+        }
+    }
+  return best;
+}
+
+
+/* Take the next connection from the run queues of W.  */
+static assuan_context_t
+dequeue_connection (server_worker_t w)
+{
+  assuan_context_t ctx = NULL;
+  int prio;
+
+  gpgrt_lock_lock (&w->lock);
+  prio = next_queue (w);
+  if (prio >= 0)
+    {
+      ctx = w->qhead[prio];
+      w->qhead[prio] = ctx->loop.qnext;
+      if (!w->qhead[prio])
+        w->qtail[prio] = NULL;
+      ctx->loop.qnext = NULL;
+      ctx->loop.queued = 0;
+      if (TIMED (w->server))
+        ctx->loop.serving++;
+    }
+  gpgrt_lock_unlock (&w->lock);
+  return ctx;
+}
+
+
+/* Take a connection from the run queue of another worker than W.
+   The workers are tried in turn starting after W so that not all
+   idle workers go for the same queue.  */
+static assuan_context_t
+steal_connection (server_worker_t w)
+{
+  assuan_server_t server = w->server;
+  unsigned int i, idx;
+  assuan_context_t ctx = NULL;
+
+  idx = w - server->workers;
+  for (i = 1; !ctx && i < server->nworkers; i++)
+    ctx = dequeue_connection (server->workers
+                              + (idx + i) % server->nworkers);
+  return ctx;
+}
+
+
+/* Return true if another worker than W has queued connections.  */
+static int
+work_available (server_worker_t w)
+{
+  assuan_server_t server = w->server;
+  server_worker_t other;
+  unsigned int i;
+  int found = 0;
+
+  for (i = 0; !found && i < server->nworkers; i++)
+    {
+      other = server->workers + i;
+      if (other == w)
+        continue;
+      gpgrt_lock_lock (&other->lock);
+      found = next_queue (other) >= 0;
+      gpgrt_lock_unlock (&other->lock);
+    }
+  return found;
+}
+
+
+/* Wake up the worker W.  */
+static void
+wake_worker (server_worker_t w)
+{
+  uint64_t one = 1;
+  int res;
+
+  res = write (w->wakefd, &one, sizeof one);
+  (void)res;  /* Already signaled if this fails with EAGAIN.  */
+}
+
+
+/* Mark the worker W as idle or, if IDLE is false, as busy.  */
+static void
+set_idle (server_worker_t w, int idle)
+{
+  assuan_server_t server = w->server;
+
+  gpgrt_lock_lock (&server->lock);
+  if (idle && !w->idle)
+    server->nidle++;
+  else if (!idle && w->idle)
+    server->nidle--;
+  w->idle = !!idle;
+  gpgrt_lock_unlock (&server->lock);
+}
+
+
+/* Wake up an idle worker so that it steals work from the busy worker
+   W.  */
+static void
+wake_idle_worker (server_worker_t w)
+{
+  assuan_server_t server = w->server;
+  server_worker_t idle = NULL;
+  unsigned int i;
+
+  gpgrt_lock_lock (&server->lock);
+  for (i = 0; server->nidle && i < server->nworkers; i++)
+    if (server->workers[i].idle && server->workers + i != w)
+      {
+        idle = server->workers + i;
+        idle->idle = 0;
+        server->nidle--;
+        break;
+      }
+  gpgrt_lock_unlock (&server->lock);
+
+  /* The write may yield to other threads, thus do it without holding
+     the lock.  */
+  if (idle)
+    wake_worker (idle);
+}
+
+
+/* Count a new connection of the user UID of SERVER.  Returns false
+   if the user already has the maximum number of connections.  Must be
+   called with SERVER->LOCK held.  */
+static int
+count_uid (assuan_server_t server, unsigned long uid)
+{
+  struct uid_count_s *uc;
+  unsigned int idx = uid % UID_BUCKETS;
+
+  for (uc = server->uids[idx]; uc; uc = uc->next)
+    if (uc->uid == uid)
+      break;
+  if (!uc)
+    {
+      uc = server->malloc_hooks.malloc (sizeof *uc);
+      if (!uc)
+        return 0;
+      uc->uid = uid;
+      uc->count = 0;
+      uc->next = server->uids[idx];
+      server->uids[idx] = uc;
+    }
+  else if (uc->count >= server->max_per_uid)
+    return 0;
+  uc->count++;
+  return 1;
+}
+
+
+/* Remove a connection of the user UID from the counts of SERVER.
+   Must be called with SERVER->LOCK held.  */
+static void
+uncount_uid (assuan_server_t server, unsigned long uid)
+{
+  struct uid_count_s *uc, **ucp;
+
+  for (ucp = &server->uids[uid % UID_BUCKETS]; (uc = *ucp); ucp = &uc->next)
+    if (uc->uid == uid)
+      {
+        if (!--uc->count)
+          {
+            *ucp = uc->next;
+            server->malloc_hooks.free (uc);
+          }
+        break;
+      }
+}
+
+
+/* Tell the client of the socket FD that SERVER is busy and close FD.
+   The client is not waited for.  */
+static void
+reject_socket (assuan_server_t server, assuan_fd_t fd)
+{
+  char line[sizeof server->busy_line];
+  ssize_t res;
+
+  gpgrt_lock_lock (&server->lock);
+  memcpy (line, server->busy_line, sizeof line);
+  gpgrt_lock_unlock (&server->lock);
+
+  res = send (fd, line, strlen (line), MSG_NOSIGNAL | MSG_DONTWAIT);
+  (void)res;
+  close (fd);
+}
+
+
+/* Let a connection waiting for a command slot of SERVER run or, if
+   ALL is true, as many as there are free slots.  */
+static void
+admit_waiting (assuan_server_t server, int all)
+{
+  assuan_context_t ctx;
+  unsigned int n = 1;
+
+  if (all)
+    {
+      gpgrt_lock_lock (&server->lock);
+      if (!server->max_active)
+        n = (unsigned int)-1;
+      else if (server->nactive < server->max_active)
+        n = server->max_active - server->nactive;
+      else
+        n = 0;
+      gpgrt_lock_unlock (&server->lock);
+    }
+
+  for (; n; n--)
+    {
+      gpgrt_lock_lock (&server->lock);
+      ctx = server->whead;
+      if (ctx && server->max_active
+          && server->nactive >= server->max_active)
+        ctx = NULL;
+      if (ctx)
+        {
+          server->whead = ctx->loop.wnext;
+          if (!server->whead)
+            server->wtail = NULL;
+          ctx->loop.wnext = NULL;
+          ctx->loop.waiting = 0;
+        }
+      gpgrt_lock_unlock (&server->lock);
+      if (!ctx)
+        break;
+
+      /* The connection has not been re-armed when it was parked;
+         the calling worker finds it in the run queue of its owner.
+         Only the owner serves the connections of a ring.  */
+      enqueue_connection (ctx);
+      if (server->io_uring && server->nworkers > 1)
+        wake_worker (ctx->loop.worker);
+    }
+}
+
+
+/* Take a command slot for the connection CTX.  Returns false if all
+   slots are taken; CTX is then parked until admit_waiting lets it
+   run again.  */
+static int
+reserve_slot (assuan_context_t ctx)
+{
+  assuan_server_t server = ctx->loop.server;
+  int ok;
+
+  gpgrt_lock_lock (&server->lock);
+  ok = !server->max_active || server->nactive < server->max_active;
+  if (ok)
+    {
+      ctx->loop.active = 1;
+      server->nactive++;
+    }
+  else if (!ctx->loop.waiting)
+    {
+      ctx->loop.waiting = 1;
+      ctx->loop.wnext = NULL;
+      if (server->wtail)
+        server->wtail->loop.wnext = ctx;
+      else
+        server->whead = ctx;
+      server->wtail = ctx;
+    }
+  gpgrt_lock_unlock (&server->lock);
+  return ok;
+}
+
+
+/* Give back the command slot of the connection CTX and let a waiting
+   connection take it.  */
+static void
+release_slot (assuan_context_t ctx)
+{
+  assuan_server_t server = ctx->loop.server;
+
+  gpgrt_lock_lock (&server->lock);
+  ctx->loop.active = 0;
+  server->nactive--;
+  gpgrt_lock_unlock (&server->lock);
+  admit_waiting (server, 0);
+}
+
+
+/* Put the timer of CTX into the slot of the wheel of W for the tick
+   EXPIRES.  Must be called with the lock of W held.  */
+static void
+link_timer (server_worker_t w, assuan_context_t ctx, unsigned long expires)
+{
+  unsigned long delta;
+  unsigned int level;
+  assuan_context_t *head;
+
+  delta = expires - w->tick;
+  if ((long)delta < 0)
+    expires = w->tick, delta = 0;
+  else if (delta >= WHEEL_SPAN)
+    expires = w->tick + WHEEL_SPAN - 1, delta = WHEEL_SPAN - 1;
+
+  for (level = 0; delta >> (WHEEL_BITS * (level + 1)); level++)
+    ;
+  head = &w->wheel[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+  ctx->loop.ttick = expires;
+  ctx->loop.tprev = NULL;
+  ctx->loop.tnext = *head;
+  if (*head)
+    (*head)->loop.tprev = ctx;
+  *head = ctx;
+  ctx->loop.thead = head;
+  w->ntimers++;
+}
+
+
+/* Remove the timer of CTX from the wheel of W.  Must be called with
+   the lock of W held.  */
+static void
+unlink_timer (server_worker_t w, assuan_context_t ctx)
+{
+  if (ctx->loop.tprev)
+    ctx->loop.tprev->loop.tnext = ctx->loop.tnext;
+  else
+    *ctx->loop.thead = ctx->loop.tnext;
+  if (ctx->loop.tnext)
+    ctx->loop.tnext->loop.tprev = ctx->loop.tprev;
+  ctx->loop.tnext = ctx->loop.tprev = NULL;
+  ctx->loop.thead = NULL;
+  w->ntimers--;
+}
+
+
+/* Schedule the timer of CTX for the time WHEN in msec on the wheel of
+   its worker W.  Must be called with the lock of W held.  Returns
+   true if W has to be woken up to notice the timer.  */
+static int
+add_timer (server_worker_t w, assuan_context_t ctx, unsigned long when)
+{
+  unsigned long ticks = 0;
+
+  if (ctx->loop.thead)
+    unlink_timer (w, ctx);
+  if ((long)(when - w->clock) > 0)
+    ticks = (when - w->clock + TICK_MSEC - 1) / TICK_MSEC;
+  ctx->loop.twhen = when;
+  link_timer (w, ctx, w->tick + (ticks < WHEEL_SPAN? ticks : WHEEL_SPAN));
+
+  if (w->napping && (long)(ctx->loop.ttick - w->wake_tick) < 0)
+    {
+      w->napping = 0;
+      return 1;
+    }
+  return 0;
+}
+
+
+/* Store at R_WHEN the time in msec at which CTX times out.  Returns
+   false if it does not time out.  */
+static int
+connection_deadline (assuan_context_t ctx, unsigned long *r_when)
+{
+  assuan_server_t server = ctx->loop.server;
+  unsigned int timeout;
+
+  timeout = ctx->loop.in_cmd? server->command_timeout : server->idle_timeout;
+  *r_when = ctx->loop.since + timeout;
+  return !!timeout;
+}
+
+
+/* Return the number of milliseconds the worker W may sleep before its
+   next timer is due or -1 if it has no timers.  Marks W as napping
+   until then.  */
+static int
+timer_timeout (server_worker_t w)
+{
+  unsigned long now, wait;
+  unsigned int k, n;
+  int timeout = -1;
+
+  gpgrt_lock_lock (&w->lock);
+  w->wake_tick = w->tick + WHEEL_SPAN;
+  if (w->ntimers)
+    {
+      /* Look at the slots up to the next cascade from the higher
+         levels, which may bring in due timers.  */
+      n = WHEEL_SIZE - (w->tick & WHEEL_MASK);
+      for (k = 0; k < n; k++)
+        if (w->wheel[0][(w->tick + k) & WHEEL_MASK])
+          break;
+      w->wake_tick = w->tick + k;
+      now = _assuan_get_msec ();
+      wait = w->clock + k * TICK_MSEC - now;
+      if ((long)wait < 0)
+        timeout = 0;
+      else
+        timeout = wait;
+    }
+  w->napping = 1;
+  gpgrt_lock_unlock (&w->lock);
+  return timeout;
+}
+
+
+/* Advance the wheel of the worker W to the current time and queue the
+   connections which have timed out.  */
+static void
+expire_timers (server_worker_t w)
+{
+  assuan_server_t server = w->server;
+  assuan_context_t ctx, list, due = NULL, expired = NULL;
+  unsigned long now, when;
+  unsigned int level, idx;
+
+  now = _assuan_get_msec ();
+  gpgrt_lock_lock (&w->lock);
+  w->napping = 0;
+  if (!w->ntimers && (long)(now - w->clock) >= 0)
+    {
+      /* Nothing to do for the ticks in between.  */
+      idx = (now - w->clock) / TICK_MSEC + 1;
+      w->tick += idx;
+      w->clock += idx * TICK_MSEC;
+    }
+  while ((long)(now - w->clock) >= 0)
+    {
+      idx = w->tick & WHEEL_MASK;
+      /* At the start of a round move the timers of the next slot of
+         the higher levels down.  */
+      for (level = 1; !idx && level < WHEEL_LEVELS; level++)
+        {
+          idx = (w->tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+          list = w->wheel[level][idx];
+          w->wheel[level][idx] = NULL;
+          while ((ctx = list))
+            {
+              list = ctx->loop.tnext;
+              w->ntimers--;
+              link_timer (w, ctx, ctx->loop.ttick);
+            }
+        }
+
+      idx = w->tick & WHEEL_MASK;
+      while ((ctx = w->wheel[0][idx]))
+        {
+          unlink_timer (w, ctx);
+          ctx->loop.tnext = due;
+          due = ctx;
+        }
+      w->tick++;
+      w->clock += TICK_MSEC;
+    }
+
+  while ((ctx = due))
+    {
+      due = ctx->loop.tnext;
+      ctx->loop.tnext = NULL;
+      /* A connection being served gets a new timer afterwards.  The
+         timer of other connections may have been postponed by
+         activity since it was scheduled.  */
+      if (ctx->loop.serving || ctx->loop.queued
+          || !connection_deadline (ctx, &when))
+        continue;
+      if ((long)(when - now) > 0)
+        add_timer (w, ctx, when);
+      else
+        {
+          ctx->loop.expired = 1;
+          ctx->loop.tnext = expired;
+          expired = ctx;
+        }
+    }
+  gpgrt_lock_unlock (&w->lock);
+
+  while ((ctx = expired))
+    {
+      expired = ctx->loop.tnext;
+      ctx->loop.tnext = NULL;
+      /* The worker closing the connection may be another one.  Only
+         this worker fetches the events of CTX, thus after removing it
+         from the epoll set no event can refer to it anymore.  */
+      if (SHARED (server))
+        epoll_ctl (w->epfd, EPOLL_CTL_DEL, ctx->inbound.fd, NULL);
+      enqueue_connection (ctx);
+    }
+}
+
+
+/* Finish serving the connection CTX, which has been PARKED or is to
+   be re-armed, and schedule its timer.  Returns an error from
+   re-arming.  */
+static int
+end_serving (assuan_context_t ctx, int parked)
+{
+  server_worker_t w = ctx->loop.worker;
+  unsigned long when;
+  int res = 0;
+  int wake = 0;
+
+  if (!parked)
+    {
+      if (!ctx->flags.in_command || !ctx->loop.in_cmd)
+        ctx->loop.since = _assuan_get_msec ();
+      ctx->loop.in_cmd = ctx->flags.in_command;
+    }
+
+  /* Re-arming is done while holding the lock so that a worker
+     serving CTX for the next event can only start afterwards.  */
+  gpgrt_lock_lock (&w->lock);
+  if (parked || !connection_deadline (ctx, &when))
+    {
+      if (ctx->loop.thead)
+        unlink_timer (w, ctx);
+    }
+  else if (!ctx->loop.thead || (long)(when - ctx->loop.twhen) < 0)
+    wake = add_timer (w, ctx, when);
+  if (!parked && SHARED (w->server))
+    res = arm_connection (ctx, EPOLL_CTL_MOD);
+  ctx->loop.serving--;
+  gpgrt_lock_unlock (&w->lock);
+
+  if (wake)
+    wake_worker (w);
+  return res;
+}
+
+
+/* Set the connection CTX, which has used up its budget, aside to be
+   queued again by its worker after the next poll, so that the other
+   connections get their turn first.  It is not re-armed as its input
+   is already buffered or waiting in the socket.  */
+static void
+yield_connection (assuan_context_t ctx)
+{
+  server_worker_t w = ctx->loop.worker;
+  int prio = ASSUAN_PRIORITY_NORMAL;
+  unsigned long now = 0;
+
+  if (PRIORITIZED (w->server))
+    {
+      prio = connection_priority (ctx);
+      now = _assuan_get_msec ();
+    }
+
+  gpgrt_lock_lock (&w->lock);
+  if (TIMED (w->server))
+    {
+      if (!ctx->flags.in_command || !ctx->loop.in_cmd)
+        ctx->loop.since = _assuan_get_msec ();
+      ctx->loop.in_cmd = ctx->flags.in_command;
+      ctx->loop.serving--;
+    }
+  /* It counts as queued so that events do not queue it twice.  */
+  if (!ctx->loop.queued)
+    {
+      ctx->loop.queued = 1;
+      ctx->loop.prio = prio;
+      ctx->loop.qtime = now;
+      ctx->loop.qnext = NULL;
+      if (w->ytail)
+        w->ytail->loop.qnext = ctx;
+      else
+        w->yhead = ctx;
+      w->ytail = ctx;
+    }
+  gpgrt_lock_unlock (&w->lock);
+}
+
+
+/* Append the connections set aside by yield_connection to the run
+   queues of W.  */
+static void
+requeue_yielded (server_worker_t w)
+{
+  assuan_context_t ctx;
+
+  gpgrt_lock_lock (&w->lock);
+  while ((ctx = w->yhead))
+    {
+      w->yhead = ctx->loop.qnext;
+      link_connection (w, ctx);
+    }
+  w->ytail = NULL;
+  gpgrt_lock_unlock (&w->lock);
+}
+
+
+/* Release the connection CTX.  */
+static void
+release_connection (assuan_context_t ctx)
+{
+  server_worker_t w = ctx->loop.worker;
+  assuan_server_t server = w->server;
+  int drained;
+
+  gpgrt_lock_lock (&w->lock);
+  if (ctx->loop.prev)
+    ctx->loop.prev->loop.next = ctx->loop.next;
+  else
+    w->conns = ctx->loop.next;
+  if (ctx->loop.next)
+    ctx->loop.next->loop.prev = ctx->loop.prev;
+  w->nconns--;
+  if (ctx->loop.thead)
+    unlink_timer (w, ctx);
+  ctx->loop.serving = 0;
+  ctx->loop.in_cmd = 0;
+  ctx->loop.expired = 0;
+  gpgrt_lock_unlock (&w->lock);
+#ifdef USE_IO_URING
+  if (w->ring)
+    ring_remove_connection (ctx);
+#endif
+
+  gpgrt_lock_lock (&server->lock);
+  server->nconns--;
+  drained = server->handed_off && !server->nconns;
+  if (ctx->loop.uid_counted)
+    uncount_uid (server, ctx->loop.uid);
+  ctx->loop.uid_counted = 0;
+  if (ctx->loop.waiting)
+    {
+      assuan_context_t *cp, prev = NULL;
+
+      for (cp = &server->whead; *cp != ctx; cp = &(*cp)->loop.wnext)
+        prev = *cp;
+      *cp = ctx->loop.wnext;
+      if (server->wtail == ctx)
+        server->wtail = prev;
+      ctx->loop.wnext = NULL;
+      ctx->loop.waiting = 0;
+    }
+  gpgrt_lock_unlock (&server->lock);
+  if (ctx->loop.active)
+    release_slot (ctx);
+
+  if (server->disconnect_cb)
+    server->disconnect_cb (server->opaque, ctx);
+  if (drained)
+    assuan_server_stop (server);
+
+  /* Closing the socket also removes it from the epoll set.  The
+     reset closes file descriptors and thus must not be done while
+     holding the lock; MAX_SPARE is only checked for real below.  */
+  if (server->max_spare)
+    {
+      _assuan_server_reset (ctx);
+      ctx->loop.worker = NULL;
+      gpgrt_lock_lock (&server->lock);
+      if (server->nspare < server->max_spare)
+        {
+          ctx->loop.next = server->spare;
+          server->spare = ctx;
+          server->nspare++;
+          ctx = NULL;
+        }
+      gpgrt_lock_unlock (&server->lock);
+    }
+  if (ctx)
+    assuan_release (ctx);
+}
+
+
+/* Write to the client of a server loop.  Unlike the usual writers
+   this does not raise SIGPIPE if the client has gone away, which
+   would terminate the entire server.  */
+static ssize_t
+loop_writer (assuan_context_t ctx, const void *buf, size_t buflen)
+{
+  struct msghdr msg;
+  struct iovec iovec;
+
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &iovec;
+  msg.msg_iovlen = 1;
+  iovec.iov_base = (void *)buf;
+  iovec.iov_len = buflen;
+
+  return _assuan_sendmsg (ctx, ctx->outbound.fd, &msg, MSG_NOSIGNAL);
+}
+
+
+/* Set up a context for the socket FD returned by accept_socket and
+   add it to the worker W.  The connection has already been counted by
+   accept_connections.  */
+static gpg_error_t
+new_connection (server_worker_t w, assuan_fd_t fd)
+{
+  assuan_server_t server = w->server;
+  gpg_error_t err;
+  assuan_context_t ctx = NULL;
+  struct _assuan_peercred cred;
+  unsigned long when;
+  int have_cred = 0;
+  int rejected = 0;
+  int counted = 0;
+
+  /* The quota of the user requires the credentials of the client,
+     which are then kept for assuan_get_peercred.  */
+  if (server->max_per_uid)
+    have_cred = _assuan_fd_peercred (fd, &cred);
+
+  gpgrt_lock_lock (&server->lock);
+  if (have_cred && server->max_per_uid)
+    {
+      counted = count_uid (server, cred.uid);
+      rejected = !counted;
+    }
+  if (!rejected)
+    {
+      ctx = server->spare;
+      if (ctx)
+        {
+          server->spare = ctx->loop.next;
+          server->nspare--;
+        }
+    }
+  gpgrt_lock_unlock (&server->lock);
+
+  if (rejected)
+    {
+      reject_socket (server, fd);
+      fd = ASSUAN_INVALID_FD;
+      err = gpg_err_make (server->err_source, GPG_ERR_LIMIT_REACHED);
+      goto leave;
+    }
+
+  if (ctx)
+    {
+      /* Set up the context for the next accept as
+         assuan_init_socket_server does.  */
+      ctx->connected_fd = fd;
+      ctx->max_accepts = 1;
+    }
+  else
+    {
+      err = assuan_new_ext (&ctx, server->err_source, &server->malloc_hooks,
+                            server->log_cb, server->log_cb_data);
+      if (err)
+        goto leave;
+      err = assuan_init_socket_server (ctx, fd,
+                                       (ASSUAN_SOCKET_SERVER_ACCEPTED
+                                        | (server->flags
+                                           & ASSUAN_SOCKET_SERVER_FDPASSING)));
+      if (err)
+        goto leave;
+      ctx->engine.writefnc = loop_writer;
+      ctx->flags.in_server_loop = 1;
+      ctx->loop.server = server;
+    }
+  ctx->loop.worker = w;
+
+  if (server->connect_cb)
+    {
+      err = server->connect_cb (server->opaque, ctx);
+      if (err)
+        goto leave;
+    }
+
+  /* From now on release_connection takes care of the counts.  */
+  ctx->loop.uid_counted = counted;
+  if (counted)
+    ctx->loop.uid = cred.uid;
+  gpgrt_lock_lock (&w->lock);
+  ctx->loop.prev = NULL;
+  ctx->loop.next = w->conns;
+  if (w->conns)
+    w->conns->loop.prev = ctx;
+  w->conns = ctx;
+  w->nconns++;
+  gpgrt_lock_unlock (&w->lock);
+
+  /* This takes over FD and queues the hello line.  */
+  err = assuan_accept (ctx);
+  if (!err && arm_connection (ctx, EPOLL_CTL_ADD))
+    err = _assuan_error (ctx, gpg_err_code_from_syserror ());
+  if (err)
+    {
+      if (ctx->inbound.fd == ASSUAN_INVALID_FD)
+        close (fd);
+      release_connection (ctx);
+      return err;
+    }
+  if (have_cred)
+    _assuan_socket_peercred (ctx, &cred);
+  if (TIMED (server))
+    {
+      ctx->loop.since = _assuan_get_msec ();
+      gpgrt_lock_lock (&w->lock);
+      if (connection_deadline (ctx, &when))
+        add_timer (w, ctx, when);
+      gpgrt_lock_unlock (&w->lock);
+    }
+  return 0;
+
+ leave:
+  if (ctx)
+    assuan_release (ctx);
+  if (fd != ASSUAN_INVALID_FD)
+    close (fd);
+  gpgrt_lock_lock (&server->lock);
+  server->nconns--;
+  if (counted)
+    uncount_uid (server, cred.uid);
+  gpgrt_lock_unlock (&server->lock);
+  return err;
+}
+
+
+/* Accept a connection on the listening socket of SERVER and return
+   its socket, which does not block and is closed on exec.  On error
+   ASSUAN_INVALID_FD is returned and ERRNO set.  */
+static assuan_fd_t
+accept_socket (assuan_server_t server)
+{
+  assuan_fd_t fd;
+#ifdef HAVE_ACCEPT4
+
+  fd = accept4 (server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else /*!HAVE_ACCEPT4*/
+  int fl;
+
+  fd = accept (server->listen_fd, NULL, NULL);
+  if (fd == ASSUAN_INVALID_FD)
+    return fd;
+  fl = fcntl (fd, F_GETFL);
+  if (fl == -1 || fcntl (fd, F_SETFL, fl | O_NONBLOCK) == -1
+      || fcntl (fd, F_SETFD, FD_CLOEXEC) == -1)
+    {
+      close (fd);
+      fd = ASSUAN_INVALID_FD;
+      gpg_err_set_errno (ECONNABORTED);  /* Only this one failed.  */
+    }
+#endif /*!HAVE_ACCEPT4*/
+  return fd;
+}
+
+
+/* Accept all pending connections on the listening socket and add
+   them to the worker W.  The connections are accepted in batches so
+   that the backlog of the listening socket is drained quickly before
+   the contexts are set up.  */
+static gpg_error_t
+accept_connections (server_worker_t w)
+{
+  assuan_server_t server = w->server;
+  assuan_fd_t fds[MAX_EVENTS];
+  assuan_fd_t fd;
+  gpg_error_t err = 0;
+  int i, nfds;
+  int full, reject;
+  int done = 0;
+
+  gpgrt_lock_lock (&server->lock);
+  server->accept_blocked = 0;
+  gpgrt_lock_unlock (&server->lock);
+
+  while (!done)
+    {
+      nfds = 0;
+      while (!done && nfds < MAX_EVENTS)
+        {
+          /* Count the connection before accepting it so that workers
+             accepting at the same time do not exceed the limit.  */
+          gpgrt_lock_lock (&server->lock);
+          if (server->handed_off)
+            {
+              /* The successor accepts the remaining clients.  */
+              gpgrt_lock_unlock (&server->lock);
+              done = 1;
+              break;
+            }
+          full = server->max_conns && server->nconns >= server->max_conns;
+          reject = full && (server->limit_flags & ASSUAN_SERVER_LIMIT_REJECT);
+          if (!full)
+            server->nconns++;
+          else if (!reject)
+            server->accept_blocked = 1;
+          gpgrt_lock_unlock (&server->lock);
+          if (full && !reject)
+            {
+              /* Leave the clients in the backlog until a connection
+                 ends.  */
+              done = 1;
+              break;
+            }
+
+          fd = accept_socket (server);
+          if (fd != ASSUAN_INVALID_FD)
+            {
+              if (reject)
+                reject_socket (server, fd);
+              else
+                fds[nfds++] = fd;
+              continue;
+            }
+
+          if (!full)
+            {
+              gpgrt_lock_lock (&server->lock);
+              server->nconns--;
+              gpgrt_lock_unlock (&server->lock);
+            }
+
+          switch (errno)
+            {
+            case EINTR:
+            case ECONNABORTED:
+            case EPROTO:
+            case EPERM:
+              break;  /* Only this connection failed.  */
+
+            case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:
+#endif
+              done = 1;
+              break;
+
+            case EMFILE:
+            case ENFILE:
+            case ENOBUFS:
+            case ENOMEM:
+              /* As the listening socket is edge-triggered, we won't
+                 be told about the waiting connections again.  Try
+                 again after a connection has been closed.  */
+              gpgrt_lock_lock (&server->lock);
+              server->accept_blocked = 1;
+              gpgrt_lock_unlock (&server->lock);
+              done = 1;
+              break;
+
+            default:
+              err = gpg_err_make (server->err_source,
+                                  gpg_err_code_from_syserror ());
+              done = 1;
+              break;
+            }
+        }
+
+      /* Errors of a single connection do not stop the server.  */
+      for (i = 0; i < nfds; i++)
+        new_connection (w, fds[i]);
+    }
+  return err;
+}
+
+
+/* Run the connection CTX until it would block.  Returns 1 if the
+   connection has ended, -1 if it has been parked to wait for a
+   command slot and 2 if it has used up the budget set with
+   ASSUAN_PROCESS_LINES and ASSUAN_PROCESS_USEC.  */
+static int
+run_connection (assuan_context_t ctx)
+{
+  gpg_error_t err;
+  unsigned int nlines = 0;
+  unsigned long start = 0;
+
+  if (ctx->budget.usec)
+    start = _assuan_get_usec ();
+
+  for (;;)
+    {
+      /* Do not read more commands while the client does not take our
+         responses.  Note that the epoll registration is
+         edge-triggered, so we must read until EAGAIN once the output
+         has been flushed.  */
+      if (ctx->outbound.pending.length)
+        {
+          err = _assuan_flush_pending (ctx);
+          if (gpg_err_code (err) == GPG_ERR_EAGAIN)
+            return 0;
+          if (err)
+            return 1;
+        }
+      if (ctx->flags.process_complete || ctx->inbound.fd == ASSUAN_INVALID_FD)
+        return 1;
+
+      /* A command holds its slot until assuan_process_done, which
+         may be called by a later run.  The limit is read without the
+         lock to keep the unlimited case cheap.  */
+      if (!ctx->loop.active && ctx->loop.server->max_active
+          && !reserve_slot (ctx))
+        return -1;
+
+      err = _assuan_process_line (ctx);
+      if (ctx->loop.active && !ctx->flags.in_command)
+        release_slot (ctx);
+      if (gpg_err_code (err) == GPG_ERR_EAGAIN)
+        {
+          if (!ctx->outbound.pending.length)
+            return 0;
+        }
+      else if (err)
+        return 1;
+      else if (_assuan_budget_spent (ctx, ++nlines, start)
+               && !ctx->outbound.pending.length
+               && !ctx->flags.process_complete)
+        return 2;
+    }
+}
+
+
+/* Close the connection CTX which has timed out.  */
+static void
+expire_connection (assuan_context_t ctx)
+{
+  gpg_error_t err = _assuan_error (ctx, GPG_ERR_TIMEOUT);
+  char ebuf[50];
+  char line[128];
+
+  gpg_strerror_r (err, ebuf, sizeof ebuf);
+  snprintf (line, sizeof line, "ERR %d %.50s <%.30s> - %s timeout",
+            err, ebuf, gpg_strsource (err),
+            ctx->loop.in_cmd? "command" : "idle");
+  /* Best effort; the client may not read anymore.  */
+  if (!assuan_write_line (ctx, line) && ctx->outbound.pending.length)
+    _assuan_flush_pending (ctx);
+  release_connection (ctx);
+}
+
+
+/* Serve the connection CTX on the worker W.  CTX may be owned by
+   another worker.  */
+static gpg_error_t
+serve_connection (server_worker_t w, assuan_context_t ctx)
+{
+  assuan_server_t server = w->server;
+  server_worker_t owner;
+  int res, blocked;
+
+  if (ctx->loop.expired)
+    expire_connection (ctx);
+  else
+    {
+      res = run_connection (ctx);
+      if (res == 2)
+        {
+          /* Another worker may take CTX as soon as it is queued.  */
+          owner = ctx->loop.worker;
+          yield_connection (ctx);
+          if (owner != w)
+            wake_worker (owner);
+          return 0;
+        }
+      if (res < 0)
+        {
+          /* Parked; admit_waiting queues it again.  */
+          if (TIMED (server))
+            end_serving (ctx, 1);
+          return 0;
+        }
+      if (!res)
+        {
+          if (TIMED (server))
+            res = end_serving (ctx, 0);
+          else if (SHARED (server))
+            res = arm_connection (ctx, EPOLL_CTL_MOD);
+#ifdef USE_IO_URING
+          if (!res && w->ring && ctx->outbound.pending.length)
+            res = ring_poll_output (ctx);
+#endif
+          if (!res)
+            return 0;
+        }
+      release_connection (ctx);
+    }
+
+  gpgrt_lock_lock (&server->lock);
+  blocked = server->accept_blocked;
+  gpgrt_lock_unlock (&server->lock);
+  if (blocked)
+    return accept_connections (w);
+  return 0;
+}
+
+
+/* The loop of the worker W.  */
+static gpg_error_t
+run_worker (server_worker_t w)
+{
+  assuan_server_t server = w->server;
+  struct epoll_event events[MAX_EVENTS];
+  assuan_context_t ctx;
+  gpg_error_t err = 0;
+  uint64_t value;
+  int i, n, nqueued, blocked, timeout, prio;
+  int busy = 0;
+
+  while (!err && !server->stop)
+    {
+      /* Block only if neither this nor another worker has queued
+         connections.  Marking the worker idle before looking at the
+         other queues makes sure that a worker queueing a connection
+         afterwards wakes us up.  */
+      if (!busy && server->nworkers > 1)
+        {
+          set_idle (w, 1);
+          busy = work_available (w);
+        }
+      if (busy)
+        n = epoll_wait (w->epfd, events, MAX_EVENTS, 0);
+      else
+        {
+          timeout = TIMED (server)? timer_timeout (w) : -1;
+          _assuan_pre_syscall ();
+          n = epoll_wait (w->epfd, events, MAX_EVENTS, timeout);
+          _assuan_post_syscall ();
+        }
+      if (server->nworkers > 1)
+        set_idle (w, 0);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          err = gpg_err_make (server->err_source,
+                              gpg_err_code_from_syserror ());
+          break;
+        }
+
+      nqueued = 0;
+      for (i = 0; i < n; i++)
+        {
+          void *ptr = events[i].data.ptr;
+
+          if (ptr == &server->listen_fd)
+            err = accept_connections (w);
+          else if (ptr == &w->wakefd)
+            {
+              while (read (w->wakefd, &value, sizeof value) > 0)
+                ;
+              /* The limits may have been raised.  */
+              gpgrt_lock_lock (&server->lock);
+              blocked = server->accept_blocked;
+              gpgrt_lock_unlock (&server->lock);
+              if (blocked)
+                err = accept_connections (w);
+              admit_waiting (server, 1);
+            }
+          else
+            {
+              enqueue_connection (ptr);
+              nqueued++;
+            }
+        }
+      requeue_yielded (w);
+      if (nqueued > 1 && server->nworkers > 1)
+        wake_idle_worker (w);
+      if (TIMED (server))
+        expire_timers (w);
+
+      /* Serve the queued connections; if there are none, help the
+         other workers.  With priorities, look for newly ready
+         connections after each one which had to wait for the high
+         priority ones.  */
+      busy = 0;
+      for (i = 0; !err && !server->stop && i < MAX_EVENTS; i++)
+        {
+          ctx = dequeue_connection (w);
+          if (!ctx && server->nworkers > 1)
+            ctx = steal_connection (w);
+          if (!ctx)
+            break;
+          busy = 1;
+          prio = ctx->loop.prio;
+          err = serve_connection (w, ctx);
+          if (PRIORITIZED (server) && prio != ASSUAN_PRIORITY_HIGH)
+            break;
+        }
+    }
+
+  return err;
+}
+
+#ifdef USE_IO_URING
+
+/* Queue the multishot receive of the connection CTX.  */
+static int
+ring_recv_connection (assuan_context_t ctx)
+{
+  server_ring_t r = ctx->loop.worker->ring;
+
+  if (ring_recv (r, ctx->inbound.fd, ring_user_data (r, ctx, UD_RECV)))
+    return -1;
+  ctx->loop.receiving = 1;
+  return 0;
+}
+
+
+/* Read from a connection of a worker with a ring.  The data has
+   already been received into the buffers of the ring.  */
+static ssize_t
+ring_reader (assuan_context_t ctx, void *buf, size_t buflen)
+{
+  server_ring_t r = ctx->loop.worker->ring;
+  size_t n, len = 0;
+  int bid;
+
+  while (len < buflen && (bid = ctx->loop.rhead) >= 0)
+    {
+      n = r->bend[bid] - r->boff[bid];
+      if (n > buflen - len)
+        n = buflen - len;
+      memcpy ((char *)buf + len, r->bufs + bid * RING_BUFSIZE + r->boff[bid],
+              n);
+      len += n;
+      r->boff[bid] += n;
+      if (r->boff[bid] == r->bend[bid])
+        {
+          ctx->loop.rhead = r->bnext[bid];
+          if (ctx->loop.rhead < 0)
+            ctx->loop.rtail = -1;
+          ctx->loop.rbufs--;
+          ring_put_buffer (r, bid);
+        }
+    }
+  if (len)
+    return len;
+  if (ctx->loop.eof)
+    return 0;
+  if (ctx->loop.rerr)
+    {
+      gpg_err_set_errno (ctx->loop.rerr);
+      return -1;
+    }
+  /* Receive again if the receive has ended or was stopped.  */
+  if (!ctx->loop.receiving && !ctx->loop.starved
+      && ring_recv_connection (ctx))
+    return -1;
+  gpg_err_set_errno (EAGAIN);
+  return -1;
+}
+
+
+/* Add the connection CTX to the ring of its worker.  */
+static int
+ring_add_connection (assuan_context_t ctx)
+{
+  server_worker_t w = ctx->loop.worker;
+  server_ring_t r = w->ring;
+  struct ring_slot_s *slots;
+  unsigned int i, n, slot;
+
+  if (!r->freeslot)
+    {
+      n = r->nslots? 2 * r->nslots : 64;
+      slots = w->server->malloc_hooks.realloc (r->slots, n * sizeof *slots);
+      if (!slots)
+        return -1;
+      for (i = r->nslots? r->nslots : 1; i < n; i++)
+        {
+          slots[i].ctx = NULL;
+          slots[i].gen = 0;
+          slots[i].next = i + 1 < n? i + 1 : 0;
+        }
+      r->freeslot = r->nslots? r->nslots : 1;
+      r->slots = slots;
+      r->nslots = n;
+    }
+  slot = r->freeslot;
+  r->freeslot = r->slots[slot].next;
+  r->slots[slot].ctx = ctx;
+
+  ctx->loop.rslot = slot;
+  ctx->loop.rhead = ctx->loop.rtail = -1;
+  ctx->loop.rbufs = 0;
+  ctx->loop.rerr = 0;
+  ctx->loop.receiving = 0;
+  ctx->loop.cancelling = 0;
+  ctx->loop.starved = 0;
+  ctx->loop.polling = 0;
+  ctx->loop.eof = 0;
+  ctx->loop.snext = NULL;
+  ctx->engine.readfnc = ring_reader;
+
+  if (ring_recv_connection (ctx))
+    return -1;
+  if (ctx->outbound.pending.length)
+    return ring_poll_output (ctx);
+  return 0;
+}
+
+
+/* Remove the connection CTX from the ring of its worker.  Its
+   requests are cancelled right away as they keep the socket open.  */
+static void
+ring_remove_connection (assuan_context_t ctx)
+{
+  server_ring_t r = ctx->loop.worker->ring;
+  assuan_context_t *cp, prev = NULL;
+  unsigned int slot = ctx->loop.rslot;
+  int bid;
+
+  if (!slot)
+    return;
+
+  if (ctx->loop.receiving)
+    ring_cancel (r, ring_user_data (r, ctx, UD_RECV));
+  if (ctx->loop.polling)
+    ring_cancel (r, ring_user_data (r, ctx, UD_POLLOUT));
+  if (ctx->loop.receiving || ctx->loop.polling)
+    ring_enter (r, 0, 0);
+
+  while ((bid = ctx->loop.rhead) >= 0)
+    {
+      ctx->loop.rhead = r->bnext[bid];
+      ring_put_buffer (r, bid);
+    }
+  if (ctx->loop.starved)
+    {
+      for (cp = &r->shead; *cp != ctx; cp = &(*cp)->loop.snext)
+        prev = *cp;
+      *cp = ctx->loop.snext;
+      if (r->stail == ctx)
+        r->stail = prev;
+    }
+
+  /* Later completions of its requests are ignored.  */
+  r->slots[slot].ctx = NULL;
+  r->slots[slot].gen++;
+  r->slots[slot].next = r->freeslot;
+  r->freeslot = slot;
+  ctx->loop.rslot = 0;
+  ctx->loop.rtail = -1;
+  ctx->loop.rbufs = 0;
+  ctx->loop.receiving = 0;
+  ctx->loop.starved = 0;
+  ctx->loop.polling = 0;
+  ctx->loop.snext = NULL;
+}
+
+
+/* Ask for a completion once the connection CTX may write again.  */
+static int
+ring_poll_output (assuan_context_t ctx)
+{
+  server_ring_t r = ctx->loop.worker->ring;
+
+  if (ctx->loop.polling)
+    return 0;
+  if (ring_poll (r, ctx->outbound.fd, POLLOUT, 0,
+                 ring_user_data (r, ctx, UD_POLLOUT)))
+    return -1;
+  ctx->loop.polling = 1;
+  return 0;
+}
+
+
+/* Append the buffer BID with the message received by the connection
+   CTX, which fills LENGTH bytes, to the buffers of CTX.  */
+static void
+ring_take_buffer (assuan_context_t ctx, int bid, unsigned int length)
+{
+  server_ring_t r = ctx->loop.worker->ring;
+  struct io_uring_recvmsg_out *out;
+  struct msghdr msg;
+
+  out = (struct io_uring_recvmsg_out *)(r->bufs + bid * RING_BUFSIZE);
+  if (r->msg.msg_controllen)
+    {
+      memset (&msg, 0, sizeof msg);
+      msg.msg_control = (unsigned char *)(out + 1) + out->namelen;
+      msg.msg_controllen = out->controllen;
+      msg.msg_flags = out->flags;
+      _assuan_uds_take_fds (ctx, &msg);
+    }
+
+  r->boff[bid] = r->hdrlen;
+  r->bend[bid] = length;
+  r->bnext[bid] = -1;
+  if (ctx->loop.rtail >= 0)
+    r->bnext[ctx->loop.rtail] = bid;
+  else
+    ctx->loop.rhead = bid;
+  ctx->loop.rtail = bid;
+
+  /* Leave further input in the socket until the buffers have been
+     read so that a client not reading our responses does not take
+     all buffers.  */
+  if (++ctx->loop.rbufs >= CONN_BUFS && ctx->loop.receiving
+      && !ctx->loop.cancelling
+      && !ring_cancel (r, ring_user_data (r, ctx, UD_RECV)))
+    ctx->loop.cancelling = 1;
+}
+
+
+/* Handle the completion CQE on the ring of the worker W.  Sets
+   *R_ACCEPT or *R_WOKEN for events of the listening socket and the
+   wake up descriptor.  */
+static void
+ring_complete (server_worker_t w, const struct io_uring_cqe *cqe,
+               int *r_accept, int *r_woken)
+{
+  server_ring_t r = w->ring;
+  uint64_t ud = cqe->user_data;
+  int more = !!(cqe->flags & IORING_CQE_F_MORE);
+  int bid = -1;
+  assuan_context_t ctx = NULL;
+  unsigned int slot;
+
+  if ((cqe->flags & IORING_CQE_F_BUFFER))
+    {
+      bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      r->nfree--;
+    }
+
+  slot = UD_SLOT (ud);
+  if (UD_KIND (ud) && slot < r->nslots && r->slots[slot].gen == UD_GEN (ud))
+    ctx = r->slots[slot].ctx;
+  if (!ctx)
+    {
+      if (ud == UD_LISTEN)
+        {
+          r->listening = more;
+          if (cqe->res > 0)
+            *r_accept = 1;
+        }
+      else if (ud == UD_WAKE)
+        {
+          r->waking = more;
+          *r_woken = 1;
+        }
+      /* Otherwise a cancellation or a request of an ended
+         connection.  */
+      if (bid >= 0)
+        ring_put_buffer (r, bid);
+      return;
+    }
+
+  if (UD_KIND (ud) == UD_POLLOUT)
+    {
+      ctx->loop.polling = 0;
+      enqueue_connection (ctx);
+      return;
+    }
+
+  if (!more)
+    {
+      ctx->loop.receiving = 0;
+      ctx->loop.cancelling = 0;
+    }
+  if (bid >= 0 && cqe->res > (int)r->hdrlen)
+    ring_take_buffer (ctx, bid, cqe->res);
+  else
+    {
+      if (bid >= 0)
+        ring_put_buffer (r, bid);
+      if (cqe->res == -ENOBUFS)
+        {
+          /* Receive again when buffers are free.  */
+          ctx->loop.starved = 1;
+          ctx->loop.snext = NULL;
+          if (r->stail)
+            r->stail->loop.snext = ctx;
+          else
+            r->shead = ctx;
+          r->stail = ctx;
+          return;
+        }
+      /* A receive cancelled by ring_take_buffer is done again by the
+         reader once the buffers have been read.  */
+      if (cqe->res == 0 || cqe->res == (int)r->hdrlen)
+        ctx->loop.eof = 1;
+      else if (cqe->res < 0 && cqe->res != -ECANCELED)
+        ctx->loop.rerr = -cqe->res;
+    }
+  enqueue_connection (ctx);
+}
+
+
+/* Let the connections waiting for buffers of the ring of W receive
+   again as far as there are free buffers.  */
+static void
+ring_feed_starved (server_worker_t w)
+{
+  server_ring_t r = w->ring;
+  assuan_context_t ctx;
+
+  while (r->nfree && (ctx = r->shead))
+    {
+      r->shead = ctx->loop.snext;
+      if (!r->shead)
+        r->stail = NULL;
+      ctx->loop.snext = NULL;
+      ctx->loop.starved = 0;
+      if (!ctx->loop.receiving && ring_recv_connection (ctx))
+        {
+          ctx->loop.rerr = errno;
+          enqueue_connection (ctx);
+        }
+    }
+}
+
+
+/* Poll the wake up descriptor of W and, unless the server has been
+   handed off, its listening socket.  */
+static int
+ring_arm_worker (server_worker_t w)
+{
+  assuan_server_t server = w->server;
+  server_ring_t r = w->ring;
+  int handed_off;
+
+  if (!r->waking)
+    {
+      if (ring_poll (r, w->wakefd, POLLIN, 1, UD_WAKE))
+        return -1;
+      r->waking = 1;
+    }
+  if (!r->listening)
+    {
+      gpgrt_lock_lock (&server->lock);
+      handed_off = server->handed_off;
+      gpgrt_lock_unlock (&server->lock);
+      if (!handed_off)
+        {
+          if (ring_poll (r, server->listen_fd, POLLIN, 1, UD_LISTEN))
+            return -1;
+          r->listening = 1;
+        }
+    }
+  return 0;
+}
+
+
+/* The loop of the worker W with a ring.  It serves only its own
+   connections, whose input is received into the buffers of the ring
+   while the worker is busy, and enters the kernel only to submit
+   requests or if it has nothing else to do.  */
+static gpg_error_t
+run_ring_worker (server_worker_t w)
+{
+  assuan_server_t server = w->server;
+  server_ring_t r = w->ring;
+  struct io_uring_cqe *cqe;
+  assuan_context_t ctx;
+  gpg_error_t err = 0;
+  uint64_t value;
+  int i, res, timeout, prio, blocked, handed_off;
+  int accept, woken;
+  int busy = 0;
+
+  while (!err && !server->stop)
+    {
+      if (ring_arm_worker (w))
+        res = -1;
+      else if (busy)
+        res = ring_enter (r, ring_overflown (r), 0);
+      else
+        {
+          timeout = TIMED (server)? timer_timeout (w) : -1;
+          _assuan_pre_syscall ();
+          res = ring_enter (r, 1, timeout);
+          _assuan_post_syscall ();
+        }
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          err = gpg_err_make (server->err_source,
+                              gpg_err_code_from_syserror ());
+          break;
+        }
+
+      accept = woken = 0;
+      while ((cqe = ring_peek (r)))
+        {
+          ring_complete (w, cqe, &accept, &woken);
+          ring_advance (r);
+        }
+      if (woken)
+        {
+          while (read (w->wakefd, &value, sizeof value) > 0)
+            ;
+          /* The limits may have been raised or the listening socket
+             been handed off.  */
+          gpgrt_lock_lock (&server->lock);
+          blocked = server->accept_blocked;
+          handed_off = server->handed_off;
+          gpgrt_lock_unlock (&server->lock);
+          if (handed_off && r->listening)
+            ring_cancel (r, UD_LISTEN);
+          if (blocked)
+            accept = 1;
+          admit_waiting (server, 1);
+        }
+      if (accept)
+        err = accept_connections (w);
+      requeue_yielded (w);
+      ring_feed_starved (w);
+      if (TIMED (server))
+        expire_timers (w);
+
+      busy = 0;
+      for (i = 0; !err && !server->stop && i < MAX_EVENTS; i++)
+        {
+          ctx = dequeue_connection (w);
+          if (!ctx)
+            break;
+          busy = 1;
+          prio = ctx->loop.prio;
+          err = serve_connection (w, ctx);
+          if (PRIORITIZED (server) && prio != ASSUAN_PRIORITY_HIGH)
+            break;
+        }
+    }
+
+  return err;
+}
+
+#endif /*USE_IO_URING*/
+
+#endif /*HAVE_SYS_EPOLL_H*/
+
+
+/* Run the worker IDX of SERVER on the calling thread until
+   assuan_server_stop is called.  Command handlers run on the thread
+   of the worker serving the connection and must not block; they are
+   invoked as with assuan_process_next and thus need to finish their
+   command with assuan_process_done.  */
+gpg_error_t
+assuan_server_run_worker (assuan_server_t server, unsigned int idx)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  server_worker_t w;
+  gpg_error_t err;
+
+  if (server && !server->nworkers)
+    return gpg_err_make (server->err_source, GPG_ERR_INV_STATE);
+  if (!server || idx >= server->nworkers)
+    return _assuan_error (NULL, GPG_ERR_ASS_INV_VALUE);
+  w = server->workers + idx;
+
+#ifdef CPU_SET
+  if (w->cpu >= 0 && w->cpu < CPU_SETSIZE)
+    {
+      cpu_set_t set;
+
+      /* On Linux this binds only the calling thread.  */
+      CPU_ZERO (&set);
+      CPU_SET (w->cpu, &set);
+      if (sched_setaffinity (0, sizeof set, &set))
+        return gpg_err_make (server->err_source,
+                             gpg_err_code_from_syserror ());
+    }
+#endif /*CPU_SET*/
+
+  gpgrt_lock_lock (&server->lock);
+  server->nrunning++;
+  gpgrt_lock_unlock (&server->lock);
+
+#ifdef USE_IO_URING
+  if (w->ring)
+    err = run_ring_worker (w);
+  else
+#endif
+    err = run_worker (w);
+
+  /* The last worker to return makes the server ready to run
+     again.  */
+  gpgrt_lock_lock (&server->lock);
+  if (!--server->nrunning)
+    server->stop = 0;
+  gpgrt_lock_unlock (&server->lock);
+  return err;
+#else /*!HAVE_SYS_EPOLL_H*/
+  (void)idx;
+  return _assuan_error (NULL, server? GPG_ERR_NOT_SUPPORTED
+                        /**/     : GPG_ERR_ASS_INV_VALUE);
+#endif /*!HAVE_SYS_EPOLL_H*/
+}
+
+
+/* Serve the connections of SERVER until assuan_server_stop is called.
+   This runs the first worker of SERVER on the calling thread.  */
+gpg_error_t
+assuan_server_loop (assuan_server_t server)
+{
+  return assuan_server_run_worker (server, 0);
+}
+
+
+/* Make assuan_server_loop and all workers of SERVER return.  This may
+   be called from a command handler, another thread or a signal
+   handler.  */
+void
+assuan_server_stop (assuan_server_t server)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  unsigned int i;
+
+  if (!server)
+    return;
+  server->stop = 1;
+  for (i = 0; i < server->nworkers; i++)
+    wake_worker (server->workers + i);
+#else
+  (void)server;
+#endif
+}
+
+
+/* Pass the listening socket of SERVER to the client of its
+   connection CTX, which is a newly started server process taking over
+   from SERVER.  This is to be called by the handler of a command; the
+   client calls assuan_server_takeover to run that command.  The
+   socket is sent as a file descriptor along with NONCE, as returned
+   by assuan_sock_get_nonce for it, or an empty one if NONCE is NULL.
+   Thus CTX must support descriptor passing, that is SERVER has been
+   created with ASSUAN_SOCKET_SERVER_FDPASSING.  Afterwards SERVER
+   does not accept any more clients; clients waiting in the backlog
+   are accepted by the successor.  The existing connections are still
+   served and the workers return as soon as they have all ended.  */
+gpg_error_t
+assuan_server_handoff (assuan_server_t server, assuan_context_t ctx,
+                       assuan_sock_nonce_t *nonce)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  assuan_sock_nonce_t empty;
+  char hexnonce[2 * sizeof empty + 1];
+  const unsigned char *p;
+  gpg_error_t err;
+  unsigned int i;
+
+  if (!server || !ctx || ctx->loop.server != server)
+    return _assuan_error (NULL, GPG_ERR_ASS_INV_VALUE);
+  if (!nonce)
+    {
+      memset (&empty, 0, sizeof empty);
+      nonce = &empty;
+    }
+
+  gpgrt_lock_lock (&server->lock);
+  if (server->handed_off)
+    {
+      gpgrt_lock_unlock (&server->lock);
+      return gpg_err_make (server->err_source, GPG_ERR_INV_STATE);
+    }
+  server->handed_off = 1;
+  gpgrt_lock_unlock (&server->lock);
+
+  /* The nonce is sent as is; both processes use the same library.
+     The descriptor is sent directly on the socket and thus must not
+     overtake queued output.  */
+  p = (const unsigned char *)nonce;
+  for (i = 0; i < sizeof *nonce; i++)
+    snprintf (hexnonce + 2 * i, 3, "%02X", p[i]);
+  err = assuan_write_status (ctx, "NONCE", hexnonce);
+  if (!err && ctx->outbound.pending.length)
+    err = _assuan_flush_pending (ctx);
+  if (!err)
+    err = assuan_sendfd (ctx, server->listen_fd);
+  if (err)
+    {
+      /* Accept the clients which arrived in the meantime.  */
+      gpgrt_lock_lock (&server->lock);
+      server->handed_off = 0;
+      server->accept_blocked = 1;
+      gpgrt_lock_unlock (&server->lock);
+      wake_worker (server->workers);
+      return err;
+    }
+
+  /* The workers with a ring cancel their poll when woken up.  */
+  for (i = 0; i < server->nworkers; i++)
+    {
+      epoll_ctl (server->workers[i].epfd, EPOLL_CTL_DEL, server->listen_fd,
+                 NULL);
+      if (server->io_uring)
+        wake_worker (server->workers + i);
+    }
+  return 0;
+#else /*!HAVE_SYS_EPOLL_H*/
+  (void)ctx;
+  (void)nonce;
+  return _assuan_error (NULL, server? GPG_ERR_NOT_SUPPORTED
+                        /**/     : GPG_ERR_ASS_INV_VALUE);
+#endif /*!HAVE_SYS_EPOLL_H*/
+}
+
+
+/* Helper for assuan_server_takeover.  */
+static gpg_error_t
+takeover_status_cb (void *opaque, const char *line)
+{
+  assuan_sock_nonce_t *nonce = opaque;
+  unsigned char *p = (unsigned char *)nonce;
+  size_t i;
+
+  if (strncmp (line, "NONCE ", 6))
+    return 0;
+  line += 6;
+  if (strlen (line) != 2 * sizeof *nonce)
+    return _assuan_error (NULL, GPG_ERR_INV_RESPONSE);
+  for (i = 0; i < sizeof *nonce; i++, line += 2)
+    {
+      if (!isxdigit ((unsigned char)line[0])
+          || !isxdigit ((unsigned char)line[1]))
+        return _assuan_error (NULL, GPG_ERR_INV_RESPONSE);
+      p[i] = xtoi_2 (line);
+    }
+  return 0;
+}
+
+
+/* Take over the listening socket of the server loop connected to by
+   CTX, which must have been connected with
+   ASSUAN_SOCKET_CONNECT_FDPASSING.  COMMAND is the command whose
+   handler calls assuan_server_handoff.  On success the socket is
+   stored at R_LISTEN_FD and its nonce at R_NONCE, if not NULL; the
+   socket is ready to be passed to assuan_server_new.  The old server
+   keeps serving CTX until it is released.  */
+gpg_error_t
+assuan_server_takeover (assuan_context_t ctx, const char *command,
+                        assuan_fd_t *r_listen_fd, assuan_sock_nonce_t *r_nonce)
+{
+  assuan_sock_nonce_t nonce;
+  gpg_error_t err;
+
+  if (r_listen_fd)
+    *r_listen_fd = ASSUAN_INVALID_FD;
+  if (!ctx || !command || !r_listen_fd)
+    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
+
+  /* An invalid length tells that no nonce has been received.  */
+  memset (&nonce, 0xff, sizeof nonce);
+  err = assuan_transact (ctx, command, NULL, NULL, NULL, NULL,
+                         takeover_status_cb, &nonce);
+  if (err)
+    return err;
+  if (nonce.length > sizeof nonce)
+    return _assuan_error (ctx, GPG_ERR_INV_RESPONSE);
+
+  err = assuan_receivefd (ctx, r_listen_fd);
+  if (err)
+    return err;
+  if (r_nonce)
+    *r_nonce = nonce;
+  return 0;
+}
+
+
+/* Close all connections of SERVER and its listening socket and
+   release SERVER.  No worker may be running.  */
+void
+assuan_server_release (assuan_server_t server)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  assuan_context_t ctx;
+  unsigned int i;
+
+  if (!server)
+    return;
+
+  for (i = 0; i < server->nworkers; i++)
+    while (server->workers[i].conns)
+      release_connection (server->workers[i].conns);
+  while ((ctx = server->spare))
+    {
+      server->spare = ctx->loop.next;
+      assuan_release (ctx);
+    }
+  destroy_workers (server);
+  close (server->listen_fd);
+  gpgrt_lock_destroy (&server->lock);
+  server->malloc_hooks.free (server);
+#else
+  (void)server;
+#endif
+}
@@ -0,0 +1,395 @@
+/* assuan-shared.c - Client connection shared by several threads
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of Assuan.
+ *
+ * Assuan is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Assuan is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "assuan-defs.h"
+#include "debug.h"
+
+
+/* A thread waiting in assuan_shared_transact.  A waiting thread
+   blocks reading from its pipe using the system hooks so that it
+   cooperates with nPth; it is woken up by writing a byte to the pipe.
+   On Windows an event object is used instead.  The pipe is only
+   created when the thread actually has to wait and is kept for
+   re-use.  */
+struct shared_waiter
+{
+  struct shared_waiter *next;
+#ifdef HAVE_W32_SYSTEM
+  HANDLE event;
+#else
+  assuan_fd_t fd[2];
+#endif
+  unsigned int ready : 1;        /* The pipe or event has been created.  */
+  unsigned int signaled : 1;     /* A wakeup is pending.  */
+  unsigned int may_inquire : 1;  /* The command may inquire.  */
+  unsigned int abandoned : 1;    /* The thread gave up waiting for the
+                                    response to its command.  */
+};
+
+
+/* A client connection shared by several threads.  Commands are sent
+   in the order of the SENDERS queue.  The threads which have sent a
+   command are queued in READERS; the first of them reads its
+   responses from the server.  The callbacks of a transaction thus run
+   on the thread which called assuan_shared_transact.  All members
+   except CTX are protected by LOCK.  */
+struct assuan_shared_s
+{
+  gpgrt_lock_t lock;
+  assuan_context_t ctx;
+
+  struct shared_waiter *senders;   /* Waiting to send a command.  */
+  struct shared_waiter *readers;   /* Waiting for their responses.  */
+  struct shared_waiter *idle;      /* Unused waiter objects.  */
+  unsigned int sending : 1;        /* A command is being sent.  */
+  unsigned int inquiring : 1;      /* A sent command may inquire.  */
+};
+
+
+/* Create a shared handle for the connected client context CTX and
+   store it at R_SHARED.  The handle takes ownership of CTX.  */
+gpg_error_t
+assuan_shared_new (assuan_shared_t *r_shared, assuan_context_t ctx)
+{
+  assuan_shared_t shared;
+  gpg_err_code_t ec;
+
+  TRACE_BEG (ctx, ASSUAN_LOG_CTX, "assuan_shared_new", ctx);
+
+  if (!r_shared || !ctx)
+    return TRACE_ERR (_assuan_error (ctx, GPG_ERR_ASS_INV_VALUE));
+  *r_shared = NULL;
+  if (ctx->flags.is_server || ctx->transact.inquire_pending
+      || ctx->transact.nonblock)
+    return TRACE_ERR (_assuan_error (ctx, GPG_ERR_INV_STATE));
+
+  shared = _assuan_calloc (ctx, 1, sizeof *shared);
+  if (!shared)
+    return TRACE_ERR (_assuan_error (ctx, gpg_err_code_from_syserror ()));
+  ec = gpgrt_lock_init (&shared->lock);
+  if (ec)
+    {
+      _assuan_free (ctx, shared);
+      return TRACE_ERR (_assuan_error (ctx, ec));
+    }
+  shared->ctx = ctx;
+
+  *r_shared = shared;
+  return TRACE_SUC1 ("shared=%p", shared);
+}
+
+
+/* Release SHARED and its client context.  No thread may be using
+   SHARED anymore.  */
+void
+assuan_shared_release (assuan_shared_t shared)
+{
+  assuan_context_t ctx;
+  struct shared_waiter *w;
+
+  if (!shared)
+    return;
+  ctx = shared->ctx;
+
+  while ((w = shared->idle))
+    {
+      shared->idle = w->next;
+      if (w->ready)
+        {
+#ifdef HAVE_W32_SYSTEM
+          CloseHandle (w->event);
+#else
+          _assuan_close (ctx, w->fd[0]);
+          _assuan_close (ctx, w->fd[1]);
+#endif
+        }
+      _assuan_free (ctx, w);
+    }
+  gpgrt_lock_destroy (&shared->lock);
+  _assuan_free (ctx, shared);
+  assuan_release (ctx);
+}
+
+
+/* Append W to the queue at QUEUE.  */
+static void
+enqueue (struct shared_waiter **queue, struct shared_waiter *w)
+{
+  while (*queue)
+    queue = &(*queue)->next;
+  w->next = NULL;
+  *queue = w;
+}
+
+
+/* Mark the thread waiting with W for wakeup.  Must be called with
+   the lock held.  Returns W if the wakeup is to be sent with
+   unlock_and_wake or NULL if W does not need to be woken up.  */
+static struct shared_waiter *
+wake (struct shared_waiter *w)
+{
+  if (!w || w->signaled || !w->ready)
+    return NULL;
+  w->signaled = 1;
+  return w;
+}
+
+
+/* Release the lock and then wake up the threads W1 and W2 as
+   returned by wake.  The wakeup is sent without holding the lock
+   because the write may yield to other threads.  */
+static void
+unlock_and_wake (assuan_shared_t shared,
+                 struct shared_waiter *w1, struct shared_waiter *w2)
+{
+  struct shared_waiter *w[2];
+  int i;
+
+  gpgrt_lock_unlock (&shared->lock);
+  w[0] = w1;
+  w[1] = w2;
+  for (i = 0; i < 2; i++)
+    if (w[i])
+#ifdef HAVE_W32_SYSTEM
+      SetEvent (w[i]->event);
+#else
+      _assuan_write (shared->ctx, w[i]->fd[1], "", 1);
+#endif
+}
+
+
+/* Wait until woken up.  Must be called with the lock held; the lock
+   is released while waiting.  */
+static gpg_error_t
+wait_turn (assuan_shared_t shared, struct shared_waiter *w)
+{
+#ifdef HAVE_W32_SYSTEM
+  DWORD res;
+
+  if (!w->ready)
+    {
+      w->event = CreateEvent (NULL, FALSE, FALSE, NULL);
+      if (!w->event)
+        return _assuan_error (shared->ctx, GPG_ERR_EIO);
+      w->ready = 1;
+    }
+
+  gpgrt_lock_unlock (&shared->lock);
+  res = WaitForSingleObject (w->event, INFINITE);
+  gpgrt_lock_lock (&shared->lock);
+  w->signaled = 0;
+  if (res != WAIT_OBJECT_0)
+    return _assuan_error (shared->ctx, GPG_ERR_EIO);
+  return 0;
+#else /*!HAVE_W32_SYSTEM*/
+  char c;
+  ssize_t n;
+
+  if (!w->ready)
+    {
+      if (_assuan_pipe (shared->ctx, w->fd, 0))
+        return _assuan_error (shared->ctx, gpg_err_code_from_syserror ());
+      w->ready = 1;
+    }
+
+  gpgrt_lock_unlock (&shared->lock);
+  do
+    n = _assuan_read (shared->ctx, w->fd[0], &c, 1);
+  while (n < 0 && errno == EINTR);
+  gpgrt_lock_lock (&shared->lock);
+  w->signaled = 0;
+  if (n != 1)
+    return _assuan_error (shared->ctx, n? gpg_err_code_from_syserror ()
+                          /**/   : GPG_ERR_EOF);
+  return 0;
+#endif /*!HAVE_W32_SYSTEM*/
+}
+
+
+/* Read and discard the responses to the commands at the head of the
+   READERS queue of SHARED whose threads have given up waiting for
+   them, so that the following readers get their own responses.  Must
+   be called with the lock held; the lock is released while
+   reading.  */
+static void
+skip_abandoned (assuan_shared_t shared)
+{
+  assuan_context_t ctx = shared->ctx;
+  struct shared_waiter *w;
+
+  while ((w = shared->readers) && w->abandoned)
+    {
+      gpgrt_lock_unlock (&shared->lock);
+      _assuan_deadline_begin (ctx);
+      _assuan_transact_responses (ctx, NULL, NULL, NULL, NULL, NULL, NULL);
+      gpgrt_lock_lock (&shared->lock);
+
+      shared->readers = w->next;
+      if (w->may_inquire)
+        shared->inquiring = 0;
+      w->abandoned = 0;
+      w->next = shared->idle;
+      shared->idle = w;
+    }
+}
+
+
+/* Remove W from SHARED and keep it for re-use.  If W has been
+   abandoned while waiting for its response, it is only removed after
+   that response has been read.  Then release the lock and wake up the
+   threads which may continue now.  Must be called with the lock
+   held.  */
+static void
+finish_and_unlock (assuan_shared_t shared, struct shared_waiter *w)
+{
+  struct shared_waiter **wp;
+
+  for (wp = &shared->senders; *wp; wp = &(*wp)->next)
+    if (*wp == w)
+      {
+        *wp = w->next;
+        break;
+      }
+  if (!w->abandoned)
+    {
+      for (wp = &shared->readers; *wp; wp = &(*wp)->next)
+        if (*wp == w)
+          {
+            *wp = w->next;
+            if (w->may_inquire)
+              shared->inquiring = 0;
+            break;
+          }
+      w->next = shared->idle;
+      shared->idle = w;
+    }
+  skip_abandoned (shared);
+
+  unlock_and_wake (shared, wake (shared->readers),
+                   (!shared->sending && !shared->inquiring)
+                   ? wake (shared->senders) : NULL);
+}
+
+
+/* Run the transaction COMMAND on the connection of SHARED.  This
+   works like assuan_transact but may be called from several threads
+   at once; the commands are sent in the order of the calls and the
+   callbacks of each transaction run on its calling thread.  If FLAGS
+   has ASSUAN_SHARED_NO_INQUIRE set the caller asserts that the server
+   does not inquire for this command.  Such commands are sent while
+   the responses to the previous commands are still outstanding.
+   Suspending a transaction by returning GPG_ERR_EAGAIN from the
+   inquire callback is not supported.  */
+gpg_error_t
+assuan_shared_transact (assuan_shared_t shared,
+                        const char *command, unsigned int flags,
+                        gpg_error_t (*data_cb)(void *, const void *, size_t),
+                        void *data_cb_arg,
+                        gpg_error_t (*inquire_cb)(void*, const char *),
+                        void *inquire_cb_arg,
+                        gpg_error_t (*status_cb)(void*, const char *),
+                        void *status_cb_arg)
+{
+  assuan_context_t ctx;
+  struct shared_waiter *w;
+  gpg_error_t err = 0;
+
+  if (!shared || !command)
+    return _assuan_error (shared? shared->ctx : NULL, GPG_ERR_ASS_INV_VALUE);
+  ctx = shared->ctx;
+
+  gpgrt_lock_lock (&shared->lock);
+  w = shared->idle;
+  if (w)
+    shared->idle = w->next;
+  else
+    {
+      w = _assuan_calloc (ctx, 1, sizeof *w);
+      if (!w)
+        {
+          err = _assuan_error (ctx, gpg_err_code_from_syserror ());
+          gpgrt_lock_unlock (&shared->lock);
+          return err;
+        }
+    }
+  w->may_inquire = !(flags & ASSUAN_SHARED_NO_INQUIRE);
+  enqueue (&shared->senders, w);
+
+  /* Wait until all commands queued before ours have been sent and no
+     outstanding command may still inquire.  */
+  while (!err
+         && (shared->senders != w || shared->sending || shared->inquiring))
+    err = wait_turn (shared, w);
+  if (err)
+    goto leave;
+
+  shared->senders = w->next;
+  shared->sending = 1;
+  gpgrt_lock_unlock (&shared->lock);
+
+  err = assuan_write_line (ctx, command);
+
+  gpgrt_lock_lock (&shared->lock);
+  shared->sending = 0;
+  if (err || *command == '#' || !*command)
+    goto leave;  /* No response is expected for a comment line.  */
+
+  enqueue (&shared->readers, w);
+  if (w->may_inquire)
+    shared->inquiring = 1;
+  else if (shared->senders)
+    {
+      unlock_and_wake (shared, wake (shared->senders), NULL);
+      gpgrt_lock_lock (&shared->lock);
+    }
+
+  /* Wait until the responses to the previous commands have been
+     read.  If that fails, the response to our command is still to be
+     read; it is skipped by the reader before us.  */
+  while (!err && shared->readers != w)
+    err = wait_turn (shared, w);
+  if (err)
+    {
+      w->abandoned = 1;
+      goto leave;
+    }
+  gpgrt_lock_unlock (&shared->lock);
+
+  _assuan_deadline_begin (ctx);
+  err = _assuan_transact_responses (ctx, data_cb, data_cb_arg,
+                                    inquire_cb, inquire_cb_arg,
+                                    status_cb, status_cb_arg);
+  if (ctx->transact.inquire_pending)
+    err = assuan_transact_resume (ctx, _assuan_error (ctx,
+                                                      GPG_ERR_NOT_SUPPORTED));
+
+  gpgrt_lock_lock (&shared->lock);
+ leave:
+  finish_and_unlock (shared, w);
+  return err;
+}
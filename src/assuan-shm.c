@@ -0,0 +1,702 @@
+/* assuan-shm.c - Shared memory transport for local connections
+ * Copyright (C) 2026 g10 Code GmbH
+ *
+ * This file is part of Assuan.
+ *
+ * Assuan is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * Assuan is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/* After a handshake over a Unix domain socket with descriptor
+   passing, the lines of a connection may be exchanged through a pair
+   of single producer, single consumer rings in a memory file shared
+   by client and server.  A side which finds its ring empty (or full)
+   spins for a short while and then sleeps on its eventfd after
+   telling the peer so in the shared header; the peer writes to that
+   eventfd when it makes progress.  The socket stays open: it is
+   watched for the end of the connection and still carries passed
+   descriptors.  As those must be received before the line which
+   refers to them, the sender counts the bytes it sent along with
+   descriptors in the header and the receiver drains the socket up to
+   that count before it takes lines from the ring.
+
+   The handshake is:
+
+     C: SHM <ringsize>
+     S: INQUIRE SHM_FDS
+     C: <sends the memory file and the eventfds of client and server>
+     C: END
+     S: OK
+
+   Both sides switch to the rings right after the OK line.  */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_STDINT_H
+# include <stdint.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+# include <poll.h>
+# include <sched.h>
+# include <sys/socket.h>
+# include <sys/eventfd.h>
+#endif
+
+#include "assuan-defs.h"
+#include "debug.h"
+
+#if defined(USE_DESCRIPTOR_PASSING) && defined(HAVE_MEMFD_CREATE) \
+    && defined(HAVE_SYS_EVENTFD_H) && defined(F_ADD_SEALS) \
+    && defined(__GNUC__)
+# define USE_SHM_RING 1
+#endif
+
+
+#ifdef USE_SHM_RING
+
+/* Identifies the layout of the shared memory.  */
+#define SHM_MAGIC 0x41534d31
+
+/* The size of the header in front of the rings.  */
+#define SHM_HEADER_SIZE 4096
+
+/* The limits and the default for the size of each ring.  */
+#define SHM_MIN_RING     4096
+#define SHM_MAX_RING     (64 * 1024 * 1024)
+#define SHM_DEFAULT_RING (64 * 1024)
+
+/* The number of times a side checks its ring before it goes to
+   sleep.  A round trip of a short command takes a few microseconds,
+   so the peer usually answers while we spin.  With a single CPU the
+   peer can't run while we spin; we yield the CPU a few times
+   instead.  */
+#define SHM_SPINS 4000
+#define SHM_YIELDS 8
+
+#if defined(__i386__) || defined(__x86_64__)
+# define cpu_relax() __builtin_ia32_pause ()
+#else
+# define cpu_relax() do { } while (0)
+#endif
+
+#define CACHELINE __attribute__ ((aligned (64)))
+
+/* A ring written by one side.  The positions run freely and wrap
+   around at 2^32; the ring size is a power of two.  */
+struct shm_ring
+{
+  unsigned int tail CACHELINE;  /* Written by the producer.  */
+  unsigned int fdbytes;         /* Bytes sent by it with descriptors.  */
+  unsigned int head CACHELINE;  /* Written by the consumer.  */
+};
+
+/* The header of the shared memory.  Ring 0 is written by the client,
+   ring 1 by the server; they follow the header in that order.  */
+struct shm_header
+{
+  unsigned int magic;
+  unsigned int ringsize;
+  struct {
+    unsigned int sleeping CACHELINE;  /* The side waits on its eventfd.  */
+  } side[2];
+  struct shm_ring ring[2];
+};
+
+/* The state of one side of a shared memory connection.  */
+struct assuan_shm_s
+{
+  struct shm_header *hdr;
+  size_t mapsize;
+  unsigned int ringsize;
+  int self;                 /* 0 for the client, 1 for the server.  */
+  int efd[2];               /* The eventfds of client and server.  */
+  unsigned char *data[2];   /* The data of the rings.  */
+  unsigned int inhead;      /* Our copy of the head of the input.  */
+  unsigned int outtail;     /* Our copy of the tail of the output.  */
+  unsigned int fdseen;      /* Bytes received with descriptors.  */
+  unsigned int active : 1;  /* The rings are in use.  */
+  unsigned int single_cpu : 1; /* Only one CPU is online.  */
+  /* The engine functions of the socket.  */
+  ssize_t (*readfnc) (assuan_context_t, void *, size_t);
+  ssize_t (*writefnc) (assuan_context_t, const void *, size_t);
+};
+
+
+/* Wake up side IDX of S if it sleeps.  */
+static void
+wake_side (struct assuan_shm_s *s, int idx)
+{
+  uint64_t one = 1;
+  ssize_t res;
+
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&s->hdr->side[idx].sleeping, __ATOMIC_RELAXED))
+    {
+      __atomic_store_n (&s->hdr->side[idx].sleeping, 0, __ATOMIC_RELAXED);
+      /* An error can only mean that the counter is already high.  */
+      res = write (s->efd[idx], &one, sizeof one);
+      (void)res;
+    }
+}
+
+
+/* Return true if our input has data or, if FOR_WRITE is set, our
+   output has room.  */
+static int
+ring_ready (struct assuan_shm_s *s, int for_write)
+{
+  if (for_write)
+    return (s->outtail - __atomic_load_n (&s->hdr->ring[s->self].head,
+                                          __ATOMIC_ACQUIRE)) < s->ringsize;
+  else
+    return __atomic_load_n (&s->hdr->ring[!s->self].tail,
+                            __ATOMIC_ACQUIRE) != s->inhead;
+}
+
+
+/* Mark our side of S as sleeping so that the peer signals our
+   eventfd when it makes progress.  A signal which we did not wait for
+   is consumed first.  Returns true, without the mark, if our input has
+   data or, if FOR_WRITE is set, our output has room already.  */
+static int
+go_to_sleep (struct assuan_shm_s *s, int for_write)
+{
+  uint64_t value;
+  ssize_t res;
+
+  res = read (s->efd[s->self], &value, sizeof value);
+  (void)res;
+  __atomic_store_n (&s->hdr->side[s->self].sleeping, 1, __ATOMIC_SEQ_CST);
+  if (!ring_ready (s, for_write))
+    return 0;
+  __atomic_store_n (&s->hdr->side[s->self].sleeping, 0, __ATOMIC_RELAXED);
+  return 1;
+}
+
+
+/* Read and discard the data the peer sent along with descriptors on
+   the socket so that the descriptors get queued.  Returns 1 on
+   success, 0 on EOF or -1 on error.  */
+static int
+drain_socket (assuan_context_t ctx)
+{
+  struct assuan_shm_s *s = ctx->shm;
+  unsigned int want;
+  char buffer[256];
+  ssize_t n;
+
+  for (;;)
+    {
+      want = (__atomic_load_n (&s->hdr->ring[!s->self].fdbytes,
+                               __ATOMIC_ACQUIRE) - s->fdseen);
+      if (!want)
+        return 1;
+      n = s->readfnc (ctx, buffer, want < sizeof buffer? want : sizeof buffer);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return n;
+      s->fdseen += n;
+    }
+}
+
+
+/* Take the descriptors which arrived on the socket of CTX and check
+   for the end of the connection.  Returns 1 if the ring shall be
+   checked again, 0 if the peer closed the connection or -1 with ERRNO
+   set on error.  */
+static int
+check_socket (assuan_context_t ctx, int for_write)
+{
+  char c;
+  int res;
+
+  res = drain_socket (ctx);
+  if (res <= 0)
+    return res;
+  if (!ring_ready (ctx->shm, for_write)
+      && recv (ctx->inbound.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+    return 0;
+  return 1;
+}
+
+
+/* Wait until our input has data or, if FOR_WRITE is set, our output
+   has room.  Returns 1 if the ring shall be checked again, 0 if the
+   peer closed the connection or -1 with ERRNO set on error.  */
+static int
+wait_ring (assuan_context_t ctx, int for_write)
+{
+  struct assuan_shm_s *s = ctx->shm;
+  struct pollfd pfd[2];
+  uint64_t value;
+  long timeout;
+  int i, res;
+
+  for (i = 0; i < (s->single_cpu? SHM_YIELDS : SHM_SPINS); i++)
+    {
+      if (ring_ready (s, for_write))
+        return 1;
+      if (s->single_cpu)
+        sched_yield ();
+      else
+        cpu_relax ();
+    }
+
+  if (go_to_sleep (s, for_write))
+    return 1;
+
+  /* In non-blocking mode the caller polls the socket and the eventfd,
+     which the peer signals as we are marked as sleeping.  */
+  if (ctx->transact.nonblock || ctx->flags.in_next_read)
+    {
+      res = check_socket (ctx, for_write);
+      if (res <= 0)
+        return res;
+      gpg_err_set_errno (EAGAIN);
+      return -1;
+    }
+
+  timeout = _assuan_deadline_left (ctx);
+  if (!timeout)
+    {
+      _assuan_deadline_expire (ctx, for_write);
+      return -1;
+    }
+
+  pfd[0].fd = s->efd[s->self];
+  pfd[0].events = POLLIN;
+  pfd[1].fd = ctx->inbound.fd;
+  pfd[1].events = POLLIN;
+  _assuan_pre_syscall ();
+  res = poll (pfd, 2, timeout < 0? -1 : (int)timeout);
+  _assuan_post_syscall ();
+  __atomic_store_n (&s->hdr->side[s->self].sleeping, 0, __ATOMIC_RELAXED);
+  if (res < 0)
+    return errno == EINTR? 1 : -1;
+
+  if ((pfd[0].revents & POLLIN)
+      && read (s->efd[s->self], &value, sizeof value) < 0)
+    return errno == EAGAIN? 1 : -1;
+  if ((pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+    return check_socket (ctx, for_write);
+  return 1;
+}
+
+
+/* Read from the ring written by the peer.  */
+static ssize_t
+shm_reader (assuan_context_t ctx, void *buf, size_t buflen)
+{
+  struct assuan_shm_s *s = ctx->shm;
+  struct shm_ring *ring = &s->hdr->ring[!s->self];
+  const unsigned char *data = s->data[!s->self];
+  unsigned int avail, off, n, first;
+  int res;
+
+  for (;;)
+    {
+      avail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE) - s->inhead;
+      /* Descriptors are sent before the line referring to them, so
+         they are queued before we pass that line on.  */
+      if (__atomic_load_n (&ring->fdbytes, __ATOMIC_ACQUIRE) != s->fdseen)
+        {
+          res = drain_socket (ctx);
+          if (res <= 0)
+            return res;
+        }
+      if (avail > s->ringsize)
+        {
+          gpg_err_set_errno (EIO);
+          return -1;
+        }
+      if (avail)
+        break;
+      res = wait_ring (ctx, 0);
+      if (res <= 0)
+        return res;
+    }
+
+  n = avail < buflen? avail : buflen;
+  off = s->inhead & (s->ringsize - 1);
+  first = n < s->ringsize - off? n : s->ringsize - off;
+  memcpy (buf, data + off, first);
+  memcpy ((char *)buf + first, data, n - first);
+  s->inhead += n;
+  __atomic_store_n (&ring->head, s->inhead, __ATOMIC_RELEASE);
+  wake_side (s, !s->self);
+  return n;
+}
+
+
+/* Write to our ring.  */
+static ssize_t
+shm_writer (assuan_context_t ctx, const void *buf, size_t buflen)
+{
+  struct assuan_shm_s *s = ctx->shm;
+  struct shm_ring *ring = &s->hdr->ring[s->self];
+  unsigned char *data = s->data[s->self];
+  unsigned int room, off, n, first;
+  int res;
+
+  for (;;)
+    {
+      room = s->ringsize - (s->outtail - __atomic_load_n (&ring->head,
+                                                           __ATOMIC_ACQUIRE));
+      if (room > s->ringsize)
+        {
+          gpg_err_set_errno (EIO);
+          return -1;
+        }
+      if (room)
+        break;
+      res = wait_ring (ctx, 1);
+      if (!res)
+        gpg_err_set_errno (EPIPE);
+      if (res <= 0)
+        return -1;
+    }
+
+  n = room < buflen? room : buflen;
+  off = s->outtail & (s->ringsize - 1);
+  first = n < s->ringsize - off? n : s->ringsize - off;
+  memcpy (data + off, buf, first);
+  memcpy (data, (const char *)buf + first, n - first);
+  s->outtail += n;
+  __atomic_store_n (&ring->tail, s->outtail, __ATOMIC_RELEASE);
+  wake_side (s, !s->self);
+  return n;
+}
+
+
+/* Map the shared memory FD for rings of RINGSIZE bytes and set up
+   the state of side SELF.  On success the eventfds EFD0 and EFD1 are
+   owned by the state; FD may be closed by the caller.  */
+static gpg_error_t
+setup_state (assuan_context_t ctx, int self, unsigned int ringsize,
+             int fd, int efd0, int efd1)
+{
+  struct assuan_shm_s *s;
+  size_t mapsize = SHM_HEADER_SIZE + 2 * (size_t)ringsize;
+  void *map;
+
+  map = mmap (NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return _assuan_error (ctx, gpg_err_code_from_syserror ());
+  s = _assuan_calloc (ctx, 1, sizeof *s);
+  if (!s)
+    {
+      gpg_error_t err = _assuan_error (ctx, gpg_err_code_from_syserror ());
+      munmap (map, mapsize);
+      return err;
+    }
+  s->hdr = map;
+  s->mapsize = mapsize;
+  s->ringsize = ringsize;
+  s->self = self;
+  s->efd[0] = efd0;
+  s->efd[1] = efd1;
+  s->data[0] = (unsigned char *)map + SHM_HEADER_SIZE;
+  s->data[1] = s->data[0] + ringsize;
+  s->single_cpu = sysconf (_SC_NPROCESSORS_ONLN) <= 1;
+  ctx->shm = s;
+  return 0;
+}
+
+
+/* Switch CTX to the rings.  */
+static void
+activate (assuan_context_t ctx)
+{
+  struct assuan_shm_s *s = ctx->shm;
+
+  s->readfnc = ctx->engine.readfnc;
+  s->writefnc = ctx->engine.writefnc;
+  ctx->engine.readfnc = shm_reader;
+  ctx->engine.writefnc = shm_writer;
+  s->active = 1;
+}
+
+
+struct start_parm_s
+{
+  assuan_context_t ctx;
+  assuan_fd_t fds[3];
+};
+
+/* Inquire callback of assuan_shm_start to send the descriptors.  */
+static gpg_error_t
+start_inquire_cb (void *opaque, const char *keyword)
+{
+  struct start_parm_s *parm = opaque;
+
+  if (strcmp (keyword, "SHM_FDS"))
+    return _assuan_error (parm->ctx, GPG_ERR_ASS_UNKNOWN_INQUIRE);
+  return assuan_sendfds (parm->ctx, parm->fds, 3);
+}
+
+#endif /*USE_SHM_RING*/
+
+
+/* Switch the client connection CTX to shared memory rings of
+   RINGSIZE bytes each, or of the default size if 0 is given.  The
+   server needs to allow this with ASSUAN_ALLOW_SHM.  */
+gpg_error_t
+assuan_shm_start (assuan_context_t ctx, unsigned int ringsize)
+{
+#ifdef USE_SHM_RING
+  gpg_error_t err;
+  struct start_parm_s parm;
+  char line[40];
+
+  if (!ctx)
+    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
+  if (!ringsize)
+    ringsize = SHM_DEFAULT_RING;
+  if (ringsize < SHM_MIN_RING || ringsize > SHM_MAX_RING
+      || (ringsize & (ringsize - 1)))
+    return _assuan_error (ctx, GPG_ERR_INV_ARG);
+  if (ctx->flags.is_server || ctx->shm || !ctx->engine.sendfds)
+    return _assuan_error (ctx, GPG_ERR_NOT_SUPPORTED);
+
+  parm.ctx = ctx;
+  parm.fds[0] = memfd_create ("assuan-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  parm.fds[1] = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  parm.fds[2] = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (parm.fds[0] == -1 || parm.fds[1] == -1 || parm.fds[2] == -1
+      || ftruncate (parm.fds[0], SHM_HEADER_SIZE + 2 * (off_t)ringsize)
+      || fcntl (parm.fds[0], F_ADD_SEALS,
+                F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL))
+    {
+      err = _assuan_error (ctx, gpg_err_code_from_syserror ());
+      goto leave;
+    }
+
+  err = setup_state (ctx, 0, ringsize, parm.fds[0], parm.fds[1], parm.fds[2]);
+  if (err)
+    goto leave;
+  ctx->shm->hdr->magic = SHM_MAGIC;
+  ctx->shm->hdr->ringsize = ringsize;
+
+  snprintf (line, sizeof line, "SHM %u", ringsize);
+  err = assuan_transact (ctx, line, NULL, NULL, start_inquire_cb, &parm,
+                         NULL, NULL);
+  /* The eventfds are now owned by the state.  */
+  parm.fds[1] = parm.fds[2] = -1;
+  if (err)
+    _assuan_shm_release (ctx);
+  else
+    activate (ctx);
+
+ leave:
+  if (parm.fds[0] != -1)
+    close (parm.fds[0]);
+  if (parm.fds[1] != -1)
+    close (parm.fds[1]);
+  if (parm.fds[2] != -1)
+    close (parm.fds[2]);
+  return err;
+#else
+  (void)ringsize;
+  return _assuan_error (ctx, GPG_ERR_NOT_SUPPORTED);
+#endif
+}
+
+
+/* The handler of the SHM command with the arguments LINE.  Takes the
+   shared memory from the client; the rings are used after the OK
+   line has been written, see _assuan_shm_commit.  */
+gpg_error_t
+_assuan_shm_handler (assuan_context_t ctx, char *line)
+{
+#ifdef USE_SHM_RING
+  gpg_error_t err;
+  unsigned long ringsize;
+  unsigned char *buffer;
+  size_t length;
+  assuan_fd_t fds[3];
+  struct stat st;
+  char *endp;
+  int seals;
+
+  if (!ctx->flags.allow_shm || ctx->flags.in_server_loop || ctx->shm
+      || !ctx->engine.sendfds)
+    return set_error (ctx, GPG_ERR_NOT_SUPPORTED, NULL);
+  ringsize = strtoul (line, &endp, 10);
+  if (endp == line || *endp || ringsize < SHM_MIN_RING
+      || ringsize > SHM_MAX_RING || (ringsize & (ringsize - 1)))
+    return set_error (ctx, GPG_ERR_ASS_PARAMETER, "invalid ring size");
+
+  err = assuan_inquire (ctx, "SHM_FDS", &buffer, &length, 16);
+  if (err)
+    return err;
+  _assuan_free (ctx, buffer);
+  err = assuan_receivefds (ctx, fds, 3);
+  if (err)
+    return err;
+
+  /* Lines sent after the command would be read from the socket.  */
+  if (ctx->inbound.attic.pending || ctx->inbound.attic.linelen)
+    {
+      err = set_error (ctx, GPG_ERR_ASS_SYNTAX, "pipelined command");
+      goto leave;
+    }
+
+  /* Without the seal the client could shrink the file while it is
+     mapped.  */
+  seals = fcntl (fds[0], F_GET_SEALS);
+  if (seals == -1 || !(seals & F_SEAL_SHRINK) || fstat (fds[0], &st)
+      || st.st_size != SHM_HEADER_SIZE + 2 * (off_t)ringsize)
+    {
+      err = set_error (ctx, GPG_ERR_ASS_PARAMETER, "invalid shared memory");
+      goto leave;
+    }
+  err = setup_state (ctx, 1, ringsize, fds[0], fds[1], fds[2]);
+  if (err)
+    goto leave;
+  fds[1] = fds[2] = ASSUAN_INVALID_FD;
+  if (ctx->shm->hdr->magic != SHM_MAGIC
+      || ctx->shm->hdr->ringsize != ringsize)
+    {
+      _assuan_shm_release (ctx);
+      err = set_error (ctx, GPG_ERR_ASS_PARAMETER, "invalid shared memory");
+    }
+
+ leave:
+  _assuan_close (ctx, fds[0]);
+  if (fds[1] != ASSUAN_INVALID_FD)
+    _assuan_close (ctx, fds[1]);
+  if (fds[2] != ASSUAN_INVALID_FD)
+    _assuan_close (ctx, fds[2]);
+  return err;
+#else
+  (void)line;
+  return set_error (ctx, GPG_ERR_NOT_SUPPORTED, NULL);
+#endif
+}
+
+
+/* Called by the server after the response RC to a command has been
+   written.  Switches to the rings set up by the SHM command.  */
+void
+_assuan_shm_commit (assuan_context_t ctx, gpg_error_t rc)
+{
+#ifdef USE_SHM_RING
+  if (!ctx->shm || ctx->shm->active)
+    return;
+  if (rc)
+    _assuan_shm_release (ctx);
+  else
+    activate (ctx);
+#else
+  (void)ctx;
+  (void)rc;
+#endif
+}
+
+
+/* Note that NBYTES have been sent with descriptors on the socket of
+   CTX.  */
+void
+_assuan_shm_sent_fds (assuan_context_t ctx, size_t nbytes)
+{
+#ifdef USE_SHM_RING
+  if (ctx->shm && ctx->shm->active)
+    __atomic_add_fetch (&ctx->shm->hdr->ring[ctx->shm->self].fdbytes,
+                        (unsigned int)nbytes, __ATOMIC_RELEASE);
+#else
+  (void)ctx;
+  (void)nbytes;
+#endif
+}
+
+
+/* Called before assuan_process_next returns to a caller which waits
+   for the descriptors of CTX.  Marks our side as sleeping so that the
+   client signals the eventfd for its next line, and signals it
+   ourselves if a line is already in the ring.  */
+void
+_assuan_shm_idle (assuan_context_t ctx)
+{
+#ifdef USE_SHM_RING
+  uint64_t one = 1;
+  ssize_t res;
+
+  if (ctx->shm && ctx->shm->active && go_to_sleep (ctx->shm, 0))
+    {
+      res = write (ctx->shm->efd[ctx->shm->self], &one, sizeof one);
+      (void)res;
+    }
+#else
+  (void)ctx;
+#endif
+}
+
+
+/* Return the descriptor to wait on for I/O on CTX if it uses shared
+   memory, or ASSUAN_INVALID_FD.  */
+assuan_fd_t
+_assuan_shm_wait_fd (assuan_context_t ctx)
+{
+#ifdef USE_SHM_RING
+  if (ctx->shm && ctx->shm->active)
+    return ctx->shm->efd[ctx->shm->self];
+#else
+  (void)ctx;
+#endif
+  return ASSUAN_INVALID_FD;
+}
+
+
+/* Stop using shared memory on CTX and release it.  */
+void
+_assuan_shm_release (assuan_context_t ctx)
+{
+#ifdef USE_SHM_RING
+  struct assuan_shm_s *s = ctx->shm;
+
+  if (!s)
+    return;
+  if (s->active)
+    {
+      ctx->engine.readfnc = s->readfnc;
+      ctx->engine.writefnc = s->writefnc;
+    }
+  munmap (s->hdr, s->mapsize);
+  close (s->efd[0]);
+  close (s->efd[1]);
+  _assuan_free (ctx, s);
+  ctx->shm = NULL;
+#else
+  (void)ctx;
+#endif
+}
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #ifdef HAVE_STDINT_H
 # include <stdint.h>
 #endif
@@ -43,6 +44,8 @@
 # include <sys/un.h>
 # include <netinet/in.h>
 # include <arpa/inet.h>
+# include <fcntl.h>
+# include <poll.h>
 #endif
 
 #include "assuan-defs.h"
@@ -75,6 +78,17 @@
 # define WITH_IPV6 1
 #endif
 
+/* Storage for any of the socket addresses we support.  */
+union sockaddr_any
+{
+  struct sockaddr sa;
+  struct sockaddr_un un;
+  struct sockaddr_in in;
+#ifdef WITH_IPV6
+  struct sockaddr_in6 in6;
+#endif
+};
+
 
 
 /* Returns true if STR represents a valid port number in decimal
@@ -98,16 +112,15 @@ parse_portno (const char *str, uint16_t *r_port)
 }
 
 
-static gpg_error_t
-_assuan_connect_finalize (assuan_context_t ctx, assuan_fd_t fd,
-                          unsigned int flags)
+/* Set up CTX as client for the connected socket FD.  */
+static void
+connect_setup (assuan_context_t ctx, assuan_fd_t fd, unsigned int flags)
 {
-  gpg_error_t err;
-
   ctx->engine.release = _assuan_client_release;
   ctx->engine.readfnc = _assuan_simple_read;
   ctx->engine.writefnc = _assuan_simple_write;
   ctx->engine.sendfd = NULL;
+  ctx->engine.sendfds = NULL;
   ctx->engine.receivefd = NULL;
   ctx->finish_handler = _assuan_client_finish;
   ctx->inbound.fd = fd;
@@ -120,52 +133,75 @@ _assuan_connect_finalize (assuan_context_t ctx, assuan_fd_t fd,
   if (flags & ASSUAN_SOCKET_CONNECT_FDPASSING)
     _assuan_init_uds_io (ctx);
 #endif
+}
 
-  /* initial handshake */
-  {
-    assuan_response_t response;
-    int off;
 
-    err = _assuan_read_from_server (ctx, &response, &off, 0);
-    if (err)
-      TRACE1 (ctx, ASSUAN_LOG_SYSIO, "assuan_socket_connect", ctx,
-	      "can't connect to server: %s\n", gpg_strerror (err));
-    else if (response == ASSUAN_RESPONSE_OK)
-      {
+/* Check the greeting RESPONSE of the server with the argument at OFF
+   in the inbound line of CTX.  */
+static gpg_error_t
+check_hello (assuan_context_t ctx, assuan_response_t response, int off)
+{
+  gpg_error_t err = 0;
+
+  if (response == ASSUAN_RESPONSE_OK)
+    {
 #if defined(HAVE_W32_SYSTEM)
-        const char *line = ctx->inbound.line + off;
-        int process_id = -1;
-
-        /* Parse the message: OK ..., process %i */
-        line = strrchr (line, ',');
-        if (line)
-          {
-            line = strchr (line + 1, ' ');
-            if (line)
-              {
-                line = strchr (line + 1, ' ');
-                if (line)
-                  process_id = atoi (line + 1);
-              }
-          }
-        if (process_id != -1)
-          ctx->process_id = process_id;
+      const char *line = ctx->inbound.line + off;
+      int process_id = -1;
+
+      /* Parse the message: OK ..., process %i */
+      line = strrchr (line, ',');
+      if (line)
+        {
+          line = strchr (line + 1, ' ');
+          if (line)
+            {
+              line = strchr (line + 1, ' ');
+              if (line)
+                process_id = atoi (line + 1);
+            }
+        }
+      if (process_id != -1)
+        ctx->process_id = process_id;
 #else
-        ;
+      (void)off;
 #endif
-      }
-    else
-      {
-	char *sname = _assuan_encode_c_string (ctx, ctx->inbound.line);
-	if (sname)
-	  {
-	    TRACE1 (ctx, ASSUAN_LOG_SYSIO, "assuan_socket_connect", ctx,
-		    "can't connect to server: %s", sname);
-	    _assuan_free (ctx, sname);
-	  }
-	err = _assuan_error (ctx, GPG_ERR_ASS_CONNECT_FAILED);
-      }
-  }
+    }
+  else
+    {
+      char *sname = _assuan_encode_c_string (ctx, ctx->inbound.line);
+      if (sname)
+        {
+          TRACE1 (ctx, ASSUAN_LOG_SYSIO, "assuan_socket_connect", ctx,
+                  "can't connect to server: %s", sname);
+          _assuan_free (ctx, sname);
+        }
+      err = _assuan_error (ctx, GPG_ERR_ASS_CONNECT_FAILED);
+    }
+
+  return err;
+}
+
+
+static gpg_error_t
+_assuan_connect_finalize (assuan_context_t ctx, assuan_fd_t fd,
+                          unsigned int flags)
+{
+  gpg_error_t err;
+  assuan_response_t response;
+  int off;
+
+  connect_setup (ctx, fd, flags);
+
+  /* initial handshake */
+  _assuan_deadline_begin (ctx);
+  err = _assuan_read_from_server (ctx, &response, &off, 0);
+  _assuan_deadline_end (ctx);
+  if (err)
+    TRACE1 (ctx, ASSUAN_LOG_SYSIO, "assuan_socket_connect", ctx,
+            "can't connect to server: %s\n", gpg_strerror (err));
+  else
+    err = check_hello (ctx, response, off);
 
   return err;
 }
@@ -195,50 +231,19 @@ assuan_socket_connect_fd (assuan_context_t ctx, assuan_fd_t fd,
 }
 
 
-/* Make a connection to the Unix domain socket NAME and return a new
- * Assuan context in CTX.  SERVER_PID is currently not used but may
- * become handy in the future.  Defined flag bits are:
- *
- *   ASSUAN_SOCKET_CONNECT_FDPASSING
- *      sendmsg and recvmsg are used.
- *
- * NAME must either start with a slash and optional with a drive
- * prefix ("c:") or use one of these URL schemata:
- *
- *    file://<fname>
- *
- *      This is the same as the default just with an explicit schemata.
- *
- *    assuan://<ipaddr>:<port>
- *    assuan://[<ip6addr>]:<port>
- *
- * Connect using TCP to PORT of the server with the numerical
- * IPADDR.  Note that '[' and ']' are literal characters.
- */
-gpg_error_t
-assuan_socket_connect (assuan_context_t ctx, const char *name,
-		       pid_t server_pid, unsigned int flags)
+/* Parse the socket NAME as described for assuan_socket_connect.  The
+ * address is stored at ADDR, its length at R_LEN and the protocol
+ * family at R_PF.  */
+static gpg_error_t
+parse_socket_name (assuan_context_t ctx, const char *name,
+                   union sockaddr_any *addr, size_t *r_len, int *r_pf)
 {
   gpg_error_t err = 0;
-  assuan_fd_t fd;
-#ifdef WITH_IPV6
-  struct sockaddr_in6 srvr_addr_in6;
-#endif
-  struct sockaddr_un srvr_addr_un;
-  struct sockaddr_in srvr_addr_in;
-  struct sockaddr *srvr_addr = NULL;
   uint16_t port = 0;
-  size_t len = 0;
   const char *s;
   int af = AF_LOCAL;
   int pf = PF_LOCAL;
 
-  TRACE2 (ctx, ASSUAN_LOG_CTX, "assuan_socket_connect", ctx,
-	  "name=%s, flags=0x%x", name ? name : "(null)", flags);
-
-  if (!ctx || !name)
-    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
-
   if (!strncmp (name, "file://", 7) && name[7])
     name += 7;
   else if (!strncmp (name, "assuan://", 9) && name[9])
@@ -263,12 +268,10 @@ assuan_socket_connect (assuan_context_t ctx, const char *name,
     {
       int redirected;
 
-      if (_assuan_sock_set_sockaddr_un (name, (struct sockaddr *)&srvr_addr_un,
-                                        &redirected))
+      if (_assuan_sock_set_sockaddr_un (name, &addr->sa, &redirected))
         return _assuan_error (ctx, gpg_err_code_from_syserror ());
 
-      len = SUN_LEN (&srvr_addr_un);
-      srvr_addr = (struct sockaddr *)&srvr_addr_un;
+      *r_len = SUN_LEN (&addr->un);
     }
   else
     {
@@ -293,14 +296,13 @@ assuan_socket_connect (assuan_context_t ctx, const char *name,
 #ifdef WITH_IPV6
               af = AF_INET6;
               pf = PF_INET6;
-              memset (&srvr_addr_in6, 0, sizeof srvr_addr_in6);
-              srvr_addr_in6.sin6_family = af;
-              srvr_addr_in6.sin6_port = htons (port);
+              memset (&addr->in6, 0, sizeof addr->in6);
+              addr->in6.sin6_family = af;
+              addr->in6.sin6_port = htons (port);
 #ifdef HAVE_INET_PTON
-              addrbuf = &srvr_addr_in6.sin6_addr;
+              addrbuf = &addr->in6.sin6_addr;
 #endif
-              srvr_addr = (struct sockaddr *)&srvr_addr_in6;
-              len = sizeof srvr_addr_in6;
+              *r_len = sizeof addr->in6;
 #else
               err =  _assuan_error (ctx, GPG_ERR_EAFNOSUPPORT);
 #endif
@@ -315,14 +317,13 @@ assuan_socket_connect (assuan_context_t ctx, const char *name,
           else
             {
               *p = 0;
-              memset (&srvr_addr_in, 0, sizeof srvr_addr_in);
-              srvr_addr_in.sin_family = af;
-              srvr_addr_in.sin_port = htons (port);
+              memset (&addr->in, 0, sizeof addr->in);
+              addr->in.sin_family = af;
+              addr->in.sin_port = htons (port);
 #ifdef HAVE_INET_PTON
-              addrbuf = &srvr_addr_in.sin_addr;
+              addrbuf = &addr->in.sin_addr;
 #endif
-              srvr_addr = (struct sockaddr *)&srvr_addr_in;
-              len = sizeof srvr_addr_in;
+              *r_len = sizeof addr->in;
             }
         }
 
@@ -340,8 +341,8 @@ assuan_socket_connect (assuan_context_t ctx, const char *name,
              support isn't enabled anyway and thus we can do fine
              without.  Note that Windows as a compatible inet_pton
              function named inetPton, but only since Vista.  */
-          srvr_addr_in.sin_addr.s_addr = inet_addr (addrstr);
-          if (srvr_addr_in.sin_addr.s_addr == INADDR_NONE)
+          addr->in.sin_addr.s_addr = inet_addr (addrstr);
+          if (addr->in.sin_addr.s_addr == INADDR_NONE)
             err = _assuan_error (ctx, GPG_ERR_BAD_URI);
 #endif /*!HAVE_INET_PTON*/
         }
@@ -351,6 +352,51 @@ assuan_socket_connect (assuan_context_t ctx, const char *name,
         return err;
     }
 
+  *r_pf = pf;
+  return 0;
+}
+
+
+/* Make a connection to the Unix domain socket NAME and return a new
+ * Assuan context in CTX.  SERVER_PID is currently not used but may
+ * become handy in the future.  Defined flag bits are:
+ *
+ *   ASSUAN_SOCKET_CONNECT_FDPASSING
+ *      sendmsg and recvmsg are used.
+ *
+ * NAME must either start with a slash and optional with a drive
+ * prefix ("c:") or use one of these URL schemata:
+ *
+ *    file://<fname>
+ *
+ *      This is the same as the default just with an explicit schemata.
+ *
+ *    assuan://<ipaddr>:<port>
+ *    assuan://[<ip6addr>]:<port>
+ *
+ * Connect using TCP to PORT of the server with the numerical
+ * IPADDR.  Note that '[' and ']' are literal characters.
+ */
+gpg_error_t
+assuan_socket_connect (assuan_context_t ctx, const char *name,
+		       pid_t server_pid, unsigned int flags)
+{
+  gpg_error_t err = 0;
+  assuan_fd_t fd;
+  union sockaddr_any srvr_addr;
+  size_t len = 0;
+  int pf = PF_LOCAL;
+
+  TRACE2 (ctx, ASSUAN_LOG_CTX, "assuan_socket_connect", ctx,
+	  "name=%s, flags=0x%x", name ? name : "(null)", flags);
+
+  if (!ctx || !name)
+    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
+
+  err = parse_socket_name (ctx, name, &srvr_addr, &len, &pf);
+  if (err)
+    return err;
+
   ctx->flags.is_socket = 1;
   fd = _assuan_sock_new (ctx, pf, SOCK_STREAM, 0);
   if (fd == ASSUAN_INVALID_FD)
@@ -361,7 +407,7 @@ assuan_socket_connect (assuan_context_t ctx, const char *name,
       return err;
     }
 
-  if (_assuan_sock_connect (ctx, fd, srvr_addr, len) == -1)
+  if (_assuan_sock_connect (ctx, fd, &srvr_addr.sa, len) == -1)
     {
       TRACE2 (ctx, ASSUAN_LOG_SYSIO, "assuan_socket_connect", ctx,
 	      "can't connect to `%s': %s\n", name, strerror (errno));
@@ -376,3 +422,303 @@ assuan_socket_connect (assuan_context_t ctx, const char *name,
 
   return err;
 }
+
+
+
+#ifndef HAVE_W32_SYSTEM
+/* The states of a connection made by assuan_socket_connect_multi.  */
+enum multi_state
+  {
+    MULTI_DONE,       /* Finished; see the error.  */
+    MULTI_RETRY,      /* The listen queue was full; try again.  */
+    MULTI_CONNECT,    /* Waiting for connect to complete.  */
+    MULTI_HELLO       /* Waiting for the greeting of the server.  */
+  };
+
+struct multi_target
+{
+  assuan_context_t ctx;
+  const char *name;
+  enum multi_state state;
+  gpg_error_t err;
+  assuan_fd_t fd;
+  union sockaddr_any addr;
+  size_t addrlen;
+  int pf;
+  int has_deadline;
+  unsigned long deadline;
+  int socks;  /* Connected via SOCKS after the others.  */
+};
+
+/* Time in milliseconds before a connection refused for a full listen
+   queue is tried again.  */
+#define MULTI_RETRY_DELAY 10
+
+
+/* Finish the connection attempt T with error ERR.  */
+static void
+multi_fail (struct multi_target *t, gpg_error_t err)
+{
+  TRACE2 (t->ctx, ASSUAN_LOG_SYSIO, "assuan_socket_connect_multi", t->ctx,
+          "can't connect to `%s': %s", t->name, gpg_strerror (err));
+  if (t->ctx->engine.release)
+    _assuan_reset (t->ctx);
+  else if (t->fd != ASSUAN_INVALID_FD)
+    _assuan_close (t->ctx, t->fd);
+  t->fd = ASSUAN_INVALID_FD;
+  t->err = err;
+  t->state = MULTI_DONE;
+}
+
+
+/* The socket of T is connected; prepare for reading the greeting.  */
+static void
+multi_connected (struct multi_target *t, unsigned int flags)
+{
+  connect_setup (t->ctx, t->fd, flags);
+  t->state = MULTI_HELLO;
+}
+
+
+/* Start a non-blocking connect for T.  */
+static void
+multi_start (struct multi_target *t, unsigned int flags)
+{
+  t->fd = _assuan_sock_new (t->ctx, t->pf, SOCK_STREAM, 0);
+  if (t->fd == ASSUAN_INVALID_FD)
+    {
+      multi_fail (t, _assuan_error (t->ctx, gpg_err_code_from_syserror ()));
+      return;
+    }
+  fcntl (t->fd, F_SETFL, fcntl (t->fd, F_GETFL) | O_NONBLOCK);
+
+  if (!_assuan_sock_connect (t->ctx, t->fd, &t->addr.sa, t->addrlen))
+    multi_connected (t, flags);
+  else if (errno == EINPROGRESS)
+    t->state = MULTI_CONNECT;
+  else if (errno == EAGAIN && t->pf == PF_LOCAL)
+    {
+      _assuan_close (t->ctx, t->fd);
+      t->fd = ASSUAN_INVALID_FD;
+      t->state = MULTI_RETRY;
+    }
+  else
+    multi_fail (t, _assuan_error (t->ctx, GPG_ERR_ASS_CONNECT_FAILED));
+}
+
+
+/* The socket of T is writable while connecting.  */
+static void
+multi_check_connect (struct multi_target *t, unsigned int flags)
+{
+  int soerr = 0;
+  socklen_t len = sizeof soerr;
+
+  if (getsockopt (t->fd, SOL_SOCKET, SO_ERROR, &soerr, &len) || soerr)
+    multi_fail (t, _assuan_error (t->ctx, GPG_ERR_ASS_CONNECT_FAILED));
+  else
+    multi_connected (t, flags);
+}
+
+
+/* The socket of T is readable while waiting for the greeting.  */
+static void
+multi_read_hello (struct multi_target *t)
+{
+  assuan_context_t ctx = t->ctx;
+  assuan_response_t response;
+  gpg_error_t err;
+  int off;
+
+  do
+    {
+      err = _assuan_read_line (ctx);
+      if (gpg_err_code (err) == GPG_ERR_EAGAIN)
+        return;
+      if (!err && !ctx->inbound.linelen)
+        response = ASSUAN_RESPONSE_COMMENT;
+      else if (!err)
+        err = assuan_client_parse_response (ctx, ctx->inbound.line,
+                                            ctx->inbound.linelen,
+                                            &response, &off);
+    }
+  while (!err && response == ASSUAN_RESPONSE_COMMENT);
+
+  if (!err)
+    err = check_hello (ctx, response, off);
+  if (err)
+    {
+      multi_fail (t, err);
+      return;
+    }
+
+  fcntl (t->fd, F_SETFL, fcntl (t->fd, F_GETFL) & ~O_NONBLOCK);
+  t->state = MULTI_DONE;
+  t->err = 0;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+/* Connect each of the N contexts CTXS to the socket with the
+ * respective name in NAMES as done by assuan_socket_connect with
+ * FLAGS.  The connections are made concurrently so that the time
+ * taken is that of the slowest server.  The result for each context
+ * is stored in the array R_ERRS; only the contexts with a result of
+ * 0 are connected.  The greeting of each server is subject to the
+ * ASSUAN_TRANSACT_TIMEOUT of its context.  Sockets reached through
+ * SOCKS are connected one after the other once the others are done,
+ * because the proxy handshake is blocking.  Returns an error only if
+ * the arguments are invalid or on memory shortage.  */
+gpg_error_t
+assuan_socket_connect_multi (assuan_context_t *ctxs, const char **names,
+                             unsigned int n, unsigned int flags,
+                             gpg_error_t *r_errs)
+{
+#ifdef HAVE_W32_SYSTEM
+  /* The local socket emulation needs blocking I/O to send the nonce;
+     thus we connect one after the other.  */
+  unsigned int i;
+
+  if (!ctxs || !names || !r_errs)
+    return _assuan_error (NULL, GPG_ERR_ASS_INV_VALUE);
+  for (i = 0; i < n; i++)
+    r_errs[i] = assuan_socket_connect (ctxs[i], names[i],
+                                       ASSUAN_INVALID_PID, flags);
+  return 0;
+#else /*!HAVE_W32_SYSTEM*/
+  assuan_context_t ctx;
+  struct multi_target *targets, *t;
+  struct pollfd *pfds;
+  unsigned int *pidx;
+  unsigned int i, npoll;
+  unsigned long now;
+  long left;
+  int timeout, res;
+
+  if (!ctxs || !names || !r_errs || !n)
+    return _assuan_error (NULL, GPG_ERR_ASS_INV_VALUE);
+  for (i = 0; i < n; i++)
+    if (!ctxs[i] || !names[i])
+      return _assuan_error (ctxs[i], GPG_ERR_ASS_INV_VALUE);
+  ctx = ctxs[0];
+
+  TRACE2 (ctx, ASSUAN_LOG_CTX, "assuan_socket_connect_multi", ctx,
+	  "n=%u, flags=0x%x", n, flags);
+
+  targets = _assuan_calloc (ctx, n, sizeof *targets);
+  if (!targets)
+    return _assuan_error (ctx, gpg_err_code_from_syserror ());
+  pfds = _assuan_calloc (ctx, n, sizeof *pfds);
+  pidx = pfds? _assuan_calloc (ctx, n, sizeof *pidx) : NULL;
+  if (!pidx)
+    {
+      gpg_error_t err = _assuan_error (ctx, gpg_err_code_from_syserror ());
+      _assuan_free (ctx, pfds);
+      _assuan_free (ctx, targets);
+      return err;
+    }
+
+  now = _assuan_get_msec ();
+  for (i = 0; i < n; i++)
+    {
+      t = targets + i;
+      t->ctx = ctxs[i];
+      t->name = names[i];
+      t->fd = ASSUAN_INVALID_FD;
+      if (t->ctx->deadline.timeout)
+        {
+          t->has_deadline = 1;
+          t->deadline = now + t->ctx->deadline.timeout;
+        }
+      t->err = parse_socket_name (t->ctx, names[i], &t->addr, &t->addrlen,
+                                  &t->pf);
+      if (t->err)
+        continue;
+      if (_assuan_sock_uses_socks (&t->addr.sa))
+        {
+          t->socks = 1;
+          continue;
+        }
+      t->ctx->flags.is_socket = 1;
+      multi_start (t, flags);
+    }
+
+  for (;;)
+    {
+      now = _assuan_get_msec ();
+      timeout = -1;
+      npoll = 0;
+      for (i = 0; i < n; i++)
+        {
+          t = targets + i;
+          if (t->state == MULTI_DONE)
+            continue;
+          if (t->has_deadline && (long)(t->deadline - now) <= 0)
+            {
+              multi_fail (t, _assuan_error (t->ctx, GPG_ERR_TIMEOUT));
+              continue;
+            }
+          if (t->state == MULTI_RETRY)
+            multi_start (t, flags);
+          if (t->state == MULTI_DONE)
+            continue;
+
+          if (t->state == MULTI_RETRY)
+            left = MULTI_RETRY_DELAY;
+          else
+            {
+              pfds[npoll].fd = t->fd;
+              pfds[npoll].events = t->state == MULTI_CONNECT? POLLOUT : POLLIN;
+              pfds[npoll].revents = 0;
+              pidx[npoll++] = i;
+              left = -1;
+            }
+          if (t->has_deadline
+              && (left < 0 || (long)(t->deadline - now) < left))
+            left = (long)(t->deadline - now);
+          if (left >= 0 && (timeout < 0 || left < timeout))
+            timeout = left > INT_MAX? INT_MAX : (int)left;
+        }
+      if (!npoll && timeout < 0)
+        break;
+
+      _assuan_pre_syscall ();
+      res = poll (pfds, npoll, timeout);
+      _assuan_post_syscall ();
+      if (res < 0 && errno != EINTR)
+        {
+          res = errno;
+          for (i = 0; i < n; i++)
+            if (targets[i].state != MULTI_DONE)
+              multi_fail (targets + i,
+                          _assuan_error (targets[i].ctx,
+                                         gpg_err_code_from_errno (res)));
+          break;
+        }
+
+      for (i = 0; res > 0 && i < npoll; i++)
+        {
+          if (!pfds[i].revents)
+            continue;
+          t = targets + pidx[i];
+          if (t->state == MULTI_CONNECT)
+            multi_check_connect (t, flags);
+          if (t->state == MULTI_HELLO)
+            multi_read_hello (t);
+        }
+    }
+
+  for (i = 0; i < n; i++)
+    if (targets[i].socks)
+      targets[i].err = assuan_socket_connect (targets[i].ctx, names[i],
+                                              ASSUAN_INVALID_PID, flags);
+
+  for (i = 0; i < n; i++)
+    r_errs[i] = targets[i].err;
+
+  _assuan_free (ctx, pidx);
+  _assuan_free (ctx, pfds);
+  _assuan_free (ctx, targets);
+  return 0;
+#endif /*!HAVE_W32_SYSTEM*/
+}
@@ -55,14 +55,17 @@
 #include "debug.h"
 #include "assuan-defs.h"
 
-static gpg_error_t
-accept_connection_bottom (assuan_context_t ctx)
+/* Store the credentials of the peer of the socket FD at CRED.
+   Returns true on success.  */
+int
+_assuan_fd_peercred (assuan_fd_t fd, struct _assuan_peercred *cred)
 {
-  assuan_fd_t fd = ctx->connected_fd;
+  int valid = 0;
 
-  TRACE (ctx, ASSUAN_LOG_SYSIO, "accept_connection_bottom", ctx);
+  (void)cred;
+  if (fd == ASSUAN_INVALID_FD)
+    return 0;
 
-  ctx->peercred_valid = 0;
 #ifdef SO_PEERCRED
   {
 #ifdef HAVE_STRUCT_SOCKPEERCRED_PID
@@ -74,19 +77,19 @@ accept_connection_bottom (assuan_context_t ctx)
 
     if (!getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cr, &cl))
       {
-        ctx->peercred_valid = 1;
-        ctx->peercred.pid = cr.pid;
-        ctx->peercred.uid = cr.uid;
-        ctx->peercred.gid = cr.gid;
+        valid = 1;
+        cred->pid = cr.pid;
+        cred->uid = cr.uid;
+        cred->gid = cr.gid;
       }
   }
 #elif defined (LOCAL_PEERPID)
   {                             /* macOS */
     socklen_t len = sizeof (pid_t);
 
-    if (!getsockopt (fd, SOL_LOCAL, LOCAL_PEERPID, &ctx->peercred.pid, &len))
+    if (!getsockopt (fd, SOL_LOCAL, LOCAL_PEERPID, &cred->pid, &len))
       {
-        ctx->peercred_valid = 1;
+        valid = 1;
 
 #if defined (LOCAL_PEERCRED)
         {
@@ -95,8 +98,8 @@ accept_connection_bottom (assuan_context_t ctx)
 
           if (!getsockopt (fd, SOL_LOCAL, LOCAL_PEERCRED, &cr, &len))
             {
-              ctx->peercred.uid = cr.cr_uid;
-              ctx->peercred.gid = cr.cr_gid;
+              cred->uid = cr.cr_uid;
+              cred->gid = cr.cr_gid;
             }
         }
 #endif
@@ -109,10 +112,10 @@ accept_connection_bottom (assuan_context_t ctx)
 
     if (getsockopt (fd, 0, LOCAL_PEEREID, &unp, &unpl) != -1)
       {
-        ctx->peercred_valid = 1;
-        ctx->peercred.pid = unp.unp_pid;
-        ctx->peercred.uid = unp.unp_euid;
-        ctx->peercred.gid = unp.unp_egid;
+        valid = 1;
+        cred->pid = unp.unp_pid;
+        cred->uid = unp.unp_euid;
+        cred->gid = unp.unp_egid;
       }
   }
 #elif defined (HAVE_GETPEERUCRED)
@@ -121,30 +124,67 @@ accept_connection_bottom (assuan_context_t ctx)
 
     if (getpeerucred (fd, &ucred) != -1)
       {
-        ctx->peercred_valid = 1;
-        ctx->peercred.pid = ucred_getpid (ucred);
-        ctx->peercred.uid = ucred_geteuid (ucred);
-        ctx->peercred.gid = ucred_getegid (ucred);
+        valid = 1;
+        cred->pid = ucred_getpid (ucred);
+        cred->uid = ucred_geteuid (ucred);
+        cred->gid = ucred_getegid (ucred);
 
         ucred_free (ucred);
       }
   }
 #elif defined(HAVE_GETPEEREID)
   {                             /* FreeBSD */
-    if (getpeereid (fd, &ctx->peercred.uid, &ctx->peercred.gid) != -1)
+    if (getpeereid (fd, &cred->uid, &cred->gid) != -1)
       {
-        ctx->peercred_valid = 1;
-        ctx->peercred.pid = ASSUAN_INVALID_PID;
+        valid = 1;
+        cred->pid = ASSUAN_INVALID_PID;
       }
   }
 #endif
 
+  return valid;
+}
+
+
+/* Set the credentials of the peer of the socket server CTX to CRED
+   or, if CRED is NULL, fetch them.  This is done on first use by
+   assuan_get_peercred and assuan_get_pid because most servers never
+   ask for them.  */
+void
+_assuan_socket_peercred (assuan_context_t ctx,
+                         const struct _assuan_peercred *cred)
+{
+  TRACE (ctx, ASSUAN_LOG_SYSIO, "_assuan_socket_peercred", ctx);
+
+  ctx->peercred_pending = 0;
+  if (cred)
+    {
+      ctx->peercred = *cred;
+      ctx->peercred_valid = 1;
+    }
+  else
+    ctx->peercred_valid = _assuan_fd_peercred (ctx->inbound.fd,
+                                               &ctx->peercred);
+
 #if !defined(HAVE_W32_SYSTEM)
   /* This overrides any already set PID if the function returns
      a valid one. */
   if (ctx->peercred_valid && ctx->peercred.pid != ASSUAN_INVALID_PID)
     ctx->pid = ctx->peercred.pid;
 #endif
+}
+
+
+static gpg_error_t
+accept_connection_bottom (assuan_context_t ctx)
+{
+  assuan_fd_t fd = ctx->connected_fd;
+
+  TRACE (ctx, ASSUAN_LOG_SYSIO, "accept_connection_bottom", ctx);
+
+  /* The credentials are fetched on first use.  */
+  ctx->peercred_valid = 0;
+  ctx->peercred_pending = 1;
 
   ctx->inbound.fd = fd;
   ctx->inbound.eof = 0;
@@ -212,6 +252,7 @@ assuan_init_socket_server (assuan_context_t ctx, assuan_fd_t fd,
   ctx->engine.readfnc = _assuan_simple_read;
   ctx->engine.writefnc = _assuan_simple_write;
   ctx->engine.sendfd = NULL;
+  ctx->engine.sendfds = NULL;
   ctx->engine.receivefd = NULL;
   ctx->flags.is_server = 1;
   if (flags & ASSUAN_SOCKET_SERVER_ACCEPTED)
@@ -1009,6 +1009,15 @@ use_socks (struct sockaddr *addr)
 }
 
 
+/* Return true if a connection to ADDR is made through the SOCKS
+   proxy.  Such connections can't be made in non-blocking mode.  */
+int
+_assuan_sock_uses_socks (struct sockaddr *addr)
+{
+  return use_socks (addr);
+}
+
+
 static assuan_fd_t
 _assuan_sock_accept (assuan_context_t ctx, assuan_fd_t sockfd,
                      struct sockaddr *addr, socklen_t *p_addrlen)
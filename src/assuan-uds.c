@@ -47,12 +47,22 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 #include <string.h>
 #include <assert.h>
 
 #include "assuan-defs.h"
 #include "debug.h"
 
+/* The number of received descriptors kept until they are taken if
+   ASSUAN_MAX_PENDING_FDS is not set.  */
+#define DEFAULT_MAX_PENDING_FDS 64
+
 #ifdef USE_DESCRIPTOR_PASSING
 /* Provide replacement for missing CMSG maccros.  We assume that
    size_t matches the alignment requirement.  NOTE: This is not true
@@ -73,6 +83,18 @@
 #ifndef CMSG_DATA
 #define CMSG_DATA(cmsg) ((unsigned char*)((struct cmsghdr*)(cmsg)+1))
 #endif
+
+/* The maximum number of descriptors sent in one message.  Linux
+   allows up to 253 (SCM_MAX_FD).  */
+#define MAX_FDS_PER_MSG 64
+
+/* Data may be passed in sealed memory files.  */
+#if defined(HAVE_MEMFD_CREATE) && defined(MFD_ALLOW_SEALING) \
+    && defined(F_ADD_SEALS)
+# define USE_DATA_MEMFD 1
+/* The seals which make the file safe to map for the receiver.  */
+# define DATA_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+#endif
 #endif /*USE_DESCRIPTOR_PASSING*/
 
 
@@ -92,9 +114,8 @@ uds_reader (assuan_context_t ctx, void *buf, size_t buflen)
 #ifdef USE_DESCRIPTOR_PASSING
       union {
         struct cmsghdr cm;
-        char control[CMSG_SPACE(sizeof (int))];
+        char control[CMSG_SPACE(MAX_FDS_PER_MSG * sizeof (int))];
       } control_u;
-      struct cmsghdr *cmptr;
 #endif /*USE_DESCRIPTOR_PASSING*/
 
       memset (&msg, 0, sizeof (msg));
@@ -117,30 +138,7 @@ uds_reader (assuan_context_t ctx, void *buf, size_t buflen)
 	return 0;
 
 #ifdef USE_DESCRIPTOR_PASSING
-      cmptr = CMSG_FIRSTHDR (&msg);
-      if (cmptr && cmptr->cmsg_len == CMSG_LEN (sizeof(int)))
-        {
-          if (cmptr->cmsg_level != SOL_SOCKET
-              || cmptr->cmsg_type != SCM_RIGHTS)
-            TRACE0 (ctx, ASSUAN_LOG_SYSIO, "uds_reader", ctx,
-		    "unexpected ancillary data received");
-          else
-            {
-              int fd;
-
-	      memcpy (&fd, CMSG_DATA (cmptr), sizeof (fd));
-
-              if (ctx->uds.pendingfdscount >= DIM (ctx->uds.pendingfds))
-                {
-		  TRACE1 (ctx, ASSUAN_LOG_SYSIO, "uds_reader", ctx,
-			  "too many descriptors pending - "
-			  "closing received descriptor %d", fd);
-                  _assuan_close (ctx, fd);
-                }
-              else
-                ctx->uds.pendingfds[ctx->uds.pendingfdscount++] = fd;
-            }
-	}
+      _assuan_uds_take_fds (ctx, &msg);
 #endif /*USE_DESCRIPTOR_PASSING*/
     }
 
@@ -154,6 +152,52 @@ uds_reader (assuan_context_t ctx, void *buf, size_t buflen)
 }
 
 
+/* Queue the descriptors received with the message MSG as pending
+   descriptors of CTX.  Descriptors beyond the limit are closed.  */
+void
+_assuan_uds_take_fds (assuan_context_t ctx, assuan_msghdr_t msg)
+{
+#ifdef USE_DESCRIPTOR_PASSING
+  struct cmsghdr *cmptr;
+  int fds[MAX_FDS_PER_MSG];
+  int i, nfds;
+
+  if ((msg->msg_flags & MSG_CTRUNC))
+    TRACE0 (ctx, ASSUAN_LOG_SYSIO, "uds_reader", ctx,
+            "ancillary data truncated - descriptors lost");
+  for (cmptr = CMSG_FIRSTHDR (msg); cmptr; cmptr = CMSG_NXTHDR (msg, cmptr))
+    {
+      if (cmptr->cmsg_level != SOL_SOCKET
+          || cmptr->cmsg_type != SCM_RIGHTS
+          || cmptr->cmsg_len < CMSG_LEN (sizeof (int)))
+        {
+          TRACE0 (ctx, ASSUAN_LOG_SYSIO, "uds_reader", ctx,
+                  "unexpected ancillary data received");
+          continue;
+        }
+
+      /* A message may carry several descriptors.  */
+      nfds = (cmptr->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+      if (nfds > MAX_FDS_PER_MSG)
+        nfds = MAX_FDS_PER_MSG;
+      memcpy (fds, CMSG_DATA (cmptr), nfds * sizeof (int));
+
+      for (i = 0; i < nfds; i++)
+        if (_assuan_uds_push_fd (ctx, fds[i]))
+          {
+            TRACE1 (ctx, ASSUAN_LOG_SYSIO, "uds_reader", ctx,
+                    "too many descriptors pending - "
+                    "closing received descriptor %d", fds[i]);
+            _assuan_close (ctx, fds[i]);
+          }
+    }
+#else
+  (void)ctx;
+  (void)msg;
+#endif
+}
+
+
 /* Write to the domain server.  */
 static ssize_t
 uds_writer (assuan_context_t ctx, const void *buf, size_t buflen)
@@ -186,15 +230,17 @@ uds_writer (assuan_context_t ctx, const void *buf, size_t buflen)
 }
 
 
+#ifdef USE_DESCRIPTOR_PASSING
+/* Send the NFDS descriptors FDS, at most MAX_FDS_PER_MSG, in one
+   message.  */
 static gpg_error_t
-uds_sendfd (assuan_context_t ctx, assuan_fd_t fd)
+send_fds (assuan_context_t ctx, const assuan_fd_t *fds, int nfds)
 {
-#ifdef USE_DESCRIPTOR_PASSING
   struct msghdr msg;
   struct iovec iovec;
   union {
     struct cmsghdr cm;
-    char control[CMSG_SPACE(sizeof (int))];
+    char control[CMSG_SPACE(MAX_FDS_PER_MSG * sizeof (int))];
   } control_u;
   struct cmsghdr *cmptr;
   int len;
@@ -202,7 +248,12 @@ uds_sendfd (assuan_context_t ctx, assuan_fd_t fd)
 
   /* We need to send some real data so that a read won't return 0
      which will be taken as an EOF.  It also helps with debugging. */
-  snprintf (buffer, sizeof(buffer)-1, "# descriptor %d is in flight\n", fd);
+  if (nfds == 1)
+    snprintf (buffer, sizeof(buffer)-1,
+              "# descriptor %d is in flight\n", fds[0]);
+  else
+    snprintf (buffer, sizeof(buffer)-1,
+              "# descriptors %d to %d are in flight\n", fds[0], fds[nfds-1]);
   buffer[sizeof(buffer)-1] = 0;
 
   memset (&msg, 0, sizeof (msg));
@@ -217,13 +268,13 @@ uds_sendfd (assuan_context_t ctx, assuan_fd_t fd)
   iovec.iov_len = strlen (buffer);
 
   msg.msg_control = control_u.control;
-  msg.msg_controllen = sizeof (control_u.control);
+  msg.msg_controllen = CMSG_SPACE (nfds * sizeof (int));
   cmptr = CMSG_FIRSTHDR (&msg);
-  cmptr->cmsg_len = CMSG_LEN(sizeof(int));
+  cmptr->cmsg_len = CMSG_LEN (nfds * sizeof (int));
   cmptr->cmsg_level = SOL_SOCKET;
   cmptr->cmsg_type = SCM_RIGHTS;
 
-  memcpy (CMSG_DATA (cmptr), &fd, sizeof (fd));
+  memcpy (CMSG_DATA (cmptr), fds, nfds * sizeof (int));
 
   len = _assuan_sendmsg (ctx, ctx->outbound.fd, &msg, 0);
   if (len < 0)
@@ -234,32 +285,57 @@ uds_sendfd (assuan_context_t ctx, assuan_fd_t fd)
       errno = saved_errno;
       return _assuan_error (ctx, gpg_err_code_from_syserror ());
     }
-  else
-    return 0;
+
+  /* Tell a peer reading from shared memory to fetch the descriptors
+     before the next line.  */
+  if (ctx->shm)
+    _assuan_shm_sent_fds (ctx, len);
+  return 0;
+}
+#endif /*USE_DESCRIPTOR_PASSING*/
+
+
+static gpg_error_t
+uds_sendfd (assuan_context_t ctx, assuan_fd_t fd)
+{
+#ifdef USE_DESCRIPTOR_PASSING
+  return send_fds (ctx, &fd, 1);
 #else
   return _assuan_error (ctx, GPG_ERR_NOT_IMPLEMENTED);
 #endif
 }
 
 
+/* Send the NFDS descriptors FDS with as few messages as possible.  */
 static gpg_error_t
-uds_receivefd (assuan_context_t ctx, assuan_fd_t *fd)
+uds_sendfds (assuan_context_t ctx, const assuan_fd_t *fds, int nfds)
 {
 #ifdef USE_DESCRIPTOR_PASSING
-  int i;
+  gpg_error_t err = 0;
+  int n;
 
-  if (!ctx->uds.pendingfdscount)
+  for (; !err && nfds > 0; fds += n, nfds -= n)
+    {
+      n = nfds < MAX_FDS_PER_MSG? nfds : MAX_FDS_PER_MSG;
+      err = send_fds (ctx, fds, n);
+    }
+  return err;
+#else
+  return _assuan_error (ctx, GPG_ERR_NOT_IMPLEMENTED);
+#endif
+}
+
+
+static gpg_error_t
+uds_receivefd (assuan_context_t ctx, assuan_fd_t *fd)
+{
+#ifdef USE_DESCRIPTOR_PASSING
+  if (_assuan_uds_pop_fd (ctx, fd))
     {
       TRACE0 (ctx, ASSUAN_LOG_SYSIO, "uds_receivefd", ctx,
 	      "no pending file descriptors");
       return _assuan_error (ctx, GPG_ERR_ASS_GENERAL);
     }
-  assert (ctx->uds.pendingfdscount <= DIM(ctx->uds.pendingfds));
-
-  *fd = ctx->uds.pendingfds[0];
-  for (i=1; i < ctx->uds.pendingfdscount; i++)
-    ctx->uds.pendingfds[i-1] = ctx->uds.pendingfds[i];
-  ctx->uds.pendingfdscount--;
 
   return 0;
 #else
@@ -268,15 +344,73 @@ uds_receivefd (assuan_context_t ctx, assuan_fd_t *fd)
 }
 
 
+/* Append the received descriptor FD to the queue of pending
+   descriptors, growing it as needed.  If the limit set with
+   ASSUAN_MAX_PENDING_FDS has been reached or memory is short, an
+   error is returned and FD is still owned by the caller.  */
+gpg_error_t
+_assuan_uds_push_fd (assuan_context_t ctx, assuan_fd_t fd)
+{
+  int max = ctx->uds.maxpending? ctx->uds.maxpending
+                                : DEFAULT_MAX_PENDING_FDS;
+  unsigned int size, head, n;
+  assuan_fd_t *fds;
+
+  if (ctx->uds.pendingfdscount >= max)
+    return _assuan_error (ctx, GPG_ERR_TOO_MANY);
+
+  size = ctx->uds.pendingsize;
+  if (ctx->uds.pendingfdscount == size)
+    {
+      /* Unwrap the ring into a buffer of twice the size.  */
+      fds = _assuan_malloc (ctx, (size? 2 * size : 8) * sizeof *fds);
+      if (!fds)
+        return _assuan_error (ctx, gpg_err_code_from_syserror ());
+      head = ctx->uds.pendinghead;
+      n = size - head;
+      if (size)
+        {
+          memcpy (fds, ctx->uds.pendingfds + head, n * sizeof *fds);
+          memcpy (fds + n, ctx->uds.pendingfds, head * sizeof *fds);
+        }
+      _assuan_free (ctx, ctx->uds.pendingfds);
+      ctx->uds.pendingfds = fds;
+      ctx->uds.pendingsize = size = size? 2 * size : 8;
+      ctx->uds.pendinghead = 0;
+    }
+
+  ctx->uds.pendingfds[(ctx->uds.pendinghead + ctx->uds.pendingfdscount)
+                      & (size - 1)] = fd;
+  ctx->uds.pendingfdscount++;
+  return 0;
+}
+
+
+/* Take the oldest pending descriptor and store it at R_FD.  Returns
+   -1 if there is none.  */
+int
+_assuan_uds_pop_fd (assuan_context_t ctx, assuan_fd_t *r_fd)
+{
+  if (!ctx->uds.pendingfdscount)
+    return -1;
+
+  *r_fd = ctx->uds.pendingfds[ctx->uds.pendinghead];
+  ctx->uds.pendinghead = ((ctx->uds.pendinghead + 1)
+                          & (ctx->uds.pendingsize - 1));
+  ctx->uds.pendingfdscount--;
+  return 0;
+}
+
+
 /* Close all pending fds. */
 void
 _assuan_uds_close_fds (assuan_context_t ctx)
 {
-  int i;
+  assuan_fd_t fd;
 
-  for (i = 0; i < ctx->uds.pendingfdscount; i++)
-    _assuan_close (ctx, ctx->uds.pendingfds[i]);
-  ctx->uds.pendingfdscount = 0;
+  while (!_assuan_uds_pop_fd (ctx, &fd))
+    _assuan_close (ctx, fd);
+  ctx->uds.pendinghead = 0;
 }
 
 /* Deinitialize the unix domain socket I/O functions.  */
@@ -284,6 +418,193 @@ void
 _assuan_uds_deinit (assuan_context_t ctx)
 {
   _assuan_uds_close_fds (ctx);
+  _assuan_free (ctx, ctx->uds.pendingfds);
+  ctx->uds.pendingfds = NULL;
+  ctx->uds.pendingsize = 0;
+}
+
+
+/* Send LENGTH bytes of BUFFER in a sealed memory file followed by a
+   "DFD <length>" line instead of as data lines.  Returns
+   GPG_ERR_NOT_SUPPORTED if the caller shall send data lines
+   instead; the peer may not have agreed to DFD lines, output may be
+   pending or the socket may not accept the descriptor right now.  */
+gpg_error_t
+_assuan_uds_send_data (assuan_context_t ctx, const void *buffer,
+                       size_t length)
+{
+#ifdef USE_DATA_MEMFD
+  gpg_error_t err;
+  const char *p = buffer;
+  size_t n;
+  ssize_t nwritten;
+  int fd;
+  char line[40];
+
+  if (!ctx->uds.peer_memfd || ctx->engine.sendfd != uds_sendfd)
+    return GPG_ERR_NOT_SUPPORTED;
+
+  /* The descriptor is sent directly on the socket and thus must not
+     overtake queued output.  */
+  if (ctx->outbound.pending.length && _assuan_flush_pending (ctx))
+    return GPG_ERR_NOT_SUPPORTED;
+
+  fd = memfd_create ("assuan-data", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    return GPG_ERR_NOT_SUPPORTED;
+  for (n = 0; n < length; n += nwritten)
+    {
+      nwritten = write (fd, p + n, length - n);
+      if (nwritten < 0 && errno == EINTR)
+        nwritten = 0;
+      else if (nwritten <= 0)
+        break;
+    }
+  if (n < length || fcntl (fd, F_ADD_SEALS, DATA_SEALS))
+    {
+      close (fd);
+      return GPG_ERR_NOT_SUPPORTED;
+    }
+
+  err = send_fds (ctx, &fd, 1);
+  close (fd);
+  if (err)
+    return GPG_ERR_NOT_SUPPORTED;
+
+  snprintf (line, sizeof line, "DFD %lu", (unsigned long)length);
+  return assuan_write_line (ctx, line);
+#else
+  (void)ctx;
+  (void)buffer;
+  (void)length;
+  return GPG_ERR_NOT_SUPPORTED;
+#endif
+}
+
+
+/* Take the descriptor announced by a "DFD" line with the arguments
+   ARGS and map the data read-only.  On success the data and its
+   length are stored at R_DATA and R_LENGTH; they need to be released
+   with _assuan_uds_unmap_data.  */
+gpg_error_t
+_assuan_uds_map_data (assuan_context_t ctx, const char *args,
+                      void **r_data, size_t *r_length)
+{
+#ifdef USE_DATA_MEMFD
+  unsigned long length;
+  struct stat st;
+  assuan_fd_t fd;
+  char *endp;
+  void *data;
+  int seals;
+
+  *r_data = NULL;
+  *r_length = 0;
+
+  length = strtoul (args, &endp, 10);
+  if (!length || endp == args || (*endp && *endp != ' '))
+    return _assuan_error (ctx, GPG_ERR_ASS_INV_RESPONSE);
+  if (_assuan_uds_pop_fd (ctx, &fd))
+    {
+      TRACE0 (ctx, ASSUAN_LOG_SYSIO, "uds_map_data", ctx,
+	      "no pending file descriptors");
+      return _assuan_error (ctx, GPG_ERR_ASS_GENERAL);
+    }
+
+  /* Without the seals the sender could change or shrink the file
+     while it is mapped.  */
+  seals = fcntl (fd, F_GET_SEALS);
+  if (seals == -1 || (seals & DATA_SEALS) != DATA_SEALS
+      || fstat (fd, &st) || st.st_size < 0
+      || (unsigned long)st.st_size < length)
+    {
+      TRACE1 (ctx, ASSUAN_LOG_SYSIO, "uds_map_data", ctx,
+	      "descriptor %d is not a sealed data file", fd);
+      _assuan_close (ctx, fd);
+      return _assuan_error (ctx, GPG_ERR_ASS_INV_RESPONSE);
+    }
+
+  data = mmap (NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  _assuan_close (ctx, fd);
+  if (data == MAP_FAILED)
+    return _assuan_error (ctx, gpg_err_code_from_syserror ());
+
+  *r_data = data;
+  *r_length = length;
+  return 0;
+#else
+  (void)args;
+  *r_data = NULL;
+  *r_length = 0;
+  return _assuan_error (ctx, GPG_ERR_NOT_SUPPORTED);
+#endif
+}
+
+
+/* Release the data mapped by _assuan_uds_map_data.  */
+void
+_assuan_uds_unmap_data (assuan_context_t ctx, void *data, size_t length)
+{
+  (void)ctx;
+#ifdef USE_DATA_MEMFD
+  if (data)
+    munmap (data, length);
+#else
+  (void)data;
+  (void)length;
+#endif
+}
+
+
+#ifdef USE_DATA_MEMFD
+static gpg_error_t
+offer_status_cb (void *opaque, const char *line)
+{
+  assuan_context_t ctx = opaque;
+
+  if (!strcmp (line, "DATA_MEMFD"))
+    ctx->uds.peer_memfd = 1;
+  return 0;
+}
+#endif
+
+
+/* Tell the server of the client connection CTX with "OPTION
+   data-memfd" that the client takes DFD lines.  A server which has
+   set ASSUAN_DATA_MEMFD as well answers with a DATA_MEMFD status
+   line; only then does the client send DFD lines.  Older servers
+   don't know the option and may even accept it silently.  This is
+   done once, by the first transaction after ASSUAN_DATA_MEMFD has
+   been set; errors are ignored and mean that data lines are used.  */
+void
+_assuan_uds_offer_memfd (assuan_context_t ctx)
+{
+  ctx->uds.memfd_offered = 1;
+#ifdef USE_DATA_MEMFD
+  if (ctx->engine.sendfd != uds_sendfd)
+    return;
+  assuan_transact (ctx, "OPTION data-memfd", NULL, NULL, NULL, NULL,
+                   offer_status_cb, ctx);
+#endif
+}
+
+
+/* The handler of "OPTION data-memfd" for the server context CTX.  The
+   client takes DFD lines from now on.  If the server has set
+   ASSUAN_DATA_MEMFD, it tells the client that it takes them too.  */
+gpg_error_t
+_assuan_uds_memfd_option (assuan_context_t ctx)
+{
+#ifdef USE_DATA_MEMFD
+  if (ctx->engine.sendfd != uds_sendfd)
+    return set_error (ctx, GPG_ERR_NOT_SUPPORTED, NULL);
+  ctx->uds.peer_memfd = 1;
+  if (ctx->uds.data_memfd)
+    return assuan_write_status (ctx, "DATA_MEMFD", NULL);
+  return 0;
+#else
+  return set_error (ctx, GPG_ERR_NOT_SUPPORTED, NULL);
+#endif
 }
 
 
@@ -294,8 +615,10 @@ _assuan_init_uds_io (assuan_context_t ctx)
   ctx->engine.readfnc = uds_reader;
   ctx->engine.writefnc = uds_writer;
   ctx->engine.sendfd = uds_sendfd;
+  ctx->engine.sendfds = uds_sendfds;
   ctx->engine.receivefd = uds_receivefd;
 
   ctx->uds.pendingfdscount = 0;
+  ctx->uds.pendinghead = 0;
 }
 
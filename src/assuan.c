@@ -228,10 +228,23 @@ assuan_release (assuan_context_t ctx)
   TRACE (ctx, ASSUAN_LOG_CTX, "assuan_release", ctx);
 
   _assuan_reset (ctx);
-  /* None of the members that are our responsibility requires
-     deallocation.  To avoid sensitive data in the line buffers we
-     wipe them out, though.  Note that we can't wipe the entire
-     context because it also has a pointer to the actual free().  */
+  _assuan_free (ctx, ctx->pool.name);
+  _assuan_release_status_handlers (ctx);
+  if (ctx->transact.chunk.buffer)
+    {
+      wipememory (ctx->transact.chunk.buffer, ctx->transact.chunk.size);
+      _assuan_free (ctx, ctx->transact.chunk.buffer);
+    }
+  if (ctx->outbound.pending.buffer)
+    {
+      wipememory (ctx->outbound.pending.buffer, ctx->outbound.pending.size);
+      _assuan_free (ctx, ctx->outbound.pending.buffer);
+    }
+  /* Except for the above none of the members that are our
+     responsibility requires deallocation.  To avoid sensitive data in
+     the line buffers we wipe them out, though.  Note that we can't
+     wipe the entire context because it also has a pointer to the
+     actual free().  */
   wipememory (&ctx->inbound, sizeof ctx->inbound);
   wipememory (&ctx->outbound, sizeof ctx->outbound);
   _assuan_free (ctx, ctx);
@@ -24,6 +24,7 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "assuan-defs.h"
 #include "debug.h"
@@ -55,6 +56,9 @@ _assuan_client_finish (assuan_context_t ctx)
       ctx->server_proc = -1;
     }
 
+  ctx->deadline.transact_set = 0;
+  ctx->deadline.expired = 0;
+  _assuan_shm_release (ctx);
   _assuan_uds_deinit (ctx);
 }
 
@@ -68,7 +72,60 @@ _assuan_client_release (assuan_context_t ctx)
   _assuan_client_finish (ctx);
 }
 
+
+/* Undo the settings made by the user of the connected client context
+   CTX so that it can be handed to another user like a new one.  */
+void
+_assuan_client_reset (assuan_context_t ctx)
+{
+  ctx->user_pointer = NULL;
+  ctx->flags.confidential = 0;
+  ctx->flags.convey_comments = 0;
+  ctx->flags.no_logging = 0;
+  ctx->flags.async_inquire = 0;
+  ctx->transact.chunksize = 0;
+  ctx->deadline.timeout = 0;
+  ctx->deadline.user_set = 0;
+  ctx->deadline.transact_set = 0;
+  ctx->uds.maxpending = 0;
+  ctx->uds.data_memfd = 0;
+  ctx->io_monitor = NULL;
+  ctx->io_monitor_data = NULL;
+  _assuan_uds_close_fds (ctx);
+  _assuan_release_status_handlers (ctx);
+}
+
 
+/* For data lines, we deescape the inbound line immediately.  The
+   user will never have to worry about it.  */
+static void
+deescape_line (assuan_context_t ctx)
+{
+  char *line = ctx->inbound.line;
+  int linelen = ctx->inbound.linelen;
+
+  if (linelen >= 1 && line[0] == 'D' && line[1] == ' ')
+    {
+      char *s, *d;
+      for (s=d=line; linelen; linelen--)
+	{
+	  if (*s == '%' && linelen > 2)
+	    { /* handle escaping */
+	      s++;
+	      *d++ = xtoi_2 (s);
+	      s += 2;
+	      linelen -= 2;
+	    }
+	  else
+	    *d++ = *s++;
+	}
+      *d = 0; /* add a hidden string terminator */
+
+      ctx->inbound.linelen = d - line;
+    }
+}
+
+
 /* This function also does deescaping for data lines.  */
 gpg_error_t
 assuan_client_read_response (assuan_context_t ctx,
@@ -95,106 +152,137 @@ assuan_client_read_response (assuan_context_t ctx,
     }
   while (!linelen);
 
-  /* For data lines, we deescape immediately.  The user will never
-     have to worry about it.  */
-  if (linelen >= 1 && line[0] == 'D' && line[1] == ' ')
-    {
-      char *s, *d;
-      for (s=d=line; linelen; linelen--)
-	{
-	  if (*s == '%' && linelen > 2)
-	    { /* handle escaping */
-	      s++;
-	      *d++ = xtoi_2 (s);
-	      s += 2;
-	      linelen -= 2;
-	    }
-	  else
-	    *d++ = *s++;
-	}
-      *d = 0; /* add a hidden string terminator */
-
-      linelen = d - line;
-      ctx->inbound.linelen = linelen;
-    }
+  deescape_line (ctx);
 
   *line_r = line;
-  *linelen_r = linelen;
+  *linelen_r = ctx->inbound.linelen;
 
   return 0;
 }
 
 
-gpg_error_t
-assuan_client_parse_response (assuan_context_t ctx, char *line, int linelen,
-			      assuan_response_t *response, int *off)
+/* The response keywords.  FIRST_BYTE_INDEX maps the first letter of
+   a line to the first keyword starting with that letter; NEXT links
+   to the next keyword with the same first letter.  */
+static const struct
+{
+  char name[8];
+  unsigned char len;
+  unsigned char type;        /* An ASSUAN_RESPONSE_ value.  */
+  unsigned char term;        /* What may follow the keyword: 0 for
+                                anything, 1 for a space or the end of
+                                the line, 2 for exactly one space.  */
+  unsigned char skip_spaces; /* Skip spaces after the keyword.  */
+  unsigned char next;
+} response_keywords[] =
+  {
+    { "",        0, 0, 0, 0, 0 }, /* Index 0 terminates the lists.  */
+    { "D",       1, ASSUAN_RESPONSE_DATA,    2, 0, 8 },
+    { "S",       1, ASSUAN_RESPONSE_STATUS,  1, 1, 0 },
+    { "OK",      2, ASSUAN_RESPONSE_OK,      1, 1, 0 },
+    { "ERR",     3, ASSUAN_RESPONSE_ERROR,   1, 1, 5 },
+    { "END",     3, ASSUAN_RESPONSE_END,     1, 0, 0 },
+    { "INQUIRE", 7, ASSUAN_RESPONSE_INQUIRE, 1, 1, 0 },
+    { "#",       1, ASSUAN_RESPONSE_COMMENT, 0, 0, 0 },
+    { "DFD",     3, ASSUAN_RESPONSE_DATA_FD, 2, 0, 0 }
+  };
+
+static const unsigned char first_byte_index[256] =
+  {
+    ['D'] = 1, ['S'] = 2, ['O'] = 3, ['E'] = 4, ['I'] = 6, ['#'] = 7
+  };
+
+
+/* Classify the response line LINE of length LINELEN and store the
+   result at R.  Returns 0 or GPG_ERR_ASS_INV_RESPONSE.  The line is
+   scanned only once; the keyword and arguments of status and inquire
+   lines and the error code of error lines are stored at R so that
+   the callers need not parse the line again.  */
+static gpg_error_t
+classify_response (assuan_context_t ctx, const char *line, int linelen,
+                   struct parsed_response_s *r)
 {
-  *response = ASSUAN_RESPONSE_ERROR;
-  *off = 0;
+  int idx, len, n;
 
-  if (linelen >= 1
-      && line[0] == 'D' && line[1] == ' ')
-    {
-      *response = ASSUAN_RESPONSE_DATA; /* data line */
-      *off = 2;
-    }
-  else if (linelen >= 1
-           && line[0] == 'S'
-           && (line[1] == '\0' || line[1] == ' '))
+  /* Note that the line is always terminated by a nul so that looking
+     at LINE[LEN] is fine if LEN <= LINELEN.  */
+  for (idx = linelen > 0? first_byte_index[(unsigned char)*line] : 0;
+       idx; idx = response_keywords[idx].next)
     {
-      *response = ASSUAN_RESPONSE_STATUS;
-      *off = 1;
-      while (line[*off] == ' ')
-        ++*off;
+      len = response_keywords[idx].len;
+      if (len > linelen)
+        continue;
+      for (n = 1; n < len && line[n] == response_keywords[idx].name[n]; n++)
+        ;
+      if (n < len)
+        continue;
+      if (response_keywords[idx].term == 1
+          && line[len] != ' ' && line[len] != '\0')
+        continue;
+      if (response_keywords[idx].term == 2 && line[len] != ' ')
+        continue;
+      break;
     }
-  else if (linelen >= 2
-           && line[0] == 'O' && line[1] == 'K'
-           && (line[2] == '\0' || line[2] == ' '))
+  if (!idx)
     {
-      *response = ASSUAN_RESPONSE_OK;
-      *off = 2;
-      while (line[*off] == ' ')
-        ++*off;
+      r->type = ASSUAN_RESPONSE_ERROR;
+      r->off = 0;
+      r->err = 0;
+      return _assuan_error (ctx, GPG_ERR_ASS_INV_RESPONSE);
     }
-  else if (linelen >= 3
-           && line[0] == 'E' && line[1] == 'R' && line[2] == 'R'
-           && (line[3] == '\0' || line[3] == ' '))
-    {
-      *response = ASSUAN_RESPONSE_ERROR;
-      *off = 3;
-      while (line[*off] == ' ')
-        ++*off;
-    }
-  else if (linelen >= 7
-           && line[0] == 'I' && line[1] == 'N' && line[2] == 'Q'
-           && line[3] == 'U' && line[4] == 'I' && line[5] == 'R'
-           && line[6] == 'E'
-           && (line[7] == '\0' || line[7] == ' '))
-    {
-      *response = ASSUAN_RESPONSE_INQUIRE;
-      *off = 7;
-      while (line[*off] == ' ')
-        ++*off;
-    }
-  else if (linelen >= 3
-           && line[0] == 'E' && line[1] == 'N' && line[2] == 'D'
-           && (line[3] == '\0' || line[3] == ' '))
-    {
-      *response = ASSUAN_RESPONSE_END;
-      *off = 3;
-    }
-  else if (linelen >= 1 && line[0] == '#')
+
+  r->type = response_keywords[idx].type;
+  n = len;
+  if (response_keywords[idx].term == 2)
+    n++;  /* Skip the one space.  */
+  else if (response_keywords[idx].skip_spaces)
+    while (line[n] == ' ')
+      n++;
+  r->off = n;
+
+  switch (r->type)
     {
-      *response = ASSUAN_RESPONSE_COMMENT;
-      *off = 1;
+    case ASSUAN_RESPONSE_STATUS:
+    case ASSUAN_RESPONSE_INQUIRE:
+      {
+        const char *s;
+
+        s = n < linelen? memchr (line + n, ' ', linelen - n) : NULL;
+        r->kwoff = n;
+        n = s? s - line : linelen;
+        r->kwlen = n - r->kwoff;
+      }
+      while (n < linelen && line[n] == ' ')
+        n++;
+      r->argoff = n;
+      break;
+
+    case ASSUAN_RESPONSE_ERROR:
+      for (r->err = 0; n < linelen && line[n] >= '0' && line[n] <= '9'; n++)
+        r->err = r->err * 10 + (line[n] - '0');
+      break;
+
+    default:
+      break;
     }
-  else
-    return _assuan_error (ctx, GPG_ERR_ASS_INV_RESPONSE);
 
   return 0;
 }
 
 
+gpg_error_t
+assuan_client_parse_response (assuan_context_t ctx, char *line, int linelen,
+			      assuan_response_t *response, int *off)
+{
+  gpg_error_t rc;
+
+  rc = classify_response (ctx, line, linelen, &ctx->inbound.parsed);
+  *response = ctx->inbound.parsed.type;
+  *off = ctx->inbound.parsed.off;
+  return rc;
+}
+
+
 gpg_error_t
 _assuan_read_from_server (assuan_context_t ctx, assuan_response_t *response,
 			  int *off, int convey_comments)
@@ -217,133 +305,704 @@ _assuan_read_from_server (assuan_context_t ctx, assuan_response_t *response,
 }
 
 
-/**
- * assuan_transact:
- * @ctx: The Assuan context
- * @command: Command line to be send to the server
- * @data_cb: Callback function for data lines
- * @data_cb_arg: first argument passed to @data_cb
- * @inquire_cb: Callback function for a inquire response
- * @inquire_cb_arg: first argument passed to @inquire_cb
- * @status_cb: Callback function for a status response
- * @status_cb_arg: first argument passed to @status_cb
- *
- * FIXME: Write documentation
- *
- * Return value: 0 on success or an error code.  The error code may be
- * the one one returned by the server via error lines or from the
- * callback functions.  Take care:  If a callback returns an error
- * this function returns immediately with this error.
- **/
+/* Return the hash value for the status keyword KEYWORD of length
+   LEN.  */
+static unsigned int
+hash_keyword (const char *keyword, size_t len)
+{
+  unsigned int hash = 2166136261U;  /* FNV-1a.  */
+
+  while (len--)
+    {
+      hash ^= *(const unsigned char *)keyword++;
+      hash *= 16777619U;
+    }
+  return hash;
+}
+
+
+/* Return the slot for the status keyword KEYWORD of length LEN.  If
+   the keyword is not in the table, the empty slot where it would be
+   inserted is returned.  Returns NULL if there is no table.  */
+static struct status_handler_s *
+lookup_status_slot (assuan_context_t ctx, const char *keyword, size_t len,
+                    unsigned int hash)
+{
+  struct status_handler_s *entry;
+  size_t mask = ctx->status_handlers.size - 1;
+  size_t idx;
+
+  if (!ctx->status_handlers.size)
+    return NULL;
+
+  for (idx = hash & mask; ; idx = (idx + 1) & mask)
+    {
+      entry = ctx->status_handlers.table + idx;
+      if (!entry->keyword)
+        return entry;
+      if (entry->hash == hash && !strncmp (entry->keyword, keyword, len)
+          && !entry->keyword[len])
+        return entry;
+    }
+}
+
+
+/* Return the registered entry for the status keyword KEYWORD of
+   length LEN or NULL.  */
+static struct status_handler_s *
+find_status_handler (assuan_context_t ctx, const char *keyword, size_t len)
+{
+  struct status_handler_s *entry;
+
+  if (!ctx->status_handlers.used)
+    return NULL;
+  entry = lookup_status_slot (ctx, keyword, len, hash_keyword (keyword, len));
+  return entry && entry->keyword? entry : NULL;
+}
+
+
+/* Register HANDLER for status lines with KEYWORD.  During
+   assuan_transact, such status lines are passed to HANDLER along with
+   OPAQUE instead of to the status callback.  A HANDLER of NULL
+   removes the registration.  */
 gpg_error_t
-assuan_transact (assuan_context_t ctx,
-                 const char *command,
-                 gpg_error_t (*data_cb)(void *, const void *, size_t),
-                 void *data_cb_arg,
-                 gpg_error_t (*inquire_cb)(void*, const char *),
-                 void *inquire_cb_arg,
-                 gpg_error_t (*status_cb)(void*, const char *),
-                 void *status_cb_arg)
+assuan_register_status_handler (assuan_context_t ctx, const char *keyword,
+                                assuan_status_handler_t handler,
+                                void *opaque)
+{
+  struct status_handler_s *entry;
+  size_t len;
+  unsigned int hash;
+
+  if (!ctx || !keyword || !*keyword || strchr (keyword, ' '))
+    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
+
+  len = strlen (keyword);
+  hash = hash_keyword (keyword, len);
+  entry = lookup_status_slot (ctx, keyword, len, hash);
+  if (entry && entry->keyword)
+    {
+      entry->handler = handler;
+      entry->opaque = opaque;
+      return 0;
+    }
+  if (!handler)
+    return 0;
+
+  /* Keep the load factor below 3/4.  */
+  if ((ctx->status_handlers.used + 1) * 4 > ctx->status_handlers.size * 3)
+    {
+      struct status_handler_s *oldtable = ctx->status_handlers.table;
+      size_t oldsize = ctx->status_handlers.size;
+      size_t newsize = oldsize? oldsize * 2 : 16;
+      size_t i;
+
+      ctx->status_handlers.table = _assuan_calloc (ctx, newsize,
+                                                   sizeof *oldtable);
+      if (!ctx->status_handlers.table)
+        {
+          ctx->status_handlers.table = oldtable;
+          return _assuan_error (ctx, gpg_err_code_from_syserror ());
+        }
+      ctx->status_handlers.size = newsize;
+      for (i = 0; i < oldsize; i++)
+        if (oldtable[i].keyword)
+          {
+            entry = lookup_status_slot (ctx, oldtable[i].keyword,
+                                        strlen (oldtable[i].keyword),
+                                        oldtable[i].hash);
+            *entry = oldtable[i];
+          }
+      _assuan_free (ctx, oldtable);
+      entry = lookup_status_slot (ctx, keyword, len, hash);
+    }
+
+  entry->keyword = _assuan_malloc (ctx, len + 1);
+  if (!entry->keyword)
+    return _assuan_error (ctx, gpg_err_code_from_syserror ());
+  strcpy (entry->keyword, keyword);
+  entry->hash = hash;
+  entry->handler = handler;
+  entry->opaque = opaque;
+  ctx->status_handlers.used++;
+  return 0;
+}
+
+
+/* Release the table of status handlers.  */
+void
+_assuan_release_status_handlers (assuan_context_t ctx)
+{
+  size_t i;
+
+  for (i = 0; i < ctx->status_handlers.size; i++)
+    _assuan_free (ctx, ctx->status_handlers.table[i].keyword);
+  _assuan_free (ctx, ctx->status_handlers.table);
+  ctx->status_handlers.table = NULL;
+  ctx->status_handlers.size = 0;
+  ctx->status_handlers.used = 0;
+}
+
+
+/* Arrange for the responses of the server up to the final OK or ERR
+   to be discarded.  The transaction then finishes with RC.  */
+static void
+skip_responses (assuan_context_t ctx, gpg_error_t rc)
+{
+  ctx->transact.skip_response = 1;
+  ctx->transact.saved_rc = rc;
+}
+
+
+/* Finish the inquiry started by the inquire callback with the result
+   RC of that callback: Send END on success or CAN on error.  Returns
+   an error from sending END; in the error case the transaction
+   finishes with RC after the response of the server has been
+   skipped.  */
+static gpg_error_t
+finish_inquire (assuan_context_t ctx, gpg_error_t rc)
+{
+  if (!rc)
+    rc = assuan_send_data (ctx, NULL, 0); /* flush and send END */
+  else
+    { /* Flush and send CAN.  */
+      /* Note that in this error case we don't want to return
+         an error code from sending the cancel.  The response from
+         the server is of no interest.  */
+      assuan_send_data (ctx, NULL, 1);
+      skip_responses (ctx, rc);
+      rc = 0;
+    }
+
+  if (ctx->flags.confidential_inquiry)
+    wipememory (ctx->outbound.data.line, LINELENGTH);
+
+  ctx->flags.confidential_inquiry = 0;
+  ctx->flags.in_inq_cb = 0;
+
+  return rc;
+}
+
+
+/* Pass the data collected by add_data_chunk to the data callback.  */
+static gpg_error_t
+flush_data_chunk (assuan_context_t ctx)
 {
   gpg_error_t rc;
-  assuan_response_t response;
-  int off;
-  char *line;
-  int linelen;
 
-  rc = assuan_write_line (ctx, command);
-  if (rc)
-    return rc;
+  rc = ctx->transact.data_cb (ctx->transact.data_cb_arg,
+                              ctx->transact.chunk.buffer,
+                              ctx->transact.chunk.length);
+  if (ctx->flags.confidential)
+    wipememory (ctx->transact.chunk.buffer, ctx->transact.chunk.length);
+  ctx->transact.chunk.length = 0;
+  return rc;
+}
 
-  if (*command == '#' || !*command)
-    return 0; /* Don't expect a response for a comment line.  */
 
- again:
-  rc = _assuan_read_from_server (ctx, &response, &off,
-                                 ctx->flags.convey_comments);
-  if (rc)
-    return rc; /* error reading from server */
+/* Wipe the data collected by add_data_chunk which has not been
+   passed to the data callback because the transaction failed.  */
+static void
+discard_data_chunk (assuan_context_t ctx)
+{
+  if (ctx->transact.chunk.length)
+    {
+      wipememory (ctx->transact.chunk.buffer, ctx->transact.chunk.length);
+      ctx->transact.chunk.length = 0;
+    }
+}
 
-  line = ctx->inbound.line + off;
-  linelen = ctx->inbound.linelen - off;
 
-  if (response == ASSUAN_RESPONSE_ERROR)
-    rc = atoi (line);
+/* Collect the data DATA of length DATALEN for the data callback and
+   call it whenever a chunk of the size requested with the flag
+   ASSUAN_DATA_CHUNKSIZE is complete.  */
+static gpg_error_t
+add_data_chunk (assuan_context_t ctx, const char *data, size_t datalen)
+{
+  gpg_error_t rc;
+  size_t limit = ctx->transact.chunk.limit;
+  size_t n;
+
+  if (ctx->transact.chunk.size < limit)
+    {
+      /* A fresh buffer is only allocated at the start of a
+         transaction; thus there is nothing to copy.  */
+      if (ctx->transact.chunk.buffer)
+        {
+          wipememory (ctx->transact.chunk.buffer, ctx->transact.chunk.size);
+          _assuan_free (ctx, ctx->transact.chunk.buffer);
+          ctx->transact.chunk.size = 0;
+        }
+      ctx->transact.chunk.buffer = _assuan_malloc (ctx, limit);
+      if (!ctx->transact.chunk.buffer)
+        return _assuan_error (ctx, gpg_err_code_from_syserror ());
+      ctx->transact.chunk.size = limit;
+    }
+
+  while (datalen)
+    {
+      n = limit - ctx->transact.chunk.length;
+      if (n > datalen)
+        n = datalen;
+      memcpy (ctx->transact.chunk.buffer + ctx->transact.chunk.length,
+              data, n);
+      ctx->transact.chunk.length += n;
+      data += n;
+      datalen -= n;
+      if (ctx->transact.chunk.length == limit)
+        {
+          rc = flush_data_chunk (ctx);
+          if (rc)
+            return rc;
+        }
+    }
+  return 0;
+}
+
+
+/* Process the response line RESPONSE with the offset OFF into the
+   inbound line using the callbacks of the current transaction.  Sets
+   DONE if the transaction is finished.  If the inquire callback asks
+   for an asynchronous inquiry, GPG_ERR_EAGAIN is returned with DONE
+   not set.  */
+static gpg_error_t
+transact_response (assuan_context_t ctx, assuan_response_t response,
+                   int off, int *done)
+{
+  gpg_error_t rc = 0;
+  char *line = ctx->inbound.line + off;
+  int linelen = ctx->inbound.linelen - off;
+
+  *done = 0;
+
+  /* Data collected for the data callback is passed on before the
+     inquiry or the end of the transaction is processed.  */
+  if (ctx->transact.chunk.length && response != ASSUAN_RESPONSE_DATA
+      && response != ASSUAN_RESPONSE_DATA_FD
+      && response != ASSUAN_RESPONSE_STATUS
+      && response != ASSUAN_RESPONSE_COMMENT)
+    {
+      rc = flush_data_chunk (ctx);
+      if (rc)
+        {
+          *done = 1;
+          return rc;
+        }
+    }
+
+  if (ctx->transact.skip_response)
+    {
+      assuan_fd_t fd;
+
+      /* Drop the descriptor with unwanted data.  */
+      if (response == ASSUAN_RESPONSE_DATA_FD
+          && !_assuan_uds_pop_fd (ctx, &fd))
+        _assuan_close (ctx, fd);
+      if (response != ASSUAN_RESPONSE_OK && response != ASSUAN_RESPONSE_ERROR)
+        return 0;
+      ctx->transact.skip_response = 0;
+      rc = ctx->transact.saved_rc;
+    }
+  else if (response == ASSUAN_RESPONSE_ERROR)
+    rc = ctx->inbound.parsed.err;
   else if (response == ASSUAN_RESPONSE_DATA)
     {
-      if (!data_cb)
+      if (!ctx->transact.data_cb)
         rc = _assuan_error (ctx, GPG_ERR_ASS_NO_DATA_CB);
       else
         {
-          rc = data_cb (data_cb_arg, line, linelen);
+          if (ctx->transact.chunk.limit)
+            rc = add_data_chunk (ctx, line, linelen);
+          else
+            rc = ctx->transact.data_cb (ctx->transact.data_cb_arg,
+                                        line, linelen);
           if (ctx->flags.confidential)
             wipememory (ctx->inbound.line, LINELENGTH);
           if (!rc)
-            goto again;
+            return 0;
+        }
+    }
+  else if (response == ASSUAN_RESPONSE_DATA_FD)
+    {
+      void *data;
+      size_t datalen;
+
+      /* The data is passed in a memory file and mapped for the data
+         callback.  */
+      rc = _assuan_uds_map_data (ctx, line, &data, &datalen);
+      if (!rc && !ctx->transact.data_cb)
+        {
+          _assuan_uds_unmap_data (ctx, data, datalen);
+          rc = _assuan_error (ctx, GPG_ERR_ASS_NO_DATA_CB);
+        }
+      else if (!rc)
+        {
+          if (ctx->transact.chunk.limit)
+            rc = add_data_chunk (ctx, data, datalen);
+          else
+            rc = ctx->transact.data_cb (ctx->transact.data_cb_arg,
+                                        data, datalen);
+          _assuan_uds_unmap_data (ctx, data, datalen);
+          if (!rc)
+            return 0;
         }
     }
   else if (response == ASSUAN_RESPONSE_INQUIRE)
     {
-      if (!inquire_cb)
+      if (!ctx->transact.inquire_cb)
         {
           assuan_write_line (ctx, "END"); /* get out of inquire mode */
-          _assuan_read_from_server (ctx, &response, &off, 0); /* dummy read */
-          rc = _assuan_error (ctx, GPG_ERR_ASS_NO_INQUIRE_CB);
+          skip_responses (ctx, _assuan_error (ctx, GPG_ERR_ASS_NO_INQUIRE_CB));
+          return 0;
         }
       else
         {
           ctx->flags.confidential_inquiry = 0;
           ctx->flags.in_inq_cb = 1;
 
-          rc = inquire_cb (inquire_cb_arg, line);
-          if (!rc)
-            rc = assuan_send_data (ctx, NULL, 0); /* flush and send END */
-          else
-            { /* Flush and send CAN.  */
-              /* Note that in this error case we don't want to return
-                 an error code from sending the cancel.  The dummy
-                 read is to remove the response from the server which
-                 we are not interested in.  */
-              assuan_send_data (ctx, NULL, 1);
-              _assuan_read_from_server (ctx, &response, &off, 0);
+          rc = ctx->transact.inquire_cb (ctx->transact.inquire_cb_arg, line);
+          if (gpg_err_code (rc) == GPG_ERR_EAGAIN
+              && ctx->flags.async_inquire)
+            {
+              /* The data will be supplied later; IN_INQ_CB stays set
+                 so that confidential data is wiped at the end.  */
+              ctx->transact.inquire_pending = 1;
+              return _assuan_error (ctx, GPG_ERR_EAGAIN);
             }
-
-          if (ctx->flags.confidential_inquiry)
-            wipememory (ctx->outbound.data.line, LINELENGTH);
-
-          ctx->flags.confidential_inquiry = 0;
-          ctx->flags.in_inq_cb = 0;
-
+          rc = finish_inquire (ctx, rc);
           if (!rc)
-            goto again;
+            return 0;
         }
     }
   else if (response == ASSUAN_RESPONSE_STATUS)
     {
-      if (status_cb)
-        rc = status_cb (status_cb_arg, line);
+      struct status_handler_s *entry;
+
+      entry = find_status_handler (ctx,
+                                   ctx->inbound.line
+                                   + ctx->inbound.parsed.kwoff,
+                                   ctx->inbound.parsed.kwlen);
+      if (entry && entry->handler)
+        rc = entry->handler (entry->opaque,
+                             ctx->inbound.line + ctx->inbound.parsed.argoff);
+      else if (ctx->transact.status_cb)
+        rc = ctx->transact.status_cb (ctx->transact.status_cb_arg, line);
       if (!rc)
-        goto again;
+        return 0;
     }
   else if (response == ASSUAN_RESPONSE_COMMENT && ctx->flags.convey_comments)
     {
       line -= off; /* Send line with the comment marker.  */
-      if (status_cb)
-        rc = status_cb (status_cb_arg, line);
+      if (ctx->transact.status_cb)
+        rc = ctx->transact.status_cb (ctx->transact.status_cb_arg, line);
       if (!rc)
-        goto again;
+        return 0;
     }
   else if (response == ASSUAN_RESPONSE_END)
     {
-      if (!data_cb)
+      if (!ctx->transact.data_cb)
         rc = _assuan_error (ctx, GPG_ERR_ASS_NO_DATA_CB);
       else
         {
-          rc = data_cb (data_cb_arg, NULL, 0);
+          rc = ctx->transact.data_cb (ctx->transact.data_cb_arg, NULL, 0);
           if (!rc)
-            goto again;
+            return 0;
+        }
+    }
+
+  *done = 1;
+  return rc;
+}
+
+
+/* Read and process server responses until the current transaction
+   has finished or has been suspended.  */
+static gpg_error_t
+transact_loop (assuan_context_t ctx)
+{
+  gpg_error_t rc;
+  assuan_response_t response;
+  int off;
+  int done;
+
+  do
+    {
+      rc = _assuan_read_from_server (ctx, &response, &off,
+                                     ctx->flags.convey_comments);
+      if (rc && ctx->transact.skip_response)
+        {
+          ctx->transact.skip_response = 0;
+          if (!ctx->deadline.expired)
+            rc = ctx->transact.saved_rc;
+          break;
         }
+      if (rc)
+        break; /* error reading from server */
+
+      rc = transact_response (ctx, response, off, &done);
+    }
+  while (!rc && !done);
+
+  /* A suspended transaction keeps its deadline and its data.  */
+  if (!ctx->transact.inquire_pending)
+    {
+      discard_data_chunk (ctx);
+      _assuan_deadline_end (ctx);
+    }
+  return rc;
+}
+
+
+/**
+ * assuan_transact:
+ * @ctx: The Assuan context
+ * @command: Command line to be send to the server
+ * @data_cb: Callback function for data lines
+ * @data_cb_arg: first argument passed to @data_cb
+ * @inquire_cb: Callback function for a inquire response
+ * @inquire_cb_arg: first argument passed to @inquire_cb
+ * @status_cb: Callback function for a status response
+ * @status_cb_arg: first argument passed to @status_cb
+ *
+ * FIXME: Write documentation
+ *
+ * Return value: 0 on success or an error code.  The error code may be
+ * the one one returned by the server via error lines or from the
+ * callback functions.  Take care:  If a callback returns an error
+ * this function returns immediately with this error.
+ *
+ * If the flag ASSUAN_ASYNC_INQUIRE is set and @inquire_cb returns
+ * GPG_ERR_EAGAIN, the transaction is suspended and this function
+ * returns GPG_ERR_EAGAIN.  The caller is then
+ * expected to send the inquired data with assuan_send_data and to
+ * continue the transaction with assuan_transact_resume.
+ **/
+gpg_error_t
+assuan_transact (assuan_context_t ctx,
+                 const char *command,
+                 gpg_error_t (*data_cb)(void *, const void *, size_t),
+                 void *data_cb_arg,
+                 gpg_error_t (*inquire_cb)(void*, const char *),
+                 void *inquire_cb_arg,
+                 gpg_error_t (*status_cb)(void*, const char *),
+                 void *status_cb_arg)
+{
+  gpg_error_t rc;
+
+  if (!ctx)
+    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
+  if (ctx->transact.inquire_pending || ctx->transact.nonblock)
+    return _assuan_error (ctx, GPG_ERR_ASS_NESTED_COMMANDS);
+
+  if (ctx->uds.data_memfd && !ctx->uds.memfd_offered)
+    _assuan_uds_offer_memfd (ctx);
+
+  _assuan_deadline_begin (ctx);
+  rc = assuan_write_line (ctx, command);
+  if (rc || *command == '#' || !*command)
+    {
+      /* Don't expect a response for a comment line.  */
+      _assuan_deadline_end (ctx);
+      return rc;
+    }
+
+  return _assuan_transact_responses (ctx, data_cb, data_cb_arg,
+                                     inquire_cb, inquire_cb_arg,
+                                     status_cb, status_cb_arg);
+}
+
+
+/* Process the responses to a command which has already been sent to
+   the server.  This is the second half of assuan_transact and is also
+   used by assuan_shared_transact.  */
+gpg_error_t
+_assuan_transact_responses (assuan_context_t ctx,
+                            gpg_error_t (*data_cb)(void *, const void *,
+                                                   size_t),
+                            void *data_cb_arg,
+                            gpg_error_t (*inquire_cb)(void*, const char *),
+                            void *inquire_cb_arg,
+                            gpg_error_t (*status_cb)(void*, const char *),
+                            void *status_cb_arg)
+{
+  ctx->transact.data_cb = data_cb;
+  ctx->transact.data_cb_arg = data_cb_arg;
+  ctx->transact.inquire_cb = inquire_cb;
+  ctx->transact.inquire_cb_arg = inquire_cb_arg;
+  ctx->transact.status_cb = status_cb;
+  ctx->transact.status_cb_arg = status_cb_arg;
+  ctx->transact.chunk.length = 0;
+  ctx->transact.chunk.limit = ctx->transact.chunksize;
+
+  return transact_loop (ctx);
+}
+
+
+/* Leave the mode used by assuan_transact_step.  Output not yet
+   written and data not yet passed to the data callback are
+   discarded.  */
+static void
+end_nonblock (assuan_context_t ctx)
+{
+  ctx->transact.nonblock = 0;
+  ctx->transact.no_response = 0;
+  ctx->transact.skip_response = 0;
+  discard_data_chunk (ctx);
+  if (ctx->outbound.pending.length)
+    {
+      wipememory (ctx->outbound.pending.buffer, ctx->outbound.pending.length);
+      ctx->outbound.pending.length = 0;
     }
+}
+
+
+/* Start a transaction like assuan_transact but return without
+   waiting for the server.  The transaction is then driven by calling
+   assuan_transact_step whenever the connection is ready for I/O.
+   The file descriptors of CTX must be in non-blocking mode.  */
+gpg_error_t
+assuan_transact_start (assuan_context_t ctx,
+                       const char *command,
+                       gpg_error_t (*data_cb)(void *, const void *, size_t),
+                       void *data_cb_arg,
+                       gpg_error_t (*inquire_cb)(void*, const char *),
+                       void *inquire_cb_arg,
+                       gpg_error_t (*status_cb)(void*, const char *),
+                       void *status_cb_arg)
+{
+  gpg_error_t rc;
 
+  if (!ctx || !command)
+    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
+  if (ctx->transact.inquire_pending || ctx->transact.nonblock)
+    return _assuan_error (ctx, GPG_ERR_ASS_NESTED_COMMANDS);
+
+  ctx->transact.data_cb = data_cb;
+  ctx->transact.data_cb_arg = data_cb_arg;
+  ctx->transact.inquire_cb = inquire_cb;
+  ctx->transact.inquire_cb_arg = inquire_cb_arg;
+  ctx->transact.status_cb = status_cb;
+  ctx->transact.status_cb_arg = status_cb_arg;
+  ctx->transact.chunk.length = 0;
+  ctx->transact.chunk.limit = ctx->transact.chunksize;
+  ctx->transact.skip_response = 0;
+  /* Don't expect a response for a comment line.  */
+  ctx->transact.no_response = (*command == '#' || !*command);
+  ctx->transact.nonblock = 1;
+
+  rc = assuan_write_line (ctx, command);
+  if (rc)
+    end_nonblock (ctx);
   return rc;
 }
+
+
+/* Continue the transaction started with assuan_transact_start as far
+   as possible without blocking.  Returns ASSUAN_TRANSACT_WANT_READ or
+   ASSUAN_TRANSACT_WANT_WRITE if the function needs to be called again
+   after the connection has become readable or writable.  Returns
+   ASSUAN_TRANSACT_DONE if the transaction has finished and stores its
+   result at R_ERR.  With the flag ASSUAN_ASYNC_INQUIRE a result with
+   the code GPG_ERR_EAGAIN indicates that the inquire callback
+   suspended the transaction; after
+   assuan_transact_resume the transaction is continued by calling this
+   function again.  */
+int
+assuan_transact_step (assuan_context_t ctx, gpg_error_t *r_err)
+{
+  gpg_error_t rc;
+  assuan_response_t response;
+  int off;
+  int done = 0;
+
+  *r_err = 0;
+  if (!ctx || !ctx->transact.nonblock)
+    {
+      *r_err = _assuan_error (ctx, GPG_ERR_INV_STATE);
+      return ASSUAN_TRANSACT_DONE;
+    }
+  if (ctx->transact.inquire_pending)
+    {
+      *r_err = _assuan_error (ctx, GPG_ERR_EAGAIN);
+      return ASSUAN_TRANSACT_DONE;
+    }
+
+  do
+    {
+      /* Everything we sent must be out before we look at the
+         response; the server does not answer before that anyway.  */
+      rc = _assuan_flush_pending (ctx);
+      if (gpg_err_code (rc) == GPG_ERR_EAGAIN)
+        return ASSUAN_TRANSACT_WANT_WRITE;
+      if (rc || ctx->transact.no_response)
+        break;
+
+      rc = _assuan_read_line (ctx);
+      if (gpg_err_code (rc) == GPG_ERR_EAGAIN)
+        return ASSUAN_TRANSACT_WANT_READ;
+      if (rc)
+        {
+          if (ctx->transact.skip_response)
+            rc = ctx->transact.saved_rc;
+          break;
+        }
+      if (!ctx->inbound.linelen)
+        continue;
+
+      deescape_line (ctx);
+      rc = assuan_client_parse_response (ctx, ctx->inbound.line,
+                                         ctx->inbound.linelen,
+                                         &response, &off);
+      if (rc)
+        break;
+      if (response == ASSUAN_RESPONSE_COMMENT && !ctx->flags.convey_comments)
+        continue;
+
+      rc = transact_response (ctx, response, off, &done);
+      if (ctx->transact.inquire_pending)
+        {
+          *r_err = rc;
+          return ASSUAN_TRANSACT_DONE;
+        }
+    }
+  while (!rc && !done);
+
+  end_nonblock (ctx);
+  *r_err = rc;
+  return ASSUAN_TRANSACT_DONE;
+}
+
+
+/* Resume a transaction which has been suspended because its inquire
+   callback returned GPG_ERR_EAGAIN.  The caller has sent the inquired
+   data using assuan_send_data; if ERR is 0 the inquiry is terminated
+   with END, otherwise it is canceled and ERR is returned.  Returns
+   the result of the transaction as assuan_transact would do; this may
+   again be GPG_ERR_EAGAIN if the server sends another inquiry.  For a
+   transaction started with assuan_transact_start this only queues the
+   end of the inquiry and the caller continues with
+   assuan_transact_step.  */
+gpg_error_t
+assuan_transact_resume (assuan_context_t ctx, gpg_error_t err)
+{
+  gpg_error_t rc;
+
+  if (!ctx)
+    return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
+  if (!ctx->transact.inquire_pending)
+    return _assuan_error (ctx, GPG_ERR_INV_STATE);
+
+  ctx->transact.inquire_pending = 0;
+  rc = finish_inquire (ctx, err);
+  if (rc && ctx->transact.nonblock)
+    end_nonblock (ctx);
+  if (rc && !ctx->transact.nonblock)
+    {
+      discard_data_chunk (ctx);
+      _assuan_deadline_end (ctx);
+    }
+  if (rc || ctx->transact.nonblock)
+    return rc;
+
+  return transact_loop (ctx);
+}
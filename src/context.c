@@ -95,6 +95,43 @@ assuan_set_flag (assuan_context_t ctx, assuan_flag_t flag, int value)
     case ASSUAN_FORCE_CLOSE:
       ctx->flags.force_close = 1;
       break;
+
+    case ASSUAN_DATA_CHUNKSIZE:
+      ctx->transact.chunksize = value > 0? value : 0;
+      break;
+
+    case ASSUAN_TRANSACT_TIMEOUT:
+      ctx->deadline.timeout = value > 0? value : 0;
+      break;
+
+    case ASSUAN_PROCESS_LINES:
+      ctx->budget.lines = value > 0? value : 0;
+      break;
+
+    case ASSUAN_PROCESS_USEC:
+      ctx->budget.usec = value > 0? value : 0;
+      break;
+
+    case ASSUAN_MAX_PENDING_FDS:
+      ctx->uds.maxpending = value > 0? value : 0;
+      break;
+
+    case ASSUAN_DATA_MEMFD:
+      ctx->uds.data_memfd = value > 0? value : 0;
+      break;
+
+    case ASSUAN_ALLOW_SHM:
+      ctx->flags.allow_shm = !!value;
+      /* Servers know the SHM command only with this flag.  Without a
+         command table the server is not yet initialized and the
+         command is registered along with the standard ones.  */
+      if (ctx->cmdtbl)
+        _assuan_update_shm_command (ctx);
+      break;
+
+    case ASSUAN_ASYNC_INQUIRE:
+      ctx->flags.async_inquire = !!value;
+      break;
     }
 }
 
@@ -135,12 +172,66 @@ assuan_get_flag (assuan_context_t ctx, assuan_flag_t flag)
     case ASSUAN_FORCE_CLOSE:
       res = ctx->flags.force_close;
       break;
+
+    case ASSUAN_DATA_CHUNKSIZE:
+      res = ctx->transact.chunksize;
+      break;
+
+    case ASSUAN_TRANSACT_TIMEOUT:
+      res = ctx->deadline.timeout;
+      break;
+
+    case ASSUAN_PROCESS_LINES:
+      res = ctx->budget.lines;
+      break;
+
+    case ASSUAN_PROCESS_USEC:
+      res = ctx->budget.usec;
+      break;
+
+    case ASSUAN_MAX_PENDING_FDS:
+      res = ctx->uds.maxpending;
+      break;
+
+    case ASSUAN_DATA_MEMFD:
+      res = ctx->uds.data_memfd;
+      break;
+
+    case ASSUAN_ALLOW_SHM:
+      res = ctx->flags.allow_shm;
+      break;
+
+    case ASSUAN_ASYNC_INQUIRE:
+      res = ctx->flags.async_inquire;
+      break;
     }
 
   return TRACE_SUC1 ("flag_value=%i", res);
 }
 
 
+/* Make all I/O on CTX fail with GPG_ERR_TIMEOUT after MSEC
+   milliseconds from now.  This is in addition to the timeout set with
+   ASSUAN_TRANSACT_TIMEOUT.  0 removes the deadline.  */
+void
+assuan_set_deadline (assuan_context_t ctx, unsigned int msec)
+{
+  TRACE1 (ctx, ASSUAN_LOG_CTX, "assuan_set_deadline", ctx,
+	  "msec=%u", msec);
+
+  if (!ctx)
+    return;
+
+  if (msec)
+    {
+      ctx->deadline.user = _assuan_get_msec () + msec;
+      ctx->deadline.user_set = 1;
+    }
+  else
+    ctx->deadline.user_set = 0;
+}
+
+
 /* Same as assuan_set_flag (ctx, ASSUAN_CONFIDENTIAL, 1).  */
 void
 assuan_begin_confidential (assuan_context_t ctx)
@@ -220,6 +311,9 @@ assuan_get_pid (assuan_context_t ctx)
   if (!ctx)
     return ASSUAN_INVALID_PID;
 
+  if (ctx->peercred_pending)
+    _assuan_socket_peercred (ctx, NULL);
+
   if (ctx->flags.is_server)
 #if defined(HAVE_W32_SYSTEM)
     return ctx->process_id;
@@ -245,6 +339,8 @@ assuan_get_peercred (assuan_context_t ctx, assuan_peercred_t *peercred)
 
   if (!ctx)
     return _assuan_error (ctx, GPG_ERR_ASS_INV_VALUE);
+  if (ctx->peercred_pending)
+    _assuan_socket_peercred (ctx, NULL);
   if (!ctx->peercred_valid)
     return _assuan_error (ctx, GPG_ERR_ASS_GENERAL);
 
@@ -50,13 +50,69 @@ _assuan_server_finish (assuan_context_t ctx)
 #else
   ctx->pid = ASSUAN_INVALID_PID;
 #endif
+  ctx->peercred_pending = 0;
 
+  _assuan_shm_release (ctx);
   _assuan_uds_deinit (ctx);
 
   _assuan_inquire_release (ctx);
 }
 
 
+/* Disconnect the context CTX and reset the state of the connection so
+   that CTX can be used for another connection.  The registered
+   commands and handlers, the hello line and the user pointer are
+   kept.  The line buffers are wiped.  */
+void
+_assuan_server_reset (assuan_context_t ctx)
+{
+  _assuan_server_finish (ctx);
+  if (ctx->input_fd != ASSUAN_INVALID_FD)
+    assuan_close_input_fd (ctx);
+  if (ctx->output_fd != ASSUAN_INVALID_FD)
+    assuan_close_output_fd (ctx);
+
+  /* The flushed part of the pending output is already wiped.  Keep
+     the buffer unless it was grown by a large response.  */
+  if (ctx->outbound.pending.buffer)
+    {
+      wipememory (ctx->outbound.pending.buffer, ctx->outbound.pending.length);
+      ctx->outbound.pending.length = 0;
+      if (ctx->outbound.pending.size > 4 * LINELENGTH)
+        {
+          _assuan_free (ctx, ctx->outbound.pending.buffer);
+          ctx->outbound.pending.buffer = NULL;
+          ctx->outbound.pending.size = 0;
+        }
+    }
+  wipememory (ctx->inbound.line, sizeof ctx->inbound.line);
+  wipememory (ctx->inbound.attic.line, sizeof ctx->inbound.attic.line);
+  wipememory (ctx->outbound.data.line, sizeof ctx->outbound.data.line);
+  ctx->inbound.linelen = 0;
+  ctx->inbound.attic.linelen = 0;
+  ctx->inbound.attic.pending = 0;
+  ctx->outbound.data.linelen = 0;
+  ctx->outbound.data.error = 0;
+
+  ctx->flags.confidential = 0;
+  ctx->flags.in_process_next = 0;
+  ctx->flags.process_complete = 0;
+  ctx->flags.in_command = 0;
+  ctx->current_cmd_name = NULL;
+  ctx->inquire_cb = NULL;
+  ctx->inquire_cb_data = NULL;
+  ctx->inquire_membuf = NULL;
+  ctx->err_no = 0;
+  ctx->err_str = NULL;
+  ctx->peercred_valid = 0;
+  ctx->uds.peer_memfd = 0;
+  ctx->deadline.user_set = 0;
+  ctx->deadline.transact_set = 0;
+  ctx->deadline.expired = 0;
+  ctx->connected_fd = ASSUAN_INVALID_FD;
+}
+
+
 void
 _assuan_server_release (assuan_context_t ctx)
 {
@@ -64,6 +120,8 @@ _assuan_server_release (assuan_context_t ctx)
 
   _assuan_free (ctx, ctx->hello_line);
   ctx->hello_line = NULL;
+  _assuan_free (ctx, ctx->hello.buffer);
+  ctx->hello.buffer = NULL;
   _assuan_free (ctx, ctx->okay_line);
   ctx->okay_line = NULL;
   _assuan_free (ctx, ctx->cmdtbl);
@@ -32,6 +32,7 @@
 #include <sys/types.h>
 #include <time.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/wait.h>
 #ifdef HAVE_GETRLIMIT
 # include <sys/time.h>
@@ -431,6 +432,51 @@ __assuan_connect (assuan_context_t ctx, int sock, struct sockaddr *addr,
 }
 
 
+int
+__assuan_poll (assuan_context_t ctx, assuan_fd_t fd, int for_write,
+               int timeout)
+{
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = for_write? POLLOUT : POLLIN;
+  pfd.revents = 0;
+  /* An error or hangup condition also makes FD ready so that the
+     following read or write reports it.  */
+  return poll (&pfd, 1, timeout);
+}
+
+
+/* Return a millisecond counter for computing deadlines.  The counter
+   has no defined origin and may wrap around.  */
+unsigned long
+_assuan_get_msec (void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (!clock_gettime (CLOCK_MONOTONIC, &ts))
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+  return (unsigned long)time (NULL) * 1000;
+}
+
+
+/* Return a monotonic time in microseconds.  Only differences are
+   meaningful and they wrap around like those of _assuan_get_msec.  */
+unsigned long
+_assuan_get_usec (void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (!clock_gettime (CLOCK_MONOTONIC, &ts))
+    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+  return (unsigned long)time (NULL) * 1000000;
+}
+
+
 
 /* The default system hooks for assuan contexts.  */
 struct assuan_system_hooks _assuan_system_hooks =
@@ -447,5 +493,6 @@ struct assuan_system_hooks _assuan_system_hooks =
     __assuan_waitpid,
     __assuan_socketpair,
     __assuan_socket,
-    __assuan_connect
+    __assuan_connect,
+    __assuan_poll
   };
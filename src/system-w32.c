@@ -223,22 +223,15 @@ w32_fdpass_send (assuan_context_t ctx, assuan_fd_t fd)
 gpg_error_t
 w32_fdpass_recv (assuan_context_t ctx, assuan_fd_t *fd)
 {
-  int i;
-
-  if (!ctx->uds.pendingfdscount)
+  if (_assuan_uds_pop_fd (ctx, fd))
     {
       TRACE0 (ctx, ASSUAN_LOG_SYSIO, "w32_receivefd", ctx,
 	      "no pending file descriptors");
       return _assuan_error (ctx, GPG_ERR_ASS_GENERAL);
     }
 
-  *fd = ctx->uds.pendingfds[0];
-  for (i=1; i < ctx->uds.pendingfdscount; i++)
-    ctx->uds.pendingfds[i-1] = ctx->uds.pendingfds[i];
-  ctx->uds.pendingfdscount--;
-
   TRACE1 (ctx, ASSUAN_LOG_SYSIO, "w32_fdpass_recv", ctx,
-          "received fd: %p", ctx->uds.pendingfds[0]);
+          "received fd: %p", *fd);
   return 0;
 }
 
@@ -642,6 +635,48 @@ __assuan_connect (assuan_context_t ctx, assuan_fd_t sock,
   return res;
 }
 
+int
+__assuan_poll (assuan_context_t ctx, assuan_fd_t fd, int for_write,
+               int timeout)
+{
+  fd_set fds;
+  struct timeval tv;
+  int res;
+
+  /* Only sockets can be waited for; for pipes we report readiness
+     and let the following read or write block.  */
+  if (!ctx->flags.is_socket)
+    return 1;
+
+  FD_ZERO (&fds);
+  FD_SET (HANDLE2SOCKET (fd), &fds);
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  res = select (0, for_write? NULL : &fds, for_write? &fds : NULL, NULL,
+                timeout < 0? NULL : &tv);
+  if (res < 0)
+    gpg_err_set_errno (_assuan_sock_wsa2errno (WSAGetLastError ()));
+  return res;
+}
+
+
+/* Return a millisecond counter for computing deadlines.  The counter
+   has no defined origin and wraps around after 49 days.  */
+unsigned long
+_assuan_get_msec (void)
+{
+  return GetTickCount ();
+}
+
+
+/* Return a monotonic time in microseconds.  */
+unsigned long
+_assuan_get_usec (void)
+{
+  return (unsigned long)GetTickCount () * 1000;
+}
+
+
 
 /* The default system hooks for assuan contexts.  */
 struct assuan_system_hooks _assuan_system_hooks =
@@ -658,5 +693,6 @@ struct assuan_system_hooks _assuan_system_hooks =
     __assuan_waitpid,
     __assuan_socketpair,
     __assuan_socket,
-    __assuan_connect
+    __assuan_connect,
+    __assuan_poll
   };
@@ -129,7 +129,11 @@ _assuan_system_hooks_copy (assuan_system_hooks_t dst,
       dst->socket = src->socket;
       dst->connect = src->connect;
     }
-  if (src->version > 2)
+  if (src->version >= 3)
+    {
+      dst->poll = src->poll;
+    }
+  if (src->version > 3)
     /* FIXME.  Application uses newer version of the library.  What to
        do?  */
     ;
@@ -537,3 +541,23 @@ _assuan_connect (assuan_context_t ctx, assuan_fd_t sock,
     }
   return TRACE_SYSRES (res);
 }
+
+
+int
+_assuan_poll (assuan_context_t ctx, assuan_fd_t fd, int for_write,
+              int timeout)
+{
+  int res;
+  TRACE_BEG3 (ctx, ASSUAN_LOG_SYSIO, "_assuan_poll", ctx,
+	      "fd=0x%x,for_write=%i,timeout=%i", fd, for_write, timeout);
+
+  if (ctx->system.version)
+    res = (ctx->system.poll) (ctx, fd, for_write, timeout);
+  else
+    {
+      _assuan_pre_syscall ();
+      res = __assuan_poll (ctx, fd, for_write, timeout);
+      _assuan_post_syscall ();
+    }
+  return TRACE_SYSRES (res);
+}
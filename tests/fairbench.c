@@ -0,0 +1,598 @@
+/* fairbench.c - Benchmark for the fairness of serving many clients
+   Copyright (C) 2026 g10 Code GmbH
+
+   This file is part of Assuan.
+
+   Assuan is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 3 of
+   the License, or (at your option) any later version.
+
+   Assuan is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   This program serves aggressive clients, which send their commands
+   in large batches without waiting for the responses, and several
+   polite clients, which send one command at a time and measure how
+   long they wait for the response.  The server either runs its own
+   poll loop around assuan_process_next or uses assuan_server_loop.
+   Each mode is run first without and then with a budget set with
+   ASSUAN_PROCESS_LINES or ASSUAN_PROCESS_USEC.  Without a budget the
+   polite clients wait for entire batches of the aggressive clients.
+   The server loop is finally run with the command of the aggressive
+   client given a low priority, which serves the polite clients
+   first.  If supported, the server loop runs are repeated with
+   io_uring.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#ifndef HAVE_W32_SYSTEM
+# include <poll.h>
+# include <signal.h>
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <sys/wait.h>
+#endif
+
+#include "../src/assuan.h"
+#include "common.h"
+
+#ifndef HAVE_W32_SYSTEM
+
+#define MAX_POLITE 64
+#define MAX_AGGRESSIVE 16
+
+static char socket_name[100];
+static int npolite = 8;
+static int naggressive = 4;
+static int nrounds = 50;
+static int batch = 200;
+static int work_usec = 20;
+static int budget_lines;
+static int budget_usec;
+static int aging = 50;
+
+/* The budget and priority aging of the current run.  */
+static int use_lines;
+static int use_usec;
+static int use_aging;
+static int use_uring;
+
+static assuan_server_t server;
+static unsigned long nbulk;
+static unsigned long npolite_cmds;
+static int npolite_closed;
+
+
+static double
+now (void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return (double)clock () / CLOCKS_PER_SEC;
+#endif
+}
+
+
+/* Spend the time a real command would take.  */
+static void
+work (void)
+{
+  double end = now () + work_usec / 1e6;
+
+  while (now () < end)
+    ;
+}
+
+
+
+/* Server part.  */
+
+/* The command of the aggressive clients.  */
+static gpg_error_t
+cmd_bulk (assuan_context_t ctx, char *line)
+{
+  (void)line;
+  work ();
+  nbulk++;
+  /* Tell the connection apart when it is closed.  */
+  assuan_set_pointer (ctx, &nbulk);
+  return assuan_process_done (ctx, 0);
+}
+
+
+/* The command of the polite clients.  */
+static gpg_error_t
+cmd_nop (assuan_context_t ctx, char *line)
+{
+  (void)line;
+  work ();
+  npolite_cmds++;
+  return assuan_process_done (ctx, 0);
+}
+
+
+static gpg_error_t
+setup_context (assuan_context_t ctx)
+{
+  gpg_error_t err;
+
+  err = assuan_register_command (ctx, "BULK", cmd_bulk, NULL);
+  if (!err)
+    err = assuan_register_command (ctx, "NOP", cmd_nop, NULL);
+  if (!err && use_aging)
+    err = assuan_set_command_priority (ctx, "BULK", ASSUAN_PRIORITY_LOW);
+  assuan_set_flag (ctx, ASSUAN_PROCESS_LINES, use_lines);
+  assuan_set_flag (ctx, ASSUAN_PROCESS_USEC, use_usec);
+  return err;
+}
+
+
+/* Serve the clients with a poll loop around assuan_process_next.
+   Connections with buffered lines are served again without
+   polling.  */
+static void
+serve_next (assuan_fd_t listen_fd)
+{
+  gpg_error_t err;
+  assuan_context_t ctxs[MAX_POLITE + MAX_AGGRESSIVE];
+  struct pollfd pfd[MAX_POLITE + MAX_AGGRESSIVE];
+  int nconns = npolite + naggressive;
+  int i, fd, done, pending, nopen;
+
+  for (i = 0; i < nconns; i++)
+    {
+      fd = accept (listen_fd, NULL, NULL);
+      if (fd == -1)
+        log_fatal ("accept failed: %s\n", strerror (errno));
+      err = assuan_new (&ctxs[i]);
+      if (!err)
+        err = assuan_init_socket_server (ctxs[i], fd,
+                                         ASSUAN_SOCKET_SERVER_ACCEPTED);
+      if (!err)
+        err = setup_context (ctxs[i]);
+      if (!err)
+        err = assuan_accept (ctxs[i]);
+      if (err)
+        log_fatal ("setting up connection %d failed: %s\n",
+                   i, gpg_strerror (err));
+      pfd[i].fd = fd;
+      pfd[i].events = POLLIN;
+    }
+
+  nopen = nconns;
+  while (nopen)
+    {
+      pending = 0;
+      for (i = 0; i < nconns; i++)
+        {
+          pfd[i].revents = 0;
+          if (ctxs[i] && assuan_pending_line (ctxs[i]))
+            pending = 1;
+        }
+      if (poll (pfd, nconns, pending? 0 : -1) == -1 && errno != EINTR)
+        log_fatal ("poll failed: %s\n", strerror (errno));
+
+      for (i = 0; i < nconns; i++)
+        {
+          if (!ctxs[i] || !(pfd[i].revents || assuan_pending_line (ctxs[i])))
+            continue;
+          err = assuan_process_next (ctxs[i], &done);
+          if (!err && !done)
+            continue;
+          if (!assuan_get_pointer (ctxs[i]))
+            npolite_closed++;
+          assuan_release (ctxs[i]);
+          ctxs[i] = NULL;
+          pfd[i].fd = -1;
+          nopen--;
+        }
+
+      /* Send the aggressive clients away once the others are done.  */
+      if (npolite_closed == npolite)
+        for (i = 0; i < nconns; i++)
+          if (ctxs[i])
+            {
+              assuan_release (ctxs[i]);
+              ctxs[i] = NULL;
+              pfd[i].fd = -1;
+              nopen--;
+            }
+    }
+}
+
+
+static gpg_error_t
+connect_cb (void *opaque, assuan_context_t ctx)
+{
+  (void)opaque;
+  /* A re-used context keeps its user pointer.  */
+  assuan_set_pointer (ctx, NULL);
+  return setup_context (ctx);
+}
+
+
+static void
+disconnect_cb (void *opaque, assuan_context_t ctx)
+{
+  (void)opaque;
+  if (!assuan_get_pointer (ctx) && ++npolite_closed == npolite)
+    assuan_server_stop (server);
+}
+
+
+/* Serve the clients with assuan_server_loop.  */
+static void
+serve_loop (assuan_fd_t listen_fd)
+{
+  gpg_error_t err;
+
+  err = assuan_server_new (&server, listen_fd, 0,
+                           connect_cb, disconnect_cb, NULL);
+  if (!err)
+    err = assuan_server_set_priorities (server, use_aging);
+  if (!err && use_uring)
+    err = assuan_server_set_io_uring (server, 1);
+  if (!err)
+    err = assuan_server_loop (server);
+  if (err)
+    log_fatal ("server loop failed: %s\n", gpg_strerror (err));
+  /* This also closes the connections of the aggressive clients.  */
+  assuan_server_release (server);
+  server = NULL;
+}
+
+
+
+/* Client part.  */
+
+/* Read from FD until NLINES lines have been received.  Returns
+   false on EOF or error.  */
+static int
+read_lines (int fd, int nlines)
+{
+  char buffer[4096];
+  ssize_t i, n;
+
+  while (nlines > 0)
+    {
+      n = read (fd, buffer, sizeof buffer);
+      if (n <= 0)
+        return 0;
+      for (i = 0; i < n; i++)
+        if (buffer[i] == '\n')
+          nlines--;
+    }
+  return 1;
+}
+
+
+/* Send batches of commands until the server closes the
+   connection.  */
+static int
+run_aggressive (void)
+{
+  struct sockaddr_un addr;
+  char *commands;
+  int fd, i, len;
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    log_fatal ("socket failed: %s\n", strerror (errno));
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, socket_name);
+  if (connect (fd, (struct sockaddr *)&addr, sizeof addr))
+    log_fatal ("connect failed: %s\n", strerror (errno));
+
+  len = batch * 5;
+  commands = malloc (len);
+  if (!commands)
+    log_fatal ("out of core\n");
+  for (i = 0; i < batch; i++)
+    memcpy (commands + 5 * i, "BULK\n", 5);
+
+  /* Skip the greeting, then send a batch whenever the previous one
+     has been answered.  */
+  if (read_lines (fd, 1))
+    while (write (fd, commands, len) == len && read_lines (fd, batch))
+      ;
+
+  free (commands);
+  close (fd);
+  return 0;
+}
+
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+
+/* Run transactions on the polite connections in turn and print their
+   latency.  */
+static int
+run_polite (const char *mode)
+{
+  gpg_error_t err;
+  assuan_context_t ctxs[MAX_POLITE];
+  double start, t, sum = 0;
+  double *times;
+  int i, round, n;
+
+  times = malloc (nrounds * npolite * sizeof *times);
+  if (!times)
+    log_fatal ("out of core\n");
+
+  for (i = 0; i < npolite; i++)
+    {
+      err = assuan_new (&ctxs[i]);
+      if (!err)
+        err = assuan_socket_connect (ctxs[i], socket_name,
+                                     ASSUAN_INVALID_PID, 0);
+      if (err)
+        log_fatal ("connection %d failed: %s\n", i, gpg_strerror (err));
+    }
+
+  n = 0;
+  for (round = 0; round < nrounds; round++)
+    for (i = 0; i < npolite; i++)
+      {
+        start = now ();
+        err = assuan_transact (ctxs[i], "NOP", NULL, NULL,
+                               NULL, NULL, NULL, NULL);
+        t = now () - start;
+        if (err)
+          log_error ("NOP failed: %s\n", gpg_strerror (err));
+        sum += t;
+        times[n++] = t;
+      }
+  qsort (times, n, sizeof *times, compare_doubles);
+
+  printf ("%-6s %-12s polite latency: %8.1f us avg, %8.1f us p99,"
+          " %8.1f us max\n",
+          mode, use_aging? "priorities"
+          /**/ : use_lines? "lines" : use_usec? "usec" : "no budget",
+          sum * 1e6 / n, times[n * 99 / 100] * 1e6, times[n - 1] * 1e6);
+  fflush (stdout);
+  free (times);
+
+  for (i = 0; i < npolite; i++)
+    assuan_release (ctxs[i]);
+  return errorcount ? 1 : 0;
+}
+
+
+
+/* Create the listening socket.  */
+static assuan_fd_t
+create_socket (void)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    log_fatal ("socket failed: %s\n", strerror (errno));
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, socket_name);
+  remove (socket_name);
+  if (bind (fd, (struct sockaddr *)&addr, sizeof addr))
+    log_fatal ("bind failed: %s\n", strerror (errno));
+  if (listen (fd, MAX_POLITE + MAX_AGGRESSIVE))
+    log_fatal ("listen failed: %s\n", strerror (errno));
+  return fd;
+}
+
+
+/* Return true if the server loop supports io_uring.  */
+static int
+have_io_uring (void)
+{
+  assuan_server_t srv;
+  gpg_error_t err;
+  int fd;
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    log_fatal ("socket failed: %s\n", strerror (errno));
+  err = assuan_server_new (&srv, fd, 0, NULL, NULL, NULL);
+  if (err)
+    {
+      close (fd);
+      return 0;
+    }
+  err = assuan_server_set_io_uring (srv, 1);
+  assuan_server_release (srv);
+  return !err;
+}
+
+
+/* Run the clients against a server of MODE with the budget given by
+   LINES and USEC and the priority aging AGING_MSEC.  */
+static void
+run (const char *mode, int lines, int usec, int aging_msec)
+{
+  assuan_fd_t fd;
+  pid_t pids[MAX_AGGRESSIVE + 1];
+  double start;
+  int i, status;
+
+  use_lines = lines;
+  use_usec = usec;
+  use_aging = aging_msec;
+  use_uring = !strcmp (mode, "uring");
+  nbulk = npolite_cmds = 0;
+  npolite_closed = 0;
+
+  fd = create_socket ();
+  /* The aggressive clients connect first so that they are busy when
+     the polite ones start.  */
+  for (i = 0; i <= naggressive; i++)
+    {
+      pids[i] = fork ();
+      if (pids[i] == -1)
+        log_fatal ("fork failed: %s\n", strerror (errno));
+      if (!pids[i])
+        {
+          close (fd);
+          _exit (i == naggressive? run_polite (mode) : run_aggressive ());
+        }
+      if (i + 1 == naggressive)
+        usleep (10000);
+    }
+
+  start = now ();
+  if (!strcmp (mode, "next"))
+    {
+      serve_next (fd);
+      close (fd);
+    }
+  else
+    serve_loop (fd);
+
+  for (i = 0; i <= naggressive; i++)
+    if (waitpid (pids[i], &status, 0) == -1
+        || !WIFEXITED (status) || WEXITSTATUS (status))
+      log_error ("client %d failed\n", i);
+  if (verbose)
+    log_info ("%s: %lu bulk and %lu polite commands in %.1f ms\n",
+              mode, nbulk, npolite_cmds, (now () - start) * 1e3);
+  remove (socket_name);
+}
+
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+int
+main (int argc, char **argv)
+{
+#ifndef HAVE_W32_SYSTEM
+  if (argc)
+    {
+      log_set_prefix (*argv);
+      argc--; argv++;
+    }
+  while (argc)
+    {
+      if (!strcmp (*argv, "--verbose"))
+        {
+          verbose = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--debug"))
+        {
+          verbose = debug = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--polite") && argc > 1)
+        {
+          npolite = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--aggressive") && argc > 1)
+        {
+          naggressive = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--rounds") && argc > 1)
+        {
+          nrounds = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--batch") && argc > 1)
+        {
+          batch = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--work") && argc > 1)
+        {
+          work_usec = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--lines") && argc > 1)
+        {
+          budget_lines = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--usec") && argc > 1)
+        {
+          budget_usec = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--aging") && argc > 1)
+        {
+          aging = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else
+        log_fatal ("usage: fairbench [--verbose] [--debug] [--polite N]"
+                   " [--aggressive N]\n"
+                   "                 [--rounds N] [--batch N] [--work USEC]"
+                   " [--lines N]\n"
+                   "                 [--usec N] [--aging MSEC]\n");
+    }
+  if (npolite < 1 || npolite > MAX_POLITE || naggressive < 1
+      || naggressive > MAX_AGGRESSIVE || nrounds < 1 || batch < 1)
+    log_fatal ("invalid arguments\n");
+  if (!budget_lines && !budget_usec)
+    budget_lines = 4;
+
+  assuan_set_assuan_log_prefix (log_prefix);
+  signal (SIGPIPE, SIG_IGN);
+  snprintf (socket_name, sizeof socket_name, "/tmp/assuan-fairbench-%d.sock",
+            (int)getpid ());
+
+  run ("next", 0, 0, 0);
+  run ("next", budget_lines, budget_usec, 0);
+  if (gpg_err_code (assuan_server_new (NULL, ASSUAN_INVALID_FD, 0,
+                                      NULL, NULL, NULL))
+      != GPG_ERR_NOT_SUPPORTED)
+    {
+      run ("loop", 0, 0, 0);
+      run ("loop", budget_lines, budget_usec, 0);
+      if (aging > 0)
+        run ("loop", budget_lines, budget_usec, aging);
+      if (have_io_uring ())
+        {
+          run ("uring", 0, 0, 0);
+          run ("uring", budget_lines, budget_usec, 0);
+          if (aging > 0)
+            run ("uring", budget_lines, budget_usec, aging);
+        }
+    }
+
+  return errorcount ? 1 : 0;
+#else /*HAVE_W32_SYSTEM*/
+  (void)argc;
+  (void)argv;
+  return 0;
+#endif /*HAVE_W32_SYSTEM*/
+}
@@ -0,0 +1,361 @@
+/* fdpassbench.c - Benchmark for passing sets of descriptors
+   Copyright (C) 2026 g10 Code GmbH
+
+   This file is part of Assuan.
+
+   Assuan is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 3 of
+   the License, or (at your option) any later version.
+
+   Assuan is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   This program passes sets of descriptors to a forked server, the
+   way a client hands over its input, output, status and attribute
+   files before a command.  Each set is followed by a command which
+   takes the descriptors.  The sets are sent first with one call of
+   assuan_sendfd per descriptor and then with a single call of
+   assuan_sendfds.
+
+   With --data N the program instead sends N bytes of data to the
+   server, which inquires them and sends them back, first in data
+   lines and then in memory files (ASSUAN_DATA_MEMFD).
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#ifndef HAVE_W32_SYSTEM
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+#include "../src/assuan.h"
+#include "common.h"
+
+#ifndef HAVE_W32_SYSTEM
+
+#define MAX_FDS 64
+
+static int nfds = 4;
+static int nsets = 20000;
+static size_t datasize;
+
+
+static double
+now (void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return (double)clock () / CLOCKS_PER_SEC;
+#endif
+}
+
+
+
+/* Server part.  */
+
+/* FDS N - Take and close N pending descriptors.  */
+static gpg_error_t
+cmd_fds (assuan_context_t ctx, char *line)
+{
+  assuan_fd_t fds[MAX_FDS];
+  gpg_error_t err;
+  int i, n;
+
+  n = atoi (line);
+  if (n < 1 || n > MAX_FDS)
+    return gpg_error (GPG_ERR_ASS_PARAMETER);
+  err = assuan_receivefds (ctx, fds, n);
+  if (err)
+    return err;
+  for (i = 0; i < n; i++)
+    close (fds[i]);
+  return 0;
+}
+
+
+/* DATA - Inquire data and send it back.  */
+static gpg_error_t
+cmd_data (assuan_context_t ctx, char *line)
+{
+  unsigned char *buffer;
+  size_t length;
+  gpg_error_t err;
+
+  (void)line;
+  err = assuan_inquire (ctx, "DATA", &buffer, &length, 0);
+  if (err)
+    return err;
+  err = assuan_send_data (ctx, buffer, length);
+  free (buffer);
+  return err;
+}
+
+
+static void
+server (void)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+
+  err = assuan_new (&ctx);
+  if (!err)
+    err = assuan_init_pipe_server (ctx, NULL);
+  if (!err)
+    err = assuan_register_command (ctx, "FDS", cmd_fds, NULL);
+  if (!err)
+    err = assuan_register_command (ctx, "DATA", cmd_data, NULL);
+  if (err)
+    log_fatal ("setting up the server failed: %s\n", gpg_strerror (err));
+  if (debug)
+    assuan_set_log_stream (ctx, stderr);
+  assuan_set_flag (ctx, ASSUAN_DATA_MEMFD, 4096);
+
+  while (!(err = assuan_accept (ctx)))
+    {
+      err = assuan_process (ctx);
+      if (err)
+        log_error ("assuan_process failed: %s\n", gpg_strerror (err));
+    }
+  if (err != -1)
+    log_error ("assuan_accept failed: %s\n", gpg_strerror (err));
+  assuan_release (ctx);
+}
+
+
+
+/* Client part.  */
+
+/* Pass NSETS sets of the descriptors FDS, with one call per
+   descriptor unless BATCH is set, and print the throughput.  */
+static void
+run (assuan_context_t ctx, const assuan_fd_t *fds, int batch)
+{
+  gpg_error_t err = 0;
+  char command[32];
+  double start, t;
+  int set, i;
+
+  snprintf (command, sizeof command, "FDS %d", nfds);
+  start = now ();
+  for (set = 0; !err && set < nsets; set++)
+    {
+      if (batch)
+        err = assuan_sendfds (ctx, fds, nfds);
+      else
+        for (i = 0; !err && i < nfds; i++)
+          err = assuan_sendfd (ctx, fds[i]);
+      if (err)
+        log_error ("sending the descriptors failed: %s\n", gpg_strerror (err));
+      else
+        {
+          err = assuan_transact (ctx, command, NULL, NULL,
+                                 NULL, NULL, NULL, NULL);
+          if (err)
+            log_error ("%s failed: %s\n", command, gpg_strerror (err));
+        }
+    }
+  t = now () - start;
+
+  printf ("%-8s %2d fds: %9.0f sets/s, %6.2f us per descriptor\n",
+          batch? "sendfds" : "sendfd", nfds, nsets / t,
+          t * 1e6 / ((double)nsets * nfds));
+  fflush (stdout);
+}
+
+
+struct data_parm_s
+{
+  assuan_context_t ctx;
+  const unsigned char *buffer;
+  size_t received;
+};
+
+static gpg_error_t
+data_cb (void *opaque, const void *buffer, size_t length)
+{
+  struct data_parm_s *parm = opaque;
+
+  (void)buffer;
+  parm->received += length;
+  return 0;
+}
+
+static gpg_error_t
+inquire_cb (void *opaque, const char *keyword)
+{
+  struct data_parm_s *parm = opaque;
+
+  (void)keyword;
+  return assuan_send_data (parm->ctx, parm->buffer, datasize);
+}
+
+
+/* Send DATASIZE bytes to the server and receive them back NSETS
+   times, in memory files if MEMFD is set, and print the
+   throughput.  */
+static void
+run_data (assuan_context_t ctx, const unsigned char *buffer, int memfd)
+{
+  struct data_parm_s parm;
+  gpg_error_t err = 0;
+  double start, t;
+  int set;
+
+  assuan_set_flag (ctx, ASSUAN_DATA_MEMFD, memfd? 4096 : 0);
+  parm.ctx = ctx;
+  parm.buffer = buffer;
+  start = now ();
+  for (set = 0; !err && set < nsets; set++)
+    {
+      parm.received = 0;
+      err = assuan_transact (ctx, "DATA", data_cb, &parm,
+                             inquire_cb, &parm, NULL, NULL);
+      if (err)
+        log_error ("DATA failed: %s\n", gpg_strerror (err));
+      else if (parm.received != datasize)
+        {
+          log_error ("DATA returned %lu bytes\n",
+                     (unsigned long)parm.received);
+          err = gpg_error (GPG_ERR_BAD_DATA);
+        }
+    }
+  t = now () - start;
+
+  printf ("%-8s %9lu bytes: %8.1f MB/s, %8.1f us per round trip\n",
+          memfd? "memfd" : "D lines", (unsigned long)datasize,
+          2.0 * datasize * nsets / t / 1e6, t * 1e6 / nsets);
+  fflush (stdout);
+}
+
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+int
+main (int argc, char **argv)
+{
+#ifndef HAVE_W32_SYSTEM
+  gpg_error_t err;
+  assuan_context_t ctx;
+  assuan_fd_t no_close_fds[2];
+  assuan_fd_t fds[MAX_FDS];
+  const char *loc;
+  int fd, i;
+
+  if (argc)
+    {
+      log_set_prefix (*argv);
+      argc--; argv++;
+    }
+  while (argc)
+    {
+      if (!strcmp (*argv, "--verbose"))
+        {
+          verbose = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--debug"))
+        {
+          verbose = debug = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--fds") && argc > 1)
+        {
+          nfds = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--sets") && argc > 1)
+        {
+          nsets = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--data") && argc > 1)
+        {
+          datasize = strtoul (argv[1], NULL, 10);
+          argc -= 2; argv += 2;
+        }
+      else
+        log_fatal ("usage: fdpassbench [--verbose] [--debug]"
+                   " [--fds N] [--sets N] [--data N]\n");
+    }
+  if (nfds < 1 || nfds > MAX_FDS || nsets < 1)
+    log_fatal ("invalid arguments\n");
+
+  assuan_set_assuan_log_prefix (log_prefix);
+  if (gpg_err_code (assuan_sendfd (NULL, ASSUAN_INVALID_FD)))
+    {
+      log_info ("descriptor passing is not supported\n");
+      return 0;
+    }
+
+  err = assuan_new (&ctx);
+  if (err)
+    log_fatal ("assuan_new failed: %s\n", gpg_strerror (err));
+  no_close_fds[0] = verbose? assuan_fd_from_posix_fd (2) : ASSUAN_INVALID_FD;
+  no_close_fds[1] = ASSUAN_INVALID_FD;
+  err = assuan_pipe_connect (ctx, NULL, &loc, no_close_fds, NULL, NULL,
+                             ASSUAN_PIPE_CONNECT_FDPASSING);
+  if (err)
+    log_fatal ("assuan_pipe_connect failed: %s\n", gpg_strerror (err));
+  if (loc[0] == 's')
+    {
+      assuan_release (ctx);
+      server ();
+      return errorcount ? 1 : 0;
+    }
+
+  if (datasize)
+    {
+      unsigned char *buffer;
+      size_t n;
+
+      buffer = malloc (datasize);
+      if (!buffer)
+        log_fatal ("out of core\n");
+      for (n = 0; n < datasize; n++)
+        buffer[n] = n & 0xff;
+      run_data (ctx, buffer, 0);
+      run_data (ctx, buffer, 1);
+      free (buffer);
+      assuan_release (ctx);
+      return errorcount ? 1 : 0;
+    }
+
+  /* The same descriptor may be passed several times.  */
+  fd = open ("/dev/null", O_RDONLY);
+  if (fd == -1)
+    log_fatal ("can't open /dev/null: %s\n", strerror (errno));
+  for (i = 0; i < nfds; i++)
+    fds[i] = fd;
+
+  run (ctx, fds, 0);
+  run (ctx, fds, 1);
+
+  close (fd);
+  assuan_release (ctx);
+  return errorcount ? 1 : 0;
+#else /*HAVE_W32_SYSTEM*/
+  (void)argc;
+  (void)argv;
+  return 0;
+#endif /*HAVE_W32_SYSTEM*/
+}
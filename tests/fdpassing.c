@@ -32,8 +32,12 @@
 # include <io.h>
 #include <fcntl.h>
 #else
+# include <fcntl.h>
+# include <poll.h>
+# include <signal.h>
 # include <sys/socket.h>
 # include <sys/un.h>
+# include <sys/wait.h>
 #endif
 #include <unistd.h>
 #include <errno.h>
@@ -41,6 +45,42 @@
 #include "../src/assuan.h"
 #include "common.h"
 
+/* The number of descriptors sent at once; more than fit into the
+   initial queue of pending descriptors.  */
+#define NFDS 10
+
+/* The limit of pending descriptors set for the check of that
+   limit.  */
+#define MAXPENDING 4
+
+/* Data of at least this size is passed in a memory file.  */
+#define MEMFD_THRESHOLD 4096
+
+
+/* Fill BUFFER of LENGTH bytes with a pattern which is not the same
+   for each line.  */
+static void
+fill_pattern (unsigned char *buffer, size_t length)
+{
+  size_t i;
+
+  for (i = 0; i < length; i++)
+    buffer[i] = (i * 7 + i / 251) & 0xff;
+}
+
+/* Return true if BUFFER of LENGTH bytes starting at offset OFF holds
+   the pattern.  */
+static int
+check_pattern (const unsigned char *buffer, size_t length, size_t off)
+{
+  size_t i;
+
+  for (i = 0; i < length; i++)
+    if (buffer[i] != (((off + i) * 7 + (off + i) / 251) & 0xff))
+      return 0;
+  return 1;
+}
+
 
 /*
 
@@ -92,26 +132,172 @@ cmd_echo (assuan_context_t ctx, char *line)
   return 0;
 }
 
+/* ECHOFDS N - Count the bytes of the N descriptors sent at once.  */
+static gpg_error_t
+cmd_echofds (assuan_context_t ctx, char *line)
+{
+  assuan_fd_t fds[NFDS];
+  gpg_error_t err;
+  int fd, n, i, nbytes;
+  char buffer[256];
+  ssize_t len;
+
+  log_info ("got ECHOFDS command (%s)\n", line);
+
+  n = atoi (line);
+  if (n < 1 || n > NFDS)
+    return gpg_error (GPG_ERR_ASS_PARAMETER);
+  err = assuan_receivefds (ctx, fds, n);
+  if (err)
+    return err;
+
+  for (i = 0; i < n; i++)
+    {
+#if HAVE_W32_SYSTEM
+      fd = _open_osfhandle ((intptr_t)fds[i], _O_RDONLY);
+#else
+      fd = (int)fds[i];
+#endif
+      nbytes = 0;
+      while ((len = read (fd, buffer, sizeof buffer)) > 0)
+        nbytes += len;
+      close (fd);
+      log_info ("read %d bytes from descriptor %d of %d\n", nbytes, i+1, n);
+      if (!nbytes)
+        err = gpg_error (GPG_ERR_ASS_NO_INPUT);
+    }
+  return err;
+}
+
+#ifndef HAVE_W32_SYSTEM
+/* MAXFDS N - Keep at most N received descriptors pending; 0 restores
+   the default.  */
+static gpg_error_t
+cmd_maxfds (assuan_context_t ctx, char *line)
+{
+  assuan_set_flag (ctx, ASSUAN_MAX_PENDING_FDS, atoi (line));
+  return 0;
+}
+
+/* READFDS N - Read one byte from each of N pending descriptors and
+   send these bytes back.  No further descriptor may be pending.  */
+static gpg_error_t
+cmd_readfds (assuan_context_t ctx, char *line)
+{
+  assuan_fd_t fds[NFDS], extra;
+  char buffer[NFDS];
+  gpg_error_t err;
+  int n, i;
+
+  n = atoi (line);
+  if (n < 1 || n > NFDS)
+    return gpg_error (GPG_ERR_ASS_PARAMETER);
+  err = assuan_receivefds (ctx, fds, n);
+  if (err)
+    return err;
+  for (i = 0; i < n; i++)
+    {
+      if (read (fds[i], buffer + i, 1) != 1)
+        err = gpg_error (GPG_ERR_ASS_NO_INPUT);
+      close (fds[i]);
+    }
+  if (!assuan_receivefd (ctx, &extra))
+    {
+      log_error ("more than %d descriptors pending\n", n);
+      close (extra);
+      err = gpg_error (GPG_ERR_TOO_MANY);
+    }
+  if (!err)
+    err = assuan_send_data (ctx, buffer, n);
+  return err;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+/* ALLOWSHM N - Set the flag ASSUAN_ALLOW_SHM to N.  */
+static gpg_error_t
+cmd_allowshm (assuan_context_t ctx, char *line)
+{
+  assuan_set_flag (ctx, ASSUAN_ALLOW_SHM, atoi (line));
+  return 0;
+}
+
+/* DATA N - Inquire N bytes of data and send them back.  */
 static gpg_error_t
-register_commands (assuan_context_t ctx)
+cmd_data (assuan_context_t ctx, char *line)
 {
-  static struct
+  gpg_error_t err;
+  unsigned char *buffer;
+  size_t length, n;
+
+  n = strtoul (line, NULL, 10);
+  err = assuan_inquire (ctx, "BLOB", &buffer, &length, 0);
+  if (err)
+    return err;
+  if (length != n || !check_pattern (buffer, length, 0))
+    {
+      log_error ("inquired data is corrupt\n");
+      err = gpg_error (GPG_ERR_BAD_DATA);
+    }
+  else
+    err = assuan_send_data (ctx, buffer, length);
+  free (buffer);
+  return err;
+}
+
+static struct
+{
+  const char *name;
+  gpg_error_t (*handler) (assuan_context_t, char *line);
+} command_table[] =
   {
-    const char *name;
-    gpg_error_t (*handler) (assuan_context_t, char *line);
-  } table[] =
-      {
-	{ "ECHO", cmd_echo },
-	{ "INPUT", NULL },
-	{ "OUTPUT", NULL },
-	{ NULL, NULL }
-      };
+    { "ECHO", cmd_echo },
+    { "ECHOFDS", cmd_echofds },
+    { "DATA", cmd_data },
+    { "ALLOWSHM", cmd_allowshm },
+#ifndef HAVE_W32_SYSTEM
+    { "MAXFDS", cmd_maxfds },
+    { "READFDS", cmd_readfds },
+#endif
+    { "INPUT", NULL },
+    { "OUTPUT", NULL },
+    { NULL, NULL }
+  };
+
+#ifndef HAVE_W32_SYSTEM
+/* Run the handler of the current command and finish the command as
+   required with assuan_process_next.  */
+static gpg_error_t
+cmd_next (assuan_context_t ctx, char *line)
+{
+  const char *name = assuan_get_command_name (ctx);
+  int i;
+
+  for (i=0; command_table[i].name; i++)
+    if (command_table[i].handler && !strcmp (command_table[i].name, name))
+      return assuan_process_done (ctx, command_table[i].handler (ctx, line));
+  return assuan_process_done (ctx, gpg_error (GPG_ERR_ASS_UNKNOWN_CMD));
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+/* Register the commands; NEXT is set for a server driven by
+   assuan_process_next.  */
+static gpg_error_t
+register_commands (assuan_context_t ctx, int next)
+{
+  assuan_handler_t handler;
   int i;
   gpg_error_t rc;
 
-  for (i=0; table[i].name; i++)
+  for (i=0; command_table[i].name; i++)
     {
-      rc = assuan_register_command (ctx, table[i].name, table[i].handler, NULL);
+      handler = command_table[i].handler;
+#ifndef HAVE_W32_SYSTEM
+      if (next && handler)
+        handler = cmd_next;
+#else
+      (void)next;
+#endif
+      rc = assuan_register_command (ctx, command_table[i].name, handler, NULL);
       if (rc)
         return rc;
     }
@@ -124,11 +310,13 @@ server_common (assuan_context_t ctx)
 {
   int rc;
 
-  rc = register_commands (ctx);
+  rc = register_commands (ctx, 0);
   if (rc)
     log_fatal ("register_commands failed: %s\n", gpg_strerror(rc));
 
   assuan_set_log_stream (ctx, stderr);
+  assuan_set_flag (ctx, ASSUAN_DATA_MEMFD, MEMFD_THRESHOLD);
+  assuan_set_flag (ctx, ASSUAN_ALLOW_SHM, 1);
 
   for (;;)
     {
@@ -170,6 +358,72 @@ server_pipe (void)
   server_common (ctx);
 }
 
+#ifndef HAVE_W32_SYSTEM
+/* Serve the client on the pipe like an event driven server, which
+   polls the descriptors of assuan_get_active_fds and calls
+   assuan_process_next.  */
+static void
+server_next (void)
+{
+  assuan_context_t ctx;
+  assuan_fd_t fds[2];
+  struct pollfd pfd[2];
+  int rc, i, n, done = 0;
+
+  log_info ("event driven server started\n");
+
+  rc = assuan_new (&ctx);
+  if (rc)
+    log_fatal ("assuan_new failed: %s\n", gpg_strerror (rc));
+  rc = assuan_init_pipe_server (ctx, NULL);
+  if (rc)
+    log_fatal ("assuan_init_pipe_server failed: %s\n", gpg_strerror (rc));
+  rc = register_commands (ctx, 1);
+  if (rc)
+    log_fatal ("register_commands failed: %s\n", gpg_strerror(rc));
+  assuan_set_log_stream (ctx, stderr);
+  assuan_set_flag (ctx, ASSUAN_DATA_MEMFD, MEMFD_THRESHOLD);
+  assuan_set_flag (ctx, ASSUAN_ALLOW_SHM, 1);
+
+  rc = assuan_accept (ctx);
+  if (rc)
+    log_fatal ("assuan_accept failed: %s\n", gpg_strerror (rc));
+  while (!done)
+    {
+      if (!assuan_pending_line (ctx))
+        {
+          n = assuan_get_active_fds (ctx, 0, fds, 2);
+          if (n < 1)
+            log_fatal ("assuan_get_active_fds failed\n");
+          for (i = 0; i < n; i++)
+            {
+              pfd[i].fd = fds[i];
+              pfd[i].events = POLLIN;
+            }
+          rc = poll (pfd, n, 10000);
+          if (rc < 0 && errno == EINTR)
+            continue;
+          if (rc < 0)
+            log_fatal ("poll failed: %s\n", strerror (errno));
+          if (!rc)
+            {
+              log_error ("event driven server has not been woken up\n");
+              break;
+            }
+        }
+      rc = assuan_process_next (ctx, &done);
+      if (rc)
+        {
+          log_error ("assuan_process_next failed: %s\n", gpg_strerror (rc));
+          break;
+        }
+    }
+
+  assuan_release (ctx);
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
 static assuan_sock_nonce_t socket_nonce;
 
 static void
@@ -241,20 +495,168 @@ server_socket (const char *socketname)
 */
 
 
-/* Client main.  If true is returned, a disconnect has not been done. */
+struct data_parm_s
+{
+  assuan_context_t ctx;
+  size_t length;    /* The amount of data to send.  */
+  size_t received;  /* The amount of data received so far.  */
+  int corrupt;
+};
+
+static gpg_error_t
+data_cb (void *opaque, const void *buffer, size_t length)
+{
+  struct data_parm_s *parm = opaque;
+
+  if (!check_pattern (buffer, length, parm->received))
+    parm->corrupt = 1;
+  parm->received += length;
+  return 0;
+}
+
+static gpg_error_t
+inquire_cb (void *opaque, const char *keyword)
+{
+  struct data_parm_s *parm = opaque;
+  unsigned char *buffer;
+  gpg_error_t err;
+
+  (void)keyword;
+  buffer = malloc (parm->length);
+  if (!buffer)
+    return gpg_error_from_syserror ();
+  fill_pattern (buffer, parm->length);
+  err = assuan_send_data (parm->ctx, buffer, parm->length);
+  free (buffer);
+  return err;
+}
+
+/* Send LENGTH bytes of data to the server and check what comes
+   back.  */
 static int
-client (assuan_context_t ctx, const char *fname)
+send_data (assuan_context_t ctx, size_t length)
+{
+  struct data_parm_s parm;
+  char line[32];
+  gpg_error_t rc;
+
+  memset (&parm, 0, sizeof parm);
+  parm.ctx = ctx;
+  parm.length = length;
+  snprintf (line, sizeof line, "DATA %lu", (unsigned long)length);
+  rc = assuan_transact (ctx, line, data_cb, &parm, inquire_cb, &parm,
+                        NULL, NULL);
+  if (rc)
+    {
+      log_error ("sending %s failed: %s\n", line, gpg_strerror (rc));
+      return -1;
+    }
+  if (parm.received != length || parm.corrupt)
+    {
+      log_error ("%s returned %s data\n", line,
+                 parm.corrupt? "corrupt" : "truncated");
+      return -1;
+    }
+  return 0;
+}
+
+
+#ifndef HAVE_W32_SYSTEM
+static gpg_error_t
+collect_cb (void *opaque, const void *buffer, size_t length)
+{
+  char *result = opaque;
+  size_t n = strlen (result);
+
+  if (n + length >= NFDS + 1)
+    return gpg_error (GPG_ERR_TOO_LARGE);
+  memcpy (result + n, buffer, length);
+  result[n + length] = 0;
+  return 0;
+}
+
+/* Pass NFDS pipes at once to a server which keeps only MAXPENDING
+   descriptors pending.  The first ones must be received in order and
+   the others closed.  */
+static int
+pass_capped (assuan_context_t ctx)
+{
+  int pipes[NFDS][2];
+  assuan_fd_t fds[NFDS];
+  char line[32], result[NFDS + 1];
+  gpg_error_t rc;
+  int i, failed = 0;
+
+  for (i = 0; i < NFDS; i++)
+    {
+      if (pipe (pipes[i]))
+        log_fatal ("pipe failed: %s\n", strerror (errno));
+      if (write (pipes[i][1], "0123456789" + i, 1) != 1)
+        log_fatal ("write failed: %s\n", strerror (errno));
+      fds[i] = pipes[i][0];
+    }
+
+  snprintf (line, sizeof line, "MAXFDS %d", MAXPENDING);
+  rc = assuan_transact (ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+  if (!rc)
+    rc = assuan_sendfds (ctx, fds, NFDS);
+  for (i = 0; i < NFDS; i++)
+    close (pipes[i][0]);
+  *result = 0;
+  snprintf (line, sizeof line, "READFDS %d", MAXPENDING);
+  if (!rc)
+    rc = assuan_transact (ctx, line, collect_cb, result,
+                          NULL, NULL, NULL, NULL);
+  if (rc)
+    {
+      log_error ("passing capped descriptors failed: %s\n",
+                 gpg_strerror (rc));
+      failed = 1;
+    }
+  else if (strlen (result) != MAXPENDING
+           || strncmp (result, "0123456789", MAXPENDING))
+    {
+      log_error ("READFDS returned `%s'\n", result);
+      failed = 1;
+    }
+
+  /* All read ends must have been closed by the server.  */
+  signal (SIGPIPE, SIG_IGN);
+  for (i = 0; i < NFDS; i++)
+    {
+      if (!failed && (write (pipes[i][1], "x", 1) != -1 || errno != EPIPE))
+        {
+          log_error ("descriptor %d is still open in the server\n", i);
+          failed = 1;
+        }
+      close (pipes[i][1]);
+    }
+
+  rc = assuan_transact (ctx, "MAXFDS 0", NULL, NULL, NULL, NULL, NULL, NULL);
+  if (rc)
+    {
+      log_error ("resetting MAXFDS failed: %s\n", gpg_strerror (rc));
+      failed = 1;
+    }
+  return failed? -1 : 0;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+/* Pass descriptors and data to the server.  */
+static int
+exchange (assuan_context_t ctx, const char *fname)
 {
   int rc;
   FILE *fp;
+  FILE *fps[NFDS];
+  assuan_fd_t fds[NFDS];
+  char line[32];
   int i;
 #if HAVE_W32_SYSTEM
   HANDLE file_handle;
 #endif
 
-  log_info ("client started. Servers's pid is %ld\n",
-            (long)assuan_get_pid (ctx));
-
   for (i=0; i < 6; i++)
     {
       fp = fopen (fname, "r");
@@ -295,6 +697,95 @@ client (assuan_context_t ctx, const char *fname)
         }
     }
 
+  /* Now send several descriptors at once.  */
+  for (i=0; i < NFDS; i++)
+    {
+      fps[i] = fopen (fname, "r");
+      if (!fps[i])
+        {
+          log_error ("failed to open `%s': %s\n", fname,
+                     strerror (errno));
+          return -1;
+        }
+#ifdef HAVE_W32_SYSTEM
+      fds[i] = (HANDLE)_get_osfhandle (fileno (fps[i]));
+#else
+      fds[i] = (assuan_fd_t)fileno (fps[i]);
+#endif
+    }
+  rc = assuan_sendfds (ctx, fds, NFDS);
+  for (i=0; i < NFDS; i++)
+    fclose (fps[i]);
+  if (rc)
+    {
+      log_error ("assuan_sendfds failed: %s\n", gpg_strerror (rc));
+      return -1;
+    }
+
+  snprintf (line, sizeof line, "ECHOFDS %d", NFDS);
+  rc = assuan_transact (ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+  if (rc)
+    {
+      log_error ("sending ECHOFDS failed: %s\n", gpg_strerror (rc));
+      return -1;
+    }
+
+#ifndef HAVE_W32_SYSTEM
+  if (pass_capped (ctx))
+    return -1;
+#endif
+
+  /* Data above the threshold is passed in memory files.  */
+  assuan_set_flag (ctx, ASSUAN_DATA_MEMFD, MEMFD_THRESHOLD);
+  if (send_data (ctx, 100) || send_data (ctx, 3 * 1024 * 1024))
+    return -1;
+  return 0;
+}
+
+
+/* Client main.  If true is returned, a disconnect has not been done. */
+static int
+client (assuan_context_t ctx, const char *fname)
+{
+  gpg_error_t rc;
+
+  log_info ("client started. Servers's pid is %ld\n",
+            (long)assuan_get_pid (ctx));
+
+  if (exchange (ctx, fname))
+    return -1;
+
+  /* The server knows SHM only while it allows it.  */
+  rc = assuan_transact (ctx, "ALLOWSHM 0", NULL, NULL, NULL, NULL, NULL, NULL);
+  if (!rc && (gpg_err_code (assuan_transact (ctx, "HELP SHM", NULL, NULL,
+                                             NULL, NULL, NULL, NULL))
+              != GPG_ERR_UNKNOWN_COMMAND))
+    log_error ("SHM still known after clearing ASSUAN_ALLOW_SHM\n");
+  if (!rc)
+    rc = assuan_transact (ctx, "ALLOWSHM 1",
+                          NULL, NULL, NULL, NULL, NULL, NULL);
+  if (!rc && (gpg_err_code (assuan_transact (ctx, "HELP SHM", NULL, NULL,
+                                             NULL, NULL, NULL, NULL))
+              == GPG_ERR_UNKNOWN_COMMAND))
+    log_error ("SHM not known with ASSUAN_ALLOW_SHM\n");
+  if (rc)
+    {
+      log_error ("ALLOWSHM failed: %s\n", gpg_strerror (rc));
+      return -1;
+    }
+
+  /* Do it all again with the lines going through shared memory.  */
+  rc = assuan_shm_start (ctx, 0);
+  if (gpg_err_code (rc) == GPG_ERR_NOT_SUPPORTED)
+    log_info ("shared memory is not supported\n");
+  else if (rc)
+    {
+      log_error ("assuan_shm_start failed: %s\n", gpg_strerror (rc));
+      return -1;
+    }
+  else if (exchange (ctx, fname))
+    return -1;
+
   /* Give us some time to check with lsof that all descriptors are closed. */
 /*   sleep (10); */
 
@@ -303,6 +794,139 @@ client (assuan_context_t ctx, const char *fname)
 }
 
 
+#ifndef HAVE_W32_SYSTEM
+/* Run COMMAND like send_data using assuan_transact_start and poll the
+   descriptors of assuan_get_active_fds in between.  */
+static gpg_error_t
+step_transact (assuan_context_t ctx, const char *command,
+               struct data_parm_s *parm)
+{
+  assuan_fd_t fds[2];
+  struct pollfd pfd[2];
+  gpg_error_t rc;
+  int want, i, n, res;
+
+  rc = assuan_transact_start (ctx, command, data_cb, parm, inquire_cb, parm,
+                              NULL, NULL);
+  if (rc)
+    return rc;
+  while ((want = assuan_transact_step (ctx, &rc)) != ASSUAN_TRANSACT_DONE)
+    {
+      /* With shared memory all descriptors are polled for reading.  */
+      n = assuan_get_active_fds (ctx, want == ASSUAN_TRANSACT_WANT_WRITE,
+                                 fds, 2);
+      if (n < 1)
+        return gpg_error (GPG_ERR_INV_STATE);
+      for (i = 0; i < n; i++)
+        {
+          pfd[i].fd = fds[i];
+          pfd[i].events = n > 1 || want == ASSUAN_TRANSACT_WANT_READ
+                          ? POLLIN : POLLOUT;
+        }
+      res = poll (pfd, n, 10000);
+      if (res < 0 && errno != EINTR)
+        return gpg_error_from_syserror ();
+      if (!res)
+        return gpg_error (GPG_ERR_TIMEOUT);
+    }
+  return rc;
+}
+
+
+/* Talk through shared memory to an event driven server, using
+   assuan_transact as well as assuan_transact_start, and check that
+   the end of the server is noticed.  */
+static void
+client_next (const char *fname)
+{
+  assuan_context_t ctx;
+  assuan_fd_t no_close_fds[2], fds[2];
+  struct data_parm_s parm;
+  const char *loc;
+  char line[32];
+  gpg_error_t rc;
+  int i, n;
+
+  rc = assuan_new (&ctx);
+  if (rc)
+    log_fatal ("assuan_new failed: %s\n", gpg_strerror (rc));
+  no_close_fds[0] = verbose? assuan_fd_from_posix_fd (2): (assuan_fd_t)-1;
+  no_close_fds[1] = (assuan_fd_t)-1;
+  rc = assuan_pipe_connect (ctx, NULL, &loc, no_close_fds, NULL, NULL, 1);
+  if (rc)
+    {
+      log_error ("assuan_pipe_connect failed: %s\n", gpg_strerror (rc));
+      assuan_release (ctx);
+      return;
+    }
+  if (loc[0] == 's')
+    {
+      server_next ();
+      assuan_release (ctx);
+      exit (errorcount ? 1 : 0);
+    }
+
+  rc = assuan_shm_start (ctx, 0);
+  if (gpg_err_code (rc) == GPG_ERR_NOT_SUPPORTED)
+    {
+      log_info ("shared memory is not supported\n");
+      assuan_release (ctx);
+      return;
+    }
+  if (rc)
+    {
+      log_error ("assuan_shm_start failed: %s\n", gpg_strerror (rc));
+      assuan_release (ctx);
+      return;
+    }
+  if (exchange (ctx, fname))
+    {
+      assuan_release (ctx);
+      return;
+    }
+
+  /* Lines and inquired data which do not fit into the ring at once
+     make both sides wait for each other.  */
+  assuan_set_flag (ctx, ASSUAN_DATA_MEMFD, 0);
+  n = assuan_get_active_fds (ctx, 0, fds, 2);
+  if (n != 2)
+    log_error ("assuan_get_active_fds returned %d descriptors\n", n);
+  for (i = 0; i < n; i++)
+    fcntl (fds[i], F_SETFL, fcntl (fds[i], F_GETFL) | O_NONBLOCK);
+  for (i = 0; i < 20; i++)
+    {
+      memset (&parm, 0, sizeof parm);
+      parm.ctx = ctx;
+      parm.length = (i & 1)? 200000 : 100;
+      snprintf (line, sizeof line, "DATA %lu", (unsigned long)parm.length);
+      rc = step_transact (ctx, line, &parm);
+      if (rc)
+        {
+          log_error ("%s using assuan_transact_step failed: %s\n",
+                     line, gpg_strerror (rc));
+          break;
+        }
+      if (parm.received != parm.length || parm.corrupt)
+        log_error ("%s returned %s data\n", line,
+                   parm.corrupt? "corrupt" : "truncated");
+    }
+
+  /* The end of the server is seen although it does not use the
+     rings.  */
+  kill (assuan_get_pid (ctx), SIGTERM);
+  waitpid (assuan_get_pid (ctx), NULL, 0);
+  assuan_set_flag (ctx, ASSUAN_NO_WAITPID, 1);
+  memset (&parm, 0, sizeof parm);
+  parm.ctx = ctx;
+  rc = step_transact (ctx, "DATA 100", &parm);
+  if (!rc || gpg_err_code (rc) == GPG_ERR_TIMEOUT)
+    log_error ("end of the server not noticed: %s\n", gpg_strerror (rc));
+
+  assuan_release (ctx);
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
 
 
 /*
@@ -457,6 +1081,10 @@ main (int argc, char **argv)
           log_info ("waiting for server to terminate...\n");
           assuan_release (ctx);
         }
+#ifndef HAVE_W32_SYSTEM
+      if (!socketname && !with_exec)
+        client_next (fname);
+#endif
       log_info ("client finished\n");
       xfree (fname);
     }
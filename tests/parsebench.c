@@ -0,0 +1,276 @@
+/* parsebench.c - Benchmark for the client response parser
+   Copyright (C) 2026 g10 Code GmbH
+
+   This file is part of Assuan.
+
+   Assuan is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 3 of
+   the License, or (at your option) any later version.
+
+   Assuan is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   This program runs assuan_client_parse_response over a transcript
+   of server responses like those gpg and gpgsm see when talking to
+   gpg-agent, scdaemon and dirmngr.  For comparison the same lines are
+   also parsed with the former comparison chain followed by the
+   keyword and error code extraction the callers had to do; both must
+   agree on the classification.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+
+#include "../src/assuan.h"
+#include "common.h"
+
+
+/* Responses in the mix and with the lengths typically seen in
+   gpg-connect-agent sessions.  Identifying values have been
+   replaced.  */
+static const char *transcript[] =
+  {
+    "OK Pleased to meet you, process 4711",
+    "OK",
+    "S PROGRESS starting_agent ? 0 0",
+    "S KEYINFO 6BD9E8F2C1D8F5A41D15F8A3B2C5D2E1F0A9B8C7 D - - - P - - -",
+    "OK",
+    "INQUIRE PINENTRY_LAUNCHED 4712 curses 1.2.1 /dev/pts/3 xterm-256color - 1000/1000/4711 1000/1000 0",
+    "OK",
+    "S INQUIRE_MAXLEN 255",
+    "INQUIRE PASSPHRASE",
+    "D (7:sig-val(3:rsa(1:s256:%0A%9F%C3%12%8D%25%0D%99%AA%03%EF",
+    "D %1B%B4%2A%7C%0F%5D%99%CC%E3%12%88%90%AB%CD%EF%01%23%45%67",
+    "S KEY_CONSIDERED 8F2A1E7C5B3D9F6E4A2C0B8D7E5F3A1C9B7D5E3F 0",
+    "S KEY_CONSIDERED 3C5E7A9B1D3F5A7C9E1B3D5F7A9C1E3B5D7F9A1C 0",
+    "S PINENTRY_LAUNCHED 4712 curses 1.2.1 /dev/pts/3 xterm-256color -",
+    "D 3082010a0282010100c3a1f2e4d6b8c0a2e4f6a8b0c2d4e6f8a0b2c4d6e8f0a2b4c6d8e0f2a4b6c8d0e2f4a6b8c0d2e4f6a8b0c2d4e6f8a0b2c4d6e8f0a2b4",
+    "D c6d8e0f2a4b6c8d0e2f4a6b8c0d2e4f6a8b0c2d4e6f8a0b2c4d6e8f0a2b4c6d8e0f2a4b6c8d0e2f4a6b8c0d2e4f6a8b0c2d4e6f8a0b2c4d6e8f0a2b4c6d8",
+    "END",
+    "# Home: /home/alice/.gnupg",
+    "S SERIALNO D2760001240103040006123456780000",
+    "S APPTYPE openpgp",
+    "S DISP-NAME Doe<<Jane",
+    "S KEY-FPR 1 8F2A1E7C5B3D9F6E4A2C0B8D7E5F3A1C9B7D5E3F",
+    "S KEY-TIME 1 1609459200",
+    "S SIG-COUNTER 42",
+    "S CHV-STATUS +1+127+127+127+3+0+3",
+    "OK",
+    "ERR 67108949 No data <GPG Agent>",
+    "ERR 100663404 Card error <SCD>",
+    "ERR 83886179 Operation cancelled <Pinentry>",
+    "S PROGRESS primegen ? 12 0",
+    "S PROGRESS primegen ? 13 0",
+    "S PROGRESS primegen ? 14 0",
+    "S PROGRESS need_entropy X 30 300",
+    "S CACHE_NONCE 8E5F3A1C9B7D5E3F2A4C",
+    "D -----BEGIN PGP PUBLIC KEY BLOCK-----%0A%0AmQINBF/1AAABEADHk2L",
+    "D 5xQH8yWw9tZrJ3k6P1nLq4R7sVbXcYd2eFg8hIj0kMl3nOp5qRs7tUv9wXy1z",
+    "OK closing connection"
+  };
+
+
+/* The parser as it was before the keyword table was introduced.  It
+   is called through a pointer so that it is not inlined and the call
+   overhead is comparable to the library call.  */
+static int
+reference_parse (const char *line, int linelen, int *response, int *off,
+                 int *errcode)
+{
+  *response = ASSUAN_RESPONSE_ERROR;
+  *off = 0;
+  *errcode = 0;
+
+  if (linelen >= 1 && line[0] == 'D' && line[1] == ' ')
+    {
+      *response = ASSUAN_RESPONSE_DATA;
+      *off = 2;
+    }
+  else if (linelen >= 1 && line[0] == 'S'
+           && (line[1] == '\0' || line[1] == ' '))
+    {
+      *response = ASSUAN_RESPONSE_STATUS;
+      *off = 1;
+      while (line[*off] == ' ')
+        ++*off;
+    }
+  else if (linelen >= 2 && line[0] == 'O' && line[1] == 'K'
+           && (line[2] == '\0' || line[2] == ' '))
+    {
+      *response = ASSUAN_RESPONSE_OK;
+      *off = 2;
+      while (line[*off] == ' ')
+        ++*off;
+    }
+  else if (linelen >= 3
+           && line[0] == 'E' && line[1] == 'R' && line[2] == 'R'
+           && (line[3] == '\0' || line[3] == ' '))
+    {
+      *response = ASSUAN_RESPONSE_ERROR;
+      *off = 3;
+      while (line[*off] == ' ')
+        ++*off;
+    }
+  else if (linelen >= 7
+           && line[0] == 'I' && line[1] == 'N' && line[2] == 'Q'
+           && line[3] == 'U' && line[4] == 'I' && line[5] == 'R'
+           && line[6] == 'E'
+           && (line[7] == '\0' || line[7] == ' '))
+    {
+      *response = ASSUAN_RESPONSE_INQUIRE;
+      *off = 7;
+      while (line[*off] == ' ')
+        ++*off;
+    }
+  else if (linelen >= 3
+           && line[0] == 'E' && line[1] == 'N' && line[2] == 'D'
+           && (line[3] == '\0' || line[3] == ' '))
+    {
+      *response = ASSUAN_RESPONSE_END;
+      *off = 3;
+    }
+  else if (linelen >= 1 && line[0] == '#')
+    {
+      *response = ASSUAN_RESPONSE_COMMENT;
+      *off = 1;
+    }
+  else
+    return -1;
+
+  /* The callers then ran atoi on error lines and the status callbacks
+     had to find the end of the keyword; this is part of the cost being
+     compared because the library now does it while classifying.  */
+  if (*response == ASSUAN_RESPONSE_ERROR)
+    *errcode = atoi (line + *off);
+  else if (*response == ASSUAN_RESPONSE_STATUS
+           || *response == ASSUAN_RESPONSE_INQUIRE)
+    *errcode = strcspn (line + *off, " ");
+
+  return 0;
+}
+
+
+static int (*volatile reference_fnc) (const char *, int, int *, int *, int *)
+  = reference_parse;
+
+
+static double
+now (void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return (double)clock () / CLOCKS_PER_SEC;
+#endif
+}
+
+
+int
+main (int argc, char **argv)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+  char lines[DIM (transcript)][ASSUAN_LINELENGTH];
+  int lens[DIM (transcript)];
+  unsigned long iterations = 200000;
+  unsigned long iter;
+  unsigned long sum = 0;
+  int i, response, off, ref_response, ref_off, errcode;
+  double start, lib_time, ref_time;
+  unsigned long nlines;
+
+  if (argc)
+    {
+      log_set_prefix (*argv);
+      argc--; argv++;
+    }
+  while (argc)
+    {
+      if (!strcmp (*argv, "--verbose"))
+        {
+          verbose = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--debug"))
+        {
+          verbose = debug = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--iterations") && argc > 1)
+        {
+          iterations = strtoul (argv[1], NULL, 10);
+          argc -= 2; argv += 2;
+        }
+      else
+        log_fatal ("usage: parsebench [--verbose] [--debug]"
+                   " [--iterations N]\n");
+    }
+
+  err = assuan_new (&ctx);
+  if (err)
+    log_fatal ("assuan_new failed: %s\n", gpg_strerror (err));
+
+  /* The parser works on modifiable lines.  */
+  for (i = 0; i < DIM (transcript); i++)
+    {
+      lens[i] = strlen (transcript[i]);
+      memcpy (lines[i], transcript[i], lens[i] + 1);
+
+      err = assuan_client_parse_response (ctx, lines[i], lens[i],
+                                          &response, &off);
+      if (err
+          || reference_parse (lines[i], lens[i], &ref_response, &ref_off,
+                              &errcode)
+          || response != ref_response || off != ref_off)
+        log_error ("parsers disagree on `%s'\n", lines[i]);
+    }
+
+  start = now ();
+  for (iter = 0; iter < iterations; iter++)
+    for (i = 0; i < DIM (transcript); i++)
+      {
+        assuan_client_parse_response (ctx, lines[i], lens[i],
+                                      &response, &off);
+        sum += response + off;
+      }
+  lib_time = now () - start;
+
+  start = now ();
+  for (iter = 0; iter < iterations; iter++)
+    for (i = 0; i < DIM (transcript); i++)
+      {
+        reference_fnc (lines[i], lens[i], &response, &off, &errcode);
+        sum += response + off + errcode;
+      }
+  ref_time = now () - start;
+
+  nlines = iterations * DIM (transcript);
+  printf ("lines parsed:       %lu (checksum %lu)\n", nlines, sum);
+  printf ("table parser:       %.2f ns/line\n",
+          nlines? lib_time * 1e9 / nlines : 0.0);
+  printf ("comparison chain:   %.2f ns/line\n",
+          nlines? ref_time * 1e9 / nlines : 0.0);
+
+  assuan_release (ctx);
+  return errorcount ? 1 : 0;
+}
@@ -0,0 +1,616 @@
+/* serverloop.c - Check the built-in server loop
+   Copyright (C) 2026 g10 Code GmbH
+
+   This file is part of Assuan.
+
+   Assuan is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 3 of
+   the License, or (at your option) any later version.
+
+   Assuan is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   This test runs assuan_server_loop on a socket and forks a process
+   which keeps many connections to that server open and runs their
+   transactions interleaved.  One command returns more data than the
+   socket buffers can hold so that the output is queued by the server.
+   Some connections are made after others have been closed to check
+   that their contexts are re-used.  Finally the remaining connections
+   are left to the timeouts of the server, and the listening socket is
+   taken over by the client, after which the server ends once the
+   connection used for that has been closed.  That connection first
+   passes a descriptor to the server.  All of this is done with epoll
+   and then, if supported, with io_uring.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef HAVE_W32_SYSTEM
+# include <signal.h>
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <sys/wait.h>
+#endif
+
+#include "../src/assuan.h"
+#include "common.h"
+
+#ifndef HAVE_W32_SYSTEM
+
+#define NCLIENTS 32
+#define NLATE    8   /* Connections made after half of them closed.  */
+#define NSPARE   4
+#define NACTIVE  2   /* Commands running at the same time.  */
+#define IDLE_TIMEOUT    500  /* In milliseconds.  */
+#define COMMAND_TIMEOUT 200
+#define PRIORITY_AGING  20
+#define NCONNS   (NCLIENTS + NLATE + 1)  /* Including the takeover.  */
+#define NROUNDS  20
+#define BIGSIZE  (256 * 1024)
+
+static char socket_name[100];
+static assuan_server_t server;
+static int nconnects;
+static int ndisconnects;
+static int nreused;
+
+
+
+/* Server part.  */
+
+static gpg_error_t
+cmd_echo (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+
+  err = assuan_send_data (ctx, line, strlen (line));
+  return assuan_process_done (ctx, err);
+}
+
+
+static gpg_error_t
+cmd_big (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err = 0;
+  char buffer[1024];
+  size_t n;
+
+  (void)line;
+  memset (buffer, 'x', sizeof buffer);
+  for (n = 0; !err && n < BIGSIZE; n += sizeof buffer)
+    err = assuan_send_data (ctx, buffer, sizeof buffer);
+  return assuan_process_done (ctx, err);
+}
+
+
+static gpg_error_t
+add_cont (void *opaque, gpg_error_t rc, unsigned char *buf, size_t len)
+{
+  assuan_context_t ctx = opaque;
+  unsigned long value;
+
+  if (!rc)
+    {
+      char *tmp = malloc (len + 1);
+      char result[30];
+
+      if (!tmp)
+        return assuan_process_done (ctx, gpg_error_from_syserror ());
+      memcpy (tmp, buf, len);
+      tmp[len] = 0;
+      value = strtoul (tmp, NULL, 10);
+      free (tmp);
+      snprintf (result, sizeof result, "%lu", value + 1);
+      rc = assuan_send_data (ctx, result, strlen (result));
+    }
+  return assuan_process_done (ctx, rc);
+}
+
+
+/* Inquire for a number and return it incremented by one.  */
+static gpg_error_t
+cmd_incr (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+
+  (void)line;
+  err = assuan_inquire_ext (ctx, "NUMBER", 100, add_cont, ctx);
+  if (err)
+    return assuan_process_done (ctx, err);
+  return 0;
+}
+
+
+/* Never finish; the server closes the connection after
+   COMMAND_TIMEOUT.  */
+static gpg_error_t
+cmd_hang (assuan_context_t ctx, char *line)
+{
+  (void)ctx;
+  (void)line;
+  return 0;
+}
+
+
+/* Write to the descriptor passed by the client and close it.  */
+static gpg_error_t
+cmd_fd (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+  assuan_fd_t fd;
+
+  (void)line;
+  err = assuan_receivefd (ctx, &fd);
+  if (!err)
+    {
+      if (write (fd, "fd", 2) != 2)
+        err = gpg_error_from_syserror ();
+      close (fd);
+    }
+  return assuan_process_done (ctx, err);
+}
+
+
+/* Pass the listening socket to the client.  */
+static gpg_error_t
+cmd_handoff (assuan_context_t ctx, char *line)
+{
+  (void)line;
+  return assuan_process_done (ctx, assuan_server_handoff (server, ctx, NULL));
+}
+
+
+static gpg_error_t
+connect_cb (void *opaque, assuan_context_t ctx)
+{
+  gpg_error_t err;
+
+  (void)opaque;
+  err = assuan_register_command (ctx, "ECHO", cmd_echo, NULL);
+  if (!err)
+    err = assuan_register_command (ctx, "BIG", cmd_big, NULL);
+  if (!err)
+    err = assuan_register_command (ctx, "INCR", cmd_incr, NULL);
+  if (!err)
+    err = assuan_register_command (ctx, "HANG", cmd_hang, NULL);
+  if (!err)
+    err = assuan_register_command (ctx, "FD", cmd_fd, NULL);
+  if (!err)
+    err = assuan_register_command (ctx, "HANDOFF", cmd_handoff, NULL);
+  if (!err)
+    err = assuan_set_command_priority (ctx, "BIG", ASSUAN_PRIORITY_LOW);
+  if (!err
+      && gpg_err_code (assuan_set_command_priority
+                       (ctx, "NOSUCH", ASSUAN_PRIORITY_HIGH))
+      != GPG_ERR_ASS_UNKNOWN_CMD)
+    log_error ("assuan_set_command_priority accepted an unknown command\n");
+  if (!err && debug)
+    assuan_set_log_stream (ctx, stderr);
+  /* Give other connections a turn after each line.  */
+  assuan_set_flag (ctx, ASSUAN_PROCESS_LINES, 1);
+  if (!err)
+    {
+      nconnects++;
+      /* A re-used context keeps its user pointer.  */
+      if (assuan_get_pointer (ctx))
+        nreused++;
+      else
+        assuan_set_pointer (ctx, &nconnects);
+    }
+  return err;
+}
+
+
+static void
+disconnect_cb (void *opaque, assuan_context_t ctx)
+{
+  (void)opaque;
+  (void)ctx;
+  /* The server stops by itself after the handoff.  */
+  ndisconnects++;
+}
+
+
+
+/* Client part.  */
+
+struct membuf
+{
+  size_t len;
+  char buf[64];
+};
+
+
+static gpg_error_t
+data_cb (void *opaque, const void *buffer, size_t length)
+{
+  struct membuf *mb = opaque;
+
+  if (mb->len + length >= sizeof mb->buf)
+    mb->len = sizeof mb->buf;  /* Overflow; fails the check.  */
+  else
+    {
+      memcpy (mb->buf + mb->len, buffer, length);
+      mb->len += length;
+    }
+  return 0;
+}
+
+
+static gpg_error_t
+count_cb (void *opaque, const void *buffer, size_t length)
+{
+  (void)buffer;
+  *(size_t *)opaque += length;
+  return 0;
+}
+
+
+static gpg_error_t
+inquire_cb (void *opaque, const char *keyword)
+{
+  assuan_context_t ctx = opaque;
+
+  if (strcmp (keyword, "NUMBER"))
+    return gpg_error (GPG_ERR_UNKNOWN_COMMAND);
+  return assuan_send_data (ctx, "41", 2);
+}
+
+
+/* Pass a pipe to the server on CTX, which writes to it.  */
+static gpg_error_t
+pass_pipe (assuan_context_t ctx)
+{
+  gpg_error_t err;
+  char buffer[2];
+  int fds[2];
+
+  if (pipe (fds))
+    log_fatal ("pipe failed: %s\n", strerror (errno));
+  err = assuan_sendfd (ctx, fds[1]);
+  if (!err)
+    err = assuan_transact (ctx, "FD", NULL, NULL, NULL, NULL, NULL, NULL);
+  close (fds[1]);
+  if (!err && (read (fds[0], buffer, 2) != 2 || memcmp (buffer, "fd", 2)))
+    err = gpg_error (GPG_ERR_BAD_DATA);
+  close (fds[0]);
+  return err;
+}
+
+
+static int
+run_client (void)
+{
+  gpg_error_t err;
+  assuan_context_t ctxs[NCLIENTS];
+  assuan_context_t extra;
+  const char *names[NCLIENTS];
+  gpg_error_t errs[NCLIENTS];
+  struct membuf mb;
+  char command[40];
+  struct sockaddr_un addr;
+  assuan_fd_t listen_fd;
+  assuan_sock_nonce_t nonce;
+  int fd, afd;
+  char *line;
+  size_t total, linelen;
+  int i, round;
+
+  for (i = 0; i < NCLIENTS; i++)
+    {
+      err = assuan_new (&ctxs[i]);
+      if (err)
+        log_fatal ("assuan_new failed: %s\n", gpg_strerror (err));
+      names[i] = socket_name;
+    }
+  err = assuan_socket_connect_multi (ctxs, names, NCLIENTS, 0, errs);
+  if (err)
+    log_fatal ("assuan_socket_connect_multi failed: %s\n", gpg_strerror (err));
+  for (i = 0; i < NCLIENTS; i++)
+    if (errs[i])
+      log_fatal ("connection %d failed: %s\n", i, gpg_strerror (errs[i]));
+
+  /* The server is full and rejects further clients.  The rejected
+     client says BYE to the closed socket.  */
+  signal (SIGPIPE, SIG_IGN);
+  err = assuan_new (&extra);
+  if (err)
+    log_fatal ("assuan_new failed: %s\n", gpg_strerror (err));
+  err = assuan_socket_connect (extra, socket_name, ASSUAN_INVALID_PID, 0);
+  if (gpg_err_code (err) != GPG_ERR_ASS_CONNECT_FAILED)
+    log_error ("connection beyond the limit: %s\n", gpg_strerror (err));
+  assuan_release (extra);
+
+  for (round = 0; round < NROUNDS; round++)
+    for (i = 0; i < NCLIENTS; i++)
+      {
+        snprintf (command, sizeof command, "ECHO %d-%d", i, round);
+        mb.len = 0;
+        err = assuan_transact (ctxs[i], command, data_cb, &mb,
+                               NULL, NULL, NULL, NULL);
+        if (err)
+          log_error ("%s failed: %s\n", command, gpg_strerror (err));
+        else if (mb.len != strlen (command + 5)
+                 || memcmp (mb.buf, command + 5, mb.len))
+          log_error ("%s returned a wrong result\n", command);
+      }
+
+  mb.len = 0;
+  err = assuan_transact (ctxs[1], "INCR", data_cb, &mb,
+                         inquire_cb, ctxs[1], NULL, NULL);
+  if (err)
+    log_error ("INCR failed: %s\n", gpg_strerror (err));
+  else if (mb.len != 2 || memcmp (mb.buf, "42", 2))
+    log_error ("INCR returned a wrong result\n");
+
+  total = 0;
+  err = assuan_transact (ctxs[2], "BIG", count_cb, &total,
+                         NULL, NULL, NULL, NULL);
+  if (err)
+    log_error ("BIG failed: %s\n", gpg_strerror (err));
+  else if (total != BIGSIZE)
+    log_error ("BIG returned %lu bytes\n", (unsigned long)total);
+
+  /* Close half of the connections.  After the server has answered
+     the next command it has seen them all closed and the new
+     connections get their contexts.  */
+  for (i = 0; i < NCLIENTS / 2; i++)
+    {
+      assuan_release (ctxs[i]);
+      ctxs[i] = NULL;
+    }
+  err = assuan_transact (ctxs[NCLIENTS - 1], "ECHO", NULL, NULL,
+                         NULL, NULL, NULL, NULL);
+  if (err)
+    log_error ("ECHO failed: %s\n", gpg_strerror (err));
+  for (i = 0; i < NLATE; i++)
+    {
+      err = assuan_new (&ctxs[i]);
+      if (!err)
+        err = assuan_socket_connect (ctxs[i], socket_name,
+                                     ASSUAN_INVALID_PID, 0);
+      mb.len = 0;
+      if (!err)
+        err = assuan_transact (ctxs[i], "ECHO late", data_cb, &mb,
+                               NULL, NULL, NULL, NULL);
+      if (err)
+        log_error ("late connection %d failed: %s\n", i, gpg_strerror (err));
+      else if (mb.len != 4 || memcmp (mb.buf, "late", 4))
+        log_error ("late connection %d returned a wrong result\n", i);
+    }
+
+  /* A command not finished in time ends its connection.  */
+  err = assuan_transact (ctxs[NCLIENTS - 1], "HANG", NULL, NULL,
+                         NULL, NULL, NULL, NULL);
+  if (gpg_err_code (err) != GPG_ERR_TIMEOUT)
+    log_error ("HANG did not time out: %s\n", gpg_strerror (err));
+
+  /* So does an idle connection.  */
+  err = assuan_read_line (ctxs[NCLIENTS - 2], &line, &linelen);
+  if (err)
+    log_error ("reading from an idle connection failed: %s\n",
+               gpg_strerror (err));
+  else if (linelen < 4 || strncmp (line, "ERR ", 4)
+           || gpg_err_code (strtoul (line + 4, NULL, 10)) != GPG_ERR_TIMEOUT)
+    log_error ("idle connection did not time out\n");
+
+  for (i = 0; i < NCLIENTS; i++)
+    assuan_release (ctxs[i]);
+
+  /* Take over the listening socket.  The connection used for that is
+     still served until it is closed.  */
+  err = assuan_new (&extra);
+  if (!err)
+    err = assuan_socket_connect (extra, socket_name, ASSUAN_INVALID_PID,
+                                 ASSUAN_SOCKET_CONNECT_FDPASSING);
+  if (!err)
+    {
+      err = pass_pipe (extra);
+      if (err)
+        log_error ("passing a descriptor failed: %s\n", gpg_strerror (err));
+    }
+  if (!err)
+    err = assuan_server_takeover (extra, "HANDOFF", &listen_fd, &nonce);
+  if (err)
+    log_error ("taking over the server failed: %s\n", gpg_strerror (err));
+  else
+    {
+      /* A new client waits for us now.  */
+      fd = socket (AF_UNIX, SOCK_STREAM, 0);
+      if (fd == -1)
+        log_fatal ("socket failed: %s\n", strerror (errno));
+      memset (&addr, 0, sizeof addr);
+      addr.sun_family = AF_UNIX;
+      strcpy (addr.sun_path, socket_name);
+      if (connect (fd, (struct sockaddr *)&addr, sizeof addr))
+        log_error ("connect after the takeover failed: %s\n",
+                   strerror (errno));
+      else
+        {
+          afd = accept (listen_fd, NULL, NULL);
+          if (afd == -1)
+            log_error ("accept after the takeover failed: %s\n",
+                       strerror (errno));
+          else
+            close (afd);
+        }
+      close (fd);
+      close (listen_fd);
+
+      err = assuan_transact (extra, "ECHO", NULL, NULL,
+                             NULL, NULL, NULL, NULL);
+      if (err)
+        log_error ("ECHO after the handoff failed: %s\n", gpg_strerror (err));
+    }
+  assuan_release (extra);
+  return errorcount ? 1 : 0;
+}
+
+
+
+/* Create the listening socket.  */
+static assuan_fd_t
+create_socket (void)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    log_fatal ("socket failed: %s\n", strerror (errno));
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, socket_name);
+  remove (socket_name);
+  if (bind (fd, (struct sockaddr *)&addr, sizeof addr))
+    log_fatal ("bind failed: %s\n", strerror (errno));
+  if (listen (fd, 64))
+    log_fatal ("listen failed: %s\n", strerror (errno));
+  return fd;
+}
+
+
+/* Run the server, with io_uring if IO_URING is true, against a
+   forked client.  Returns -1 if the server is not supported.  */
+static int
+run_server (int io_uring)
+{
+  gpg_error_t err;
+  assuan_fd_t fd;
+  pid_t pid;
+  int status;
+
+  nconnects = ndisconnects = nreused = 0;
+  fd = create_socket ();
+  err = assuan_server_new (&server, fd, ASSUAN_SOCKET_SERVER_FDPASSING,
+                           connect_cb, disconnect_cb, NULL);
+  if (gpg_err_code (err) == GPG_ERR_NOT_SUPPORTED)
+    {
+      close (fd);
+      remove (socket_name);
+      return -1;
+    }
+  if (err)
+    log_fatal ("assuan_server_new failed: %s\n", gpg_strerror (err));
+  if (io_uring)
+    {
+      err = assuan_server_set_io_uring (server, 1);
+      if (gpg_err_code (err) == GPG_ERR_NOT_SUPPORTED)
+        {
+          if (verbose)
+            log_info ("io_uring is not supported\n");
+          assuan_server_release (server);
+          remove (socket_name);
+          return -1;
+        }
+      if (err)
+        log_fatal ("assuan_server_set_io_uring failed: %s\n",
+                   gpg_strerror (err));
+    }
+  err = assuan_server_set_recycle (server, NSPARE);
+  if (err)
+    log_fatal ("assuan_server_set_recycle failed: %s\n", gpg_strerror (err));
+  err = assuan_server_set_limits (server, NCLIENTS, NACTIVE, NCLIENTS,
+                                  ASSUAN_SERVER_LIMIT_REJECT);
+  if (err)
+    log_fatal ("assuan_server_set_limits failed: %s\n", gpg_strerror (err));
+  err = assuan_server_set_timeouts (server, IDLE_TIMEOUT, COMMAND_TIMEOUT);
+  if (err)
+    log_fatal ("assuan_server_set_timeouts failed: %s\n", gpg_strerror (err));
+  err = assuan_server_set_priorities (server, PRIORITY_AGING);
+  if (err)
+    log_fatal ("assuan_server_set_priorities failed: %s\n",
+               gpg_strerror (err));
+
+  pid = fork ();
+  if (pid == -1)
+    log_fatal ("fork failed: %s\n", strerror (errno));
+  if (!pid)
+    _exit (run_client ());
+
+  err = assuan_server_loop (server);
+  if (err)
+    log_error ("assuan_server_loop failed: %s\n", gpg_strerror (err));
+  if (verbose)
+    log_info ("%s: %d connections, %d closed, %d re-used\n",
+              io_uring? "io_uring" : "epoll",
+              nconnects, ndisconnects, nreused);
+  if (nconnects != NCONNS)
+    log_error ("%d connections instead of %d\n", nconnects, NCONNS);
+  /* The late connections and the takeover re-use contexts.  */
+  if (nreused != NSPARE + 1)
+    log_error ("%d contexts re-used instead of %d\n", nreused, NSPARE + 1);
+  assuan_server_release (server);
+  if (ndisconnects != NCONNS)
+    log_error ("%d connections released instead of %d\n",
+               ndisconnects, NCONNS);
+
+  if (waitpid (pid, &status, 0) == -1)
+    log_fatal ("waitpid failed: %s\n", strerror (errno));
+  if (!WIFEXITED (status) || WEXITSTATUS (status))
+    log_error ("client failed\n");
+  remove (socket_name);
+
+  return 0;
+}
+
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+int
+main (int argc, char **argv)
+{
+#ifndef HAVE_W32_SYSTEM
+  if (argc)
+    {
+      log_set_prefix (*argv);
+      argc--; argv++;
+    }
+  while (argc)
+    {
+      if (!strcmp (*argv, "--verbose"))
+        {
+          verbose = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--debug"))
+        {
+          verbose = debug = 1;
+          argc--; argv++;
+        }
+      else
+        log_fatal ("usage: serverloop [--verbose] [--debug]\n");
+    }
+
+  assuan_set_assuan_log_prefix (log_prefix);
+
+  /* Socket names must be absolute and short.  */
+  snprintf (socket_name, sizeof socket_name, "/tmp/assuan-serverloop-%d.sock",
+            (int)getpid ());
+  if (run_server (0))
+    return 77;  /* Skip.  */
+  run_server (1);
+
+  return errorcount ? 1 : 0;
+#else /*HAVE_W32_SYSTEM*/
+  (void)argc;
+  (void)argv;
+  return 77;  /* Skip.  */
+#endif /*HAVE_W32_SYSTEM*/
+}
@@ -0,0 +1,249 @@
+/* shmbench.c - Benchmark for the shared memory transport
+   Copyright (C) 2026 g10 Code GmbH
+
+   This file is part of Assuan.
+
+   Assuan is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 3 of
+   the License, or (at your option) any later version.
+
+   Assuan is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   This program runs short commands and commands returning data
+   against a forked server, first over the Unix domain socket and
+   then after switching to shared memory with assuan_shm_start, and
+   prints the round trip times.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#ifndef HAVE_W32_SYSTEM
+# include <unistd.h>
+#endif
+
+#include "../src/assuan.h"
+#include "common.h"
+
+#ifndef HAVE_W32_SYSTEM
+
+static int ncommands = 100000;
+static size_t datasize = 16384;
+
+
+static double
+now (void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return (double)clock () / CLOCKS_PER_SEC;
+#endif
+}
+
+
+
+/* Server part.  */
+
+/* GET N - Send N bytes of data.  */
+static gpg_error_t
+cmd_get (assuan_context_t ctx, char *line)
+{
+  static char *buffer;
+  static size_t size;
+  size_t n;
+
+  n = strtoul (line, NULL, 10);
+  if (n > size)
+    {
+      free (buffer);
+      buffer = malloc (n);
+      if (!buffer)
+        return gpg_error_from_syserror ();
+      memset (buffer, 'x', n);
+      size = n;
+    }
+  return assuan_send_data (ctx, buffer, n);
+}
+
+
+static void
+server (void)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+
+  err = assuan_new (&ctx);
+  if (!err)
+    err = assuan_init_pipe_server (ctx, NULL);
+  if (!err)
+    err = assuan_register_command (ctx, "GET", cmd_get, NULL);
+  if (err)
+    log_fatal ("setting up the server failed: %s\n", gpg_strerror (err));
+  if (debug)
+    assuan_set_log_stream (ctx, stderr);
+  assuan_set_flag (ctx, ASSUAN_ALLOW_SHM, 1);
+
+  while (!(err = assuan_accept (ctx)))
+    {
+      err = assuan_process (ctx);
+      if (err)
+        log_error ("assuan_process failed: %s\n", gpg_strerror (err));
+    }
+  if (err != -1)
+    log_error ("assuan_accept failed: %s\n", gpg_strerror (err));
+  assuan_release (ctx);
+}
+
+
+
+/* Client part.  */
+
+static gpg_error_t
+data_cb (void *opaque, const void *buffer, size_t length)
+{
+  (void)buffer;
+  *(size_t *)opaque += length;
+  return 0;
+}
+
+
+/* Run NCOMMANDS times COMMAND on CTX and print the time per round
+   trip for the transport NAME.  */
+static void
+run (assuan_context_t ctx, const char *name, const char *command)
+{
+  gpg_error_t err = 0;
+  double start, t;
+  size_t received = 0;
+  int i;
+
+  start = now ();
+  for (i = 0; !err && i < ncommands; i++)
+    {
+      err = assuan_transact (ctx, command, data_cb, &received,
+                             NULL, NULL, NULL, NULL);
+      if (err)
+        log_error ("%s failed: %s\n", command, gpg_strerror (err));
+    }
+  t = now () - start;
+
+  printf ("%-6s %-10s %8.2f us per round trip", name, command,
+          t * 1e6 / ncommands);
+  if (received)
+    printf (", %8.1f MB/s", received / t / 1e6);
+  putchar ('\n');
+  fflush (stdout);
+}
+
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+int
+main (int argc, char **argv)
+{
+#ifndef HAVE_W32_SYSTEM
+  gpg_error_t err;
+  assuan_context_t ctx;
+  assuan_fd_t no_close_fds[2];
+  const char *loc;
+  char command[40];
+  int pass;
+
+  if (argc)
+    {
+      log_set_prefix (*argv);
+      argc--; argv++;
+    }
+  while (argc)
+    {
+      if (!strcmp (*argv, "--verbose"))
+        {
+          verbose = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--debug"))
+        {
+          verbose = debug = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--commands") && argc > 1)
+        {
+          ncommands = atoi (argv[1]);
+          argc -= 2; argv += 2;
+        }
+      else if (!strcmp (*argv, "--data") && argc > 1)
+        {
+          datasize = strtoul (argv[1], NULL, 10);
+          argc -= 2; argv += 2;
+        }
+      else
+        log_fatal ("usage: shmbench [--verbose] [--debug]"
+                   " [--commands N] [--data N]\n");
+    }
+  if (ncommands < 1)
+    log_fatal ("invalid arguments\n");
+
+  assuan_set_assuan_log_prefix (log_prefix);
+
+  err = assuan_new (&ctx);
+  if (err)
+    log_fatal ("assuan_new failed: %s\n", gpg_strerror (err));
+  no_close_fds[0] = verbose? assuan_fd_from_posix_fd (2) : ASSUAN_INVALID_FD;
+  no_close_fds[1] = ASSUAN_INVALID_FD;
+  err = assuan_pipe_connect (ctx, NULL, &loc, no_close_fds, NULL, NULL,
+                             ASSUAN_PIPE_CONNECT_FDPASSING);
+  if (err)
+    log_fatal ("assuan_pipe_connect failed: %s\n", gpg_strerror (err));
+  if (loc[0] == 's')
+    {
+      assuan_release (ctx);
+      server ();
+      return errorcount ? 1 : 0;
+    }
+
+  snprintf (command, sizeof command, "GET %lu", (unsigned long)datasize);
+  for (pass = 0; pass < 2; pass++)
+    {
+      if (pass)
+        {
+          err = assuan_shm_start (ctx, 0);
+          if (gpg_err_code (err) == GPG_ERR_NOT_SUPPORTED)
+            {
+              log_info ("shared memory is not supported\n");
+              break;
+            }
+          else if (err)
+            log_fatal ("assuan_shm_start failed: %s\n", gpg_strerror (err));
+        }
+      run (ctx, pass? "shm" : "socket", "NOP");
+      if (datasize)
+        run (ctx, pass? "shm" : "socket", command);
+    }
+
+  assuan_release (ctx);
+  return errorcount ? 1 : 0;
+#else /*HAVE_W32_SYSTEM*/
+  (void)argc;
+  (void)argv;
+  return 0;
+#endif /*HAVE_W32_SYSTEM*/
+}
@@ -0,0 +1,1011 @@
+/* transact.c - Check the assuan_transact call with inquiries.
+   Copyright (C) 2026 g10 Code GmbH
+
+   This file is part of Assuan.
+
+   Assuan is free software; you can redistribute it and/or modify it
+   under the terms of the GNU Lesser General Public License as
+   published by the Free Software Foundation; either version 3 of
+   the License, or (at your option) any later version.
+
+   Assuan is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   This test creates a program which starts an assuan server and
+   answers the inquiries of that server asynchronously.  The other
+   program is actually the same program but called with the option
+   --server.  A connection to that server is also shared by several
+   threads which run their transactions interleaved.  Finally a
+   socket server which serves each connection in its own process is
+   run to check the connection pool.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#ifndef HAVE_W32_SYSTEM
+# include <fcntl.h>
+# include <poll.h>
+# include <pthread.h>
+# include <signal.h>
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/time.h>
+# include <sys/un.h>
+# include <sys/wait.h>
+#endif
+
+#include "../src/assuan.h"
+#include "common.h"
+
+static assuan_fd_t my_stdin = ASSUAN_INVALID_FD;
+static assuan_fd_t my_stdout = ASSUAN_INVALID_FD;
+#ifndef HAVE_W32_SYSTEM
+static char socket_name[100];
+#endif
+
+
+/* Inquire for NUMBER twice and send back the concatenation of the
+   answers as data.  */
+static gpg_error_t
+cmd_add (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+  unsigned char *value1, *value2;
+  size_t len1, len2;
+
+  log_info ("got ADD command (%s)\n", line);
+
+  err = assuan_inquire (ctx, "NUMBER 1", &value1, &len1, 100);
+  if (err)
+    return err;
+  err = assuan_inquire (ctx, "NUMBER 2", &value2, &len2, 100);
+  if (err)
+    {
+      free (value1);
+      return err;
+    }
+
+  assuan_write_status (ctx, "PROGRESS", "add");
+  err = assuan_send_data (ctx, value1, len1);
+  if (!err)
+    err = assuan_send_data (ctx, "+", 1);
+  if (!err)
+    err = assuan_send_data (ctx, value2, len2);
+  free (value1);
+  free (value2);
+  return err;
+}
+
+
+/* Send back the arguments as data.  */
+static gpg_error_t
+cmd_echo (assuan_context_t ctx, char *line)
+{
+  return assuan_send_data (ctx, line, strlen (line));
+}
+
+
+#ifndef HAVE_W32_SYSTEM
+/* Keep the client waiting for a second.  */
+static gpg_error_t
+cmd_sleep (assuan_context_t ctx, char *line)
+{
+  (void)ctx;
+  (void)line;
+
+  sleep (1);
+  return 0;
+}
+
+
+/* Return the process ID of the server as status line and as data.
+   The socket server serves each connection in its own process.  */
+static gpg_error_t
+cmd_pid (assuan_context_t ctx, char *line)
+{
+  char buffer[30];
+
+  (void)line;
+  snprintf (buffer, sizeof buffer, "%lu", (unsigned long)getpid ());
+  assuan_write_status (ctx, "PID", buffer);
+  return assuan_send_data (ctx, buffer, strlen (buffer));
+}
+
+
+/* Send the client a descriptor of a pipe.  */
+static gpg_error_t
+cmd_fd (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+  int fds[2];
+
+  (void)line;
+  if (pipe (fds))
+    return gpg_error_from_syserror ();
+  err = assuan_sendfd (ctx, fds[0]);
+  close (fds[0]);
+  close (fds[1]);
+  return err;
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+static void
+register_commands (assuan_context_t ctx)
+{
+  int rc;
+
+  rc = assuan_register_command (ctx, "ADD", cmd_add, NULL);
+  if (rc)
+    log_fatal ("register_command failed: %s\n", gpg_strerror(rc));
+  rc = assuan_register_command (ctx, "ECHO", cmd_echo, NULL);
+  if (rc)
+    log_fatal ("register_command failed: %s\n", gpg_strerror(rc));
+#ifndef HAVE_W32_SYSTEM
+  rc = assuan_register_command (ctx, "SLEEP", cmd_sleep, NULL);
+  if (rc)
+    log_fatal ("register_command failed: %s\n", gpg_strerror(rc));
+  rc = assuan_register_command (ctx, "PID", cmd_pid, NULL);
+  if (rc)
+    log_fatal ("register_command failed: %s\n", gpg_strerror(rc));
+  rc = assuan_register_command (ctx, "FD", cmd_fd, NULL);
+  if (rc)
+    log_fatal ("register_command failed: %s\n", gpg_strerror(rc));
+#endif
+}
+
+
+/* Serve the connected context CTX until the client goes away.  */
+static void
+serve (assuan_context_t ctx)
+{
+  int rc;
+
+  for (;;)
+    {
+      rc = assuan_accept (ctx);
+      if (rc)
+        {
+          if (rc != -1)
+            log_error ("assuan_accept failed: %s\n", gpg_strerror (rc));
+          break;
+        }
+
+      rc = assuan_process (ctx);
+      if (gpg_err_code (rc) == GPG_ERR_EPIPE)
+        break; /* The client went away after a timeout.  */
+      if (rc)
+        log_error ("assuan_process failed: %s\n", gpg_strerror (rc));
+    }
+
+  assuan_release (ctx);
+}
+
+
+static void
+run_server (int enable_debug)
+{
+  int rc;
+  assuan_context_t ctx;
+  assuan_fd_t filedes[2];
+
+  filedes[0] = my_stdin;
+  filedes[1] = my_stdout;
+
+  rc = assuan_new (&ctx);
+  if (rc)
+    log_fatal ("assuan_new failed: %s\n", gpg_strerror (rc));
+
+  rc = assuan_init_pipe_server (ctx, filedes);
+  if (rc)
+    log_fatal ("assuan_init_pipe_server failed: %s\n",
+               gpg_strerror (rc));
+  register_commands (ctx);
+  if (enable_debug)
+    assuan_set_log_stream (ctx, stderr);
+
+  serve (ctx);
+}
+
+
+#ifndef HAVE_W32_SYSTEM
+/* Return a socket listening on NAME.  */
+static int
+listen_socket (const char *name)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    log_fatal ("socket failed: %s\n", strerror (errno));
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, name);
+  remove (name);
+  if (bind (fd, (struct sockaddr *)&addr, sizeof addr))
+    log_fatal ("bind failed: %s\n", strerror (errno));
+  if (listen (fd, 16))
+    log_fatal ("listen failed: %s\n", strerror (errno));
+  return fd;
+}
+
+
+/* Run a socket server on SOCKET_NAME in a new process and return its
+   process ID.  Each connection is served by a process of its own so
+   that the client can tell the connections apart and kill them.  */
+static pid_t
+start_socket_server (void)
+{
+  assuan_context_t ctx;
+  gpg_error_t err;
+  pid_t pid;
+  int fd, cfd;
+
+  fd = listen_socket (socket_name);
+
+  pid = fork ();
+  if (pid == -1)
+    log_fatal ("fork failed: %s\n", strerror (errno));
+  if (pid)
+    {
+      close (fd);
+      return pid;
+    }
+
+  /* Let the connection processes be reaped by the system.  */
+  signal (SIGCHLD, SIG_IGN);
+  for (;;)
+    {
+      cfd = accept (fd, NULL, NULL);
+      if (cfd == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          log_fatal ("accept failed: %s\n", strerror (errno));
+        }
+      pid = fork ();
+      if (pid == -1)
+        log_fatal ("fork failed: %s\n", strerror (errno));
+      if (pid)
+        {
+          close (cfd);
+          continue;
+        }
+
+      close (fd);
+      err = assuan_new (&ctx);
+      if (!err)
+        err = assuan_init_socket_server (ctx, cfd,
+                                         (ASSUAN_SOCKET_SERVER_ACCEPTED
+                                          | ASSUAN_SOCKET_SERVER_FDPASSING));
+      if (err)
+        log_fatal ("setting up the socket server failed: %s\n",
+                   gpg_strerror (err));
+      register_commands (ctx);
+      if (debug)
+        assuan_set_log_stream (ctx, stderr);
+      serve (ctx);
+      _exit (errorcount ? 1 : 0);
+    }
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+
+struct result_s
+{
+  char buffer[100];
+  size_t length;
+  int data_calls;
+  int inquiries;
+  int status_lines;
+  int progress_lines;
+};
+
+
+static gpg_error_t
+data_cb (void *opaque, const void *buffer, size_t length)
+{
+  struct result_s *result = opaque;
+
+  if (!buffer)
+    return 0;
+  if (result->length + length > sizeof result->buffer)
+    return gpg_error (GPG_ERR_TOO_LARGE);
+  memcpy (result->buffer + result->length, buffer, length);
+  result->length += length;
+  result->data_calls++;
+  return 0;
+}
+
+
+/* Do not answer the inquiry right away.  */
+static gpg_error_t
+inquire_cb (void *opaque, const char *line)
+{
+  struct result_s *result = opaque;
+
+  if (strncmp (line, "NUMBER", 6))
+    return gpg_error (GPG_ERR_ASS_UNKNOWN_INQUIRE);
+  result->inquiries++;
+  return gpg_error (GPG_ERR_EAGAIN);
+}
+
+
+static gpg_error_t
+status_cb (void *opaque, const char *line)
+{
+  struct result_s *result = opaque;
+
+  if (!strncmp (line, "PROGRESS", 8))
+    result->status_lines++;
+  return 0;
+}
+
+
+static gpg_error_t
+progress_handler (void *opaque, const char *args)
+{
+  struct result_s *result = opaque;
+
+  if (!strcmp (args, "add"))
+    result->progress_lines++;
+  return 0;
+}
+
+
+#ifndef HAVE_W32_SYSTEM
+/* Run ADD using the non-blocking step interface.  The status line is
+   dispatched to a registered status handler.  */
+static void
+run_step_client (assuan_context_t ctx)
+{
+  gpg_error_t err;
+  assuan_fd_t fds[2], tmp[2];
+  struct pollfd pfd;
+  struct result_s result;
+  int i, want, answered = 0;
+
+  if (assuan_get_active_fds (ctx, 0, tmp, 2) != 1)
+    {
+      log_error ("assuan_get_active_fds failed\n");
+      return;
+    }
+  fds[0] = tmp[0];
+  if (assuan_get_active_fds (ctx, 1, tmp, 2) != 1)
+    {
+      log_error ("assuan_get_active_fds failed\n");
+      return;
+    }
+  fds[1] = tmp[0];
+  for (i = 0; i < 2; i++)
+    fcntl (fds[i], F_SETFL, fcntl (fds[i], F_GETFL) | O_NONBLOCK);
+
+  memset (&result, 0, sizeof result);
+  err = assuan_register_status_handler (ctx, "PROGRESS", progress_handler,
+                                        &result);
+  if (err)
+    {
+      log_error ("registering a status handler failed: %s\n",
+                 gpg_strerror (err));
+      return;
+    }
+  err = assuan_transact_start (ctx, "ADD", data_cb, &result,
+                               inquire_cb, &result, status_cb, &result);
+  if (err)
+    {
+      log_error ("assuan_transact_start failed: %s\n", gpg_strerror (err));
+      return;
+    }
+  while ((want = assuan_transact_step (ctx, &err)) != ASSUAN_TRANSACT_DONE
+         || gpg_err_code (err) == GPG_ERR_EAGAIN)
+    {
+      if (want == ASSUAN_TRANSACT_DONE)
+        {
+          /* Answer the inquiry.  */
+          err = assuan_send_data (ctx, answered? "25" : "8",
+                                  answered? 2 : 1);
+          answered++;
+          if (!err)
+            err = assuan_transact_resume (ctx, 0);
+          if (err)
+            break;
+          continue;
+        }
+      pfd.fd = want == ASSUAN_TRANSACT_WANT_READ? fds[0] : fds[1];
+      pfd.events = want == ASSUAN_TRANSACT_WANT_READ? POLLIN : POLLOUT;
+      if (poll (&pfd, 1, -1) < 0 && errno != EINTR)
+        log_fatal ("poll failed: %s\n", strerror (errno));
+    }
+  if (err)
+    log_error ("stepping ADD failed: %s\n", gpg_strerror (err));
+  else if (result.length != 4 || memcmp (result.buffer, "8+25", 4)
+           || result.inquiries != 2 || result.status_lines
+           || result.progress_lines != 1 || result.data_calls != 1)
+    log_error ("stepping ADD returned a wrong result `%.*s'\n",
+               (int)result.length, result.buffer);
+
+  assuan_register_status_handler (ctx, "PROGRESS", NULL, NULL);
+  for (i = 0; i < 2; i++)
+    fcntl (fds[i], F_SETFL, fcntl (fds[i], F_GETFL) & ~O_NONBLOCK);
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+#ifndef HAVE_W32_SYSTEM
+static gpg_error_t
+pid_handler (void *opaque, const char *args)
+{
+  (void)args;
+  ++*(int *)opaque;
+  return 0;
+}
+
+
+static unsigned int
+count_monitor (assuan_context_t ctx, void *hook, int inout,
+               const char *line, size_t linelen)
+{
+  (void)ctx;
+  (void)inout;
+  (void)line;
+  (void)linelen;
+  ++*(int *)hook;
+  return 0;
+}
+
+
+/* Return the process ID of the socket server serving CTX or 0.  */
+static unsigned long
+connection_pid (assuan_context_t ctx)
+{
+  gpg_error_t err;
+  struct result_s result;
+
+  memset (&result, 0, sizeof result);
+  err = assuan_transact (ctx, "PID", data_cb, &result, NULL, NULL, NULL, NULL);
+  if (err || result.length >= sizeof result.buffer)
+    {
+      log_error ("PID failed: %s\n", gpg_strerror (err));
+      return 0;
+    }
+  result.buffer[result.length] = 0;
+  return strtoul (result.buffer, NULL, 10);
+}
+
+
+/* Check that the connection pool re-uses the most recently returned
+   idle connection, evicts the least recently used one if it is full,
+   discards connections closed by the server and does not hand the
+   state of one user to the next.  */
+static void
+run_pool_client (void)
+{
+  gpg_error_t err;
+  assuan_pool_t pool;
+  assuan_context_t ctxs[3];
+  unsigned long pids[3], pid;
+  assuan_fd_t fd;
+  int i, n;
+
+  err = assuan_pool_new (&pool, 2);
+  if (err)
+    log_fatal ("assuan_pool_new failed: %s\n", gpg_strerror (err));
+
+  for (i = 0; i < 3; i++)
+    {
+      err = assuan_pool_get (pool, &ctxs[i], socket_name, 0);
+      if (err)
+        log_fatal ("assuan_pool_get failed: %s\n", gpg_strerror (err));
+      pids[i] = connection_pid (ctxs[i]);
+    }
+  if (pids[0] == pids[1] || pids[0] == pids[2] || pids[1] == pids[2])
+    log_error ("pool returned a connection twice\n");
+
+  /* The pool keeps only the last two of them.  */
+  for (i = 0; i < 3; i++)
+    assuan_pool_put (pool, ctxs[i]);
+  for (i = 0; i < 3; i++)
+    {
+      err = assuan_pool_get (pool, &ctxs[i], socket_name, 0);
+      if (err)
+        log_fatal ("assuan_pool_get failed: %s\n", gpg_strerror (err));
+    }
+  if (connection_pid (ctxs[0]) != pids[2]
+      || connection_pid (ctxs[1]) != pids[1])
+    log_error ("pool did not re-use the idle connections\n");
+  pid = connection_pid (ctxs[2]);
+  if (pid == pids[0] || pid == pids[1] || pid == pids[2])
+    log_error ("pool did not evict the oldest connection\n");
+
+  /* A connection closed by the server while idle is not handed out
+     again.  */
+  for (i = 2; i >= 0; i--)
+    assuan_pool_put (pool, ctxs[i]);
+  kill ((pid_t)pids[2], SIGTERM);
+  for (n = 0; n < 5000 && !kill ((pid_t)pids[2], 0); n++)
+    usleep (1000);
+  err = assuan_pool_get (pool, &ctxs[0], socket_name, 0);
+  if (err)
+    log_fatal ("assuan_pool_get failed: %s\n", gpg_strerror (err));
+  if (connection_pid (ctxs[0]) != pids[1])
+    log_error ("pool did not discard a closed connection\n");
+
+  /* The deadlines, flags and status handlers of a user are not kept
+     for the next one.  */
+  assuan_set_deadline (ctxs[0], 50);
+  assuan_set_flag (ctxs[0], ASSUAN_TRANSACT_TIMEOUT, 50);
+  assuan_set_flag (ctxs[0], ASSUAN_DATA_CHUNKSIZE, 3);
+  n = 0;
+  err = assuan_register_status_handler (ctxs[0], "PID", pid_handler, &n);
+  if (err)
+    log_fatal ("registering a status handler failed: %s\n",
+               gpg_strerror (err));
+  connection_pid (ctxs[0]);
+  assuan_pool_put (pool, ctxs[0]);
+  err = assuan_pool_get (pool, &ctxs[0], socket_name, 0);
+  if (err)
+    log_fatal ("assuan_pool_get failed: %s\n", gpg_strerror (err));
+  usleep (100000);
+  if (connection_pid (ctxs[0]) != pids[1] || n != 1)
+    log_error ("status handler kept in the pool (%d calls)\n", n);
+  if (assuan_get_flag (ctxs[0], ASSUAN_TRANSACT_TIMEOUT)
+      || assuan_get_flag (ctxs[0], ASSUAN_DATA_CHUNKSIZE))
+    log_error ("flags kept in the pool\n");
+  assuan_pool_put (pool, ctxs[0]);
+
+  /* Neither the I/O monitor nor descriptors not yet received are
+     handed to the next user.  */
+  err = assuan_pool_get (pool, &ctxs[0], socket_name,
+                         ASSUAN_SOCKET_CONNECT_FDPASSING);
+  if (err)
+    log_fatal ("assuan_pool_get failed: %s\n", gpg_strerror (err));
+  pid = connection_pid (ctxs[0]);
+  n = 0;
+  assuan_set_io_monitor (ctxs[0], count_monitor, &n);
+  err = assuan_transact (ctxs[0], "FD", NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    log_error ("FD failed: %s\n", gpg_strerror (err));
+  i = n;
+  assuan_pool_put (pool, ctxs[0]);
+  err = assuan_pool_get (pool, &ctxs[0], socket_name,
+                         ASSUAN_SOCKET_CONNECT_FDPASSING);
+  if (err)
+    log_fatal ("assuan_pool_get failed: %s\n", gpg_strerror (err));
+  if (connection_pid (ctxs[0]) != pid)
+    log_error ("pool did not re-use the connection\n");
+  if (!i || n != i)
+    log_error ("I/O monitor kept in the pool (%d/%d calls)\n", i, n);
+  if (!assuan_receivefd (ctxs[0], &fd))
+    {
+      log_error ("descriptor of the previous user kept in the pool\n");
+      close (fd);
+    }
+  assuan_pool_put (pool, ctxs[0]);
+
+  assuan_pool_release (pool);
+}
+
+
+/* Connect concurrently to the socket server, to a socket which does
+   not exist and to a socket which is never served.  */
+static void
+run_multi_client (void)
+{
+  gpg_error_t err, errs[3];
+  assuan_context_t ctxs[3];
+  char missing[110], silent[110];
+  const char *names[3];
+  struct timeval start, end;
+  long msec;
+  int i, fd;
+
+  snprintf (missing, sizeof missing, "%s.missing", socket_name);
+  snprintf (silent, sizeof silent, "%s.silent", socket_name);
+  remove (missing);
+  fd = listen_socket (silent);
+
+  names[0] = silent;
+  names[1] = socket_name;
+  names[2] = missing;
+  for (i = 0; i < 3; i++)
+    {
+      err = assuan_new (&ctxs[i]);
+      if (err)
+        log_fatal ("assuan_new failed: %s\n", gpg_strerror (err));
+      assuan_set_flag (ctxs[i], ASSUAN_TRANSACT_TIMEOUT, 300);
+    }
+
+  gettimeofday (&start, NULL);
+  err = assuan_socket_connect_multi (ctxs, names, 3, 0, errs);
+  gettimeofday (&end, NULL);
+  if (err)
+    log_fatal ("assuan_socket_connect_multi failed: %s\n",
+               gpg_strerror (err));
+  msec = ((end.tv_sec - start.tv_sec) * 1000
+          + (end.tv_usec - start.tv_usec) / 1000);
+
+  if (gpg_err_code (errs[0]) != GPG_ERR_TIMEOUT)
+    log_error ("silent server did not time out: %s\n",
+               gpg_strerror (errs[0]));
+  if (msec < 250 || msec > 3000)
+    log_error ("connecting took %ld ms\n", msec);
+  if (errs[1])
+    log_error ("connecting to the server failed: %s\n",
+               gpg_strerror (errs[1]));
+  else if (!connection_pid (ctxs[1]))
+    log_error ("connection to the server not usable\n");
+  if (gpg_err_code (errs[2]) != GPG_ERR_ASS_CONNECT_FAILED)
+    log_error ("connecting to a missing socket gave: %s\n",
+               gpg_strerror (errs[2]));
+
+  for (i = 0; i < 3; i++)
+    assuan_release (ctxs[i]);
+  close (fd);
+  remove (silent);
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+/* Start the server and return a context connected to it or NULL.  */
+static assuan_context_t
+connect_server (const char *servername)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+  assuan_fd_t no_close_fds[2];
+  const char *arglist[5];
+
+  no_close_fds[0] = assuan_fd_from_posix_fd (fileno (stderr));
+  no_close_fds[1] = ASSUAN_INVALID_FD;
+
+  arglist[0] = servername;
+  arglist[1] = "--server";
+  arglist[2] = debug? "--debug" : verbose? "--verbose":NULL;
+  arglist[3] = NULL;
+
+  err = assuan_new (&ctx);
+  if (err)
+    log_fatal ("assuan_new failed: %s\n", gpg_strerror (err));
+
+  err = assuan_pipe_connect (ctx, servername, arglist, no_close_fds,
+                             NULL, NULL, 0);
+  if (err)
+    {
+      log_error ("assuan_pipe_connect failed: %s\n", gpg_strerror (err));
+      assuan_release (ctx);
+      return NULL;
+    }
+  return ctx;
+}
+
+
+#ifndef HAVE_W32_SYSTEM
+/* Check that a transaction with a hanging server fails with a
+   timeout and that the connection can't be used afterwards.  */
+static void
+run_timeout_client (const char *servername)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+
+  ctx = connect_server (servername);
+  if (!ctx)
+    return;
+
+  assuan_set_flag (ctx, ASSUAN_TRANSACT_TIMEOUT, 200);
+  err = assuan_transact (ctx, "NOP", NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    log_error ("NOP failed: %s\n", gpg_strerror (err));
+
+  err = assuan_transact (ctx, "SLEEP", NULL, NULL, NULL, NULL, NULL, NULL);
+  if (gpg_err_code (err) != GPG_ERR_TIMEOUT)
+    log_error ("SLEEP did not time out: %s\n", gpg_strerror (err));
+
+  err = assuan_transact (ctx, "NOP", NULL, NULL, NULL, NULL, NULL, NULL);
+  if (gpg_err_code (err) != GPG_ERR_TIMEOUT)
+    log_error ("connection still used after a timeout: %s\n",
+               gpg_strerror (err));
+
+  assuan_release (ctx);
+}
+
+
+#define NTHREADS 4
+#define NSHARED  30  /* Transactions per thread.  */
+
+static assuan_context_t shared_ctx;
+
+struct shared_parm_s
+{
+  struct result_s result;  /* Must be the first member.  */
+  assuan_shared_t shared;
+  int thread;
+  int round;
+};
+
+
+/* Answer the inquiries of ADD with the thread and the round.  */
+static gpg_error_t
+shared_inquire_cb (void *opaque, const char *line)
+{
+  struct shared_parm_s *parm = opaque;
+  char buffer[20];
+
+  parm->result.inquiries++;
+  snprintf (buffer, sizeof buffer, "%d",
+            strcmp (line, "NUMBER 1")? parm->round : parm->thread);
+  return assuan_send_data (shared_ctx, buffer, strlen (buffer));
+}
+
+
+/* Run ADD and ECHO with and without ASSUAN_SHARED_NO_INQUIRE and check
+   that each of them gets its own result.  */
+static void *
+shared_thread (void *opaque)
+{
+  struct shared_parm_s *parm = opaque;
+  gpg_error_t err;
+  char command[60], expected[40];
+  unsigned int flags;
+
+  for (parm->round = 0; parm->round < NSHARED; parm->round++)
+    {
+      flags = 0;
+      switch ((parm->thread + parm->round) % 3)
+        {
+        case 0:
+          strcpy (command, "ADD");
+          snprintf (expected, sizeof expected, "%d+%d",
+                    parm->thread, parm->round);
+          break;
+        case 1:
+          flags = ASSUAN_SHARED_NO_INQUIRE;
+          /* fall through */
+        default:
+          snprintf (expected, sizeof expected, "thread %d round %d",
+                    parm->thread, parm->round);
+          snprintf (command, sizeof command, "ECHO %s", expected);
+          break;
+        }
+
+      memset (&parm->result, 0, sizeof parm->result);
+      err = assuan_shared_transact (parm->shared, command, flags,
+                                    data_cb, &parm->result,
+                                    shared_inquire_cb, parm, NULL, NULL);
+      if (err)
+        log_error ("shared %s failed: %s\n", command, gpg_strerror (err));
+      else if (parm->result.length != strlen (expected)
+               || memcmp (parm->result.buffer, expected, strlen (expected))
+               || parm->result.inquiries != (*command == 'A'? 2 : 0))
+        log_error ("shared %s returned `%.*s'\n", command,
+                   (int)parm->result.length, parm->result.buffer);
+    }
+  return NULL;
+}
+
+
+/* Share one connection between several threads.  */
+static void
+run_shared_client (const char *servername)
+{
+  gpg_error_t err;
+  assuan_shared_t shared;
+  pthread_t threads[NTHREADS];
+  struct shared_parm_s parms[NTHREADS];
+  int i;
+
+  shared_ctx = connect_server (servername);
+  if (!shared_ctx)
+    return;
+  err = assuan_shared_new (&shared, shared_ctx);
+  if (err)
+    log_fatal ("assuan_shared_new failed: %s\n", gpg_strerror (err));
+
+  for (i = 0; i < NTHREADS; i++)
+    {
+      memset (&parms[i], 0, sizeof parms[i]);
+      parms[i].shared = shared;
+      parms[i].thread = i;
+      if (pthread_create (&threads[i], NULL, shared_thread, &parms[i]))
+        log_fatal ("pthread_create failed: %s\n", strerror (errno));
+    }
+  for (i = 0; i < NTHREADS; i++)
+    pthread_join (threads[i], NULL);
+
+  assuan_shared_release (shared);
+}
+#endif /*!HAVE_W32_SYSTEM*/
+
+
+static void
+run_client (const char *servername)
+{
+  gpg_error_t err;
+  assuan_context_t ctx;
+  struct result_s result;
+
+  ctx = connect_server (servername);
+  if (!ctx)
+    return;
+
+  /* Without ASSUAN_ASYNC_INQUIRE GPG_ERR_EAGAIN cancels the inquiry.  */
+  memset (&result, 0, sizeof result);
+  err = assuan_transact (ctx, "ADD", data_cb, &result, inquire_cb, &result,
+                         status_cb, &result);
+  if (gpg_err_code (err) != GPG_ERR_EAGAIN || result.inquiries != 1
+      || result.length)
+    log_error ("ADD not canceled: %s\n", gpg_strerror (err));
+  err = assuan_transact (ctx, "NOP", NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    log_error ("NOP after a canceled inquiry failed: %s\n",
+               gpg_strerror (err));
+
+  /* Answer both inquiries after assuan_transact returned.  The data
+     is passed in chunks of 3 bytes.  */
+  assuan_set_flag (ctx, ASSUAN_ASYNC_INQUIRE, 1);
+  assuan_set_flag (ctx, ASSUAN_DATA_CHUNKSIZE, 3);
+  memset (&result, 0, sizeof result);
+  err = assuan_transact (ctx, "ADD", data_cb, &result, inquire_cb, &result,
+                         status_cb, &result);
+  if (gpg_err_code (err) != GPG_ERR_EAGAIN || result.inquiries != 1)
+    log_error ("ADD not suspended: %s\n", gpg_strerror (err));
+  err = assuan_transact (ctx, "NOP", NULL, NULL, NULL, NULL, NULL, NULL);
+  if (gpg_err_code (err) != GPG_ERR_ASS_NESTED_COMMANDS)
+    log_error ("command accepted while suspended\n");
+
+  err = assuan_send_data (ctx, "17", 2);
+  if (!err)
+    err = assuan_transact_resume (ctx, 0);
+  if (gpg_err_code (err) != GPG_ERR_EAGAIN || result.inquiries != 2)
+    log_error ("second inquiry not suspended: %s\n", gpg_strerror (err));
+
+  err = assuan_send_data (ctx, "4", 1);
+  if (!err)
+    err = assuan_transact_resume (ctx, 0);
+  if (err)
+    log_error ("ADD failed: %s\n", gpg_strerror (err));
+  else if (result.length != 4 || memcmp (result.buffer, "17+4", 4)
+           || result.status_lines != 1 || result.data_calls != 2)
+    log_error ("ADD returned a wrong result `%.*s'\n",
+               (int)result.length, result.buffer);
+  assuan_set_flag (ctx, ASSUAN_DATA_CHUNKSIZE, 0);
+
+  if (!assuan_transact_resume (ctx, 0))
+    log_error ("resume without a suspended transaction succeeded\n");
+
+  /* Cancel the second inquiry.  */
+  memset (&result, 0, sizeof result);
+  err = assuan_transact (ctx, "ADD", data_cb, &result, inquire_cb, &result,
+                         status_cb, &result);
+  if (gpg_err_code (err) == GPG_ERR_EAGAIN)
+    err = assuan_transact_resume (ctx, 0);
+  if (gpg_err_code (err) == GPG_ERR_EAGAIN)
+    err = assuan_transact_resume (ctx, gpg_error (GPG_ERR_CANCELED));
+  if (gpg_err_code (err) != GPG_ERR_CANCELED || result.length)
+    log_error ("canceling the inquiry failed: %s\n", gpg_strerror (err));
+
+#ifndef HAVE_W32_SYSTEM
+  run_step_client (ctx);
+#endif
+
+  err = assuan_transact (ctx, "BYE", NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    log_error ("sending BYE failed: %s\n", gpg_strerror (err));
+
+  assuan_release (ctx);
+
+#ifndef HAVE_W32_SYSTEM
+  run_timeout_client (servername);
+  run_shared_client (servername);
+
+  {
+    pid_t pid;
+
+    pid = start_socket_server ();
+    run_pool_client ();
+    run_multi_client ();
+    kill (pid, SIGTERM);
+    waitpid (pid, NULL, 0);
+    remove (socket_name);
+  }
+#endif
+}
+
+
+/*
+     M A I N
+ */
+int
+main (int argc, char **argv)
+{
+  gpg_error_t err;
+  const char *myname = "no-pgm";
+  int last_argc = -1;
+  int server = 0;
+
+  my_stdin = assuan_fd_from_posix_fd (0);
+  my_stdout = assuan_fd_from_posix_fd (1);
+  if (argc)
+    {
+      myname = *argv;
+      log_set_prefix (*argv);
+      argc--; argv++;
+    }
+  while (argc && last_argc != argc )
+    {
+      last_argc = argc;
+      if (!strcmp (*argv, "--help"))
+        {
+          printf ("usage: %s [options]\n"
+                  "\n"
+                  "Options:\n"
+                  "  --verbose      Show what is going on\n"
+                  "  --server       Run in server mode\n",
+                  log_get_prefix ());
+          exit (0);
+        }
+      if (!strcmp (*argv, "--verbose"))
+        {
+          verbose = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--debug"))
+        {
+          verbose = debug = 1;
+          argc--; argv++;
+        }
+      else if (!strcmp (*argv, "--server"))
+        {
+          server = 1;
+          argc--; argv++;
+        }
+      else
+        log_fatal ("invalid option `%s' (try --help)\n", *argv);
+    }
+
+  log_set_prefix (xstrconcat (log_get_prefix (),
+                              server? ".server":".client", NULL));
+  assuan_set_assuan_log_prefix (log_get_prefix ());
+
+#ifndef HAVE_W32_SYSTEM
+  /* Socket names must be absolute and short.  */
+  snprintf (socket_name, sizeof socket_name, "/tmp/assuan-transact-%d.sock",
+            (int)getpid ());
+#endif
+
+  err = assuan_sock_init ();
+  if (err)
+    log_fatal ("socket init failed: %s\n", gpg_strerror (err));
+
+  if (server)
+    {
+      if (debug)
+        assuan_set_assuan_log_stream (stderr);
+      run_server (debug);
+    }
+  else
+    {
+      if (debug)
+        assuan_set_assuan_log_stream (stderr);
+      run_client (myname);
+    }
+
+  return errorcount ? 1 : 0;
+}